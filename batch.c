@@ -0,0 +1,201 @@
+#include "batch.h"
+#include "trace.h"
+#include "tune.h"
+#include "kernels.h"
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+/*
+ * Allocate a zeroed batch of `count` matrices of `rows` x `cols` entries of type `dtype`.
+ * Return 0 upon success, -1 for invalid dimensions and -2 if allocation fails.
+ */
+int allocate_batch(batch **b, int count, int rows, int cols, int dtype) {
+    if (count <= 0 || rows <= 0 || cols <= 0 || (dtype != DTYPE_FLOAT64 && dtype != DTYPE_FLOAT32))
+    {
+      return -1;
+    }
+
+    TRACE_BEGIN(t_alloc);
+    batch *res = (batch *)malloc(sizeof(batch));
+    if (!res)
+    {
+      return -2;
+    }
+    size_t elem = dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    res->data = calloc((size_t)count * rows * cols, elem);
+    if (!res->data)
+    {
+      free(res);
+      return -2;
+    }
+    res->count = count;
+    res->rows = rows;
+    res->cols = cols;
+    res->dtype = dtype;
+    res->stride = (long long)rows * cols;
+    res->ref_cnt = 1;
+    *b = res;
+    TRACE_END(t_alloc, "allocate_batch", "alloc", count * rows, cols);
+    return 0;
+}
+
+/*
+ * Drop a hold on `b`, freeing it with the last one. Does nothing if `b` is NULL.
+ */
+void deallocate_batch(batch *b) {
+    if (!b)
+    {
+      return;
+    }
+    int holders;
+    #pragma omp atomic capture
+    holders = --b->ref_cnt;
+    if (holders == 0)
+    {
+      free(b->data);
+      free(b);
+    }
+}
+
+/*
+ * Hold on to `b` for an operation that reads or writes it without the GIL, while other threads
+ * may replace the batch that owned it. Each retain_batch is ended by a deallocate_batch.
+ * Return `b`.
+ */
+batch *retain_batch(batch *b) {
+    #pragma omp atomic update
+    b->ref_cnt++;
+    return b;
+}
+
+/*
+ * Address of row r of entry i.
+ */
+static void *batch_row(batch *b, int i, int r) {
+    size_t elem = b->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    return (char *)b->data + ((size_t)i * b->stride + (size_t)r * b->cols) * elem;
+}
+
+/*
+ * Copy `mat` into entry i of `b`, converting the dtype if needed.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int batch_set_matrix(batch *b, int i, matrix *mat) {
+    if (i < 0 || i >= b->count || mat->rows != b->rows || mat->cols != b->cols)
+    {
+      return -1;
+    }
+    if (mat->transposed)
+    {
+      matrix *dense;
+      int ret = dense_matrix(&dense, mat);
+      if (ret == 0)
+      {
+        ret = batch_set_matrix(b, i, dense);
+        deallocate_matrix(dense);
+      }
+      return ret;
+    }
+    for (int r = 0; r < b->rows; r++)
+    {
+      void *dst = batch_row(b, i, r);
+      if (b->dtype == mat->dtype)
+      {
+        memcpy(dst, mat->dtype == DTYPE_FLOAT32 ? (void *)mat->fdata[r] : (void *)mat->data[r],
+               (mat->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double)) * b->cols);
+      }
+      else if (b->dtype == DTYPE_FLOAT32)
+      {
+        kernels->f64_to_f32((float *)dst, mat->data[r], b->cols);
+      }
+      else
+      {
+        kernels->f32_to_f64((double *)dst, mat->fdata[r], b->cols);
+      }
+    }
+    return 0;
+}
+
+/*
+ * Copy entry i of `b` into `result`, converting the dtype if needed.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int batch_get_matrix(matrix *result, batch *b, int i) {
+    if (i < 0 || i >= b->count || result->rows != b->rows || result->cols != b->cols ||
+        result->transposed)
+    {
+      return -1;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+    for (int r = 0; r < b->rows; r++)
+    {
+      void *src = batch_row(b, i, r);
+      if (b->dtype == result->dtype)
+      {
+        memcpy(result->dtype == DTYPE_FLOAT32 ? (void *)result->fdata[r] : (void *)result->data[r],
+               src, (b->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double)) * b->cols);
+      }
+      else if (result->dtype == DTYPE_FLOAT32)
+      {
+        kernels->f64_to_f32(result->fdata[r], (double *)src, b->cols);
+      }
+      else
+      {
+        kernels->f32_to_f64(result->data[r], (float *)src, b->cols);
+      }
+    }
+    return 0;
+}
+
+/*
+ * Store b1[i] * b2[i] to result[i] for every entry. A batch of one on either side is
+ * multiplied with every entry of the other. Entries are spread over the threads whole, each
+ * one a single call of the small GEMM kernel, so there is no blocking or copying per entry.
+ * `result` must not share data with the operands.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int batch_mul(batch *result, batch *b1, batch *b2) {
+    int count = b1->count > b2->count ? b1->count : b2->count;
+    if ((b1->count != count && b1->count != 1) || (b2->count != count && b2->count != 1) ||
+        result->count != count || b1->cols != b2->rows || result->rows != b1->rows ||
+        result->cols != b2->cols || b1->dtype != b2->dtype || result->dtype != b1->dtype ||
+        result->data == b1->data || result->data == b2->data)
+    {
+      return -1;
+    }
+
+    int m = b1->rows, n = b2->cols, k = b1->cols;
+    long long stride1 = b1->count == 1 ? 0 : b1->stride;
+    long long stride2 = b2->count == 1 ? 0 : b2->stride;
+    long long stride = result->stride;
+    TRACE_BEGIN(t_compute);
+    #pragma omp parallel if ((long long)count * m * n * k >= matrix_tune.par_mul)
+    {
+      TRACE_BEGIN(t_tile);
+      int entries = 0;
+      #pragma omp for schedule(static) nowait
+      for (int i = 0; i < count; i++)
+      {
+          if (result->dtype == DTYPE_FLOAT32)
+          {
+            kernels->gemm_small_f32((float *)result->data + i * stride,
+                                    (float *)b1->data + i * stride1,
+                                    (float *)b2->data + i * stride2, m, n, k);
+          }
+          else
+          {
+            kernels->gemm_small((double *)result->data + i * stride,
+                                (double *)b1->data + i * stride1,
+                                (double *)b2->data + i * stride2, m, n, k);
+          }
+          entries++;
+      }
+      TRACE_END(t_tile, "batch_mul.tile", "thread", entries * m, n);
+    }
+    TRACE_END(t_compute, "batch_mul", "compute", count * m, n);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef NUMC_BATCH_H
+#define NUMC_BATCH_H
+
+#include "matrix.h"
+
+/*
+ * A stack of `count` matrices of the same shape and dtype in one contiguous
+ * block. Entry i starts `stride` elements after entry i - 1 and is stored row
+ * major without padding. A stride of 0 repeats a single entry, which is how a
+ * batch of one is broadcast against a larger one.
+ */
+typedef struct batch {
+    int count;         // number of matrices
+    int rows;          // rows of each matrix
+    int cols;          // columns of each matrix
+    int dtype;         // DTYPE_FLOAT64 or DTYPE_FLOAT32
+    long long stride;  // elements from the start of one entry to the next
+    void *data;        // double or float entries, depending on dtype
+    int ref_cnt;       // holders of the batch, updated atomically; freed with the last
+} batch;
+
+int allocate_batch(batch **b, int count, int rows, int cols, int dtype);
+void deallocate_batch(batch *b);
+batch *retain_batch(batch *b);
+int batch_set_matrix(batch *b, int i, matrix *mat);
+int batch_get_matrix(matrix *result, batch *b, int i);
+int batch_mul(batch *result, batch *b1, batch *b2);
+
+#endif
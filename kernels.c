@@ -0,0 +1,101 @@
+#include "kernels.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define KERNELS_X86 1
+#endif
+
+/* Portable variant, built for whatever the compiler targets by default */
+#define KERNEL_ISA scalar
+#include "kernels_impl.h"
+#undef KERNEL_ISA
+
+#ifdef KERNELS_X86
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#define KERNEL_ISA avx2
+#include "kernels_impl.h"
+#undef KERNEL_ISA
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+#define KERNEL_ISA avx512
+#include "kernels_impl.h"
+#undef KERNEL_ISA
+#pragma GCC pop_options
+#endif
+
+const matrix_kernels *kernels = &kernels_scalar;
+
+/*
+ * Return the variant called `isa` if it exists in this build, otherwise NULL.
+ */
+static const matrix_kernels *kernels_find(const char *isa) {
+    if (!strcmp(isa, "scalar")) return &kernels_scalar;
+#ifdef KERNELS_X86
+    if (!strcmp(isa, "avx2")) return &kernels_avx2;
+    if (!strcmp(isa, "avx512")) return &kernels_avx512;
+#endif
+    return NULL;
+}
+
+/*
+ * Return whether this CPU can run the variant called `isa`.
+ */
+int kernels_supported(const char *isa) {
+    if (!strcmp(isa, "scalar"))
+    {
+      return 1;
+    }
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    int avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (!strcmp(isa, "avx2"))
+    {
+      return avx2;
+    }
+    if (!strcmp(isa, "avx512"))
+    {
+      return avx2 && __builtin_cpu_supports("avx512f");
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Switch to the variant called `isa`, or to the best one this CPU supports if
+ * `isa` is NULL, empty or "auto".
+ * Return 0 upon success, -1 if there is no such variant and -2 if this CPU
+ * cannot run it. The current variant is kept upon failure.
+ */
+int kernels_select(const char *isa) {
+    if (!isa || !isa[0] || !strcmp(isa, "auto"))
+    {
+      static const char *best_first[] = {"avx512", "avx2", "scalar"};
+      for (int i = 0; i < 3; i++)
+      {
+        if (kernels_find(best_first[i]) && kernels_supported(best_first[i]))
+        {
+          kernels = kernels_find(best_first[i]);
+          return 0;
+        }
+      }
+      return -1;
+    }
+
+    const matrix_kernels *k = kernels_find(isa);
+    if (!k)
+    {
+      return -1;
+    }
+    if (!kernels_supported(isa))
+    {
+      return -2;
+    }
+    kernels = k;
+    return 0;
+}
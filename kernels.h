@@ -0,0 +1,107 @@
+#ifndef NUMC_KERNELS_H
+#define NUMC_KERNELS_H
+
+/*
+ * Inner loops of the matrix operations. kernels.c compiles every kernel once
+ * per instruction set (see kernels_impl.h) and kernels_select picks the
+ * variant to use from what cpuid reports, so a single build runs everywhere
+ * and still uses AVX2 or AVX-512 where they exist.
+ */
+
+/* Number of register-blocked GEMM micro kernel shapes, see micro_shapes in matrix.c */
+#define MICRO_KERNELS 4
+
+/* Comparisons of the cmp kernels, also the ops of compare_matrix in mask.c */
+#define CMP_LT 0
+#define CMP_LE 1
+#define CMP_GT 2
+#define CMP_GE 3
+#define CMP_EQ 4
+#define CMP_NE 5
+
+typedef void (*micro_kernel)(double **c, double **a, double **b, int r, int col, int k0, int k1);
+typedef void (*micro_kernel_f32)(float **c, float **a, float **b, int r, int col, int k0, int k1);
+typedef void (*micro_kernel_mixed)(double **c, float **a, float **b, int r, int col, int k0, int k1);
+
+typedef struct matrix_kernels {
+    const char *name;
+    void (*fill)(double *dst, double val, int n);
+    void (*add)(double *dst, const double *a, const double *b, int n);
+    void (*sub)(double *dst, const double *a, const double *b, int n);
+    void (*neg)(double *dst, const double *a, int n);
+    void (*abs)(double *dst, const double *a, int n);
+    micro_kernel micro[MICRO_KERNELS];  // 2x8, 4x4, 4x8 and 8x4
+
+    /* Elementwise binary operations, comparisons into 0/1 bytes and selection by them */
+    void (*mul)(double *dst, const double *a, const double *b, int n);
+    void (*div)(double *dst, const double *a, const double *b, int n);
+    void (*min)(double *dst, const double *a, const double *b, int n);
+    void (*max)(double *dst, const double *a, const double *b, int n);
+    void (*cmp)(unsigned char *dst, const double *a, const double *b, double s, int n, int op);
+    void (*where)(double *dst, const unsigned char *m, const double *a, const double *b,
+                  double sa, double sb, int n);
+
+    /* Matrix-vector products, and the sparse inner loops in sparse.c */
+    double (*dot)(const double *a, const double *x, int n);
+    void (*axpy)(double *dst, double alpha, const double *x, int n);
+    double (*gather_dot)(const double *vals, const int *idx, const double *x, long long n);
+
+    /* Indexed bulk reads and writes of take_matrix and put_matrix */
+    void (*gather)(double *dst, const double *base, const long long *idx, int n);
+    void (*scatter)(double *base, const long long *idx, const double *src, int n);
+
+    /* Counter based random numbers of uniform_matrix and normal_matrix */
+    void (*philox)(double *u0, double *u1, unsigned long long first, int n, unsigned long long key);
+
+    /* Elementwise math functions, see ufunc_matrix */
+    void (*exp)(double *dst, const double *a, int n);
+    void (*log)(double *dst, const double *a, int n);
+    void (*sqrt)(double *dst, const double *a, int n);
+    void (*pow_scalar)(double *dst, const double *a, int n, double p);
+    void (*tanh)(double *dst, const double *a, int n);
+    void (*sigmoid)(double *dst, const double *a, int n);
+    void (*relu)(double *dst, const double *a, int n);
+    void (*clip)(double *dst, const double *a, int n, double lo, double hi);
+
+    /* One contiguous row-major product of a batch, see batch.c */
+    void (*gemm_small)(double *c, const double *a, const double *b, int m, int n, int k);
+
+    /* dst[j][dst_col + i] = src[i][src_col + j], see transpose_matrix */
+    void (*transpose)(double *const *dst, int dst_col, double *const *src, int src_col,
+                      int rows, int cols);
+
+    /* float32 versions of the above */
+    void (*fill_f32)(float *dst, float val, int n);
+    void (*add_f32)(float *dst, const float *a, const float *b, int n);
+    void (*sub_f32)(float *dst, const float *a, const float *b, int n);
+    void (*neg_f32)(float *dst, const float *a, int n);
+    void (*abs_f32)(float *dst, const float *a, int n);
+    void (*mul_f32)(float *dst, const float *a, const float *b, int n);
+    void (*div_f32)(float *dst, const float *a, const float *b, int n);
+    void (*min_f32)(float *dst, const float *a, const float *b, int n);
+    void (*max_f32)(float *dst, const float *a, const float *b, int n);
+    void (*cmp_f32)(unsigned char *dst, const float *a, const float *b, float s, int n, int op);
+    void (*where_f32)(float *dst, const unsigned char *m, const float *a, const float *b,
+                      float sa, float sb, int n);
+    float (*dot_f32)(const float *a, const float *x, int n);
+    void (*axpy_f32)(float *dst, float alpha, const float *x, int n);
+    void (*gemm_small_f32)(float *c, const float *a, const float *b, int m, int n, int k);
+    void (*transpose_f32)(float *const *dst, int dst_col, float *const *src, int src_col,
+                          int rows, int cols);
+    micro_kernel_f32 micro_f32[MICRO_KERNELS];
+
+    /* float32 operands, float64 accumulators and result */
+    micro_kernel_mixed micro_mixed[MICRO_KERNELS];
+
+    /* Conversions between the two dtypes */
+    void (*f64_to_f32)(float *dst, const double *a, int n);
+    void (*f32_to_f64)(double *dst, const float *a, int n);
+} matrix_kernels;
+
+/* The variant in use. Starts out as the portable one until kernels_select runs. */
+extern const matrix_kernels *kernels;
+
+int kernels_supported(const char *isa);
+int kernels_select(const char *isa);
+
+#endif
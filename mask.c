@@ -0,0 +1,201 @@
+#include "mask.h"
+#include "trace.h"
+#include "tune.h"
+#include <stdlib.h>
+#include <omp.h>
+
+/*
+ * Allocate a zeroed `rows` x `cols` mask.
+ * Return 0 upon success, -1 for invalid dimensions and -2 if allocation fails.
+ */
+int allocate_mask(mask **m, int rows, int cols) {
+    if (rows <= 0 || cols <= 0)
+    {
+      return -1;
+    }
+
+    mask *res = (mask *)malloc(sizeof(mask));
+    if (!res)
+    {
+      return -2;
+    }
+    res->data = (unsigned char *)calloc((size_t)rows * cols, 1);
+    if (!res->data)
+    {
+      free(res);
+      return -2;
+    }
+    res->rows = rows;
+    res->cols = cols;
+    *m = res;
+    return 0;
+}
+
+/*
+ * Free `m`. Does nothing if `m` is NULL.
+ */
+void deallocate_mask(mask *m) {
+    if (!m)
+    {
+      return;
+    }
+    free(m->data);
+    free(m);
+}
+
+/*
+ * Store mat1 <op> mat2 to `result` for every entry, where op is one of CMP_*. With mat2 NULL
+ * every entry of mat1 is compared with the scalar s instead.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int compare_matrix(mask *result, matrix *mat1, matrix *mat2, double s, int op) {
+    if (result->rows != mat1->rows || result->cols != mat1->cols ||
+        (mat2 && (mat2->rows != mat1->rows || mat2->cols != mat1->cols ||
+                  mat2->dtype != mat1->dtype)) ||
+        op < CMP_LT || op > CMP_NE)
+    {
+      return -1;
+    }
+    if (mat1->transposed || (mat2 && mat2->transposed))
+    {
+      matrix *tmp1, *tmp2 = NULL;
+      int ret = dense_matrix(&tmp1, mat1);
+      if (ret == 0 && mat2)
+      {
+        ret = dense_matrix(&tmp2, mat2);
+      }
+      if (ret == 0)
+      {
+        ret = compare_matrix(result, tmp1 ? tmp1 : mat1, tmp2 ? tmp2 : mat2, s, op);
+      }
+      deallocate_matrix(tmp1);
+      deallocate_matrix(tmp2);
+      return ret;
+    }
+
+    TRACE_BEGIN(t_compute);
+    #pragma omp parallel if ((long long)mat1->rows * mat1->cols >= matrix_tune.par_elem)
+    {
+      TRACE_BEGIN(t_tile);
+      int tile_rows = 0;
+      #pragma omp for nowait
+      for (int r = 0; r < mat1->rows; r++)
+      {
+          unsigned char *dst = result->data + (size_t)r * result->cols;
+          if (mat1->dtype == DTYPE_FLOAT32)
+          {
+            kernels->cmp_f32(dst, mat1->fdata[r], mat2 ? mat2->fdata[r] : NULL, (float)s,
+                             mat1->cols, op);
+          }
+          else
+          {
+            kernels->cmp(dst, mat1->data[r], mat2 ? mat2->data[r] : NULL, s, mat1->cols, op);
+          }
+          tile_rows++;
+      }
+      TRACE_END(t_tile, "compare_matrix.tile", "thread", tile_rows, mat1->cols);
+    }
+    TRACE_END(t_compute, "compare_matrix", "compute", mat1->rows, mat1->cols);
+    return 0;
+}
+
+/*
+ * Store a where `m` is set and b elsewhere to `result`. A NULL a or b stands for the scalar
+ * sa or sb in every entry. Operands that are matrices must have the dtype of `result`, which
+ * may be either of them but not a transposed view.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int where_matrix(matrix *result, mask *m, matrix *a, matrix *b, double sa, double sb) {
+    if (result->rows != m->rows || result->cols != m->cols ||
+        (a && (a->rows != m->rows || a->cols != m->cols || a->dtype != result->dtype)) ||
+        (b && (b->rows != m->rows || b->cols != m->cols || b->dtype != result->dtype)) ||
+        result->transposed)
+    {
+      return -1;
+    }
+    if ((a && a->transposed) || (b && b->transposed))
+    {
+      matrix *tmp_a = NULL, *tmp_b = NULL;
+      int ret = a ? dense_matrix(&tmp_a, a) : 0;
+      if (ret == 0 && b)
+      {
+        ret = dense_matrix(&tmp_b, b);
+      }
+      if (ret == 0)
+      {
+        ret = where_matrix(result, m, tmp_a ? tmp_a : a, tmp_b ? tmp_b : b, sa, sb);
+      }
+      deallocate_matrix(tmp_a);
+      deallocate_matrix(tmp_b);
+      return ret;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+
+    TRACE_BEGIN(t_compute);
+    #pragma omp parallel if ((long long)m->rows * m->cols >= matrix_tune.par_elem)
+    {
+      TRACE_BEGIN(t_tile);
+      int tile_rows = 0;
+      #pragma omp for nowait
+      for (int r = 0; r < m->rows; r++)
+      {
+          const unsigned char *bits = m->data + (size_t)r * m->cols;
+          if (result->dtype == DTYPE_FLOAT32)
+          {
+            kernels->where_f32(result->fdata[r], bits, a ? a->fdata[r] : NULL,
+                               b ? b->fdata[r] : NULL, (float)sa, (float)sb, m->cols);
+          }
+          else
+          {
+            kernels->where(result->data[r], bits, a ? a->data[r] : NULL,
+                           b ? b->data[r] : NULL, sa, sb, m->cols);
+          }
+          tile_rows++;
+      }
+      TRACE_END(t_tile, "where_matrix.tile", "thread", tile_rows, m->cols);
+    }
+    TRACE_END(t_compute, "where_matrix", "compute", m->rows, m->cols);
+    return 0;
+}
+
+/*
+ * Store m1 & m2, m1 | m2 or ~m1 to `result` according to `op` (one of MASK_*). m2 is unused
+ * by MASK_NOT. `result` may be either operand.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int mask_logic(mask *result, mask *m1, mask *m2, int op) {
+    if (result->rows != m1->rows || result->cols != m1->cols || op < MASK_AND || op > MASK_NOT ||
+        (op != MASK_NOT && (m2->rows != m1->rows || m2->cols != m1->cols)))
+    {
+      return -1;
+    }
+
+    long long n = (long long)m1->rows * m1->cols;
+    unsigned char *dst = result->data;
+    const unsigned char *a = m1->data;
+    const unsigned char *b = op == MASK_NOT ? m1->data : m2->data;
+    /* Entries are 0 or 1, so the byte operations below vectorize as they are */
+    #pragma omp parallel for schedule(static) if (n >= matrix_tune.par_elem)
+    for (long long i = 0; i < n; i++)
+    {
+      dst[i] = op == MASK_AND ? a[i] & b[i] : op == MASK_OR ? a[i] | b[i] : a[i] ^ 1;
+    }
+    return 0;
+}
+
+/*
+ * Return the number of set entries of `m`.
+ */
+long long mask_count(mask *m) {
+    long long n = (long long)m->rows * m->cols;
+    long long count = 0;
+    #pragma omp parallel for schedule(static) reduction(+:count) if (n >= matrix_tune.par_elem)
+    for (long long i = 0; i < n; i++)
+    {
+      count += m->data[i];
+    }
+    return count;
+}
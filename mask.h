@@ -0,0 +1,30 @@
+#ifndef NUMC_MASK_H
+#define NUMC_MASK_H
+
+#include "matrix.h"
+#include "kernels.h"
+
+/* Operations of mask_logic */
+#define MASK_AND 0
+#define MASK_OR 1
+#define MASK_NOT 2   // of the first operand only
+
+/*
+ * The result of comparing matrices entry by entry: one byte per entry, 0 or 1,
+ * stored row major without padding. Kept apart from matrix so a mask costs an
+ * eighth of a float64 matrix and feeds the blend of where_matrix directly.
+ */
+typedef struct mask {
+    int rows;             // number of rows
+    int cols;             // number of columns
+    unsigned char *data;  // rows * cols entries of 0 or 1
+} mask;
+
+int allocate_mask(mask **m, int rows, int cols);
+void deallocate_mask(mask *m);
+int compare_matrix(mask *result, matrix *mat1, matrix *mat2, double s, int op);
+int where_matrix(matrix *result, mask *m, matrix *a, matrix *b, double sa, double sb);
+int mask_logic(mask *result, mask *m1, mask *m2, int op);
+long long mask_count(mask *m);
+
+#endif
@@ -1,8 +1,22 @@
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #include "CUnit/Basic.h"
 #include "CUnit/CUnit.h"
 #include "matrix.h"
+#include "trace.h"
+#include "tune.h"
+#include "kernels.h"
+#include "sparse.h"
+#include "batch.h"
+#include "mask.h"
+#include "matfile.h"
+#include "ooc.h"
+#include "shard.h"
 
 /* Test Suite setup and cleanup functions: */
 int init_suite(void) { return 0; }
@@ -252,6 +266,1578 @@ void set_test(void) {
     deallocate_matrix(mat);
 }
 
+void trace_test(void) {
+    matrix *result = NULL;
+    matrix *mat = NULL;
+    const char *path = "mat_test_trace.json";
+    CU_ASSERT_EQUAL(trace_start(path), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&result, 6, 6), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&mat, 6, 6), 0);
+    fill_matrix(mat, 2);
+    CU_ASSERT_EQUAL(mul_matrix(result, mat, mat), 0);
+    /* The unrolled kernels of small matrices are traced too */
+    matrix *tiny = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&tiny, 4, 4), 0);
+    CU_ASSERT_EQUAL(add_matrix(tiny, tiny, tiny), 0);
+    CU_ASSERT_EQUAL(trace_stop(), 0);
+    CU_ASSERT_EQUAL(trace_stop(), -1);
+    deallocate_matrix(result);
+    deallocate_matrix(mat);
+    deallocate_matrix(tiny);
+
+    char buf[4096];
+    FILE *f = fopen(path, "r");
+    CU_ASSERT_PTR_NOT_NULL(f);
+    if (f) {
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        buf[n] = '\0';
+        fclose(f);
+        CU_ASSERT_PTR_NOT_NULL(strstr(buf, "\"traceEvents\""));
+        CU_ASSERT_PTR_NOT_NULL(strstr(buf, "\"name\":\"mul_matrix\""));
+        CU_ASSERT_PTR_NOT_NULL(strstr(buf, "\"name\":\"mul_matrix.tile\""));
+        CU_ASSERT_PTR_NOT_NULL(strstr(buf, "\"cat\":\"alloc\""));
+        CU_ASSERT_PTR_NOT_NULL(strstr(buf, "\"name\":\"add_matrix\""));
+    }
+    remove(path);
+}
+
+/* Check mul_matrix against a naive triple loop for every micro kernel and ragged tiles */
+void mul_blocked_test(void) {
+    static const int shapes[][2] = {{2, 8}, {4, 4}, {4, 8}, {8, 4}};
+    tune_params saved = matrix_tune;
+    matrix *result = NULL;
+    matrix *mat1 = NULL;
+    matrix *mat2 = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&result, 37, 29), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&mat1, 37, 53), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&mat2, 53, 29), 0);
+    rand_matrix(mat1, 1, -1, 1);
+    rand_matrix(mat2, 2, -1, 1);
+    matrix_tune.tile_m = 12;
+    matrix_tune.tile_n = 20;
+    matrix_tune.tile_k = 16;
+    for (int s = 0; s < 4; s++) {
+        matrix_tune.micro_m = shapes[s][0];
+        matrix_tune.micro_n = shapes[s][1];
+        CU_ASSERT_EQUAL(mul_matrix(result, mat1, mat2), 0);
+        for (int i = 0; i < 37; i++) {
+            for (int j = 0; j < 29; j++) {
+                double expected = 0;
+                for (int k = 0; k < 53; k++) {
+                    expected += get(mat1, i, k) * get(mat2, k, j);
+                }
+                CU_ASSERT_DOUBLE_EQUAL(get(result, i, j), expected, 1e-9);
+            }
+        }
+    }
+    matrix_tune = saved;
+    deallocate_matrix(result);
+    deallocate_matrix(mat1);
+    deallocate_matrix(mat2);
+}
+
+void tune_profile_test(void) {
+    const char *path = "mat_test_profile";
+    tune_params saved = matrix_tune;
+    matrix_tune.tile_m = 32;
+    matrix_tune.micro_m = 2;
+    matrix_tune.micro_n = 8;
+    matrix_tune.par_elem = 12345;
+    CU_ASSERT_EQUAL(tune_save(path), 0);
+    matrix_tune = saved;
+    CU_ASSERT_EQUAL(tune_load(path), 0);
+    CU_ASSERT_EQUAL(matrix_tune.tile_m, 32);
+    CU_ASSERT_EQUAL(matrix_tune.micro_m, 2);
+    CU_ASSERT_EQUAL(matrix_tune.micro_n, 8);
+    CU_ASSERT_EQUAL(matrix_tune.par_elem, 12345);
+
+    /* An unsupported micro kernel shape rejects the whole profile */
+    FILE *f = fopen(path, "w");
+    fprintf(f, "tile_m 16\nmicro_m 3\n");
+    fclose(f);
+    CU_ASSERT_EQUAL(tune_load(path), -2);
+    CU_ASSERT_EQUAL(matrix_tune.tile_m, 32);
+    remove(path);
+    CU_ASSERT_EQUAL(tune_load(path), -1);
+    matrix_tune = saved;
+}
+
+/* Every kernel variant this CPU supports must agree with the portable one */
+void isa_dispatch_test(void) {
+    static const char *isas[] = {"scalar", "avx2", "avx512"};
+    const matrix_kernels *saved = kernels;
+    matrix *mat1 = NULL;
+    matrix *mat2 = NULL;
+    matrix *expected[4];
+    matrix *result[4];
+    CU_ASSERT_EQUAL(allocate_matrix(&mat1, 19, 19), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&mat2, 19, 19), 0);
+    rand_matrix(mat1, 3, -2, 2);
+    rand_matrix(mat2, 4, -2, 2);
+    for (int i = 0; i < 4; i++) {
+        CU_ASSERT_EQUAL(allocate_matrix(&expected[i], 19, 19), 0);
+        CU_ASSERT_EQUAL(allocate_matrix(&result[i], 19, 19), 0);
+    }
+    CU_ASSERT_EQUAL(kernels_select("scalar"), 0);
+    add_matrix(expected[0], mat1, mat2);
+    sub_matrix(expected[1], mat1, mat2);
+    abs_matrix(expected[2], mat1);
+    mul_matrix(expected[3], mat1, mat2);
+    CU_ASSERT_EQUAL(kernels_select("sse9"), -1);
+
+    for (int v = 1; v < 3; v++) {
+        if (!kernels_supported(isas[v])) {
+            CU_ASSERT_EQUAL(kernels_select(isas[v]), -2);
+            continue;
+        }
+        CU_ASSERT_EQUAL(kernels_select(isas[v]), 0);
+        CU_ASSERT_EQUAL(strcmp(kernels->name, isas[v]), 0);
+        add_matrix(result[0], mat1, mat2);
+        sub_matrix(result[1], mat1, mat2);
+        abs_matrix(result[2], mat1);
+        mul_matrix(result[3], mat1, mat2);
+        for (int m = 0; m < 4; m++) {
+            for (int i = 0; i < 19; i++) {
+                for (int j = 0; j < 19; j++) {
+                    CU_ASSERT_DOUBLE_EQUAL(get(result[m], i, j), get(expected[m], i, j), 1e-9);
+                }
+            }
+        }
+    }
+    kernels = saved;
+    for (int i = 0; i < 4; i++) {
+        deallocate_matrix(expected[i]);
+        deallocate_matrix(result[i]);
+    }
+    deallocate_matrix(mat1);
+    deallocate_matrix(mat2);
+}
+
+void float32_test(void) {
+    static const char *isas[] = {"scalar", "avx2", "avx512"};
+    const matrix_kernels *saved = kernels;
+    matrix *mat1 = NULL;
+    matrix *mat2 = NULL;
+    matrix *mat1_f32 = NULL;
+    matrix *mat2_f32 = NULL;
+    matrix *expected = NULL;
+    matrix *result = NULL;
+    matrix *sum = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&mat1_f32, 0, 3, DTYPE_FLOAT32), -1);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&mat1_f32, 3, 3, 7), -1);
+    CU_ASSERT_EQUAL(allocate_matrix(&mat1, 21, 35), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&mat2, 35, 17), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&expected, 21, 17), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&mat1_f32, 21, 35, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&mat2_f32, 35, 17, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&result, 21, 17, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&sum, 21, 35, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(mat1_f32->dtype, DTYPE_FLOAT32);
+    CU_ASSERT_PTR_NULL(mat1_f32->data);
+    CU_ASSERT_EQUAL(get(mat1_f32, 20, 34), 0);
+    rand_matrix(mat1, 5, -1, 1);
+    rand_matrix(mat2, 6, -1, 1);
+    CU_ASSERT_EQUAL(copy_matrix(mat1_f32, mat1), 0);
+    CU_ASSERT_EQUAL(copy_matrix(mat2_f32, mat2), 0);
+    CU_ASSERT_EQUAL(get(mat1_f32, 3, 4), (float)get(mat1, 3, 4));
+    CU_ASSERT_EQUAL(mul_matrix(expected, mat1, mat2), 0);
+    /* Mixing dtypes is rejected; numc.c converts operands first */
+    CU_ASSERT_EQUAL(mul_matrix(result, mat1, mat2_f32), -1);
+    CU_ASSERT_EQUAL(add_matrix(sum, mat1, mat1_f32), -1);
+
+    for (int v = 0; v < 3; v++) {
+        if (kernels_select(isas[v]) != 0) {
+            continue;
+        }
+        CU_ASSERT_EQUAL(mul_matrix(result, mat1_f32, mat2_f32), 0);
+        for (int i = 0; i < 21; i++) {
+            for (int j = 0; j < 17; j++) {
+                CU_ASSERT_DOUBLE_EQUAL(get(result, i, j), get(expected, i, j), 1e-4);
+            }
+        }
+        CU_ASSERT_EQUAL(add_matrix(sum, mat1_f32, mat1_f32), 0);
+        CU_ASSERT_EQUAL(abs_matrix(sum, sum), 0);
+        for (int i = 0; i < 21; i++) {
+            for (int j = 0; j < 35; j++) {
+                CU_ASSERT_EQUAL(get(sum, i, j), 2 * fabsf((float)get(mat1, i, j)));
+            }
+        }
+    }
+    kernels = saved;
+    deallocate_matrix(mat1);
+    deallocate_matrix(mat2);
+    deallocate_matrix(mat1_f32);
+    deallocate_matrix(mat2_f32);
+    deallocate_matrix(expected);
+    deallocate_matrix(result);
+    deallocate_matrix(sum);
+}
+
+void mixed_precision_test(void) {
+    static const char *isas[] = {"scalar", "avx2", "avx512"};
+    const matrix_kernels *saved = kernels;
+    matrix *mat1_f32 = NULL;
+    matrix *mat2_f32 = NULL;
+    matrix *mat1 = NULL;
+    matrix *mat2 = NULL;
+    matrix *expected = NULL;
+    matrix *result = NULL;
+    matrix *result_f32 = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&mat1_f32, 13, 1000, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&mat2_f32, 1000, 19, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&mat1, 13, 1000), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&mat2, 1000, 19), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&expected, 13, 19), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&result, 13, 19), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&result_f32, 13, 19, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(mat1_f32->acc_f64, 0);
+    rand_matrix(mat1_f32, 7, -1, 1);
+    rand_matrix(mat2_f32, 8, -1, 1);
+    /* The exact float64 product of the float32 values is the reference */
+    copy_matrix(mat1, mat1_f32);
+    copy_matrix(mat2, mat2_f32);
+    CU_ASSERT_EQUAL(mul_matrix(expected, mat1, mat2), 0);
+    CU_ASSERT_EQUAL(mul_matrix_mixed(result, mat1, mat2), -1);
+    CU_ASSERT_EQUAL(mul_matrix_mixed(result, mat2_f32, mat1_f32), -1);
+
+    for (int v = 0; v < 3; v++) {
+        if (kernels_select(isas[v]) != 0) {
+            continue;
+        }
+        /* A float64 result of float32 operands accumulates in float64 */
+        CU_ASSERT_EQUAL(mul_matrix(result, mat1_f32, mat2_f32), 0);
+        /* So does a float32 result once an operand asks for it */
+        mat2_f32->acc_f64 = 1;
+        CU_ASSERT_EQUAL(mul_matrix(result_f32, mat1_f32, mat2_f32), 0);
+        mat2_f32->acc_f64 = 0;
+        for (int i = 0; i < 13; i++) {
+            for (int j = 0; j < 19; j++) {
+                CU_ASSERT_DOUBLE_EQUAL(get(result, i, j), get(expected, i, j), 1e-12);
+                CU_ASSERT_EQUAL(get(result_f32, i, j), (float)get(result, i, j));
+            }
+        }
+        /* Or when the caller asks for it, whatever the operands say */
+        fill_matrix(result_f32, 0);
+        CU_ASSERT_EQUAL(mul_matrix_acc(result_f32, mat1_f32, mat2_f32, DTYPE_FLOAT64), 0);
+        CU_ASSERT_EQUAL(get(result_f32, 12, 18), (float)get(result, 12, 18));
+    }
+    kernels = saved;
+    deallocate_matrix(mat1_f32);
+    deallocate_matrix(mat2_f32);
+    deallocate_matrix(mat1);
+    deallocate_matrix(mat2);
+    deallocate_matrix(expected);
+    deallocate_matrix(result);
+    deallocate_matrix(result_f32);
+}
+
+void sparse_test(void) {
+    static const char *isas[] = {"scalar", "avx2", "avx512"};
+    const matrix_kernels *saved = kernels;
+    matrix *dense = NULL;
+    matrix *mat = NULL;
+    matrix *vec = NULL;
+    matrix *expected = NULL;
+    matrix *expected_vec = NULL;
+    matrix *result = NULL;
+    matrix *result_vec = NULL;
+    sparse *sp = NULL;
+    sparse *sum = NULL;
+    CU_ASSERT_EQUAL(allocate_sparse(&sp, 0, 3, 0), -1);
+    CU_ASSERT_EQUAL(allocate_sparse(&sp, 2, 2, 5), -1);
+    CU_ASSERT_EQUAL(allocate_matrix(&dense, 37, 41), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&mat, 41, 9), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&vec, 41, 1), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&expected, 37, 9), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&expected_vec, 37, 1), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&result, 37, 9), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&result_vec, 37, 1), 0);
+    /* About one entry in ten is nonzero, and row 3 is empty */
+    for (int i = 0; i < 37; i++) {
+        for (int j = 0; j < 41; j++) {
+            set(dense, i, j, (i * 7 + j * 3) % 10 == 0 && i != 3 ? i - j + 0.5 : 0);
+        }
+    }
+    rand_matrix(mat, 9, -1, 1);
+    rand_matrix(vec, 10, -1, 1);
+    CU_ASSERT_EQUAL(mul_matrix(expected, dense, mat), 0);
+    CU_ASSERT_EQUAL(mul_matrix(expected_vec, dense, vec), 0);
+
+    CU_ASSERT_EQUAL(dense_to_sparse(&sp, dense), 0);
+    CU_ASSERT_EQUAL(check_sparse(sp), 0);
+    CU_ASSERT_EQUAL(sp->row_ptr[3], sp->row_ptr[4]);
+    CU_ASSERT(sp->nnz > 100 && sp->nnz < 200);
+    CU_ASSERT_EQUAL(mul_sparse_dense(result, sp, dense), -1);
+    for (int v = 0; v < 3; v++) {
+        if (kernels_select(isas[v]) != 0) {
+            continue;
+        }
+        CU_ASSERT_EQUAL(mul_sparse_dense(result, sp, mat), 0);
+        CU_ASSERT_EQUAL(mul_sparse_dense(result_vec, sp, vec), 0);
+        for (int i = 0; i < 37; i++) {
+            for (int j = 0; j < 9; j++) {
+                CU_ASSERT_DOUBLE_EQUAL(get(result, i, j), get(expected, i, j), 1e-12);
+            }
+            CU_ASSERT_DOUBLE_EQUAL(get(result_vec, i, 0), get(expected_vec, i, 0), 1e-12);
+        }
+    }
+    kernels = saved;
+
+    /* sp + sp doubles every entry; adding the negation cancels them all */
+    CU_ASSERT_EQUAL(add_sparse(&sum, sp, sp), 0);
+    CU_ASSERT_EQUAL(sum->nnz, sp->nnz);
+    CU_ASSERT_EQUAL(sparse_to_dense(result, sum), -1);
+    matrix *back = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&back, 37, 41), 0);
+    CU_ASSERT_EQUAL(sparse_to_dense(back, sum), 0);
+    for (int i = 0; i < 37; i++) {
+        for (int j = 0; j < 41; j++) {
+            CU_ASSERT_EQUAL(get(back, i, j), 2 * get(dense, i, j));
+        }
+    }
+    deallocate_sparse(sum);
+    neg_matrix(dense, dense);
+    sparse *neg = NULL;
+    CU_ASSERT_EQUAL(dense_to_sparse(&neg, dense), 0);
+    CU_ASSERT_EQUAL(add_sparse(&sum, sp, neg), 0);
+    CU_ASSERT_EQUAL(sum->nnz, 0);
+    CU_ASSERT_EQUAL(check_sparse(sum), 0);
+
+    deallocate_sparse(sp);
+    deallocate_sparse(neg);
+    deallocate_sparse(sum);
+    deallocate_matrix(back);
+    deallocate_matrix(dense);
+    deallocate_matrix(mat);
+    deallocate_matrix(vec);
+    deallocate_matrix(expected);
+    deallocate_matrix(expected_vec);
+    deallocate_matrix(result);
+    deallocate_matrix(result_vec);
+}
+
+/* Naive product of float64 matrices, the reference for the specialized paths */
+static double naive_mul_entry(matrix *mat1, matrix *mat2, int i, int j) {
+    double sum = 0;
+    for (int k = 0; k < mat1->cols; k++) {
+        sum += get(mat1, i, k) * get(mat2, k, j);
+    }
+    return sum;
+}
+
+void gemv_test(void) {
+    static const char *isas[] = {"scalar", "avx2", "avx512"};
+    const matrix_kernels *saved = kernels;
+    matrix *mat = NULL;
+    matrix *vec = NULL;
+    matrix *row = NULL;
+    matrix *wide = NULL;
+    matrix *result = NULL;
+    matrix *result_row = NULL;
+    matrix *row_result = NULL;
+    matrix *mat_f32 = NULL;
+    matrix *vec_f32 = NULL;
+    matrix *result_f32 = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&mat, 203, 203), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&vec, 203, 1), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&row, 1, 203), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&wide, 203, 1100), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&result, 203, 1), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&result_row, 1, 1100), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&mat_f32, 203, 203, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&vec_f32, 203, 1, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&result_f32, 203, 1, DTYPE_FLOAT32), 0);
+    rand_matrix(mat, 11, -1, 1);
+    rand_matrix(vec, 12, -1, 1);
+    rand_matrix(row, 13, -1, 1);
+    rand_matrix(wide, 14, -1, 1);
+    copy_matrix(mat_f32, mat);
+    copy_matrix(vec_f32, vec);
+
+    for (int v = 0; v < 3; v++) {
+        if (kernels_select(isas[v]) != 0) {
+            continue;
+        }
+        CU_ASSERT_EQUAL(mul_matrix(result, mat, vec), 0);
+        CU_ASSERT_EQUAL(mul_matrix(result_row, row, wide), 0);
+        CU_ASSERT_EQUAL(mul_matrix(result_f32, mat_f32, vec_f32), 0);
+        for (int i = 0; i < 203; i++) {
+            CU_ASSERT_DOUBLE_EQUAL(get(result, i, 0), naive_mul_entry(mat, vec, i, 0), 1e-12);
+            CU_ASSERT_DOUBLE_EQUAL(get(result_f32, i, 0), get(result, i, 0), 1e-3);
+        }
+        for (int j = 0; j < 1100; j++) {
+            CU_ASSERT_DOUBLE_EQUAL(get(result_row, 0, j), naive_mul_entry(row, wide, 0, j), 1e-12);
+        }
+    }
+    kernels = saved;
+
+    /* A forced parallel vector-matrix product narrower than one chunk */
+    long long par_mul = matrix_tune.par_mul;
+    matrix_tune.par_mul = 0;
+    CU_ASSERT_EQUAL(allocate_matrix(&row_result, 1, 203), 0);
+    CU_ASSERT_EQUAL(mul_matrix(row_result, row, mat), 0);
+    for (int j = 0; j < 203; j++) {
+        CU_ASSERT_DOUBLE_EQUAL(get(row_result, 0, j), naive_mul_entry(row, mat, 0, j), 1e-12);
+    }
+    matrix_tune.par_mul = par_mul;
+    deallocate_matrix(row_result);
+
+    /* x = A * x in place */
+    CU_ASSERT_EQUAL(mul_matrix(result, mat, vec), 0);
+    CU_ASSERT_EQUAL(mul_matrix(vec, mat, vec), 0);
+    for (int i = 0; i < 203; i++) {
+        CU_ASSERT_EQUAL(get(vec, i, 0), get(result, i, 0));
+    }
+    /* Shapes are still checked */
+    CU_ASSERT_EQUAL(mul_matrix(result, wide, vec), -1);
+    CU_ASSERT_EQUAL(mul_matrix(result_row, row, mat), -1);
+
+    deallocate_matrix(mat);
+    deallocate_matrix(vec);
+    deallocate_matrix(row);
+    deallocate_matrix(wide);
+    deallocate_matrix(result);
+    deallocate_matrix(result_row);
+    deallocate_matrix(mat_f32);
+    deallocate_matrix(vec_f32);
+    deallocate_matrix(result_f32);
+}
+
+void pow_apply_test(void) {
+    matrix *mat = NULL;
+    matrix *vec = NULL;
+    matrix *row = NULL;
+    matrix *powered = NULL;
+    matrix *expected = NULL;
+    matrix *result = NULL;
+    int steps = -1;
+    CU_ASSERT_EQUAL(allocate_matrix(&mat, 30, 30), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&vec, 30, 1), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&row, 1, 30), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&powered, 30, 30), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&expected, 30, 1), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&result, 30, 1), 0);
+    rand_matrix(mat, 15, -0.3, 0.3);
+    rand_matrix(vec, 16, -1, 1);
+    CU_ASSERT_EQUAL(pow_matrix(powered, mat, 7), 0);
+    CU_ASSERT_EQUAL(mul_matrix(expected, powered, vec), 0);
+    CU_ASSERT_EQUAL(pow_apply_matrix(result, mat, 7, vec, 0, &steps), 0);
+    CU_ASSERT_EQUAL(steps, 7);
+    for (int i = 0; i < 30; i++) {
+        CU_ASSERT_DOUBLE_EQUAL(get(result, i, 0), get(expected, i, 0), 1e-12);
+    }
+    /* A row vector in and out works the same; k = 0 is a copy */
+    for (int i = 0; i < 30; i++) {
+        set(row, 0, i, get(vec, i, 0));
+    }
+    CU_ASSERT_EQUAL(pow_apply_matrix(row, mat, 0, row, 0, &steps), 0);
+    CU_ASSERT_EQUAL(steps, 0);
+    CU_ASSERT_EQUAL(get(row, 0, 29), get(vec, 29, 0));
+    CU_ASSERT_EQUAL(pow_apply_matrix(result, mat, -1, vec, 0, NULL), -1);
+    CU_ASSERT_EQUAL(pow_apply_matrix(result, powered, 2, mat, 0, NULL), -1);
+
+    /* A column stochastic matrix converges to its stationary distribution (1/2, 1/2) */
+    matrix *chain = NULL;
+    matrix *dist = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&chain, 2, 2), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&dist, 2, 1), 0);
+    set(chain, 0, 0, 0.9);
+    set(chain, 0, 1, 0.1);
+    set(chain, 1, 0, 0.1);
+    set(chain, 1, 1, 0.9);
+    set(dist, 0, 0, 1);
+    CU_ASSERT_EQUAL(pow_apply_matrix(dist, chain, 100000, dist, 1e-12, &steps), 0);
+    CU_ASSERT(steps > 10 && steps < 1000);
+    CU_ASSERT_DOUBLE_EQUAL(get(dist, 0, 0), 0.5, 1e-10);
+    CU_ASSERT_DOUBLE_EQUAL(get(dist, 1, 0), 0.5, 1e-10);
+
+    deallocate_matrix(mat);
+    deallocate_matrix(vec);
+    deallocate_matrix(row);
+    deallocate_matrix(powered);
+    deallocate_matrix(expected);
+    deallocate_matrix(result);
+    deallocate_matrix(chain);
+    deallocate_matrix(dist);
+}
+
+void batch_test(void) {
+    static const char *isas[] = {"scalar", "avx2", "avx512"};
+    static const int sizes[][3] = {{8, 8, 8}, {16, 5, 16}, {32, 32, 32}, {64, 7, 64}, {3, 4, 5}};
+    const matrix_kernels *saved = kernels;
+    batch *b = NULL;
+    CU_ASSERT_EQUAL(allocate_batch(&b, 0, 2, 2, DTYPE_FLOAT64), -1);
+    CU_ASSERT_EQUAL(allocate_batch(&b, 2, 2, 2, 5), -1);
+
+    /* A retained batch outlives its first owner */
+    CU_ASSERT_EQUAL(allocate_batch(&b, 2, 2, 2, DTYPE_FLOAT64), 0);
+    CU_ASSERT(retain_batch(b) == b);
+    deallocate_batch(b);
+    CU_ASSERT_EQUAL(b->ref_cnt, 1);
+    deallocate_batch(b);
+
+    for (int s = 0; s < 5; s++) {
+        int m = sizes[s][0], k = sizes[s][1], n = sizes[s][2];
+        matrix *mat1 = NULL, *mat2 = NULL, *expected = NULL, *entry = NULL, *entry_f32 = NULL;
+        batch *b1 = NULL, *b2 = NULL, *res = NULL, *b1_f32 = NULL, *b2_f32 = NULL, *res_f32 = NULL;
+        CU_ASSERT_EQUAL(allocate_matrix(&mat1, m, k), 0);
+        CU_ASSERT_EQUAL(allocate_matrix(&mat2, k, n), 0);
+        CU_ASSERT_EQUAL(allocate_matrix(&expected, m, n), 0);
+        CU_ASSERT_EQUAL(allocate_matrix(&entry, m, n), 0);
+        CU_ASSERT_EQUAL(allocate_matrix_dtype(&entry_f32, m, n, DTYPE_FLOAT32), 0);
+        CU_ASSERT_EQUAL(allocate_batch(&b1, 3, m, k, DTYPE_FLOAT64), 0);
+        CU_ASSERT_EQUAL(allocate_batch(&b2, 1, k, n, DTYPE_FLOAT64), 0);
+        CU_ASSERT_EQUAL(allocate_batch(&res, 3, m, n, DTYPE_FLOAT64), 0);
+        CU_ASSERT_EQUAL(allocate_batch(&b1_f32, 3, m, k, DTYPE_FLOAT32), 0);
+        CU_ASSERT_EQUAL(allocate_batch(&b2_f32, 1, k, n, DTYPE_FLOAT32), 0);
+        CU_ASSERT_EQUAL(allocate_batch(&res_f32, 3, m, n, DTYPE_FLOAT32), 0);
+        rand_matrix(mat1, 17 + s, -1, 1);
+        rand_matrix(mat2, 18 + s, -1, 1);
+        CU_ASSERT_EQUAL(mul_matrix(expected, mat1, mat2), 0);
+        /* Entry 1 holds mat1, the others stay zero; b2 is broadcast */
+        CU_ASSERT_EQUAL(batch_set_matrix(b1, 1, mat1), 0);
+        CU_ASSERT_EQUAL(batch_set_matrix(b2, 0, mat2), 0);
+        CU_ASSERT_EQUAL(batch_set_matrix(b1_f32, 1, mat1), 0);
+        CU_ASSERT_EQUAL(batch_set_matrix(b2_f32, 0, mat2), 0);
+        CU_ASSERT_EQUAL(batch_set_matrix(b1, 3, mat1), -1);
+        CU_ASSERT_EQUAL(batch_mul(b1, b1, b2), -1);
+        CU_ASSERT_EQUAL(batch_mul(res, b1, b2_f32), -1);
+
+        for (int v = 0; v < 3; v++) {
+            if (kernels_select(isas[v]) != 0) {
+                continue;
+            }
+            CU_ASSERT_EQUAL(batch_mul(res, b1, b2), 0);
+            CU_ASSERT_EQUAL(batch_mul(res_f32, b1_f32, b2_f32), 0);
+            CU_ASSERT_EQUAL(batch_get_matrix(entry, res, 1), 0);
+            CU_ASSERT_EQUAL(batch_get_matrix(entry_f32, res_f32, 1), 0);
+            for (int i = 0; i < m; i++) {
+                for (int j = 0; j < n; j++) {
+                    CU_ASSERT_DOUBLE_EQUAL(get(entry, i, j), get(expected, i, j), 1e-12);
+                    CU_ASSERT_DOUBLE_EQUAL(get(entry_f32, i, j), get(expected, i, j), 1e-4);
+                }
+            }
+            CU_ASSERT_EQUAL(batch_get_matrix(entry, res, 2), 0);
+            CU_ASSERT_EQUAL(get(entry, m - 1, n - 1), 0);
+        }
+        deallocate_matrix(mat1);
+        deallocate_matrix(mat2);
+        deallocate_matrix(expected);
+        deallocate_matrix(entry);
+        deallocate_matrix(entry_f32);
+        deallocate_batch(b1);
+        deallocate_batch(b2);
+        deallocate_batch(res);
+        deallocate_batch(b1_f32);
+        deallocate_batch(b2_f32);
+        deallocate_batch(res_f32);
+    }
+    kernels = saved;
+}
+
+void tiny_test(void) {
+    static const int sizes[] = {2, 3, 4, 8};
+    for (int s = 0; s < 4; s++) {
+        int n = sizes[s];
+        matrix *mat1 = NULL, *mat2 = NULL, *result = NULL, *powered = NULL, *big = NULL;
+        matrix *mat_f32 = NULL, *result_f32 = NULL;
+        CU_ASSERT_EQUAL(allocate_matrix(&mat1, n, n), 0);
+        CU_ASSERT_EQUAL(allocate_matrix(&mat2, n, n), 0);
+        CU_ASSERT_EQUAL(allocate_matrix(&result, n, n), 0);
+        CU_ASSERT_EQUAL(allocate_matrix(&powered, n, n), 0);
+        CU_ASSERT_EQUAL(allocate_matrix_dtype(&mat_f32, n, n, DTYPE_FLOAT32), 0);
+        CU_ASSERT_EQUAL(allocate_matrix_dtype(&result_f32, n, n, DTYPE_FLOAT32), 0);
+        CU_ASSERT_EQUAL(mat1->is_inline, 1);
+        rand_matrix(mat1, 30 + s, -1, 1);
+        rand_matrix(mat2, 40 + s, -1, 1);
+        copy_matrix(mat_f32, mat1);
+
+        CU_ASSERT_EQUAL(mul_matrix(result, mat1, mat2), 0);
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                CU_ASSERT_DOUBLE_EQUAL(get(result, i, j), naive_mul_entry(mat1, mat2, i, j), 1e-12);
+            }
+        }
+        /* In place: mat2 = mat1 * mat2 */
+        CU_ASSERT_EQUAL(mul_matrix(mat2, mat1, mat2), 0);
+        CU_ASSERT_EQUAL(get(mat2, n - 1, 0), get(result, n - 1, 0));
+
+        /* pow by squaring matches repeated products */
+        CU_ASSERT_EQUAL(pow_matrix(powered, mat1, 11), 0);
+        CU_ASSERT_EQUAL(pow_matrix(result, mat1, 0), 0);
+        for (int p = 0; p < 11; p++) {
+            CU_ASSERT_EQUAL(mul_matrix(result, result, mat1), 0);
+        }
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                CU_ASSERT_DOUBLE_EQUAL(get(powered, i, j), get(result, i, j), 1e-9);
+            }
+        }
+        /* In place pow keeps the original for pow = 1 */
+        CU_ASSERT_EQUAL(pow_matrix(mat1, mat1, 1), 0);
+        CU_ASSERT_DOUBLE_EQUAL(get(mat1, 0, n - 1), get(mat_f32, 0, n - 1), 1e-7);
+
+        CU_ASSERT_EQUAL(add_matrix(result, mat1, mat1), 0);
+        CU_ASSERT_EQUAL(abs_matrix(result, result), 0);
+        CU_ASSERT_EQUAL(add_matrix(result_f32, mat_f32, mat_f32), 0);
+        CU_ASSERT_EQUAL(abs_matrix(result_f32, result_f32), 0);
+        CU_ASSERT_EQUAL(mul_matrix(result_f32, result_f32, mat_f32), 0);
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                CU_ASSERT_EQUAL(get(result, i, j), 2 * fabs(get(mat1, i, j)));
+            }
+        }
+        CU_ASSERT_EQUAL(allocate_matrix(&big, n * 8, n * 8), 0);
+        CU_ASSERT_EQUAL(big->is_inline, 0);
+
+        deallocate_matrix(mat1);
+        deallocate_matrix(mat2);
+        deallocate_matrix(result);
+        deallocate_matrix(powered);
+        deallocate_matrix(mat_f32);
+        deallocate_matrix(result_f32);
+        deallocate_matrix(big);
+    }
+}
+
+void take_put_test(void) {
+    static const char *isas[] = {"scalar", "avx2", "avx512"};
+    const int n = 1000;
+    matrix *mat = NULL, *slice = NULL, *mat_f32 = NULL;
+    long long rows[1000], cols[1000];
+    double vals[1000], out[1000];
+    CU_ASSERT_EQUAL(allocate_matrix(&mat, 37, 29), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_ref(&slice, mat, 3, 2, 30, 20), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&mat_f32, 37, 29, DTYPE_FLOAT32), 0);
+    rand_matrix(mat, 50, -1, 1);
+    copy_matrix(mat_f32, mat);
+    for (int i = 0; i < n; i++) {
+        rows[i] = i % 30;
+        cols[i] = (i / 30) % 20;
+        vals[i] = i;
+    }
+
+    for (int v = 0; v < 3; v++) {
+        if (!kernels_supported(isas[v])) {
+            continue;
+        }
+        CU_ASSERT_EQUAL(kernels_select(isas[v]), 0);
+        CU_ASSERT_EQUAL(take_matrix(out, slice, rows, cols, n), 0);
+        for (int i = 0; i < n; i++) {
+            CU_ASSERT_EQUAL(out[i], get(mat, rows[i] + 3, cols[i] + 2));
+        }
+        CU_ASSERT_EQUAL(take_matrix(out, mat_f32, rows, cols, n), 0);
+        CU_ASSERT_EQUAL(out[n - 1], get(mat_f32, rows[n - 1], cols[n - 1]));
+
+        /* Positions repeat every 600 indices, so 400 to 599 are written exactly once */
+        CU_ASSERT_EQUAL(put_matrix(slice, rows, cols, vals, n), 0);
+        for (int i = 400; i < 600; i++) {
+            CU_ASSERT_EQUAL(get(mat, rows[i] + 3, cols[i] + 2), vals[i]);
+        }
+    }
+    kernels_select("auto");
+
+    /* Out of range indices fail without writing anything */
+    rows[n - 1] = 30;
+    fill_matrix(mat, 1);
+    CU_ASSERT_EQUAL(take_matrix(out, slice, rows, cols, n), -1);
+    CU_ASSERT_EQUAL(put_matrix(slice, rows, cols, vals, n), -1);
+    CU_ASSERT_EQUAL(get(mat, 3, 2), 1);
+    cols[0] = -1;
+    CU_ASSERT_EQUAL(take_matrix(out, mat, rows, cols, 1), -1);
+
+    deallocate_matrix(slice);
+    deallocate_matrix(mat);
+    deallocate_matrix(mat_f32);
+}
+
+void pool_test(void) {
+    matrix *mat = NULL, *slice = NULL, *big = NULL;
+    /* A freed small matrix comes back for the next one of the same size, zeroed */
+    CU_ASSERT_EQUAL(allocate_matrix(&mat, 3, 3), 0);
+    matrix *first = mat;
+    fill_matrix(mat, 5);
+    deallocate_matrix(mat);
+    CU_ASSERT_EQUAL(allocate_matrix(&mat, 3, 3), 0);
+    CU_ASSERT_PTR_EQUAL(mat, first);
+    CU_ASSERT_EQUAL(get(mat, 2, 2), 0);
+
+    /* Headers of slices and large matrices are shared with the same pool */
+    CU_ASSERT_EQUAL(allocate_matrix(&big, 100, 100), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_ref(&slice, big, 10, 10, 20, 20), 0);
+    matrix *header = slice;
+    deallocate_matrix(slice);
+    CU_ASSERT_EQUAL(allocate_matrix_ref(&slice, big, 0, 0, 5, 5), 0);
+    CU_ASSERT_PTR_EQUAL(slice, header);
+    CU_ASSERT_EQUAL(slice->rows, 5);
+    CU_ASSERT_EQUAL(big->ref_cnt, 2);
+    set(big, 4, 4, 3);
+    CU_ASSERT_EQUAL(get(slice, 4, 4), 3);
+
+    /* The largest inline block, a float32 column of SMALL_MATRIX_BYTES, has a class too */
+    matrix *column = NULL;
+    int tall = SMALL_MATRIX_BYTES / sizeof(float);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&column, tall, 1, DTYPE_FLOAT32), 0);
+    CU_ASSERT_TRUE(column->is_inline);
+    first = column;
+    set(column, tall - 1, 0, 2);
+    deallocate_matrix(column);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&column, tall, 1, DTYPE_FLOAT32), 0);
+    CU_ASSERT_PTR_EQUAL(column, first);
+    CU_ASSERT_EQUAL(get(column, tall - 1, 0), 0);
+    deallocate_matrix(column);
+
+    deallocate_matrix(slice);
+    deallocate_matrix(big);
+    deallocate_matrix(mat);
+}
+
+void random_test(void) {
+    static const char *isas[] = {"scalar", "avx2", "avx512"};
+    double u0[9], u1[9], ref0[9], ref1[9];
+    /* Known answer of Philox4x32-10 for a zero counter and key */
+    kernels_select("scalar");
+    kernels->philox(u0, u1, 0, 1, 0);
+    CU_ASSERT_EQUAL(u0[0], (double)((0x6627e8d5ull << 32 | 0xe169c58dull) >> 12) / (1ull << 52));
+    CU_ASSERT_EQUAL(u1[0], (double)((0xbc57ac4cull << 32 | 0x9b00dbd8ull) >> 12) / (1ull << 52));
+    kernels->philox(ref0, ref1, (1ull << 32) - 3, 9, 12345);
+    for (int v = 1; v < 3; v++) {
+        if (!kernels_supported(isas[v])) {
+            continue;
+        }
+        kernels_select(isas[v]);
+        kernels->philox(u0, u1, (1ull << 32) - 3, 9, 12345);
+        for (int i = 0; i < 9; i++) {
+            CU_ASSERT_EQUAL(u0[i], ref0[i]);
+            CU_ASSERT_EQUAL(u1[i], ref1[i]);
+        }
+    }
+    kernels_select("auto");
+
+    /* The same seed gives the same matrix with one thread or many */
+    matrix *mat1 = NULL, *mat2 = NULL, *mat_f32 = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&mat1, 301, 207), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&mat2, 301, 207), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&mat_f32, 301, 207, DTYPE_FLOAT32), 0);
+    long long par_elem = matrix_tune.par_elem;
+    matrix_tune.par_elem = 1LL << 62;
+    uniform_matrix(mat1, 7, -2, 3);
+    matrix_tune.par_elem = 1;
+    uniform_matrix(mat2, 7, -2, 3);
+    uniform_matrix(mat_f32, 7, -2, 3);
+    double sum = 0;
+    for (int i = 0; i < 301; i++) {
+        for (int j = 0; j < 207; j++) {
+            CU_ASSERT_EQUAL(get(mat1, i, j), get(mat2, i, j));
+            CU_ASSERT_EQUAL(get(mat_f32, i, j), (float)get(mat1, i, j));
+            CU_ASSERT(get(mat1, i, j) >= -2 && get(mat1, i, j) < 3);
+            sum += get(mat1, i, j);
+        }
+    }
+    CU_ASSERT_DOUBLE_EQUAL(sum / (301 * 207), 0.5, 0.02);
+    uniform_matrix(mat2, 8, -2, 3);
+    CU_ASSERT_NOT_EQUAL(get(mat1, 0, 0), get(mat2, 0, 0));
+
+    /* Entries rounding up to high are kept below it, in either dtype */
+    double high_f32 = nextafterf(1.0f, 2.0f);
+    CU_ASSERT_EQUAL(uniform_matrix(mat_f32, 10, 1, high_f32), 0);
+    CU_ASSERT_EQUAL(uniform_matrix(mat1, 10, 1, nextafter(1.0, 2.0)), 0);
+    for (int i = 0; i < 301; i++) {
+        for (int j = 0; j < 207; j++) {
+            CU_ASSERT(get(mat_f32, i, j) == 1.0);
+            CU_ASSERT(get(mat1, i, j) == 1.0);
+        }
+    }
+
+    /* Normal numbers have the requested mean and standard deviation */
+    normal_matrix(mat1, 9, 1, 2);
+    matrix_tune.par_elem = 1LL << 62;
+    normal_matrix(mat2, 9, 1, 2);
+    matrix_tune.par_elem = par_elem;
+    double sq = 0;
+    sum = 0;
+    for (int i = 0; i < 301; i++) {
+        for (int j = 0; j < 207; j++) {
+            CU_ASSERT_EQUAL(get(mat1, i, j), get(mat2, i, j));
+            sum += get(mat1, i, j);
+            sq += get(mat1, i, j) * get(mat1, i, j);
+        }
+    }
+    double mean = sum / (301 * 207);
+    CU_ASSERT_DOUBLE_EQUAL(mean, 1, 0.03);
+    CU_ASSERT_DOUBLE_EQUAL(sqrt(sq / (301 * 207) - mean * mean), 2, 0.03);
+
+    deallocate_matrix(mat1);
+    deallocate_matrix(mat2);
+    deallocate_matrix(mat_f32);
+}
+
+static double sigmoid_ref(double x) {
+    return 1 / (1 + exp(-x));
+}
+
+void ufunc_test(void) {
+    static const char *isas[] = {"scalar", "avx2", "avx512"};
+    matrix *mat = NULL, *result = NULL, *mat_f32 = NULL, *result_f32 = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&mat, 13, 21), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&result, 13, 21), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&mat_f32, 13, 21, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&result_f32, 13, 21, DTYPE_FLOAT32), 0);
+    rand_matrix(mat, 60, -20, 20);
+    copy_matrix(mat_f32, mat);
+    CU_ASSERT_EQUAL(ufunc_matrix(result, mat_f32, UFUNC_EXP, 0, 0), -1);
+
+    for (int v = 0; v < 3; v++) {
+        if (!kernels_supported(isas[v])) {
+            continue;
+        }
+        kernels_select(isas[v]);
+        static const int ops[] = {UFUNC_EXP, UFUNC_LOG, UFUNC_SQRT, UFUNC_POW, UFUNC_POW,
+                                  UFUNC_TANH, UFUNC_SIGMOID, UFUNC_RELU, UFUNC_CLIP};
+        static const double p0[] = {0, 0, 0, -3, 1.5, 0, 0, 0, -1};
+        for (int k = 0; k < 9; k++) {
+            CU_ASSERT_EQUAL(ufunc_matrix(result, mat, ops[k], p0[k], 2), 0);
+            for (int i = 0; i < 13; i++) {
+                for (int j = 0; j < 21; j++) {
+                    double x = get(mat, i, j), y = get(result, i, j), ref;
+                    switch (k) {
+                    case 0: ref = exp(x); break;
+                    case 1: ref = log(x); break;
+                    case 2: ref = sqrt(x); break;
+                    case 3: ref = pow(x, -3); break;
+                    case 4: ref = pow(x, 1.5); break;
+                    case 5: ref = tanh(x); break;
+                    case 6: ref = sigmoid_ref(x); break;
+                    case 7: ref = x < 0 ? 0 : x; break;
+                    default: ref = x < -1 ? -1 : x > 2 ? 2 : x; break;
+                    }
+                    if (isnan(ref)) {
+                        CU_ASSERT(isnan(y));
+                    } else {
+                        CU_ASSERT_DOUBLE_EQUAL(y, ref, 1e-14 * fabs(ref));
+                    }
+                }
+            }
+        }
+    }
+    kernels_select("auto");
+
+    /* float32 goes through float64, and the result may be the operand */
+    CU_ASSERT_EQUAL(ufunc_matrix(result_f32, mat_f32, UFUNC_TANH, 0, 0), 0);
+    CU_ASSERT_EQUAL(ufunc_matrix(mat_f32, mat_f32, UFUNC_TANH, 0, 0), 0);
+    CU_ASSERT_EQUAL(ufunc_matrix(mat, mat, UFUNC_TANH, 0, 0), 0);
+    for (int i = 0; i < 13; i++) {
+        for (int j = 0; j < 21; j++) {
+            CU_ASSERT_EQUAL(get(result_f32, i, j), get(mat_f32, i, j));
+            CU_ASSERT_DOUBLE_EQUAL(get(mat_f32, i, j), get(mat, i, j), 1e-7);
+        }
+    }
+
+    deallocate_matrix(mat);
+    deallocate_matrix(result);
+    deallocate_matrix(mat_f32);
+    deallocate_matrix(result_f32);
+}
+
+void mask_test(void) {
+    static const char *isas[] = {"scalar", "avx2", "avx512"};
+    matrix *a = NULL, *b = NULL, *result = NULL, *a_f32 = NULL, *b_f32 = NULL, *result_f32 = NULL;
+    mask *m = NULL, *m2 = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&a, 11, 37), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&b, 11, 37), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&result, 11, 37), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&a_f32, 11, 37, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&b_f32, 11, 37, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&result_f32, 11, 37, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_mask(&m, 11, 37), 0);
+    CU_ASSERT_EQUAL(allocate_mask(&m2, 11, 37), 0);
+    CU_ASSERT_EQUAL(allocate_mask(&m2, 0, 37), -1);
+    /* Small integers so that equal entries occur */
+    for (int i = 0; i < 11; i++) {
+        for (int j = 0; j < 37; j++) {
+            set(a, i, j, (i * 7 + j * 3) % 5 - 2);
+            set(b, i, j, (i * 5 + j) % 4 - 1);
+        }
+    }
+    set(a, 3, 4, NAN);
+    copy_matrix(a_f32, a);
+    copy_matrix(b_f32, b);
+    CU_ASSERT_EQUAL(elementwise_matrix(result, a, b_f32, ELEM_MUL), -1);
+    CU_ASSERT_EQUAL(compare_matrix(m, a, b_f32, 0, CMP_LT), -1);
+
+    for (int v = 0; v < 3; v++) {
+        if (!kernels_supported(isas[v])) {
+            continue;
+        }
+        kernels_select(isas[v]);
+        for (int op = ELEM_MUL; op <= ELEM_MAX; op++) {
+            CU_ASSERT_EQUAL(elementwise_matrix(result, a, b, op), 0);
+            CU_ASSERT_EQUAL(elementwise_matrix(result_f32, a_f32, b_f32, op), 0);
+            for (int i = 0; i < 11; i++) {
+                for (int j = 0; j < 37; j++) {
+                    double x = get(a, i, j), y = get(b, i, j);
+                    double ref = op == ELEM_MUL ? x * y : op == ELEM_DIV ? x / y :
+                                 op == ELEM_MIN ? (x < y ? x : y) : (x > y ? x : y);
+                    CU_ASSERT(get(result, i, j) == ref || (isnan(ref) && isnan(get(result, i, j))));
+                    CU_ASSERT(get(result_f32, i, j) == (float)ref ||
+                              (isnan(ref) && isnan(get(result_f32, i, j))));
+                }
+            }
+        }
+        for (int op = CMP_LT; op <= CMP_NE; op++) {
+            for (int scalar = 0; scalar < 2; scalar++) {
+                CU_ASSERT_EQUAL(compare_matrix(m, a, scalar ? NULL : b, 0, op), 0);
+                CU_ASSERT_EQUAL(compare_matrix(m2, a_f32, scalar ? NULL : b_f32, 0, op), 0);
+                for (int i = 0; i < 11; i++) {
+                    for (int j = 0; j < 37; j++) {
+                        double x = get(a, i, j), y = scalar ? 0 : get(b, i, j);
+                        int ref = op == CMP_LT ? x < y : op == CMP_LE ? x <= y : op == CMP_GT ? x > y :
+                                  op == CMP_GE ? x >= y : op == CMP_EQ ? x == y : x != y;
+                        CU_ASSERT_EQUAL(m->data[i * 37 + j], ref);
+                        CU_ASSERT_EQUAL(m2->data[i * 37 + j], ref);
+                    }
+                }
+            }
+        }
+
+        /* Either side of where may be a scalar */
+        CU_ASSERT_EQUAL(compare_matrix(m, a, b, 0, CMP_GT), 0);
+        for (int k = 0; k < 3; k++) {
+            CU_ASSERT_EQUAL(where_matrix(result, m, k == 1 ? NULL : a, k == 2 ? NULL : b, 7, -7), 0);
+            CU_ASSERT_EQUAL(where_matrix(result_f32, m, k == 1 ? NULL : a_f32,
+                                         k == 2 ? NULL : b_f32, 7, -7), 0);
+            for (int i = 0; i < 11; i++) {
+                for (int j = 0; j < 37; j++) {
+                    double ref = m->data[i * 37 + j] ? (k == 1 ? 7 : get(a, i, j)) :
+                                                       (k == 2 ? -7 : get(b, i, j));
+                    CU_ASSERT_EQUAL(get(result, i, j), ref);
+                    CU_ASSERT_EQUAL(get(result_f32, i, j), ref);
+                }
+            }
+        }
+    }
+    kernels_select("auto");
+
+    /* Logic, counting, and a result that is an operand */
+    CU_ASSERT_EQUAL(compare_matrix(m, a, NULL, 0, CMP_GE), 0);
+    CU_ASSERT_EQUAL(compare_matrix(m2, a, NULL, 0, CMP_LT), 0);
+    long long ge = mask_count(m), lt = mask_count(m2);
+    CU_ASSERT_EQUAL(ge + lt, 11 * 37 - 1);  // the NaN is in neither
+    mask_logic(m2, m, m2, MASK_OR);
+    CU_ASSERT_EQUAL(mask_count(m2), 11 * 37 - 1);
+    mask_logic(m2, m2, NULL, MASK_NOT);
+    CU_ASSERT_EQUAL(mask_count(m2), 1);
+    CU_ASSERT_EQUAL(m2->data[3 * 37 + 4], 1);
+    mask_logic(m2, m, m2, MASK_AND);
+    CU_ASSERT_EQUAL(mask_count(m2), 0);
+    CU_ASSERT_EQUAL(elementwise_matrix(a, a, a, ELEM_MUL), 0);
+    CU_ASSERT_EQUAL(get(a, 0, 1), 1);
+
+    deallocate_matrix(a);
+    deallocate_matrix(b);
+    deallocate_matrix(result);
+    deallocate_matrix(a_f32);
+    deallocate_matrix(b_f32);
+    deallocate_matrix(result_f32);
+    deallocate_mask(m);
+    deallocate_mask(m2);
+}
+
+void matfile_test(void) {
+    const char *path = "/tmp/numc_matfile_test.bin";
+    matrix *mat = NULL, *slice = NULL, *loaded = NULL, *mapped = NULL, *mat_f32 = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&mat, 30, 40), 0);
+    rand_matrix(mat, 70, -5, 5);
+    CU_ASSERT_EQUAL(allocate_matrix_ref(&slice, mat, 3, 5, 20, 17), 0);
+
+    /* A slice is written densely and reads back the same */
+    CU_ASSERT_EQUAL(save_matrix(path, slice), 0);
+    CU_ASSERT_EQUAL(load_matrix(&loaded, path), 0);
+    CU_ASSERT_EQUAL(loaded->rows, 20);
+    CU_ASSERT_EQUAL(loaded->cols, 17);
+    CU_ASSERT_EQUAL(map_matrix(&mapped, path, MATFILE_PRIVATE), 0);
+    CU_ASSERT_PTR_NOT_NULL(mapped->map);
+    CU_ASSERT_EQUAL((size_t)mapped->data[0] % MATFILE_ALIGN, 0);
+    for (int i = 0; i < 20; i++) {
+        for (int j = 0; j < 17; j++) {
+            CU_ASSERT_EQUAL(get(loaded, i, j), get(mat, i + 3, j + 5));
+            CU_ASSERT_EQUAL(get(mapped, i, j), get(mat, i + 3, j + 5));
+        }
+    }
+
+    /* Private changes stay in memory, shared ones reach the file */
+    set(mapped, 2, 2, 1234);
+    deallocate_matrix(mapped);
+    CU_ASSERT_EQUAL(map_matrix(&mapped, path, MATFILE_SHARED), 0);
+    CU_ASSERT_EQUAL(get(mapped, 2, 2), get(mat, 5, 7));
+    set(mapped, 2, 2, 1234);
+    deallocate_matrix(mapped);
+    deallocate_matrix(loaded);
+    CU_ASSERT_EQUAL(load_matrix(&loaded, path), 0);
+    CU_ASSERT_EQUAL(get(loaded, 2, 2), 1234);
+    deallocate_matrix(loaded);
+
+    /* New files are zero filled */
+    CU_ASSERT_EQUAL(create_matrix_file(path, 3, 1000, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(map_matrix(&mat_f32, path, MATFILE_SHARED), 0);
+    CU_ASSERT_EQUAL(mat_f32->dtype, DTYPE_FLOAT32);
+    CU_ASSERT_EQUAL(get(mat_f32, 2, 999), 0);
+    deallocate_matrix(mat_f32);
+
+    /* Files too short for their header and foreign files are rejected */
+    matfile_header h;
+    FILE *f = fopen(path, "r+b");
+    CU_ASSERT_EQUAL(fread(&h, sizeof(h), 1, f), 1);
+    h.rows = 4;
+    rewind(f);
+    fwrite(&h, sizeof(h), 1, f);
+    fclose(f);
+    CU_ASSERT_EQUAL(load_matrix(&loaded, path), -1);
+    CU_ASSERT_EQUAL(map_matrix(&mapped, path, MATFILE_PRIVATE), -1);
+    f = fopen(path, "w");
+    fputs("not a matrix file, but long enough to hold a header of sixty four bytes", f);
+    fclose(f);
+    CU_ASSERT_EQUAL(load_matrix(&loaded, path), -1);
+    CU_ASSERT_EQUAL(map_matrix(&mapped, path, MATFILE_PRIVATE), -1);
+    remove(path);
+    CU_ASSERT_EQUAL(load_matrix(&loaded, path), -3);
+    CU_ASSERT_EQUAL(map_matrix(&mapped, path, MATFILE_PRIVATE), -3);
+
+    deallocate_matrix(slice);
+    deallocate_matrix(mat);
+}
+
+static int count_tiles(long long done, long long total, void *arg) {
+    int *calls = (int *)arg;
+    calls[0]++;
+    calls[1] = (int)done;
+    calls[2] = (int)total;
+    return calls[3] && calls[0] == calls[3];
+}
+
+void ooc_test(void) {
+    const char *paths[] = {"/tmp/numc_ooc_a.bin", "/tmp/numc_ooc_b.bin", "/tmp/numc_ooc_c.bin"};
+    matrix *a = NULL, *b = NULL, *c = NULL, *ref = NULL, *a_f32 = NULL, *b_f32 = NULL, *c_f32 = NULL;
+    size_t limit = 4 * 64 * 64 * sizeof(double) + 1000;  // 64 x 64 tiles
+    CU_ASSERT_EQUAL(ooc_tile_size(limit, DTYPE_FLOAT64), 64);
+    CU_ASSERT_EQUAL(ooc_tile_size(limit, DTYPE_FLOAT32), 64);
+    CU_ASSERT_EQUAL(ooc_tile_size(limit - 2000, DTYPE_FLOAT64), 0);
+
+    CU_ASSERT_EQUAL(create_matrix_file(paths[0], 150, 130, DTYPE_FLOAT64), 0);
+    CU_ASSERT_EQUAL(create_matrix_file(paths[1], 130, 170, DTYPE_FLOAT64), 0);
+    CU_ASSERT_EQUAL(create_matrix_file(paths[2], 150, 170, DTYPE_FLOAT64), 0);
+    CU_ASSERT_EQUAL(map_matrix(&a, paths[0], MATFILE_SHARED), 0);
+    CU_ASSERT_EQUAL(map_matrix(&b, paths[1], MATFILE_SHARED), 0);
+    CU_ASSERT_EQUAL(map_matrix(&c, paths[2], MATFILE_SHARED), 0);
+    rand_matrix(a, 80, -1, 1);
+    rand_matrix(b, 81, -1, 1);
+    CU_ASSERT_EQUAL(allocate_matrix(&ref, 150, 170), 0);
+    CU_ASSERT_EQUAL(mul_matrix(ref, a, b), 0);
+
+    int calls[4] = {0, 0, 0, 0};
+    CU_ASSERT_EQUAL(mul_matrix_ooc(c, a, b, limit, count_tiles, calls), 0);
+    CU_ASSERT_EQUAL(calls[0], 9);
+    CU_ASSERT_EQUAL(calls[1], 9);
+    CU_ASSERT_EQUAL(calls[2], 9);
+    for (int i = 0; i < 150; i++) {
+        for (int j = 0; j < 170; j++) {
+            CU_ASSERT_DOUBLE_EQUAL(get(c, i, j), get(ref, i, j), 1e-12);
+        }
+    }
+
+    /* Stopping early, aliasing and a limit below the smallest tiles */
+    int stop[4] = {0, 0, 0, 2};
+    CU_ASSERT_EQUAL(mul_matrix_ooc(c, a, b, limit, count_tiles, stop), 1);
+    CU_ASSERT_EQUAL(stop[1], 2);
+    CU_ASSERT_EQUAL(mul_matrix_ooc(c, a, b, 1000, NULL, NULL), -1);
+    CU_ASSERT_EQUAL(mul_matrix_ooc(a, a, b, limit, NULL, NULL), -1);
+
+    /* In-memory float32 operands, one tile deep, that stay shared and uncounted */
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&a_f32, 150, 130, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&b_f32, 130, 170, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&c_f32, 150, 170, DTYPE_FLOAT32), 0);
+    copy_matrix(a_f32, a);
+    copy_matrix(b_f32, b);
+    matrix *a_shared = NULL;
+    CU_ASSERT_EQUAL(share_matrix(&a_shared, a_f32), 0);
+    matrix_buffer *held = a_f32->buf;
+    CU_ASSERT_EQUAL(mul_matrix_ooc(c_f32, a_f32, b_f32, 1 << 30, NULL, NULL), 0);
+    CU_ASSERT(a_f32->buf == held);
+    CU_ASSERT_EQUAL(a_f32->ref_cnt, 1);
+    CU_ASSERT_EQUAL(b_f32->ref_cnt, 1);
+    deallocate_matrix(a_shared);
+    for (int i = 0; i < 150; i++) {
+        for (int j = 0; j < 170; j++) {
+            CU_ASSERT_DOUBLE_EQUAL(get(c_f32, i, j), get(ref, i, j), 1e-4);
+        }
+    }
+
+    deallocate_matrix(a);
+    deallocate_matrix(b);
+    deallocate_matrix(c);
+    deallocate_matrix(ref);
+    deallocate_matrix(a_f32);
+    deallocate_matrix(b_f32);
+    deallocate_matrix(c_f32);
+    for (int i = 0; i < 3; i++) {
+        remove(paths[i]);
+    }
+}
+
+void text_test(void) {
+    const char *path = "/tmp/numc_text_test.txt";
+    matrix *mat = NULL, *loaded = NULL, *mat_f32 = NULL;
+    long long bad_row;
+    CU_ASSERT_EQUAL(allocate_matrix(&mat, 40, 9), 0);
+    normal_matrix(mat, 3, 0, 1e5);
+    set(mat, 0, 0, 1e-300);
+    set(mat, 0, 1, -0.1);
+    set(mat, 0, 2, 123456789012345678.0);
+
+    /* Every entry reads back exactly, whichever parser path it takes */
+    CU_ASSERT_EQUAL(save_text_matrix(path, mat, ','), 0);
+    CU_ASSERT_EQUAL(load_text_matrix(&loaded, path, ',', DTYPE_FLOAT64, &bad_row), 0);
+    CU_ASSERT_EQUAL(loaded->rows, 40);
+    CU_ASSERT_EQUAL(loaded->cols, 9);
+    for (int i = 0; i < 40; i++) {
+        for (int j = 0; j < 9; j++) {
+            CU_ASSERT_EQUAL(get(loaded, i, j), get(mat, i, j));
+        }
+    }
+    deallocate_matrix(loaded);
+    CU_ASSERT_EQUAL(load_text_matrix(&mat_f32, path, ',', DTYPE_FLOAT32, &bad_row), 0);
+    CU_ASSERT_EQUAL(get(mat_f32, 5, 5), (float)get(mat, 5, 5));
+    deallocate_matrix(mat_f32);
+
+    /* Blanks, comments, CRLF line ends and the odd number formats */
+    FILE *f = fopen(path, "w");
+    fputs("# a comment\n\n  1 2.5\t-3e2\r\n.5  +4 1E-3\n\n0.1 inf 17\n", f);
+    fclose(f);
+    CU_ASSERT_EQUAL(load_text_matrix(&loaded, path, 0, DTYPE_FLOAT64, &bad_row), 0);
+    CU_ASSERT_EQUAL(loaded->rows, 3);
+    CU_ASSERT_EQUAL(loaded->cols, 3);
+    CU_ASSERT_EQUAL(get(loaded, 0, 2), -300);
+    CU_ASSERT_EQUAL(get(loaded, 1, 0), 0.5);
+    CU_ASSERT_EQUAL(get(loaded, 1, 2), 1e-3);
+    CU_ASSERT_EQUAL(get(loaded, 2, 0), 0.1);
+    CU_ASSERT(isinf(get(loaded, 2, 1)));
+    deallocate_matrix(loaded);
+
+    /* Numbers of any length, the last one ending a page sized file without a line break */
+    char text[4096];
+    memset(text, '2', sizeof(text));
+    memcpy(text, "0.", 2);
+    memcpy(text + 102, ",1\n3,0.", 7);
+    f = fopen(path, "w");
+    fwrite(text, 1, sizeof(text), f);
+    fclose(f);
+    CU_ASSERT_EQUAL(load_text_matrix(&loaded, path, ',', DTYPE_FLOAT64, &bad_row), 0);
+    CU_ASSERT_EQUAL(loaded->rows, 2);
+    CU_ASSERT_DOUBLE_EQUAL(get(loaded, 0, 0), 2.0 / 9, 1e-15);
+    CU_ASSERT_EQUAL(get(loaded, 0, 1), 1);
+    CU_ASSERT_EQUAL(get(loaded, 1, 0), 3);
+    CU_ASSERT_DOUBLE_EQUAL(get(loaded, 1, 1), 2.0 / 9, 1e-15);
+    deallocate_matrix(loaded);
+
+    /* Ragged and malformed rows are reported by row */
+    f = fopen(path, "w");
+    fputs("1,2\n3,4\n5\n", f);
+    fclose(f);
+    CU_ASSERT_EQUAL(load_text_matrix(&loaded, path, ',', DTYPE_FLOAT64, &bad_row), -1);
+    CU_ASSERT_EQUAL(bad_row, 2);
+    f = fopen(path, "w");
+    fputs("1,2\n3,x\n", f);
+    fclose(f);
+    CU_ASSERT_EQUAL(load_text_matrix(&loaded, path, ',', DTYPE_FLOAT64, &bad_row), -1);
+    CU_ASSERT_EQUAL(bad_row, 1);
+    CU_ASSERT_EQUAL(load_text_matrix(&loaded, path, 0, DTYPE_FLOAT64, &bad_row), -1);
+    CU_ASSERT_EQUAL(bad_row, 0);
+    remove(path);
+    CU_ASSERT_EQUAL(load_text_matrix(&loaded, path, 0, DTYPE_FLOAT64, &bad_row), -3);
+
+    deallocate_matrix(mat);
+}
+
+static void count_release(void *owner) {
+    (*(int *)owner)++;
+}
+
+void borrowed_test(void) {
+    double data[12];
+    int released = 0;
+    matrix *mat = NULL, *slice = NULL;
+    for (int i = 0; i < 12; i++) {
+        data[i] = i;
+    }
+    CU_ASSERT_EQUAL(allocate_matrix_borrowed(&mat, data, 0, 4, DTYPE_FLOAT64, count_release, &released), -1);
+    CU_ASSERT_EQUAL(allocate_matrix_borrowed(&mat, data, 3, 4, DTYPE_FLOAT64, count_release, &released), 0);
+    CU_ASSERT_EQUAL(get(mat, 2, 3), 11);
+    set(mat, 1, 0, -4);
+    CU_ASSERT_EQUAL(data[4], -4);
+
+    /* The owner is released once, after the last slice goes */
+    CU_ASSERT_EQUAL(allocate_matrix_ref(&slice, mat, 1, 1, 2, 2), 0);
+    deallocate_matrix(mat);
+    CU_ASSERT_EQUAL(released, 0);
+    CU_ASSERT_EQUAL(get(slice, 1, 1), 10);
+    deallocate_matrix(slice);
+    CU_ASSERT_EQUAL(released, 1);
+}
+
+void shared_test(void) {
+    const char *name = "numc_shared_test";
+    matrix *mat = NULL, *attached = NULL, *slice = NULL, *other = NULL;
+    CU_ASSERT_EQUAL(create_shared_matrix(&mat, name, 0, 4, DTYPE_FLOAT64), -1);
+    CU_ASSERT_EQUAL(create_shared_matrix(&mat, "a/b", 3, 4, DTYPE_FLOAT64), -1);
+    CU_ASSERT_EQUAL(create_shared_matrix(&mat, name, 30, 40, DTYPE_FLOAT64), 0);
+    CU_ASSERT_EQUAL(create_shared_matrix(&other, name, 3, 4, DTYPE_FLOAT64), -3);
+    CU_ASSERT_EQUAL(errno, EEXIST);
+    CU_ASSERT_EQUAL(attach_shared_matrix(&attached, "/numc_shared_test"), 0);
+    CU_ASSERT_EQUAL(attached->rows, 30);
+    CU_ASSERT_EQUAL(attached->cols, 40);
+    CU_ASSERT_EQUAL(get(attached, 29, 39), 0);
+    set(mat, 29, 39, 2.5);
+    set(attached, 0, 1, -1);
+    CU_ASSERT_EQUAL(get(attached, 29, 39), 2.5);
+    CU_ASSERT_EQUAL(get(mat, 0, 1), -1);
+
+    /* The name goes with the last slice of the creator; attached matrices keep the data */
+    CU_ASSERT_EQUAL(allocate_matrix_ref(&slice, mat, 0, 0, 2, 2), 0);
+    deallocate_matrix(mat);
+    CU_ASSERT_EQUAL(attach_shared_matrix(&other, name), 0);
+    deallocate_matrix(other);
+    deallocate_matrix(slice);
+    CU_ASSERT_EQUAL(attach_shared_matrix(&other, name), -3);
+    CU_ASSERT_EQUAL(errno, ENOENT);
+    CU_ASSERT_EQUAL(get(attached, 29, 39), 2.5);
+    deallocate_matrix(attached);
+}
+
+void shard_test(void) {
+    shard_pool *pool = NULL;
+    matrix *a = NULL, *b = NULL, *c = NULL, *ref = NULL, *sq = NULL, *shared = NULL;
+    CU_ASSERT_EQUAL(shard_pool_start(&pool, 0), -1);
+    CU_ASSERT_EQUAL(shard_pool_start(&pool, 3), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&a, 100, 70), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&b, 70, 90), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&c, 100, 90), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&ref, 100, 90), 0);
+    rand_matrix(a, 90, -1, 1);
+    rand_matrix(b, 91, -1, 1);
+    CU_ASSERT_EQUAL(mul_matrix(ref, a, b), 0);
+    CU_ASSERT_EQUAL(shard_mul(pool, c, a, b), 0);
+    for (int i = 0; i < 100; i++) {
+        for (int j = 0; j < 90; j++) {
+            CU_ASSERT_DOUBLE_EQUAL(get(c, i, j), get(ref, i, j), 1e-12);
+        }
+    }
+    CU_ASSERT_EQUAL(shard_mul(pool, c, b, a), -1);
+
+    /* A dead worker's shards go to the one started in its place */
+    int pid = pool->workers[1].pid;
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    CU_ASSERT_EQUAL(create_shared_matrix(&shared, "numc_shard_test", 100, 90, DTYPE_FLOAT64), 0);
+    CU_ASSERT_EQUAL(shard_mul(pool, shared, a, b), 0);
+    CU_ASSERT_EQUAL(pool->restarts, 1);
+    CU_ASSERT_NOT_EQUAL(pool->workers[1].pid, pid);
+    for (int i = 0; i < 100; i++) {
+        for (int j = 0; j < 90; j++) {
+            CU_ASSERT_DOUBLE_EQUAL(get(shared, i, j), get(ref, i, j), 1e-12);
+        }
+    }
+
+    /* Powers by squaring */
+    CU_ASSERT_EQUAL(allocate_matrix(&sq, 70, 70), 0);
+    rand_matrix(sq, 92, -0.1, 0.1);
+    matrix *p1 = NULL, *p2 = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&p1, 70, 70), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&p2, 70, 70), 0);
+    CU_ASSERT_EQUAL(pow_matrix(p1, sq, 11), 0);
+    CU_ASSERT_EQUAL(shard_pow(pool, p2, sq, 11), 0);
+    for (int i = 0; i < 70; i++) {
+        for (int j = 0; j < 70; j++) {
+            CU_ASSERT_DOUBLE_EQUAL(get(p2, i, j), get(p1, i, j), 1e-12);
+        }
+    }
+    CU_ASSERT_EQUAL(shard_pow(pool, p2, a, 2), -1);
+
+    shard_pool_stop(pool);
+    deallocate_matrix(a);
+    deallocate_matrix(b);
+    deallocate_matrix(c);
+    deallocate_matrix(ref);
+    deallocate_matrix(sq);
+    deallocate_matrix(p1);
+    deallocate_matrix(p2);
+    deallocate_matrix(shared);
+}
+
+void cow_test(void) {
+    matrix *mat = NULL, *copy = NULL, *other = NULL, *slice = NULL, *small = NULL, *res = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&mat, 40, 40), 0);
+    for (int i = 0; i < 40; i++) {
+        for (int j = 0; j < 40; j++) {
+            set(mat, i, j, i == j ? 2 : 0);
+        }
+    }
+
+    /* Copies share the entries until one of them is written */
+    CU_ASSERT_EQUAL(share_matrix(&copy, mat), 0);
+    CU_ASSERT_EQUAL(share_matrix(&other, mat), 0);
+    CU_ASSERT_PTR_EQUAL(copy->data[3], mat->data[3]);
+    CU_ASSERT_EQUAL(mat->buf->ref_cnt, 3);
+    set(copy, 0, 1, 5);
+    CU_ASSERT_PTR_NULL(copy->buf);
+    CU_ASSERT_EQUAL(mat->buf->ref_cnt, 2);
+    CU_ASSERT_EQUAL(get(copy, 0, 1), 5);
+    CU_ASSERT_EQUAL(get(mat, 0, 1), 0);
+    CU_ASSERT_EQUAL(get(other, 0, 1), 0);
+    set(mat, 1, 0, 7);
+    CU_ASSERT_EQUAL(get(other, 1, 0), 0);
+    CU_ASSERT_PTR_NULL(mat->buf);
+    CU_ASSERT_EQUAL(other->buf->ref_cnt, 1);
+
+    /* Operations write their result through unshare_matrix, aliased operands included */
+    CU_ASSERT_EQUAL(share_matrix(&res, other), 0);
+    CU_ASSERT_EQUAL(mul_matrix(other, other, other), 0);
+    CU_ASSERT_EQUAL(get(other, 5, 5), 4);
+    CU_ASSERT_EQUAL(get(res, 5, 5), 2);
+    CU_ASSERT_EQUAL(add_matrix(res, res, res), 0);
+    CU_ASSERT_EQUAL(get(res, 5, 5), 4);
+    deallocate_matrix(res);
+
+    /* Slicing a shared matrix gives it entries of its own first, and matrices with slices copy */
+    CU_ASSERT_EQUAL(share_matrix(&res, copy), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_ref(&slice, copy, 0, 0, 2, 2), 0);
+    CU_ASSERT_PTR_NULL(copy->buf);
+    set(slice, 0, 1, -1);
+    CU_ASSERT_EQUAL(get(res, 0, 1), 5);
+    deallocate_matrix(res);
+    CU_ASSERT_EQUAL(share_matrix(&res, copy), 0);
+    CU_ASSERT_PTR_NULL(res->buf);
+    CU_ASSERT_EQUAL(get(res, 0, 1), -1);
+    deallocate_matrix(res);
+    deallocate_matrix(slice);
+
+    /* Small matrices live inline and are copied */
+    CU_ASSERT_EQUAL(allocate_matrix(&small, 2, 2), 0);
+    set(small, 1, 1, 3);
+    CU_ASSERT_EQUAL(share_matrix(&res, small), 0);
+    CU_ASSERT_PTR_NULL(res->buf);
+    CU_ASSERT_EQUAL(get(res, 1, 1), 3);
+    deallocate_matrix(res);
+    deallocate_matrix(small);
+
+    /* A pin keeps the entries a reader holds while the matrix moves off them and copies go */
+    matrix_buffer *pin;
+    CU_ASSERT_EQUAL(share_matrix(&res, mat), 0);
+    pin = pin_matrix(mat);
+    double *held = mat->data[1];
+    set(mat, 1, 0, 6);
+    CU_ASSERT_FALSE(mat->data[1] == held);
+    deallocate_matrix(res);
+    CU_ASSERT_EQUAL(held[0], 7);
+    CU_ASSERT_EQUAL(share_matrix(&res, mat), 0);
+    CU_ASSERT_PTR_NULL(res->buf);
+    deallocate_matrix(res);
+    unpin_matrix(mat, pin);
+    CU_ASSERT_EQUAL(mat->ref_cnt, 1);
+    set(mat, 1, 0, 7);
+
+    /* The entries go with the last matrix sharing them, whichever it is */
+    CU_ASSERT_EQUAL(share_matrix(&res, mat), 0);
+    deallocate_matrix(mat);
+    CU_ASSERT_EQUAL(get(res, 1, 0), 7);
+    CU_ASSERT_EQUAL(res->buf->ref_cnt, 1);
+    set(res, 1, 0, 8);
+    CU_ASSERT_PTR_NULL(res->buf);
+    deallocate_matrix(res);
+    deallocate_matrix(copy);
+    deallocate_matrix(other);
+}
+
+void transpose_test(void) {
+    matrix *a = NULL, *b = NULL, *at = NULL, *bt = NULL, *res = NULL, *ref = NULL, *tmp = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&a, 67, 45), 0);
+    for (int i = 0; i < 67; i++) {
+        for (int j = 0; j < 45; j++) {
+            set(a, i, j, (i * 7 + j * 3) % 11 - 5);
+        }
+    }
+
+    /* A transposed view reads and writes the entries of its matrix across */
+    CU_ASSERT_EQUAL(allocate_matrix_transposed(&at, a), 0);
+    CU_ASSERT_EQUAL(at->rows, 45);
+    CU_ASSERT_EQUAL(at->cols, 67);
+    CU_ASSERT_EQUAL(get(at, 44, 66), get(a, 66, 44));
+    set(at, 3, 10, 100);
+    CU_ASSERT_EQUAL(get(a, 10, 3), 100);
+
+    /* transpose_matrix copies it, at sizes that leave ragged blocks, in both dtypes */
+    CU_ASSERT_EQUAL(allocate_matrix(&res, 45, 67), 0);
+    CU_ASSERT_EQUAL(transpose_matrix(res, a), 0);
+    for (int i = 0; i < 45; i++) {
+        for (int j = 0; j < 67; j++) {
+            CU_ASSERT_EQUAL(get(res, i, j), get(a, j, i));
+        }
+    }
+    CU_ASSERT_EQUAL(transpose_matrix(res, at), -1);
+    CU_ASSERT_EQUAL(transpose_matrix(a, at), -1);
+    deallocate_matrix(res);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&tmp, 67, 45, DTYPE_FLOAT32), 0);
+    copy_matrix(tmp, a);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&res, 45, 67, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(transpose_matrix(res, tmp), 0);
+    for (int i = 0; i < 45; i++) {
+        for (int j = 0; j < 67; j++) {
+            CU_ASSERT_EQUAL(get(res, i, j), get(a, j, i));
+        }
+    }
+    deallocate_matrix(res);
+    deallocate_matrix(tmp);
+
+    /* Products pack transposed operands instead of copying them first */
+    CU_ASSERT_EQUAL(allocate_matrix(&b, 67, 130), 0);
+    for (int i = 0; i < 67; i++) {
+        for (int j = 0; j < 130; j++) {
+            set(b, i, j, (i + j * 5) % 7 - 3);
+        }
+    }
+    CU_ASSERT_EQUAL(allocate_matrix(&tmp, 45, 67), 0);
+    copy_matrix(tmp, at);
+    CU_ASSERT_EQUAL(allocate_matrix(&res, 45, 130), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&ref, 45, 130), 0);
+    CU_ASSERT_EQUAL(mul_matrix(res, at, b), 0);
+    CU_ASSERT_EQUAL(mul_matrix(ref, tmp, b), 0);
+    for (int i = 0; i < 45; i++) {
+        for (int j = 0; j < 130; j++) {
+            CU_ASSERT_EQUAL(get(res, i, j), get(ref, i, j));
+        }
+    }
+    deallocate_matrix(res);
+    deallocate_matrix(ref);
+    CU_ASSERT_EQUAL(allocate_matrix_transposed(&bt, b), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&res, 130, 45), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&ref, 130, 45), 0);
+    CU_ASSERT_EQUAL(mul_matrix(res, bt, a), 0);
+    for (int i = 0; i < 130; i++) {
+        for (int j = 0; j < 45; j++) {
+            double sum = 0;
+            for (int k = 0; k < 67; k++) {
+                sum += get(b, k, i) * get(a, k, j);
+            }
+            CU_ASSERT_EQUAL(get(res, i, j), sum);
+        }
+    }
+    CU_ASSERT_EQUAL(mul_matrix(bt, bt, a), -1);
+    deallocate_matrix(res);
+    deallocate_matrix(ref);
+
+    /* The same for float32 operands that accumulate in float64 */
+    matrix *a32 = NULL, *b32 = NULL, *at32 = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&a32, 67, 45, DTYPE_FLOAT32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_dtype(&b32, 67, 130, DTYPE_FLOAT32), 0);
+    copy_matrix(a32, a);
+    copy_matrix(b32, b);
+    a32->acc_f64 = 1;
+    CU_ASSERT_EQUAL(allocate_matrix_transposed(&at32, a32), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&res, 45, 130), 0);
+    CU_ASSERT_EQUAL(allocate_matrix(&ref, 45, 130), 0);
+    CU_ASSERT_EQUAL(mul_matrix_mixed(res, at32, b32), 0);
+    CU_ASSERT_EQUAL(mul_matrix(ref, at, b), 0);
+    for (int i = 0; i < 45; i++) {
+        for (int j = 0; j < 130; j++) {
+            CU_ASSERT_EQUAL(get(res, i, j), get(ref, i, j));
+        }
+    }
+    deallocate_matrix(res);
+    deallocate_matrix(ref);
+    deallocate_matrix(at32);
+    deallocate_matrix(a32);
+    deallocate_matrix(b32);
+
+    /* Views of views, slices of them and rowwise operations on them */
+    matrix *att = NULL, *slice = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix_transposed(&att, at), 0);
+    CU_ASSERT_FALSE(att->transposed);
+    CU_ASSERT_EQUAL(get(att, 10, 3), 100);
+    CU_ASSERT_EQUAL(allocate_matrix_ref(&slice, at, 2, 5, 3, 4), 0);
+    CU_ASSERT_TRUE(slice->transposed);
+    CU_ASSERT_EQUAL(get(slice, 1, 0), get(a, 5, 3));
+    set(slice, 2, 3, -9);
+    CU_ASSERT_EQUAL(get(a, 8, 4), -9);
+    CU_ASSERT_EQUAL(allocate_matrix(&res, 45, 67), 0);
+    CU_ASSERT_EQUAL(add_matrix(res, at, tmp), 0);
+    CU_ASSERT_EQUAL(get(res, 4, 8), -9 + get(tmp, 4, 8));
+    CU_ASSERT_EQUAL(get(res, 3, 10), 200);
+    deallocate_matrix(res);
+
+    /* The entries outlive the matrix for as long as views of it are left */
+    deallocate_matrix(a);
+    deallocate_matrix(at);
+    CU_ASSERT_EQUAL(get(att, 10, 3), 100);
+    CU_ASSERT_EQUAL(get(slice, 2, 3), -9);
+    deallocate_matrix(att);
+    deallocate_matrix(slice);
+    deallocate_matrix(bt);
+    deallocate_matrix(b);
+    deallocate_matrix(tmp);
+}
+
+void reshape_test(void) {
+    matrix *mat = NULL, *flat = NULL, *back = NULL, *slice = NULL, *res = NULL, *t = NULL;
+    CU_ASSERT_EQUAL(allocate_matrix(&mat, 6, 10), 0);
+    for (int i = 0; i < 6; i++) {
+        for (int j = 0; j < 10; j++) {
+            set(mat, i, j, i * 10 + j);
+        }
+    }
+
+    /* Contiguous entries are reshaped in place, and writes go through */
+    CU_ASSERT_TRUE(matrix_contiguous(mat));
+    CU_ASSERT_EQUAL(allocate_matrix_reshaped(&flat, mat, 1, 60), 0);
+    CU_ASSERT_TRUE(flat->is_1d);
+    CU_ASSERT_PTR_EQUAL(flat->data[0], mat->data[0]);
+    CU_ASSERT_EQUAL(get(flat, 0, 37), 37);
+    CU_ASSERT_EQUAL(allocate_matrix_reshaped(&back, flat, 15, 4), 0);
+    CU_ASSERT_FALSE(back->is_1d);
+    CU_ASSERT_EQUAL(get(back, 9, 1), 37);
+    set(back, 9, 1, -1);
+    CU_ASSERT_EQUAL(get(mat, 3, 7), -1);
+    CU_ASSERT_EQUAL(allocate_matrix_reshaped(&res, mat, 7, 9), -1);
+    CU_ASSERT_EQUAL(allocate_matrix_reshaped(&res, mat, 0, 60), -1);
+
+    /* Whole rows are contiguous, part of them or a transpose are copied */
+    CU_ASSERT_EQUAL(allocate_matrix_ref(&slice, mat, 2, 0, 3, 10), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_reshaped(&res, slice, 30, 1), 0);
+    CU_ASSERT_PTR_EQUAL(res->data[0], slice->data[0]);
+    CU_ASSERT_EQUAL(get(res, 17, 0), -1);
+    deallocate_matrix(res);
+    deallocate_matrix(slice);
+    CU_ASSERT_EQUAL(allocate_matrix_ref(&slice, mat, 1, 2, 3, 4), 0);
+    CU_ASSERT_FALSE(matrix_contiguous(slice));
+    CU_ASSERT_EQUAL(allocate_matrix_reshaped(&res, slice, 2, 6), 0);
+    CU_ASSERT_PTR_NULL(res->parent);
+    CU_ASSERT_EQUAL(get(res, 1, 1), 25);
+    set(res, 1, 1, 0);
+    CU_ASSERT_EQUAL(get(slice, 1, 3), 25);
+    deallocate_matrix(res);
+    CU_ASSERT_EQUAL(allocate_matrix_transposed(&t, mat), 0);
+    CU_ASSERT_EQUAL(allocate_matrix_reshaped(&res, t, 1, 60), 0);
+    CU_ASSERT_EQUAL(get(res, 0, 1), 10);
+    CU_ASSERT_EQUAL(get(res, 0, 6), 1);
+    deallocate_matrix(res);
+
+    /* Views keep the entries after the matrix goes */
+    deallocate_matrix(mat);
+    deallocate_matrix(flat);
+    CU_ASSERT_EQUAL(get(back, 9, 1), -1);
+    deallocate_matrix(back);
+    deallocate_matrix(slice);
+    deallocate_matrix(t);
+}
+
 /************* Test Runner Code goes here **************/
 
 int main(void) {
@@ -281,7 +1867,32 @@ int main(void) {
             (CU_add_test(pSuite, "alloc_ref_test", alloc_ref_test) == NULL) ||
             (CU_add_test(pSuite, "dealloc_null_test", dealloc_null_test) == NULL) ||
             (CU_add_test(pSuite, "get_test", get_test) == NULL) ||
-            (CU_add_test(pSuite, "set_test", set_test) == NULL)) {
+            (CU_add_test(pSuite, "set_test", set_test) == NULL) ||
+            (CU_add_test(pSuite, "trace_test", trace_test) == NULL) ||
+            (CU_add_test(pSuite, "mul_blocked_test", mul_blocked_test) == NULL) ||
+            (CU_add_test(pSuite, "tune_profile_test", tune_profile_test) == NULL) ||
+            (CU_add_test(pSuite, "isa_dispatch_test", isa_dispatch_test) == NULL) ||
+            (CU_add_test(pSuite, "float32_test", float32_test) == NULL) ||
+            (CU_add_test(pSuite, "mixed_precision_test", mixed_precision_test) == NULL) ||
+            (CU_add_test(pSuite, "sparse_test", sparse_test) == NULL) ||
+            (CU_add_test(pSuite, "gemv_test", gemv_test) == NULL) ||
+            (CU_add_test(pSuite, "pow_apply_test", pow_apply_test) == NULL) ||
+            (CU_add_test(pSuite, "batch_test", batch_test) == NULL) ||
+            (CU_add_test(pSuite, "tiny_test", tiny_test) == NULL) ||
+            (CU_add_test(pSuite, "take_put_test", take_put_test) == NULL) ||
+            (CU_add_test(pSuite, "pool_test", pool_test) == NULL) ||
+            (CU_add_test(pSuite, "random_test", random_test) == NULL) ||
+            (CU_add_test(pSuite, "ufunc_test", ufunc_test) == NULL) ||
+            (CU_add_test(pSuite, "mask_test", mask_test) == NULL) ||
+            (CU_add_test(pSuite, "matfile_test", matfile_test) == NULL) ||
+            (CU_add_test(pSuite, "ooc_test", ooc_test) == NULL) ||
+            (CU_add_test(pSuite, "text_test", text_test) == NULL) ||
+            (CU_add_test(pSuite, "borrowed_test", borrowed_test) == NULL) ||
+            (CU_add_test(pSuite, "shared_test", shared_test) == NULL) ||
+            (CU_add_test(pSuite, "shard_test", shard_test) == NULL) ||
+            (CU_add_test(pSuite, "cow_test", cow_test) == NULL) ||
+            (CU_add_test(pSuite, "transpose_test", transpose_test) == NULL) ||
+            (CU_add_test(pSuite, "reshape_test", reshape_test) == NULL)) {
         CU_cleanup_registry();
         return CU_get_error();
     }
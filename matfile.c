@@ -0,0 +1,757 @@
+#include "matfile.h"
+#include "trace.h"
+#include "kernels.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * The functions below return 0 upon success, -1 if the arguments or the file contents are
+ * invalid, -2 if allocation fails and -3 if a system call fails, with errno describing it.
+ */
+
+/*
+ * Fill in the header of a densely stored `rows` x `cols` matrix.
+ */
+static void make_header(matfile_header *h, int rows, int cols, int dtype) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, MATFILE_MAGIC, sizeof(MATFILE_MAGIC));
+    h->version = MATFILE_VERSION;
+    h->dtype = dtype;
+    h->rows = rows;
+    h->cols = cols;
+    h->row_stride = cols;
+    h->col_stride = 1;
+    h->data_offset = (sizeof(matfile_header) + MATFILE_ALIGN - 1) / MATFILE_ALIGN * MATFILE_ALIGN;
+}
+
+/*
+ * Return 0 if `h` describes a matrix whose data fits in a file of `size` bytes, and -1
+ * otherwise.
+ */
+static int check_header(const matfile_header *h, long long size) {
+    if (memcmp(h->magic, MATFILE_MAGIC, sizeof(MATFILE_MAGIC)) != 0 ||
+        h->version != MATFILE_VERSION ||
+        (h->dtype != DTYPE_FLOAT64 && h->dtype != DTYPE_FLOAT32) ||
+        h->rows <= 0 || h->rows > INT_MAX || h->cols <= 0 || h->cols > INT_MAX ||
+        h->row_stride < h->cols || h->col_stride != 1 ||
+        h->data_offset < (long long)sizeof(matfile_header) || h->data_offset % MATFILE_ALIGN != 0)
+    {
+      return -1;
+    }
+    long long elem = h->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    long long room = (size - h->data_offset) / elem;
+    /* The last row ends (rows - 1) * row_stride + cols entries into the data */
+    if (size < h->data_offset || (h->rows - 1) > (room - h->cols) / h->row_stride ||
+        room < h->cols)
+    {
+      return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write `mat` (which may be a slice or a transposed view) to a new file at `path`, replacing
+ * any file there.
+ */
+int save_matrix(const char *path, matrix *mat) {
+    if (mat->transposed)
+    {
+      matrix *dense;
+      int ret = dense_matrix(&dense, mat);
+      if (ret == 0)
+      {
+        ret = save_matrix(path, dense);
+        deallocate_matrix(dense);
+      }
+      return ret;
+    }
+    matfile_header h;
+    make_header(&h, mat->rows, mat->cols, mat->dtype);
+    FILE *f = fopen(path, "wb");
+    if (!f)
+    {
+      return -3;
+    }
+
+    TRACE_BEGIN(t_convert);
+    static const char zeros[MATFILE_ALIGN] = {0};
+    size_t elem = mat->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(zeros, 1, h.data_offset - sizeof(h), f) == h.data_offset - sizeof(h);
+    for (int r = 0; ok && r < mat->rows; r++)
+    {
+      const void *row = mat->dtype == DTYPE_FLOAT32 ? (void *)mat->fdata[r] : (void *)mat->data[r];
+      ok = fwrite(row, elem, mat->cols, f) == (size_t)mat->cols;
+    }
+    if (!ok)
+    {
+      int saved_errno = errno;
+      fclose(f);
+      errno = saved_errno;
+      return -3;
+    }
+    if (fclose(f) != 0)
+    {
+      return -3;
+    }
+    TRACE_END(t_convert, "save_matrix", "convert", mat->rows, mat->cols);
+    return 0;
+}
+
+/*
+ * Read the matrix file at `path` into a newly allocated matrix *mat.
+ */
+int load_matrix(matrix **mat, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+      return -3;
+    }
+    matfile_header h;
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0)
+    {
+      fclose(f);
+      return -3;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 || check_header(&h, st.st_size) != 0)
+    {
+      fclose(f);
+      return -1;
+    }
+
+    matrix *m;
+    int ret = allocate_matrix_dtype(&m, (int)h.rows, (int)h.cols, h.dtype);
+    if (ret != 0)
+    {
+      fclose(f);
+      return ret;
+    }
+    TRACE_BEGIN(t_convert);
+    size_t elem = h.dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    int ok = 1;
+    for (int r = 0; ok && r < m->rows; r++)
+    {
+      void *row = m->dtype == DTYPE_FLOAT32 ? (void *)m->fdata[r] : (void *)m->data[r];
+      ok = fseeko(f, h.data_offset + (off_t)r * h.row_stride * elem, SEEK_SET) == 0 &&
+           fread(row, elem, m->cols, f) == (size_t)m->cols;
+    }
+    fclose(f);
+    if (!ok)
+    {
+      deallocate_matrix(m);
+      return -3;
+    }
+    TRACE_END(t_convert, "load_matrix", "convert", m->rows, m->cols);
+    *mat = m;
+    return 0;
+}
+
+/*
+ * Create a matrix file of zeros at `path`, replacing any file there. The data is not written
+ * out, so on most file systems the file takes no space until its entries are set through
+ * map_matrix.
+ */
+int create_matrix_file(const char *path, int rows, int cols, int dtype) {
+    if (rows <= 0 || cols <= 0 || (dtype != DTYPE_FLOAT64 && dtype != DTYPE_FLOAT32))
+    {
+      return -1;
+    }
+    matfile_header h;
+    make_header(&h, rows, cols, dtype);
+    size_t elem = dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+      return -3;
+    }
+    if (write(fd, &h, sizeof(h)) != (ssize_t)sizeof(h) ||
+        ftruncate(fd, h.data_offset + (off_t)rows * cols * elem) != 0)
+    {
+      int saved_errno = errno;
+      close(fd);
+      errno = saved_errno;
+      return -3;
+    }
+    return close(fd) == 0 ? 0 : -3;
+}
+
+/*
+ * Map the matrix file open at `fd`, which is closed, and make *mat a matrix of its data.
+ */
+static int map_fd(matrix **mat, int fd, int share) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      int saved_errno = errno;
+      close(fd);
+      errno = saved_errno;
+      return -3;
+    }
+    if (st.st_size < (off_t)sizeof(matfile_header))
+    {
+      close(fd);
+      return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                     share == MATFILE_SHARED ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    int saved_errno = errno;
+    close(fd);  // the mapping keeps the file open
+    if (map == MAP_FAILED)
+    {
+      errno = saved_errno;
+      return -3;
+    }
+
+    const matfile_header *h = (const matfile_header *)map;
+    if (check_header(h, st.st_size) != 0)
+    {
+      munmap(map, st.st_size);
+      return -1;
+    }
+    int ret = allocate_matrix_mapped(mat, (char *)map + h->data_offset, (int)h->rows,
+                                     (int)h->cols, h->row_stride, h->dtype, map, st.st_size);
+    if (ret != 0)
+    {
+      munmap(map, st.st_size);
+    }
+    return ret;
+}
+
+/*
+ * Map the matrix file at `path` and make *mat a matrix whose entries are the mapped data, so
+ * opening takes the same time however large the file is and pages are read as they are
+ * touched. With MATFILE_SHARED the file must be writable and sets change it; with
+ * MATFILE_PRIVATE they only change this process's copy.
+ */
+int map_matrix(matrix **mat, const char *path, int share) {
+    if (share != MATFILE_PRIVATE && share != MATFILE_SHARED)
+    {
+      return -1;
+    }
+    int fd = open(path, share == MATFILE_SHARED ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+    {
+      return -3;
+    }
+    return map_fd(mat, fd, share);
+}
+
+/* SHARED MEMORY */
+
+/*
+ * Copy the shared memory object name `name` to `buf` with the leading slash shm_open wants.
+ * Return 0, or -1 if the name is empty, contains another slash or is too long.
+ */
+static int shm_path(char *buf, const char *name) {
+    if (name[0] == '/')
+    {
+      name++;
+    }
+    size_t len = strlen(name);
+    if (len == 0 || len >= SHM_NAME_MAX || strchr(name, '/'))
+    {
+      return -1;
+    }
+    buf[0] = '/';
+    memcpy(buf + 1, name, len + 1);
+    return 0;
+}
+
+/*
+ * Release function of the matrix that created a shared memory object: removes the name.
+ */
+static void unlink_shared(void *path) {
+    shm_unlink((const char *)path);
+    free(path);
+}
+
+/*
+ * Create the POSIX shared memory object `name` holding a `rows` x `cols` matrix of zeros, laid
+ * out like a matrix file, and make *mat a matrix of its data. Fails with EEXIST if the name is
+ * taken. The name is removed again when *mat is deallocated; processes that attached before
+ * then keep working on the same pages, which the system frees once the last one lets go.
+ */
+int create_shared_matrix(matrix **mat, const char *name, int rows, int cols, int dtype) {
+    char path[SHM_NAME_MAX + 1];
+    if (rows <= 0 || cols <= 0 || (dtype != DTYPE_FLOAT64 && dtype != DTYPE_FLOAT32) ||
+        shm_path(path, name) != 0)
+    {
+      return -1;
+    }
+    char *owner = strdup(path);
+    if (!owner)
+    {
+      return -2;
+    }
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+      free(owner);
+      return -3;
+    }
+    matfile_header h;
+    make_header(&h, rows, cols, dtype);
+    size_t elem = dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    int ret = -3;
+    if (ftruncate(fd, h.data_offset + (off_t)rows * cols * elem) == 0 &&
+        pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h))
+    {
+      ret = map_fd(mat, fd, MATFILE_SHARED);
+    }
+    else
+    {
+      int saved_errno = errno;
+      close(fd);
+      errno = saved_errno;
+    }
+    if (ret != 0)
+    {
+      int saved_errno = errno;
+      shm_unlink(path);
+      free(owner);
+      errno = saved_errno;
+      return ret;
+    }
+    (*mat)->release = unlink_shared;
+    (*mat)->owner = owner;
+    return 0;
+}
+
+/*
+ * Release function of attached matrices, which only remember the name.
+ */
+static void forget_name(void *path) {
+    free(path);
+}
+
+/*
+ * Make *mat a matrix of the data of the shared memory object `name`, made by
+ * create_shared_matrix in this or another process. Sets change the shared data; deallocating
+ * *mat only unmaps it.
+ */
+int attach_shared_matrix(matrix **mat, const char *name) {
+    char path[SHM_NAME_MAX + 1];
+    if (shm_path(path, name) != 0)
+    {
+      return -1;
+    }
+    char *owner = strdup(path);
+    if (!owner)
+    {
+      return -2;
+    }
+    int fd = shm_open(path, O_RDWR, 0);
+    int ret = fd < 0 ? -3 : map_fd(mat, fd, MATFILE_SHARED);
+    if (ret != 0)
+    {
+      int saved_errno = errno;
+      free(owner);
+      errno = saved_errno;
+      return ret;
+    }
+    (*mat)->release = forget_name;
+    (*mat)->owner = owner;
+    return 0;
+}
+
+/*
+ * The name of the shared memory object holding all of `mat`, which another process can
+ * attach, or NULL if `mat` is not a whole shared matrix.
+ */
+const char *shared_matrix_name(matrix *mat) {
+    if (!mat->parent && (mat->release == unlink_shared || mat->release == forget_name))
+    {
+      return (const char *)mat->owner;
+    }
+    return NULL;
+}
+
+/* TEXT FILES */
+
+/* Text is split into pieces of about this many bytes, each ending at a line break */
+#define TEXT_CHUNK (1 << 20)
+
+/* Powers of ten that are exact doubles */
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static int is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/*
+ * Parse the number at p, which ends before `end`, into *val and return the first character
+ * after it, or NULL if there is no number there. Numbers with at most 19 significant digits
+ * and a small decimal exponent take an exact shortcut (the digits and the power of ten are
+ * both exact doubles, so one rounding gives the correctly rounded result); everything else,
+ * inf and nan included, is handed to strtod in place, which the NUL after the mapped text
+ * (see load_text_matrix) keeps from reading past its end.
+ */
+static const char *parse_double(const char *p, const char *end, double *val) {
+    const char *start = p;
+    int neg = 0;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+      neg = *p++ == '-';
+    }
+    unsigned long long digits = 0;
+    int ndigits = 0, exp10 = 0, seen = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, seen = 1)
+    {
+      if (ndigits < 19)
+      {
+        digits = digits * 10 + (*p - '0');
+        ndigits += digits != 0;
+      }
+      else
+      {
+        exp10++;
+        ndigits++;
+      }
+    }
+    if (p < end && *p == '.')
+    {
+      for (p++; p < end && *p >= '0' && *p <= '9'; p++, seen = 1)
+      {
+        if (ndigits < 19)
+        {
+          digits = digits * 10 + (*p - '0');
+          ndigits += digits != 0;
+          exp10--;
+        }
+        else
+        {
+          ndigits++;
+        }
+      }
+    }
+    if (seen && p < end && (*p == 'e' || *p == 'E'))
+    {
+      const char *q = p + 1;
+      int eneg = 0, e = 0, edigits = 0;
+      if (q < end && (*q == '-' || *q == '+'))
+      {
+        eneg = *q++ == '-';
+      }
+      for (; q < end && *q >= '0' && *q <= '9'; q++, edigits++)
+      {
+        e = e < 100000 ? e * 10 + (*q - '0') : e;
+      }
+      if (edigits == 0)
+      {
+        return NULL;
+      }
+      exp10 += eneg ? -e : e;
+      p = q;
+    }
+    if (seen && ndigits <= 19 && digits <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22)
+    {
+      double v = (double)digits;
+      v = exp10 < 0 ? v / exact_pow10[-exp10] : v * exact_pow10[exp10];
+      *val = neg ? -v : v;
+      return p;
+    }
+
+    /* Long mantissas, large exponents, inf and nan */
+    char *parsed;
+    *val = strtod(start, &parsed);
+    return parsed == start || parsed > end ? NULL : parsed;
+}
+
+/*
+ * Parse the line [p, end) of fields separated by `delim` (or by runs of blanks if `delim` is
+ * 0) into `row`, which may be NULL to only count the fields. Blank lines and lines starting
+ * with '#' have no fields. Returns the number of fields, or -1 if the line is malformed or
+ * has more than `cols` fields (when `row` is given).
+ */
+static int parse_line(const char *p, const char *end, char delim, double *row, int cols) {
+    int n = 0;
+    while (p < end && is_blank(*p))
+    {
+      p++;
+    }
+    if (p == end || *p == '#')
+    {
+      return 0;
+    }
+    while (1)
+    {
+      double v;
+      if (row && n == cols)
+      {
+        return -1;
+      }
+      if (!(p = parse_double(p, end, &v)))
+      {
+        return -1;
+      }
+      if (row)
+      {
+        row[n] = v;
+      }
+      n++;
+      while (p < end && is_blank(*p))
+      {
+        p++;
+      }
+      if (p == end)
+      {
+        return n;
+      }
+      if (delim)
+      {
+        if (*p != delim)
+        {
+          return -1;
+        }
+        for (p++; p < end && is_blank(*p); p++)
+        {
+        }
+      }
+      else if (p[-1] != ' ' && p[-1] != '\t')
+      {
+        return -1;  // junk right after a number
+      }
+    }
+}
+
+/*
+ * Return the end of the line starting at p: its '\n', or `end`.
+ */
+static const char *line_end(const char *p, const char *end) {
+    const char *nl = memchr(p, '\n', end - p);
+    return nl ? nl : end;
+}
+
+/*
+ * Read a text file of one matrix row per line into a new matrix *mat of type `dtype`.
+ * Fields are separated by `delim`, or by blanks if it is 0; blank lines and lines starting
+ * with '#' are skipped. The file is mapped and cut into line aligned chunks of about
+ * TEXT_CHUNK bytes, whose rows are counted and then parsed in parallel, each chunk straight
+ * into its rows of the matrix. If the text is malformed or rows differ in length, -1 is
+ * returned and *bad_row is the index of the first bad row.
+ */
+int load_text_matrix(matrix **mat, const char *path, char delim, int dtype, long long *bad_row) {
+    *bad_row = -1;
+    if (dtype != DTYPE_FLOAT64 && dtype != DTYPE_FLOAT32)
+    {
+      return -1;
+    }
+    if (is_blank(delim))
+    {
+      delim = 0;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+      return -3;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      int saved_errno = errno;
+      close(fd);
+      errno = saved_errno;
+      return -3;
+    }
+    if (st.st_size == 0)
+    {
+      close(fd);
+      return -1;
+    }
+    /* The file goes over a zeroed mapping one byte longer, so the text always ends in a NUL */
+    size_t map_size = (size_t)st.st_size + 1;
+    char *text = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (text != MAP_FAILED &&
+        mmap(text, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+      int saved_errno = errno;
+      munmap(text, map_size);
+      errno = saved_errno;
+      text = MAP_FAILED;
+    }
+    int saved_errno = errno;
+    close(fd);
+    if (text == MAP_FAILED)
+    {
+      errno = saved_errno;
+      return -3;
+    }
+    madvise((void *)text, st.st_size, MADV_SEQUENTIAL);
+    const char *text_end = text + st.st_size;
+
+    TRACE_BEGIN(t_convert);
+    long long nchunks = (st.st_size + TEXT_CHUNK - 1) / TEXT_CHUNK;
+    const char **bounds = (const char **)malloc(sizeof(char *) * (nchunks + 1));
+    long long *row_start = (long long *)calloc(nchunks + 1, sizeof(long long));
+    if (!bounds || !row_start)
+    {
+      free(bounds);
+      free(row_start);
+      munmap(text, map_size);
+      return -2;
+    }
+    bounds[0] = text;
+    for (long long c = 1; c < nchunks; c++)
+    {
+      const char *eol = line_end(text + c * TEXT_CHUNK, text_end);
+      bounds[c] = eol < text_end ? eol + 1 : text_end;
+    }
+    bounds[nchunks] = text_end;
+
+    /* Count the rows of every chunk, then turn the counts into the index of its first row */
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long long c = 0; c < nchunks; c++)
+    {
+      long long rows = 0;
+      for (const char *p = bounds[c]; p < bounds[c + 1]; )
+      {
+        const char *eol = line_end(p, bounds[c + 1]);
+        while (p < eol && is_blank(*p))
+        {
+          p++;
+        }
+        rows += p < eol && *p != '#';
+        p = eol + 1;
+      }
+      row_start[c + 1] = rows;
+    }
+    for (long long c = 0; c < nchunks; c++)
+    {
+      row_start[c + 1] += row_start[c];
+    }
+
+    /* The first row decides the number of columns */
+    int cols = 0;
+    for (const char *p = text; p < text_end && cols == 0; )
+    {
+      const char *eol = line_end(p, text_end);
+      cols = parse_line(p, eol, delim, NULL, 0);
+      p = eol + 1;
+    }
+    long long rows = row_start[nchunks];
+    int ret = rows == 0 || rows > INT_MAX || cols <= 0 ? -1 :
+              allocate_matrix_dtype(mat, (int)rows, cols, dtype);
+    if (ret != 0)
+    {
+      *bad_row = cols < 0 ? 0 : -1;
+      free(bounds);
+      free(row_start);
+      munmap(text, map_size);
+      return ret;
+    }
+    matrix *m = *mat;
+
+    /* Rows are counted above exactly as parse_line finds fields, so chunk c fills rows
+       row_start[c] .. row_start[c + 1] - 1 */
+    long long first_bad = LLONG_MAX;
+    int failed_alloc = 0;
+    #pragma omp parallel reduction(||:failed_alloc)
+    {
+      double *tmp = dtype == DTYPE_FLOAT32 ? (double *)malloc(sizeof(double) * cols) : NULL;
+      failed_alloc = dtype == DTYPE_FLOAT32 && !tmp;
+      #pragma omp for schedule(dynamic, 1) reduction(min:first_bad)
+      for (long long c = 0; c < nchunks; c++)
+      {
+        long long r = row_start[c];
+        for (const char *p = bounds[c]; !failed_alloc && p < bounds[c + 1] && r < first_bad; )
+        {
+          const char *eol = line_end(p, bounds[c + 1]);
+          int n = parse_line(p, eol, delim, dtype == DTYPE_FLOAT32 ? tmp : m->data[r], cols);
+          if (n == cols)
+          {
+            if (dtype == DTYPE_FLOAT32)
+            {
+              kernels->f64_to_f32(m->fdata[r], tmp, cols);
+            }
+            r++;
+          }
+          else if (n != 0)
+          {
+            first_bad = r;
+          }
+          p = eol + 1;
+        }
+      }
+      free(tmp);
+    }
+    TRACE_END(t_convert, "load_text_matrix", "convert", m->rows, m->cols);
+
+    free(bounds);
+    free(row_start);
+    munmap(text, map_size);
+    if (failed_alloc || first_bad != LLONG_MAX)
+    {
+      *bad_row = failed_alloc ? -1 : first_bad;
+      deallocate_matrix(m);
+      return failed_alloc ? -2 : -1;
+    }
+    return 0;
+}
+
+/*
+ * Write `mat` to `path` as text, one row per line with the entries separated by `delim`.
+ * Entries are printed with enough digits to read back exactly. Rows are formatted in
+ * parallel, in blocks that are written to the file in order.
+ */
+int save_text_matrix(const char *path, matrix *mat, char delim) {
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+      return -3;
+    }
+    /* "-1.2345678901234567e-308" plus a separator */
+    size_t width = 26;
+    int block = TEXT_CHUNK / ((size_t)mat->cols * width) + 1;
+    int nblocks = (mat->rows + block - 1) / block;
+    int ok = 1, failed_alloc = 0;  // only changed in the ordered region
+
+    TRACE_BEGIN(t_convert);
+    #pragma omp parallel for ordered schedule(static, 1)
+    for (int b = 0; b < nblocks; b++)
+    {
+      int r1 = (b + 1) * block < mat->rows ? (b + 1) * block : mat->rows;
+      char *buf = (char *)malloc((size_t)(r1 - b * block) * mat->cols * width + 1);
+      size_t len = 0;
+      for (int r = b * block; buf && r < r1; r++)
+      {
+        for (int c = 0; c < mat->cols; c++)
+        {
+          char sep = c + 1 < mat->cols ? delim : '\n';
+          len += mat->dtype == DTYPE_FLOAT32 ?
+                 sprintf(buf + len, "%.9g%c", get(mat, r, c), sep) :
+                 sprintf(buf + len, "%.17g%c", get(mat, r, c), sep);
+        }
+      }
+      #pragma omp ordered
+      {
+        if (!buf)
+        {
+          failed_alloc = 1;
+        }
+        else if (ok && fwrite(buf, 1, len, f) != len)
+        {
+          ok = 0;
+        }
+      }
+      free(buf);
+    }
+    TRACE_END(t_convert, "save_text_matrix", "convert", mat->rows, mat->cols);
+
+    if (fclose(f) != 0)
+    {
+      ok = 0;
+    }
+    return failed_alloc ? -2 : ok ? 0 : -3;
+}
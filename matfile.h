@@ -0,0 +1,47 @@
+#ifndef NUMC_MATFILE_H
+#define NUMC_MATFILE_H
+
+#include "matrix.h"
+
+/* First bytes of every matrix file */
+#define MATFILE_MAGIC "NUMCMAT"
+#define MATFILE_VERSION 1
+
+/* The data starts at a multiple of this many bytes into the file */
+#define MATFILE_ALIGN 64
+
+/* Longest name of a shared memory object, without the leading slash */
+#define SHM_NAME_MAX 250
+
+/* How map_matrix shares the file */
+#define MATFILE_PRIVATE 0  // writes stay in memory, the file is never modified
+#define MATFILE_SHARED 1   // writes go through to the file
+
+/*
+ * The 64 bytes at the start of a matrix file, in the byte order of the machine
+ * that wrote it. Row r of the data starts data_offset + r * row_stride entries
+ * into the file; entries of a row are contiguous.
+ */
+typedef struct matfile_header {
+    char magic[8];           // MATFILE_MAGIC, NUL terminated
+    unsigned int version;    // MATFILE_VERSION
+    unsigned int dtype;      // DTYPE_FLOAT64 or DTYPE_FLOAT32
+    long long rows;          // number of rows
+    long long cols;          // number of columns
+    long long row_stride;    // entries from the start of one row to the next, at least cols
+    long long col_stride;    // entries from one column to the next, always 1
+    long long data_offset;   // bytes before the data, a multiple of MATFILE_ALIGN
+    long long reserved;      // zero
+} matfile_header;
+
+int save_matrix(const char *path, matrix *mat);
+int load_matrix(matrix **mat, const char *path);
+int create_matrix_file(const char *path, int rows, int cols, int dtype);
+int map_matrix(matrix **mat, const char *path, int share);
+int create_shared_matrix(matrix **mat, const char *name, int rows, int cols, int dtype);
+int attach_shared_matrix(matrix **mat, const char *name);
+const char *shared_matrix_name(matrix *mat);
+int load_text_matrix(matrix **mat, const char *path, char delim, int dtype, long long *bad_row);
+int save_text_matrix(const char *path, matrix *mat, char delim);
+
+#endif
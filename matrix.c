@@ -1,8 +1,14 @@
 #include "matrix.h"
+#include "trace.h"
+#include "tune.h"
+#include "kernels.h"
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
+#include <string.h>
 #include <omp.h>
+#include <sys/mman.h>
 
 // Include SSE intrinsics
 #if defined(_MSC_VER)
@@ -26,6 +32,66 @@
  * __m256d _mm256_max_pd (__m256d a, __m256d b)
 */
 
+/*
+ * Matrix headers and single block small matrices are recycled instead of going back to malloc.
+ * Blocks are grouped by size in steps of POOL_GRAIN bytes, every block of a class is allocated
+ * at the full class size, and each class keeps up to POOL_DEPTH freed blocks.
+ */
+#define POOL_GRAIN 64
+#define POOL_DEPTH 16
+/* Largest block: a small float32 matrix of a single column, with a row pointer per entry */
+#define POOL_MAX_BLOCK (sizeof(matrix) + sizeof(void *) * (SMALL_MATRIX_BYTES / sizeof(float)) + \
+                        SMALL_MATRIX_BYTES)
+/* Blocks are looked up by their size rounded up to the grain, so the class count rounds up too */
+#define POOL_CLASSES ((POOL_MAX_BLOCK + POOL_GRAIN - 1) / POOL_GRAIN + 1)
+
+static void *pool[POOL_CLASSES][POOL_DEPTH];
+static int pool_count[POOL_CLASSES];
+
+/*
+ * Return a block of at least `size` bytes, which must not exceed a small matrix block.
+ */
+static void *pool_get(size_t size) {
+    size_t c = (size + POOL_GRAIN - 1) / POOL_GRAIN;
+    void *p = NULL;
+    #pragma omp critical (matrix_pool)
+    {
+      if (pool_count[c] > 0)
+      {
+        p = pool[c][--pool_count[c]];
+      }
+    }
+    return p ? p : malloc(c * POOL_GRAIN);
+}
+
+/*
+ * Give back the block `p` of `size` bytes returned by pool_get.
+ */
+static void pool_put(void *p, size_t size) {
+    size_t c = (size + POOL_GRAIN - 1) / POOL_GRAIN;
+    int kept = 0;
+    #pragma omp critical (matrix_pool)
+    {
+      if (pool_count[c] < POOL_DEPTH)
+      {
+        pool[c][pool_count[c]++] = p;
+        kept = 1;
+      }
+    }
+    if (!kept)
+    {
+      free(p);
+    }
+}
+
+/*
+ * Size of the single block holding a small `rows` x `cols` matrix of type `dtype`.
+ */
+static size_t inline_size(int rows, int cols, int dtype) {
+    size_t elem_size = dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    return sizeof(matrix) + sizeof(void*)*rows + (size_t)rows*cols*elem_size;
+}
+
 /*
  * Generates a random double between `low` and `high`.
  */
@@ -36,7 +102,9 @@ double rand_double(double low, double high) {
 }
 
 /*
- * Generates a random matrix with `seed`.
+ * Generates a random matrix with `seed`. Uses the C library's rand() so that the numbers match
+ * those of the reference implementation for the same seed; uniform_matrix is the parallel
+ * generator for everything else.
  */
 void rand_matrix(matrix *result, unsigned int seed, double low, double high) {
     srand(seed);
@@ -47,6 +115,102 @@ void rand_matrix(matrix *result, unsigned int seed, double low, double high) {
     }
 }
 
+/* Entries handled per step of the random generators and float32 ufuncs */
+#define ROW_CHUNK 256
+
+/*
+ * Fill `result` with numbers drawn uniformly from [low, high). Entry (r, c) comes from block
+ * r * cols + c of the Philox stream keyed by `seed` (see kernels_impl.h), so rows can be filled
+ * by any number of threads and the matrix only depends on the seed and its shape. Entries that
+ * round up to `high` are clamped to the largest value below it.
+ * Return 0 upon success and -2 if `result` cannot be unshared.
+ */
+int uniform_matrix(matrix *result, unsigned long long seed, double low, double high) {
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+    double range = high - low;
+    double top = nextafter(high, low);
+    float top_f32 = (float)high;
+    if (top_f32 >= high)
+    {
+      top_f32 = nextafterf(top_f32, (float)low);
+    }
+    TRACE_BEGIN(t_compute);
+    #pragma omp parallel if ((long long)result->rows * result->cols >= matrix_tune.par_elem)
+    {
+      double u[ROW_CHUNK];
+      #pragma omp for nowait
+      for (int r = 0; r < result->rows; r++)
+      {
+          for (int c = 0; c < result->cols; c += ROW_CHUNK)
+          {
+            int len = result->cols - c < ROW_CHUNK ? result->cols - c : ROW_CHUNK;
+            kernels->philox(u, NULL, (unsigned long long)r * result->cols + c, len, seed);
+            for (int j = 0; j < len; j++)
+            {
+              double v = low + u[j] * range;
+              if (result->dtype == DTYPE_FLOAT32)
+              {
+                float f = (float)v;
+                result->fdata[r][c + j] = f < top_f32 ? f : top_f32;
+              }
+              else
+              {
+                result->data[r][c + j] = v < top ? v : top;
+              }
+            }
+          }
+      }
+    }
+    TRACE_END(t_compute, "uniform_matrix", "compute", result->rows, result->cols);
+    return 0;
+}
+
+/*
+ * Fill `result` with normally distributed numbers of the given mean and standard deviation.
+ * Entry (r, c) is the Box-Muller transform of the two uniforms of Philox block r * cols + c,
+ * so like uniform_matrix the result does not depend on the number of threads.
+ * Return 0 upon success and -2 if `result` cannot be unshared.
+ */
+int normal_matrix(matrix *result, unsigned long long seed, double mean, double std) {
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+    const double two_pi = 6.283185307179586;
+    TRACE_BEGIN(t_compute);
+    #pragma omp parallel if ((long long)result->rows * result->cols >= matrix_tune.par_elem / 8)
+    {
+      double u0[ROW_CHUNK], u1[ROW_CHUNK];
+      #pragma omp for nowait
+      for (int r = 0; r < result->rows; r++)
+      {
+          for (int c = 0; c < result->cols; c += ROW_CHUNK)
+          {
+            int len = result->cols - c < ROW_CHUNK ? result->cols - c : ROW_CHUNK;
+            kernels->philox(u0, u1, (unsigned long long)r * result->cols + c, len, seed);
+            for (int j = 0; j < len; j++)
+            {
+              /* 1 - u0 is in (0, 1], so the log is finite */
+              double z = mean + std * sqrt(-2 * log(1 - u0[j])) * cos(two_pi * u1[j]);
+              if (result->dtype == DTYPE_FLOAT32)
+              {
+                result->fdata[r][c + j] = (float)z;
+              }
+              else
+              {
+                result->data[r][c + j] = z;
+              }
+            }
+          }
+      }
+    }
+    TRACE_END(t_compute, "normal_matrix", "compute", result->rows, result->cols);
+    return 0;
+}
+
 /*
  * Allocate space for a matrix struct pointed to by the double pointer mat with
  * `rows` rows and `cols` columns. You should also allocate memory for the data array
@@ -59,46 +223,112 @@ void rand_matrix(matrix *result, unsigned int seed, double low, double high) {
  */
 int allocate_matrix(matrix **mat, int rows, int cols) {
     /* TODO: YOUR CODE HERE */
+    return allocate_matrix_dtype(mat, rows, cols, DTYPE_FLOAT64);
+}
+
+/*
+ * Same as allocate_matrix, but the entries are of type `dtype`.
+ */
+int allocate_matrix_dtype(matrix **mat, int rows, int cols, int dtype) {
 
-    if (rows <= 0 || cols <= 0)
+    if (rows <= 0 || cols <= 0 || (dtype != DTYPE_FLOAT64 && dtype != DTYPE_FLOAT32))
     {
       return -1;
     }
 
-    matrix* m  = (matrix*)malloc(sizeof(matrix));
-    if (!m)
+    TRACE_BEGIN(t_alloc);
+
+    size_t elem_size = dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    size_t data_size = (size_t)rows*cols*elem_size;
+    matrix* m;
+    char * matrix_data;
+    void * row_ptrs;
+    if (data_size <= SMALL_MATRIX_BYTES)
     {
-      return -2;
+      // Small matrices live in one block: the struct, then the row pointers, then the data.
+      m = (matrix*)pool_get(inline_size(rows, cols, dtype));
+      if (!m)
+      {
+        return -2;
+      }
+      row_ptrs = m + 1;
+      matrix_data = (char *)row_ptrs + sizeof(void*)*rows;
+      m->is_inline = 1;
     }
-
-    double * matrix_data = (double *)malloc(rows*cols*sizeof(double));
-    if (!matrix_data) 
+    else
     {
-      return -2;
+      m = (matrix*)pool_get(sizeof(matrix));
+      if (!m)
+      {
+        return -2;
+      }
+
+      matrix_data = (char *)malloc(data_size);
+      if (!matrix_data)
+      {
+        pool_put(m, sizeof(matrix));
+        return -2;
+      }
+
+      row_ptrs = malloc(sizeof(void*)*rows);
+      if (!row_ptrs) {
+        free(matrix_data);
+        pool_put(m, sizeof(matrix));
+        return -2;
+      }
+      m->is_inline = 0;
     }
 
-    m->data = (double **)malloc(sizeof(double*)*cols);
-    if (!m->data) {
-      return -2;
+    m->data = NULL;
+    m->fdata = NULL;
+    if (dtype == DTYPE_FLOAT32)
+    {
+      m->fdata = (float **)row_ptrs;
+    }
+    else
+    {
+      m->data = (double **)row_ptrs;
     }
 
     m->rows = rows;
     m->cols = cols;
+    m->dtype = dtype;
 
     for(int i = 0; i < rows; i++)
     {
-        m-> data[i] = &matrix_data[cols*i];
+        if (dtype == DTYPE_FLOAT32)
+        {
+          m->fdata[i] = (float *)matrix_data + (size_t)cols*i;
+        }
+        else
+        {
+          m->data[i] = (double *)matrix_data + (size_t)cols*i;
+        }
     }
     m->is_1d = ((rows==1) || (cols==1));
+    m->acc_f64 = 0;
     m->ref_cnt = 1;
     m->parent = NULL;
+    m->map = NULL;
+    m->map_size = 0;
+    m->release = NULL;
+    m->owner = NULL;
+    m->buf = NULL;
+    m->transposed = 0;
     *mat = m;
 
-    // Initiate it to be all 0s as per test requests.
-    fill_matrix(m, 0);
+    // Initiate it to be all 0s as per test requests. Small blocks skip the parallel region,
+    // which costs more than the memset itself.
+    if (m->is_inline)
+    {
+      memset(matrix_data, 0, data_size);
+    }
+    else
+    {
+      fill_matrix(m, 0);
+    }
 
-    //REVISIT: is mat allocated before passing to this function ?
-    //REVISIT: Is it OK to not allocate data row by row ?
+    TRACE_END(t_alloc, "allocate_matrix", "alloc", rows, cols);
     return 0;
 }
 
@@ -106,6 +336,7 @@ int allocate_matrix(matrix **mat, int rows, int cols) {
  * Allocate space for a matrix struct pointed to by `mat` with `rows` rows and `cols` columns.
  * This is equivalent to setting the new matrix to be
  * from[row_offset:row_offset + rows, col_offset:col_offset + cols]
+ * A slice of a transposed view is itself a transposed view.
  * If you don't set python error messages here upon failure, then remember to set it in numc.c.
  * Return 0 upon success and non-zero upon failure.
  */
@@ -113,37 +344,74 @@ int allocate_matrix_ref(matrix **mat, matrix *from, int row_offset, int col_offs
                         int rows, int cols) {
     /* TODO: YOUR CODE HERE */
 
-  if (row_offset + rows > from -> rows || col_offset + cols > from -> cols)
+  if (!from)
+  {
+    return -1;
+  }
+
+  if (rows <= 0 || cols <= 0 || row_offset < 0 || col_offset < 0 ||
+      row_offset + rows > from -> rows || col_offset + cols > from -> cols)
   {
     // out of range
     return -1;
   }
 
-  if (!from)
+  // Slices write through to `from`, so it cannot keep sharing its entries with copies.
+  if (unshare_matrix(from) != 0)
   {
-    return -1;
+    return -2;
   }
 
-  matrix * m = (matrix *)malloc(sizeof(matrix));
+  matrix * m = (matrix *)pool_get(sizeof(matrix));
   if (!m)
   {
     return -2;
   }
 
-  m-> data = (double**)malloc(sizeof(cols));
-  if (!(m -> data))
+  // A transposed view keeps a pointer per column, each starting at its first row
+  int ptrs = from->transposed ? cols : rows;
+  int first = from->transposed ? col_offset : row_offset;
+  int skip = from->transposed ? row_offset : col_offset;
+  m->data = NULL;
+  m->fdata = NULL;
+  if (from->dtype == DTYPE_FLOAT32)
+  {
+    m->fdata = (float**)malloc(sizeof(float*)*ptrs);
+  }
+  else
+  {
+    m->data = (double**)malloc(sizeof(double*)*ptrs);
+  }
+  if (!(m -> data) && !(m -> fdata))
   {
+    pool_put(m, sizeof(matrix));
     return -2;
   }
 
-  for (int i = 0; i<rows; i++)
+  for (int i = 0; i<ptrs; i++)
   {
-    m->data[i] = &(from->data[i+row_offset][col_offset]);
+    if (from->dtype == DTYPE_FLOAT32)
+    {
+      m->fdata[i] = &(from->fdata[i+first][skip]);
+    }
+    else
+    {
+      m->data[i] = &(from->data[i+first][skip]);
+    }
   }
 
-  m->is_1d =1;
+  m->is_1d = ((rows==1) || (cols==1));
+  m->dtype = from->dtype;
+  m->acc_f64 = from->acc_f64;
+  m->is_inline = 0;
   m->ref_cnt = 1;
   m->parent = from;
+  m->map = NULL;
+  m->map_size = 0;
+  m->release = NULL;
+  m->owner = NULL;
+  m->buf = NULL;
+  m->transposed = from->transposed;
   m->rows = rows;
   m->cols = cols;
 
@@ -156,221 +424,1784 @@ int allocate_matrix_ref(matrix **mat, matrix *from, int row_offset, int col_offs
 }
 
 /*
- * This function will be called automatically by Python when a numc matrix loses all of its
- * reference pointers.
- * You need to make sure that you only free `mat->data` if no other existing matrices are also
- * referring this data array.
- * See the spec for more information.
+ * Make *mat a matrix of the `rows` x `cols` entries of type `dtype` at `data`, with rows
+ * `row_stride` entries apart, without copying them. The caller records who owns the data.
+ * Return 0 upon success, -1 for invalid dimensions and -2 if allocation fails.
  */
-void deallocate_matrix(matrix *mat) {
-    /* TODO: YOUR CODE HERE */
-    if (mat)
+static int wrap_data(matrix **mat, void *data, int rows, int cols, long long row_stride,
+                     int dtype) {
+    if (rows <= 0 || cols <= 0 || row_stride < cols ||
+        (dtype != DTYPE_FLOAT64 && dtype != DTYPE_FLOAT32))
     {
-      if (mat->ref_cnt == 0)
-      {
-        free(mat->data);
-      }
+      return -1;
+    }
 
-      free(mat);
+    matrix *m = (matrix *)pool_get(sizeof(matrix));
+    if (!m)
+    {
+      return -2;
+    }
+    void **row_ptrs = (void **)malloc(sizeof(void *) * rows);
+    if (!row_ptrs)
+    {
+      pool_put(m, sizeof(matrix));
+      return -2;
+    }
+    size_t elem_size = dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    for (int i = 0; i < rows; i++)
+    {
+      row_ptrs[i] = (char *)data + (size_t)i * row_stride * elem_size;
     }
-}
 
-/*
- * Return the double value of the matrix at the given row and column.
- * You may assume `row` and `col` are valid.
- */
-double get(matrix *mat, int row, int col) {
-    /* TODO: YOUR CODE HERE */
-    return mat->data[row][col];
+    m->data = dtype == DTYPE_FLOAT64 ? (double **)row_ptrs : NULL;
+    m->fdata = dtype == DTYPE_FLOAT32 ? (float **)row_ptrs : NULL;
+    m->rows = rows;
+    m->cols = cols;
+    m->dtype = dtype;
+    m->is_1d = ((rows==1) || (cols==1));
+    m->acc_f64 = 0;
+    m->is_inline = 0;
+    m->ref_cnt = 1;
+    m->parent = NULL;
+    m->map = NULL;
+    m->map_size = 0;
+    m->release = NULL;
+    m->owner = NULL;
+    m->buf = NULL;
+    m->transposed = 0;
+    *mat = m;
+    return 0;
 }
 
 /*
- * Set the value at the given row and column to val. You may assume `row` and
- * `col` are valid
+ * Make a matrix of the `rows` x `cols` entries of type `dtype` at `data`, with rows
+ * `row_stride` entries apart, without copying them. `data` lies in the memory mapping `map`
+ * of `map_size` bytes, which the matrix takes over and unmaps when it is deallocated.
+ * Return 0 upon success, -1 for invalid dimensions and -2 if allocation fails; on failure
+ * the mapping is left alone.
  */
-void set(matrix *mat, int row, int col, double val) {
-    /* TODO: YOUR CODE HERE */
-    mat->data[row][col] = val;
+int allocate_matrix_mapped(matrix **mat, void *data, int rows, int cols, long long row_stride,
+                           int dtype, void *map, size_t map_size) {
+    int ret = wrap_data(mat, data, rows, cols, row_stride, dtype);
+    if (ret == 0)
+    {
+      (*mat)->map = map;
+      (*mat)->map_size = map_size;
+    }
+    return ret;
 }
 
 /*
- * Set all entries in mat to val
+ * Make a matrix of the `rows` x `cols` entries of type `dtype` stored contiguously at `data`,
+ * which belongs to someone else, without copying them. When the matrix is deallocated
+ * release(owner) is called instead of freeing the data.
+ * Return 0 upon success, -1 for invalid dimensions and -2 if allocation fails; on failure
+ * release is not called.
  */
-void fill_matrix(matrix *mat, double val) {
-    /* TODO: YOUR CODE HERE */
-    for (int r = 0; r< mat->rows; r++)
+int allocate_matrix_borrowed(matrix **mat, void *data, int rows, int cols, int dtype,
+                             void (*release)(void *), void *owner) {
+    int ret = wrap_data(mat, data, rows, cols, cols, dtype);
+    if (ret == 0)
     {
-        for (int c = 0; c < mat->cols; c++)
-        {
-            mat->data[r][c] = val;
-        }
+      (*mat)->release = release;
+      (*mat)->owner = owner;
     }
+    return ret;
 }
 
 /*
- * Store the result of adding mat1 and mat2 to `result`.
- * Return 0 upon success and a nonzero value upon failure.
+ * Make *mat the transpose of `from` without copying: a view that reads the rows of `from` as
+ * its columns and writes through to it, like the slices of allocate_matrix_ref. The
+ * transpose of a transposed view reads its parent the right way round again.
+ * Return 0 upon success and -2 if allocation fails.
  */
-int add_matrix(matrix *result, matrix *mat1, matrix *mat2) {
-    /* TODO: YOUR CODE HERE */
-
-    //REVISIT: not considering broadcasting 
-    
-    if (mat1->cols != mat2->cols|| mat1->rows != mat2->rows)
+int allocate_matrix_transposed(matrix **mat, matrix *from) {
+    if (unshare_matrix(from) != 0)
     {
-      return -1;
+      return -2;
     }
-
-    for (int r = 0; r< mat1->rows; r++)
+    matrix *m = (matrix *)pool_get(sizeof(matrix));
+    if (!m)
     {
-        for (int c = 0; c < mat1->cols; c++)
-        {
-          result -> data[r][c] =  mat1->data[r][c]+mat2->data[r][c];
-        }
+      return -2;
+    }
+    int ptrs = from->transposed ? from->cols : from->rows;
+    void **row_ptrs = (void **)malloc(sizeof(void *) * ptrs);
+    if (!row_ptrs)
+    {
+      pool_put(m, sizeof(matrix));
+      return -2;
     }
+    memcpy(row_ptrs, from->dtype == DTYPE_FLOAT32 ? (void *)from->fdata : (void *)from->data,
+           sizeof(void *) * ptrs);
 
+    m->data = from->dtype == DTYPE_FLOAT64 ? (double **)row_ptrs : NULL;
+    m->fdata = from->dtype == DTYPE_FLOAT32 ? (float **)row_ptrs : NULL;
+    m->rows = from->cols;
+    m->cols = from->rows;
+    m->dtype = from->dtype;
+    m->acc_f64 = from->acc_f64;
+    m->is_1d = from->is_1d;
+    m->is_inline = 0;
+    m->ref_cnt = 1;
+    m->parent = from;
+    m->map = NULL;
+    m->map_size = 0;
+    m->release = NULL;
+    m->owner = NULL;
+    m->buf = NULL;
+    m->transposed = !from->transposed;
+    from->ref_cnt++;
+    *mat = m;
     return 0;
 }
 
 /*
- * Store the result of subtracting mat2 from mat1 to `result`.
- * Return 0 upon success and a nonzero value upon failure.
+ * The contiguous entries of a matrix, starting with row 0.
  */
-int sub_matrix(matrix *result, matrix *mat1, matrix *mat2) {
-    /* TODO: YOUR CODE HERE */
-    if (mat1->cols != mat2->cols || mat1->rows != mat2->rows)
-    {
-      return -1;
-    }
+static void *matrix_entries(matrix *mat) {
+    return mat->dtype == DTYPE_FLOAT32 ? (void *)mat->fdata[0] : (void *)mat->data[0];
+}
 
-    for (int r = 0; r< mat1->rows; r++)
+/*
+ * Return whether the rows of `mat` follow each other without gaps, as in a matrix of its own
+ * or a slice of whole rows. Transposed views never do.
+ */
+int matrix_contiguous(matrix *mat) {
+    if (mat->transposed)
     {
-        for (int c = 0; c < mat1->cols; c++)
-        {
-          result -> data[r][c] =  mat1->data[r][c] - mat2->data[r][c];
-        }
+      return 0;
     }
-
-    return 0;
-}
-
-int copy_matrix(matrix * result, matrix* mat)
-{
-  if (result->cols != mat->cols || result->rows != mat->rows)
-  {
-    return -1;
-  }
-
-  if (!result || !mat)
-  {
-    return -2;
-  }
-
-  for (int r = 0; r< mat->rows; r++)
-  {
-      for (int c = 0; c < mat->cols; c++)
+    size_t row_bytes = (size_t)mat->cols * (mat->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double));
+    char *base = (char *)matrix_entries(mat);
+    for (int r = 1; r < mat->rows; r++)
+    {
+      char *row = mat->dtype == DTYPE_FLOAT32 ? (char *)mat->fdata[r] : (char *)mat->data[r];
+      if (row != base + r * row_bytes)
       {
-          result-> data[r][c] = mat->data[r][c]; 
+        return 0;
       }
-  }
-  return 0;
-  
+    }
+    return 1;
 }
+
 /*
- * Store the result of multiplying mat1 and mat2 to `result`.
- * Return 0 upon success and a nonzero value upon failure.
- * Remember that matrix multiplication is not the same as multiplying individual elements.
+ * Allocate *mat as the entries of `from` read row by row into `rows` x `cols`. If they are
+ * contiguous (see matrix_contiguous), *mat is a view that writes through to them like a
+ * slice; otherwise it is a copy of its own.
+ * Return 0 upon success, -1 if the number of entries differs and -2 if allocation fails.
  */
-int mul_matrix(matrix *result, matrix *mat1, matrix *mat2) {
-    /* TODO: YOUR CODE HERE */
-    if (mat1->cols != mat2->rows || mat1->rows != result->rows || mat2->cols != result->cols)
+int allocate_matrix_reshaped(matrix **mat, matrix *from, int rows, int cols) {
+    if (rows <= 0 || cols <= 0 || (long long)rows * cols != (long long)from->rows * from->cols)
     {
       return -1;
     }
+    size_t elem = from->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
 
-    // Need to consider if mat1 or mat2 are the same point as result.
-    matrix* mat1_shadow;
-    matrix* mat2_shadow;
+    if (!matrix_contiguous(from))
+    {
+      matrix *dense;
+      if (dense_matrix(&dense, from) != 0)
+      {
+        return -2;
+      }
+      matrix *src = dense ? dense : from;
+      int ret = allocate_matrix_dtype(mat, rows, cols, from->dtype);
+      if (ret == 0)
+      {
+        size_t row_bytes = (size_t)src->cols * elem;
+        char *dst = (char *)matrix_entries(*mat);
+        for (int r = 0; r < src->rows; r++)
+        {
+          memcpy(dst + r * row_bytes,
+                 src->dtype == DTYPE_FLOAT32 ? (void *)src->fdata[r] : (void *)src->data[r],
+                 row_bytes);
+        }
+        (*mat)->acc_f64 = from->acc_f64;
+        (*mat)->is_1d = rows == 1 || cols == 1;
+      }
+      deallocate_matrix(dense);
+      return ret;
+    }
 
-    if (allocate_matrix(&mat1_shadow, mat1->rows, mat1->cols) != 0 || copy_matrix(mat1_shadow, mat1) !=0)
+    // Like a slice, the view writes through to `from`, so it cannot keep sharing with copies
+    if (unshare_matrix(from) != 0)
     {
       return -2;
     }
-
-    if (allocate_matrix(&mat2_shadow, mat2->rows, mat2->cols) !=0 || copy_matrix(mat2_shadow, mat2) !=0)
+    matrix *m = (matrix *)pool_get(sizeof(matrix));
+    if (!m)
     {
       return -2;
     }
-
-
-    for (int r = 0; r< mat1->rows; r++)
+    void **row_ptrs = (void **)malloc(sizeof(void *) * rows);
+    if (!row_ptrs)
     {
-        for (int c = 0; c < mat2->cols; c++)
-        {
-          
-          double tmp = 0;
-          for (int e=0;  e<mat1->cols; e++)
-          {
-            tmp +=  mat1_shadow->data[r][e] * mat2_shadow->data[e][c];
-          }
-          result -> data[r][c] = tmp;
-        }
+      pool_put(m, sizeof(matrix));
+      return -2;
+    }
+    char *base = (char *)matrix_entries(from);
+    for (int r = 0; r < rows; r++)
+    {
+      row_ptrs[r] = base + (size_t)r * cols * elem;
     }
 
-    deallocate_matrix(mat1_shadow);
-    deallocate_matrix(mat2_shadow);
-
+    m->data = from->dtype == DTYPE_FLOAT64 ? (double **)row_ptrs : NULL;
+    m->fdata = from->dtype == DTYPE_FLOAT32 ? (float **)row_ptrs : NULL;
+    m->rows = rows;
+    m->cols = cols;
+    m->dtype = from->dtype;
+    m->acc_f64 = from->acc_f64;
+    m->is_1d = rows == 1 || cols == 1;
+    m->is_inline = 0;
+    m->ref_cnt = 1;
+    m->parent = from;
+    m->map = NULL;
+    m->map_size = 0;
+    m->release = NULL;
+    m->owner = NULL;
+    m->buf = NULL;
+    m->transposed = 0;
+    from->ref_cnt++;
+    *mat = m;
     return 0;
 }
 
 /*
- * Store the result of raising mat to the (pow)th power to `result`.
- * Return 0 upon success and a nonzero value upon failure.
- * Remember that pow is defined with matrix multiplication, not element-wise multiplication.
+ * Make *mat a copy of `from` that shares its entries until either of them is written: writers
+ * call unshare_matrix first, which gives the matrix written a copy of its own. The entries
+ * are counted in a matrix_buffer made on the first share. Matrices that cannot share (see
+ * matrix_buffer) are copied right away.
+ * Return 0 upon success and -2 if allocation fails.
  */
-int pow_matrix(matrix *result, matrix *mat, int pow) {
-    /* TODO: YOUR CODE HERE */
-
-
-    if (mat->cols != mat->rows)
+int share_matrix(matrix **mat, matrix *from) {
+    if (from->parent || from->ref_cnt != 1 || from->is_inline || from->map || from->release)
     {
-      return -1;
+      int ret = allocate_matrix_dtype(mat, from->rows, from->cols, from->dtype);
+      if (ret == 0)
+      {
+        copy_matrix(*mat, from);
+        (*mat)->acc_f64 = from->acc_f64;
+        (*mat)->is_1d = from->is_1d;
+      }
+      return ret;
     }
 
-    //Identity matrix
-    for (int r= 0; r<mat->rows; r++)
+    if (!from->buf)
     {
-      for (int c= 0; c<mat->cols; c++)
+      matrix_buffer *buf = (matrix_buffer *)malloc(sizeof(matrix_buffer));
+      if (!buf)
       {
-        result->data[r][c] = r==c ? 1: 0;
+        return -2;
       }
+      buf->ref_cnt = 1;
+      buf->data = matrix_entries(from);
+      from->buf = buf;
     }
-
-
-    if (pow > 0)
+    int ret = wrap_data(mat, from->buf->data, from->rows, from->cols, from->cols, from->dtype);
+    if (ret != 0)
     {
-       for(int i=0; i<pow; i++)
-       {
-           mul_matrix(result, result, mat);
-       }
+      return ret;
     }
-
+    (*mat)->acc_f64 = from->acc_f64;
+    (*mat)->is_1d = from->is_1d;
+    (*mat)->buf = from->buf;
+    #pragma omp atomic update
+    from->buf->ref_cnt++;
     return 0;
 }
 
 /*
- * Store the result of element-wise negating mat's entries to `result`.
+ * Give `mat` entries of its own if it shares them with copies made by share_matrix, before it
+ * is written. The last matrix left on a buffer just takes the entries over.
+ * Return 0 upon success and -2 if allocation fails, in which case `mat` must not be written.
+ */
+int unshare_matrix(matrix *mat) {
+    matrix_buffer *buf = mat->buf;
+    if (!buf)
+    {
+      return 0;
+    }
+    int users;
+    #pragma omp atomic read
+    users = buf->ref_cnt;
+    if (users > 1)
+    {
+      size_t elem_size = mat->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+      size_t row_size = (size_t)mat->cols * elem_size;
+      char *data = (char *)malloc((size_t)mat->rows * row_size);
+      if (!data)
+      {
+        return -2;
+      }
+      TRACE_BEGIN(t_alloc);
+      memcpy(data, buf->data, (size_t)mat->rows * row_size);
+      for (int i = 0; i < mat->rows; i++)
+      {
+        if (mat->dtype == DTYPE_FLOAT32)
+        {
+          mat->fdata[i] = (float *)(data + i * row_size);
+        }
+        else
+        {
+          mat->data[i] = (double *)(data + i * row_size);
+        }
+      }
+      TRACE_END(t_alloc, "unshare_matrix", "alloc", mat->rows, mat->cols);
+      #pragma omp atomic capture
+      users = --buf->ref_cnt;
+      if (users > 0)
+      {
+        buf = NULL;
+      }
+    }
+    // The others let go while the entries were copied, or there were none to begin with
+    if (buf)
+    {
+      if (matrix_entries(mat) != buf->data)
+      {
+        free(buf->data);
+      }
+      free(buf);
+    }
+    mat->buf = NULL;
+    return 0;
+}
+
+/*
+ * Let go of one use of `buf`, freeing the entries with the last one.
+ */
+static void release_buffer(matrix_buffer *buf) {
+    int users;
+    #pragma omp atomic capture
+    users = --buf->ref_cnt;
+    if (users == 0)
+    {
+      free(buf->data);
+      free(buf);
+    }
+}
+
+/*
+ * Keep the entries `mat` has now allocated for an operation that reads or writes them without
+ * the GIL, while other threads may copy and write `mat`. Writing `mat` moves it to entries of
+ * its own if it shares them, and the old ones go with the last copy; the pin counts as one
+ * more user of them, so they stay until unpin_matrix. `mat` also counts as having a view
+ * meanwhile, so copies made of it are copied right away instead of starting to share.
+ * Return the buffer to pass to unpin_matrix. Does nothing if `mat` is NULL.
+ */
+matrix_buffer *pin_matrix(matrix *mat) {
+    if (!mat)
+    {
+      return NULL;
+    }
+    #pragma omp atomic update
+    mat->ref_cnt++;
+    matrix_buffer *buf = mat->buf;
+    if (buf)
+    {
+      #pragma omp atomic update
+      buf->ref_cnt++;
+    }
+    return buf;
+}
+
+/*
+ * End the pin_matrix call on `mat` that returned `pin`.
+ */
+void unpin_matrix(matrix *mat, matrix_buffer *pin) {
+    if (!mat)
+    {
+      return;
+    }
+    if (pin)
+    {
+      release_buffer(pin);
+    }
+    #pragma omp atomic update
+    mat->ref_cnt--;
+}
+
+/*
+ * This function will be called automatically by Python when a numc matrix loses all of its
+ * reference pointers.
+ * You need to make sure that you only free `mat->data` if no other existing matrices are also
+ * referring this data array.
+ * See the spec for more information.
+ */
+void deallocate_matrix(matrix *mat) {
+    /* TODO: YOUR CODE HERE */
+    if (!mat)
+    {
+      return;
+    }
+
+    if (mat->parent)
+    {
+      // A slice only owns its row pointers; the data belongs to the parent. Slices of slices
+      // and transposes of transposes keep their parent alive.
+      if (--mat->ref_cnt > 0)
+      {
+        return;
+      }
+      deallocate_matrix(mat->parent);
+      free(mat->data);
+      free(mat->fdata);
+      pool_put(mat, sizeof(matrix));
+      return;
+    }
+
+    mat->ref_cnt--;
+    if (mat->ref_cnt == 0 && mat->is_inline)
+    {
+      pool_put(mat, inline_size(mat->rows, mat->cols, mat->dtype));
+    }
+    else if (mat->ref_cnt == 0 && (mat->map || mat->release))
+    {
+      if (mat->map)
+      {
+        munmap(mat->map, mat->map_size);
+      }
+      if (mat->release)
+      {
+        mat->release(mat->owner);
+      }
+      free(mat->data);
+      free(mat->fdata);
+      pool_put(mat, sizeof(matrix));
+    }
+    else if (mat->ref_cnt == 0 && mat->buf)
+    {
+      release_buffer(mat->buf);
+      free(mat->data);
+      free(mat->fdata);
+      pool_put(mat, sizeof(matrix));
+    }
+    else if (mat->ref_cnt == 0)
+    {
+      if (mat->dtype == DTYPE_FLOAT32)
+      {
+        free(mat->fdata[0]);
+      }
+      else
+      {
+        free(mat->data[0]);
+      }
+      free(mat->data);
+      free(mat->fdata);
+      pool_put(mat, sizeof(matrix));
+    }
+}
+
+/*
+ * Return the double value of the matrix at the given row and column.
+ * You may assume `row` and `col` are valid.
+ */
+double get(matrix *mat, int row, int col) {
+    /* TODO: YOUR CODE HERE */
+    if (mat->transposed)
+    {
+      int t = row;
+      row = col;
+      col = t;
+    }
+    if (mat->dtype == DTYPE_FLOAT32)
+    {
+      return mat->fdata[row][col];
+    }
+    return mat->data[row][col];
+}
+
+/*
+ * Set the value at the given row and column to val. You may assume `row` and
+ * `col` are valid
+ */
+void set(matrix *mat, int row, int col, double val) {
+    /* TODO: YOUR CODE HERE */
+    if (mat->buf && unshare_matrix(mat) != 0)
+    {
+      return;
+    }
+    if (mat->transposed)
+    {
+      int t = row;
+      row = col;
+      col = t;
+    }
+    if (mat->dtype == DTYPE_FLOAT32)
+    {
+      mat->fdata[row][col] = (float)val;
+    }
+    else
+    {
+      mat->data[row][col] = val;
+    }
+}
+
+/*
+ * Set all entries in mat to val
+ */
+void fill_matrix(matrix *mat, double val) {
+    /* TODO: YOUR CODE HERE */
+    if (unshare_matrix(mat) != 0)
+    {
+      return;
+    }
+    // Transposed views are filled along their row pointers, a column at a time
+    int rows = mat->transposed ? mat->cols : mat->rows;
+    int cols = mat->transposed ? mat->rows : mat->cols;
+    #pragma omp parallel if ((long long)rows * cols >= matrix_tune.par_elem)
+    {
+      TRACE_BEGIN(t_tile);
+      int tile_rows = 0;
+      #pragma omp for nowait
+      for (int r = 0; r< rows; r++)
+      {
+          if (mat->dtype == DTYPE_FLOAT32)
+          {
+            kernels->fill_f32(mat->fdata[r], (float)val, cols);
+          }
+          else
+          {
+            kernels->fill(mat->data[r], val, cols);
+          }
+          tile_rows++;
+      }
+      TRACE_END(t_tile, "fill_matrix.tile", "thread", tile_rows, cols);
+    }
+}
+
+/*
+ * Fully unrolled kernels for 2x2, 3x3, 4x4 and 8x8 matrices, where the general loops, the
+ * parallel region setup and the shadow copies cost more than the arithmetic. N is a compile
+ * time constant, so the compiler unrolls the loops and keeps the operands in registers.
+ * Products are formed in a local array before they are stored, so the output may alias
+ * the inputs.
+ */
+#define TINY_MUL(N, T, dst, x, y)                                              \
+    for (int i = 0; i < N; i++)                                                \
+      for (int j = 0; j < N; j++)                                              \
+      {                                                                        \
+        T sum = 0;                                                             \
+        for (int k = 0; k < N; k++)                                            \
+          sum += (x)[i][k] * (y)[k][j];                                        \
+        (dst)[i][j] = sum;                                                     \
+      }
+
+#define DEFINE_TINY_KERNELS(N, T, S)                                           \
+static void tiny_add_##N##S(T **c, T **a, T **b) {                             \
+    for (int i = 0; i < N; i++)                                                \
+      for (int j = 0; j < N; j++)                                              \
+        c[i][j] = a[i][j] + b[i][j];                                           \
+}                                                                              \
+                                                                               \
+static void tiny_abs_##N##S(T **c, T **a) {                                    \
+    for (int i = 0; i < N; i++)                                                \
+      for (int j = 0; j < N; j++)                                              \
+        c[i][j] = a[i][j] < 0 ? -a[i][j] : a[i][j];                            \
+}                                                                              \
+                                                                               \
+static void tiny_mul_##N##S(T **c, T **a, T **b) {                             \
+    T t[N][N];                                                                 \
+    TINY_MUL(N, T, t, a, b)                                                    \
+    for (int i = 0; i < N; i++)                                                \
+      for (int j = 0; j < N; j++)                                              \
+        c[i][j] = t[i][j];                                                     \
+}                                                                              \
+                                                                               \
+/* Binary exponentiation: log2(pow) squarings instead of pow products */       \
+static void tiny_pow_##N##S(T **c, T **a, int pow) {                           \
+    T base[N][N], acc[N][N], t[N][N];                                          \
+    for (int i = 0; i < N; i++)                                                \
+      for (int j = 0; j < N; j++)                                              \
+      {                                                                        \
+        base[i][j] = a[i][j];                                                  \
+        acc[i][j] = i == j;                                                    \
+      }                                                                        \
+    while (pow > 0)                                                            \
+    {                                                                          \
+      if (pow & 1)                                                             \
+      {                                                                        \
+        TINY_MUL(N, T, t, acc, base)                                           \
+        memcpy(acc, t, sizeof(t));                                             \
+      }                                                                        \
+      pow >>= 1;                                                               \
+      if (pow > 0)                                                             \
+      {                                                                        \
+        TINY_MUL(N, T, t, base, base)                                          \
+        memcpy(base, t, sizeof(t));                                            \
+      }                                                                        \
+    }                                                                          \
+    for (int i = 0; i < N; i++)                                                \
+      for (int j = 0; j < N; j++)                                              \
+        c[i][j] = acc[i][j];                                                   \
+}
+
+DEFINE_TINY_KERNELS(2, double, )
+DEFINE_TINY_KERNELS(3, double, )
+DEFINE_TINY_KERNELS(4, double, )
+DEFINE_TINY_KERNELS(8, double, )
+DEFINE_TINY_KERNELS(2, float, _f32)
+DEFINE_TINY_KERNELS(3, float, _f32)
+DEFINE_TINY_KERNELS(4, float, _f32)
+DEFINE_TINY_KERNELS(8, float, _f32)
+
+typedef struct tiny_kernels {
+    int n;
+    void (*add)(double **c, double **a, double **b);
+    void (*abs)(double **c, double **a);
+    void (*mul)(double **c, double **a, double **b);
+    void (*pow)(double **c, double **a, int pow);
+    void (*add_f32)(float **c, float **a, float **b);
+    void (*abs_f32)(float **c, float **a);
+    void (*mul_f32)(float **c, float **a, float **b);
+    void (*pow_f32)(float **c, float **a, int pow);
+} tiny_kernels;
+
+#define TINY_ENTRY(N)                                                          \
+    {N, tiny_add_##N, tiny_abs_##N, tiny_mul_##N, tiny_pow_##N,                \
+     tiny_add_##N##_f32, tiny_abs_##N##_f32, tiny_mul_##N##_f32, tiny_pow_##N##_f32}
+
+static const tiny_kernels tiny_table[] = {TINY_ENTRY(2), TINY_ENTRY(3), TINY_ENTRY(4), TINY_ENTRY(8)};
+
+/*
+ * Return the tiny kernels for `mat` if it is one of the fixed square sizes, otherwise NULL.
+ */
+static const tiny_kernels *find_tiny(matrix *mat) {
+    if (mat->rows != mat->cols)
+    {
+      return NULL;
+    }
+    for (int i = 0; i < (int)(sizeof(tiny_table) / sizeof(tiny_table[0])); i++)
+    {
+      if (tiny_table[i].n == mat->rows)
+      {
+        return &tiny_table[i];
+      }
+    }
+    return NULL;
+}
+
+/* Entries per side of the square blocks copy_rows transposes at a time */
+#define TRANSPOSE_BLOCK 64
+
+/*
+ * Copy the `rows` x `cols` entries under the row pointers `src` to those under `dst`, turned
+ * across if `across` is set (dst[j][i] = src[i][j]). Transposes go in square blocks that fit
+ * the cache, each moved by the transpose kernel and split over the threads.
+ */
+static void copy_rows(void **dst, void **src, int rows, int cols, int dtype, int across) {
+    size_t elem_size = dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    if (!across)
+    {
+      #pragma omp parallel for if ((long long)rows * cols >= matrix_tune.par_elem)
+      for (int r = 0; r < rows; r++)
+      {
+          memcpy(dst[r], src[r], elem_size * cols);
+      }
+      return;
+    }
+
+    int row_blocks = (rows + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+    int col_blocks = (cols + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+    #pragma omp parallel if ((long long)rows * cols >= matrix_tune.par_elem)
+    {
+      TRACE_BEGIN(t_tile);
+      int tile_rows = 0;
+      #pragma omp for schedule(static) nowait
+      for (int b = 0; b < row_blocks * col_blocks; b++)
+      {
+          int i0 = b / col_blocks * TRANSPOSE_BLOCK;
+          int j0 = b % col_blocks * TRANSPOSE_BLOCK;
+          int n = rows - i0 < TRANSPOSE_BLOCK ? rows - i0 : TRANSPOSE_BLOCK;
+          int m = cols - j0 < TRANSPOSE_BLOCK ? cols - j0 : TRANSPOSE_BLOCK;
+          if (dtype == DTYPE_FLOAT32)
+          {
+            kernels->transpose_f32((float **)dst + j0, i0, (float **)src + i0, j0, n, m);
+          }
+          else
+          {
+            kernels->transpose((double **)dst + j0, i0, (double **)src + i0, j0, n, m);
+          }
+          tile_rows += n;
+      }
+      TRACE_END(t_tile, "copy_rows.tile", "thread", tile_rows, TRANSPOSE_BLOCK);
+    }
+}
+
+/*
+ * The row pointers of `mat`, whichever its dtype.
+ */
+static void **row_pointers(matrix *mat) {
+    return mat->dtype == DTYPE_FLOAT32 ? (void **)mat->fdata : (void **)mat->data;
+}
+
+int copy_matrix(matrix * result, matrix* mat)
+{
+  if (!result || !mat)
+  {
+    return -2;
+  }
+
+  if (result->cols != mat->cols || result->rows != mat->rows)
+  {
+    return -1;
+  }
+  if (result->buf && result->buf == mat->buf && result->dtype == mat->dtype)
+  {
+    return 0;  // copies of each other already
+  }
+  if (unshare_matrix(result) != 0)
+  {
+    return -2;
+  }
+
+  if (result->transposed || mat->transposed)
+  {
+    if (result->dtype == mat->dtype)
+    {
+      copy_rows(row_pointers(result), row_pointers(mat), mat->transposed ? mat->cols : mat->rows,
+                mat->transposed ? mat->rows : mat->cols, mat->dtype,
+                result->transposed != mat->transposed);
+      return 0;
+    }
+    // Converting across at the same time is rare enough to go an entry at a time
+    #pragma omp parallel for if ((long long)mat->rows * mat->cols >= matrix_tune.par_elem)
+    for (int r = 0; r < mat->rows; r++)
+    {
+        for (int c = 0; c < mat->cols; c++)
+        {
+          set(result, r, c, get(mat, r, c));
+        }
+    }
+    return 0;
+  }
+
+  #pragma omp parallel for if ((long long)mat->rows * mat->cols >= matrix_tune.par_elem)
+  for (int r = 0; r< mat->rows; r++)
+  {
+      if (result->dtype == mat->dtype && mat->dtype == DTYPE_FLOAT32)
+      {
+        memcpy(result->fdata[r], mat->fdata[r], sizeof(float) * mat->cols);
+      }
+      else if (result->dtype == mat->dtype)
+      {
+        memcpy(result->data[r], mat->data[r], sizeof(double) * mat->cols);
+      }
+      else if (result->dtype == DTYPE_FLOAT32)
+      {
+        kernels->f64_to_f32(result->fdata[r], mat->data[r], mat->cols);
+      }
+      else
+      {
+        kernels->f32_to_f64(result->data[r], mat->fdata[r], mat->cols);
+      }
+  }
+  return 0;
+
+}
+
+/*
+ * The matrix whose entries `mat` reads, following the parents of slices and views.
+ */
+static matrix *matrix_root(matrix *mat) {
+    while (mat->parent)
+    {
+      mat = mat->parent;
+    }
+    return mat;
+}
+
+/*
+ * Store the transpose of `mat` to `result`. Either may be a transposed view, so transposing
+ * a view of a transposed matrix is a plain copy. `result` must not read the entries of `mat`.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int transpose_matrix(matrix *result, matrix *mat) {
+    if (result->rows != mat->cols || result->cols != mat->rows || result->dtype != mat->dtype ||
+        matrix_root(result) == matrix_root(mat))
+    {
+      return -1;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+
+    TRACE_BEGIN(t_compute);
+    copy_rows(row_pointers(result), row_pointers(mat), mat->transposed ? mat->cols : mat->rows,
+              mat->transposed ? mat->rows : mat->cols, mat->dtype,
+              result->transposed == mat->transposed);
+    TRACE_END(t_compute, "transpose_matrix", "compute", mat->rows, mat->cols);
+    return 0;
+}
+
+/*
+ * Store a row-major copy of `mat` to *dense if it is a transposed view, for the operations
+ * that read whole rows, or NULL if `mat` can be read as it is. The caller deallocates *dense.
+ * Return 0 upon success and -2 if allocation fails.
+ */
+int dense_matrix(matrix **dense, matrix *mat) {
+    *dense = NULL;
+    if (!mat->transposed)
+    {
+      return 0;
+    }
+    if (allocate_matrix_dtype(dense, mat->rows, mat->cols, mat->dtype) != 0)
+    {
+      *dense = NULL;
+      return -2;
+    }
+    copy_matrix(*dense, mat);
+    (*dense)->acc_f64 = mat->acc_f64;
+    (*dense)->is_1d = mat->is_1d;
+    return 0;
+}
+
+/*
+ * Replace whichever of *mat1 and *mat2 are transposed views with row-major copies (see
+ * dense_matrix), stored to *tmp1 and *tmp2 for the caller to deallocate.
+ * Return 0 upon success and -2 if allocation fails.
+ */
+static int dense_operands(matrix **mat1, matrix **mat2, matrix **tmp1, matrix **tmp2) {
+    *tmp2 = NULL;
+    if (dense_matrix(tmp1, *mat1) != 0 || dense_matrix(tmp2, *mat2) != 0)
+    {
+      return -2;
+    }
+    *mat1 = *tmp1 ? *tmp1 : *mat1;
+    *mat2 = *tmp2 ? *tmp2 : *mat2;
+    return 0;
+}
+
+/*
+ * Store the result of adding mat1 and mat2 to `result`.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int add_matrix(matrix *result, matrix *mat1, matrix *mat2) {
+    /* TODO: YOUR CODE HERE */
+
+    //REVISIT: not considering broadcasting
+
+    if (mat1->cols != mat2->cols || mat1->rows != mat2->rows ||
+        result->rows != mat1->rows || result->cols != mat1->cols ||
+        mat1->dtype != mat2->dtype || result->dtype != mat1->dtype || result->transposed)
+    {
+      return -1;
+    }
+    if (mat1->transposed || mat2->transposed)
+    {
+      matrix *tmp1, *tmp2;
+      int ret = dense_operands(&mat1, &mat2, &tmp1, &tmp2);
+      if (ret == 0)
+      {
+        ret = add_matrix(result, mat1, mat2);
+      }
+      deallocate_matrix(tmp1);
+      deallocate_matrix(tmp2);
+      return ret;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+
+    const tiny_kernels *tiny = find_tiny(mat1);
+    if (tiny)
+    {
+      TRACE_BEGIN(t_compute);
+      if (mat1->dtype == DTYPE_FLOAT32)
+      {
+        tiny->add_f32(result->fdata, mat1->fdata, mat2->fdata);
+      }
+      else
+      {
+        tiny->add(result->data, mat1->data, mat2->data);
+      }
+      TRACE_END(t_compute, "add_matrix", "compute", mat1->rows, mat1->cols);
+      return 0;
+    }
+
+    TRACE_BEGIN(t_compute);
+    #pragma omp parallel if ((long long)mat1->rows * mat1->cols >= matrix_tune.par_elem)
+    {
+      TRACE_BEGIN(t_tile);
+      int tile_rows = 0;
+      #pragma omp for nowait
+      for (int r = 0; r< mat1->rows; r++)
+      {
+          if (mat1->dtype == DTYPE_FLOAT32)
+          {
+            kernels->add_f32(result->fdata[r], mat1->fdata[r], mat2->fdata[r], mat1->cols);
+          }
+          else
+          {
+            kernels->add(result->data[r], mat1->data[r], mat2->data[r], mat1->cols);
+          }
+          tile_rows++;
+      }
+      TRACE_END(t_tile, "add_matrix.tile", "thread", tile_rows, mat1->cols);
+    }
+    TRACE_END(t_compute, "add_matrix", "compute", mat1->rows, mat1->cols);
+
+    return 0;
+}
+
+/*
+ * Store the result of subtracting mat2 from mat1 to `result`.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int sub_matrix(matrix *result, matrix *mat1, matrix *mat2) {
+    /* TODO: YOUR CODE HERE */
+    if (mat1->cols != mat2->cols || mat1->rows != mat2->rows ||
+        result->rows != mat1->rows || result->cols != mat1->cols ||
+        mat1->dtype != mat2->dtype || result->dtype != mat1->dtype || result->transposed)
+    {
+      return -1;
+    }
+    if (mat1->transposed || mat2->transposed)
+    {
+      matrix *tmp1, *tmp2;
+      int ret = dense_operands(&mat1, &mat2, &tmp1, &tmp2);
+      if (ret == 0)
+      {
+        ret = sub_matrix(result, mat1, mat2);
+      }
+      deallocate_matrix(tmp1);
+      deallocate_matrix(tmp2);
+      return ret;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+
+    TRACE_BEGIN(t_compute);
+    #pragma omp parallel if ((long long)mat1->rows * mat1->cols >= matrix_tune.par_elem)
+    {
+      TRACE_BEGIN(t_tile);
+      int tile_rows = 0;
+      #pragma omp for nowait
+      for (int r = 0; r< mat1->rows; r++)
+      {
+          if (mat1->dtype == DTYPE_FLOAT32)
+          {
+            kernels->sub_f32(result->fdata[r], mat1->fdata[r], mat2->fdata[r], mat1->cols);
+          }
+          else
+          {
+            kernels->sub(result->data[r], mat1->data[r], mat2->data[r], mat1->cols);
+          }
+          tile_rows++;
+      }
+      TRACE_END(t_tile, "sub_matrix.tile", "thread", tile_rows, mat1->cols);
+    }
+    TRACE_END(t_compute, "sub_matrix", "compute", mat1->rows, mat1->cols);
+
+    return 0;
+}
+
+/*
+ * Shapes of the register-blocked micro kernels, in the order of
+ * matrix_kernels.micro.
+ */
+static const int micro_shapes[MICRO_KERNELS][2] = {{2, 8}, {4, 4}, {4, 8}, {8, 4}};
+
+/*
+ * Return whether there is a micro kernel of shape micro_m x micro_n.
+ */
+int mul_micro_supported(int micro_m, int micro_n) {
+  for (int i = 0; i < MICRO_KERNELS; i++)
+  {
+    if (micro_shapes[i][0] == micro_m && micro_shapes[i][1] == micro_n)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Scalar fallback for the ragged edges that do not fill a whole micro kernel.
+ */
+static void micro_edge(double **c, double **a, double **b, int r0, int r1,
+                       int c0, int c1, int k0, int k1) {
+  for (int r = r0; r < r1; r++)
+  {
+    for (int k = k0; k < k1; k++)
+    {
+      double ark = a[r][k];
+      for (int col = c0; col < c1; col++)
+      {
+        c[r][col] += ark * b[k][col];
+      }
+    }
+  }
+}
+
+static void micro_edge_f32(float **c, float **a, float **b, int r0, int r1,
+                           int c0, int c1, int k0, int k1) {
+  for (int r = r0; r < r1; r++)
+  {
+    for (int k = k0; k < k1; k++)
+    {
+      float ark = a[r][k];
+      for (int col = c0; col < c1; col++)
+      {
+        c[r][col] += ark * b[k][col];
+      }
+    }
+  }
+}
+
+/*
+ * Accumulate one cache block c[r0:r1, c0:c1] += a[r0:r1, k0:k1] * b[k0:k1, c0:c1].
+ */
+static void mul_block(double **c, double **a, double **b, int r0, int r1, int c0, int c1,
+                      int k0, int k1, int mm, int nn, micro_kernel micro) {
+  int r = r0;
+  for (; r + mm <= r1; r += mm)
+  {
+    int col = c0;
+    for (; col + nn <= c1; col += nn)
+    {
+      micro(c, a, b, r, col, k0, k1);
+    }
+    if (col < c1)
+    {
+      micro_edge(c, a, b, r, r + mm, col, c1, k0, k1);
+    }
+  }
+  if (r < r1)
+  {
+    micro_edge(c, a, b, r, r1, c0, c1, k0, k1);
+  }
+}
+
+static void mul_block_f32(float **c, float **a, float **b, int r0, int r1, int c0, int c1,
+                          int k0, int k1, int mm, int nn, micro_kernel_f32 micro) {
+  int r = r0;
+  for (; r + mm <= r1; r += mm)
+  {
+    int col = c0;
+    for (; col + nn <= c1; col += nn)
+    {
+      micro(c, a, b, r, col, k0, k1);
+    }
+    if (col < c1)
+    {
+      micro_edge_f32(c, a, b, r, r + mm, col, c1, k0, k1);
+    }
+  }
+  if (r < r1)
+  {
+    micro_edge_f32(c, a, b, r, r1, c0, c1, k0, k1);
+  }
+}
+
+static void micro_edge_mixed(double **c, float **a, float **b, int r0, int r1,
+                             int c0, int c1, int k0, int k1) {
+  for (int r = r0; r < r1; r++)
+  {
+    for (int k = k0; k < k1; k++)
+    {
+      double ark = a[r][k];
+      for (int col = c0; col < c1; col++)
+      {
+        c[r][col] += ark * (double)b[k][col];
+      }
+    }
+  }
+}
+
+static void mul_block_mixed(double **c, float **a, float **b, int r0, int r1, int c0, int c1,
+                            int k0, int k1, int mm, int nn, micro_kernel_mixed micro) {
+  int r = r0;
+  for (; r + mm <= r1; r += mm)
+  {
+    int col = c0;
+    for (; col + nn <= c1; col += nn)
+    {
+      micro(c, a, b, r, col, k0, k1);
+    }
+    if (col < c1)
+    {
+      micro_edge_mixed(c, a, b, r, r + mm, col, c1, k0, k1);
+    }
+  }
+  if (r < r1)
+  {
+    micro_edge_mixed(c, a, b, r, r1, c0, c1, k0, k1);
+  }
+}
+
+/*
+ * mul_block and its variants for operands of which one or both are transposed views. The
+ * block of each such operand is first turned the right way round into `scratch` with the
+ * transpose kernel, and all three matrices are addressed through row pointers relative to
+ * the block, so transposed operands are never copied whole.
+ */
+static void mul_block_packed(matrix *result, matrix *mat1, matrix *mat2, int r0, int r1,
+                             int c0, int c1, int k0, int k1, const tune_params *tune,
+                             int shape, char *scratch) {
+    int m = r1 - r0, n = c1 - c0, k = k1 - k0;
+    int is_f32 = mat1->dtype == DTYPE_FLOAT32;
+    size_t elem = is_f32 ? sizeof(float) : sizeof(double);
+    size_t res_elem = result->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    void **c = (void **)scratch;
+    void **a = c + tune->tile_m;
+    void **b = a + tune->tile_m;
+    char *a_pack = (char *)(b + tune->tile_k);
+    char *b_pack = a_pack + elem * tune->tile_m * tune->tile_k;
+    void **rows = row_pointers(result), **rows1 = row_pointers(mat1), **rows2 = row_pointers(mat2);
+
+    for (int i = 0; i < m; i++)
+    {
+      c[i] = (char *)rows[r0 + i] + c0 * res_elem;
+      a[i] = mat1->transposed ? a_pack + (size_t)i * k * elem : (char *)rows1[r0 + i] + k0 * elem;
+    }
+    for (int i = 0; i < k; i++)
+    {
+      b[i] = mat2->transposed ? b_pack + (size_t)i * n * elem : (char *)rows2[k0 + i] + c0 * elem;
+    }
+    // Column r of a transposed mat1 is its row pointer r, and likewise for mat2
+    if (mat1->transposed && is_f32)
+    {
+      kernels->transpose_f32((float **)a, 0, (float **)rows1 + k0, r0, k, m);
+    }
+    else if (mat1->transposed)
+    {
+      kernels->transpose((double **)a, 0, (double **)rows1 + k0, r0, k, m);
+    }
+    if (mat2->transposed && is_f32)
+    {
+      kernels->transpose_f32((float **)b, 0, (float **)rows2 + c0, k0, n, k);
+    }
+    else if (mat2->transposed)
+    {
+      kernels->transpose((double **)b, 0, (double **)rows2 + c0, k0, n, k);
+    }
+
+    if (result->dtype == DTYPE_FLOAT32)
+    {
+      mul_block_f32((float **)c, (float **)a, (float **)b, 0, m, 0, n, 0, k,
+                    tune->micro_m, tune->micro_n, kernels->micro_f32[shape]);
+    }
+    else if (is_f32)
+    {
+      mul_block_mixed((double **)c, (float **)a, (float **)b, 0, m, 0, n, 0, k,
+                      tune->micro_m, tune->micro_n, kernels->micro_mixed[shape]);
+    }
+    else
+    {
+      mul_block((double **)c, (double **)a, (double **)b, 0, m, 0, n, 0, k,
+                tune->micro_m, tune->micro_n, kernels->micro[shape]);
+    }
+}
+
+/*
+ * Blocked, parallel result = mat1 * mat2 without any checks. The operands must not alias
+ * `result`. A float64 result with float32 operands accumulates in float64. Transposed
+ * operands are packed a block at a time (see mul_block_packed) into scratch space per thread.
+ * The blocking factors and parallel cutoff come from `params`.
+ * Return 0 upon success and -2 if the scratch space cannot be allocated.
+ */
+static int mul_tiles(matrix *result, matrix *mat1, matrix *mat2, const tune_params *params) {
+    tune_params tune = *params;
+    if (!mul_micro_supported(tune.micro_m, tune.micro_n))
+    {
+      tune.micro_m = 4;
+      tune.micro_n = 8;
+    }
+    int shape = 0;
+    while (micro_shapes[shape][0] != tune.micro_m || micro_shapes[shape][1] != tune.micro_n)
+    {
+      shape++;
+    }
+    int is_f32 = result->dtype == DTYPE_FLOAT32;
+    int is_mixed = !is_f32 && mat1->dtype == DTYPE_FLOAT32;
+
+    int rows = result->rows;
+    int cols = result->cols;
+    int inner = mat1->cols;
+    int row_tiles = (rows + tune.tile_m - 1) / tune.tile_m;
+
+    int packed = mat1->transposed || mat2->transposed;
+    size_t scratch_size = 0;
+    char *scratch = NULL;
+    if (packed)
+    {
+      size_t elem = mat1->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+      scratch_size = sizeof(void *) * (2 * tune.tile_m + tune.tile_k) +
+                     elem * ((size_t)tune.tile_m * tune.tile_k + (size_t)tune.tile_k * tune.tile_n);
+      scratch = (char *)malloc(scratch_size * omp_get_max_threads());
+      if (!scratch)
+      {
+        return -2;
+      }
+    }
+
+    TRACE_BEGIN(t_compute);
+    fill_matrix(result, 0);
+    #pragma omp parallel if ((long long)rows * cols * inner >= tune.par_mul)
+    {
+      TRACE_BEGIN(t_tile);
+      int tile_rows = 0;
+      char *own = scratch + scratch_size * omp_get_thread_num();
+      #pragma omp for schedule(dynamic) nowait
+      for (int t = 0; t < row_tiles; t++)
+      {
+          int r0 = t * tune.tile_m;
+          int r1 = r0 + tune.tile_m < rows ? r0 + tune.tile_m : rows;
+          for (int c0 = 0; c0 < cols; c0 += tune.tile_n)
+          {
+            int c1 = c0 + tune.tile_n < cols ? c0 + tune.tile_n : cols;
+            for (int k0 = 0; k0 < inner; k0 += tune.tile_k)
+            {
+              int k1 = k0 + tune.tile_k < inner ? k0 + tune.tile_k : inner;
+              if (packed)
+              {
+                mul_block_packed(result, mat1, mat2, r0, r1, c0, c1, k0, k1, &tune, shape, own);
+              }
+              else if (is_f32)
+              {
+                mul_block_f32(result->fdata, mat1->fdata, mat2->fdata, r0, r1, c0, c1,
+                              k0, k1, tune.micro_m, tune.micro_n, kernels->micro_f32[shape]);
+              }
+              else if (is_mixed)
+              {
+                mul_block_mixed(result->data, mat1->fdata, mat2->fdata, r0, r1, c0, c1,
+                                k0, k1, tune.micro_m, tune.micro_n, kernels->micro_mixed[shape]);
+              }
+              else
+              {
+                mul_block(result->data, mat1->data, mat2->data, r0, r1, c0, c1,
+                          k0, k1, tune.micro_m, tune.micro_n, kernels->micro[shape]);
+              }
+            }
+          }
+          tile_rows += r1 - r0;
+      }
+      TRACE_END(t_tile, "mul_matrix.tile", "thread", tile_rows, cols);
+    }
+    TRACE_END(t_compute, "mul_matrix", "compute", rows, cols);
+    free(scratch);
+    return 0;
+}
+
+/*
+ * result = mat1 * mat2 for a single column mat2, one dot product per result row. The vector
+ * is packed first, so mat1 is streamed exactly once and `result` may alias mat2.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+static int mul_gemv(matrix *result, matrix *mat1, matrix *mat2) {
+    int rows = mat1->rows;
+    int inner = mat1->cols;
+    int is_f32 = mat1->dtype == DTYPE_FLOAT32;
+    void *x = malloc((size_t)inner * (is_f32 ? sizeof(float) : sizeof(double)));
+    if (!x)
+    {
+      return -2;
+    }
+    for (int k = 0; k < inner; k++)
+    {
+      if (is_f32)
+      {
+        ((float *)x)[k] = (float)get(mat2, k, 0);
+      }
+      else
+      {
+        ((double *)x)[k] = get(mat2, k, 0);
+      }
+    }
+
+    TRACE_BEGIN(t_compute);
+    #pragma omp parallel if ((long long)rows * inner >= matrix_tune.par_elem)
+    {
+      TRACE_BEGIN(t_tile);
+      int tile_rows = 0;
+      #pragma omp for nowait
+      for (int r = 0; r < rows; r++)
+      {
+          if (is_f32)
+          {
+            result->fdata[r][0] = kernels->dot_f32(mat1->fdata[r], (float *)x, inner);
+          }
+          else
+          {
+            result->data[r][0] = kernels->dot(mat1->data[r], (double *)x, inner);
+          }
+          tile_rows++;
+      }
+      TRACE_END(t_tile, "mul_gemv.tile", "thread", tile_rows, inner);
+    }
+    TRACE_END(t_compute, "mul_gemv", "compute", rows, inner);
+    free(x);
+    return 0;
+}
+
+/* Most result columns per thread chunk of mul_gevm */
+#define GEVM_CHUNK 512
+
+/*
+ * result = mat1 * mat2 for a single row mat1: the rows of mat2 scaled by the entries of mat1
+ * are summed into an accumulator row, which threads split by column ranges. It goes parallel
+ * at the mul_matrix cutoff, with the columns shared evenly when there are too few for every
+ * thread to get GEVM_CHUNK. mat2 is streamed once and the accumulator is copied out at the
+ * end, so `result` may alias either operand.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+static int mul_gevm(matrix *result, matrix *mat1, matrix *mat2) {
+    int inner = mat2->rows;
+    int cols = mat2->cols;
+    int is_f32 = mat1->dtype == DTYPE_FLOAT32;
+    size_t elem = is_f32 ? sizeof(float) : sizeof(double);
+    char *x = (char *)malloc((size_t)inner * elem);
+    char *acc = (char *)malloc((size_t)cols * elem);
+    if (!x || !acc)
+    {
+      free(x);
+      free(acc);
+      return -2;
+    }
+    for (int k = 0; k < inner; k++)
+    {
+      if (is_f32)
+      {
+        ((float *)x)[k] = (float)get(mat1, 0, k);
+      }
+      else
+      {
+        ((double *)x)[k] = get(mat1, 0, k);
+      }
+    }
+
+    TRACE_BEGIN(t_compute);
+    int parallel = (long long)inner * cols >= matrix_tune.par_mul;
+    int threads = parallel ? omp_get_max_threads() : 1;
+    int chunk = (cols + threads - 1) / threads;
+    chunk = chunk < GEVM_CHUNK ? (chunk + 7) / 8 * 8 : GEVM_CHUNK;
+    int chunks = (cols + chunk - 1) / chunk;
+    #pragma omp parallel if (parallel)
+    {
+      TRACE_BEGIN(t_tile);
+      int tile_cols = 0;
+      #pragma omp for nowait
+      for (int t = 0; t < chunks; t++)
+      {
+          int c0 = t * chunk;
+          int n = cols - c0 < chunk ? cols - c0 : chunk;
+          if (is_f32)
+          {
+            float *y = (float *)acc + c0;
+            kernels->fill_f32(y, 0, n);
+            for (int k = 0; k < inner; k++)
+            {
+              kernels->axpy_f32(y, ((float *)x)[k], mat2->fdata[k] + c0, n);
+            }
+          }
+          else
+          {
+            double *y = (double *)acc + c0;
+            kernels->fill(y, 0, n);
+            for (int k = 0; k < inner; k++)
+            {
+              kernels->axpy(y, ((double *)x)[k], mat2->data[k] + c0, n);
+            }
+          }
+          tile_cols += n;
+      }
+      TRACE_END(t_tile, "mul_gevm.tile", "thread", 1, tile_cols);
+    }
+    memcpy(is_f32 ? (void *)result->fdata[0] : (void *)result->data[0], acc, (size_t)cols * elem);
+    TRACE_END(t_compute, "mul_gevm", "compute", inner, cols);
+    free(x);
+    free(acc);
+    return 0;
+}
+
+/*
+ * Store the operand of mul_matrix that mul_tiles reads in place of `mat` to *shadow: a copy
+ * sharing its entries (see share_matrix), or NULL for a transposed view, which mul_tiles packs
+ * a block at a time anyway. Only a transposed view of `result` itself is copied out.
+ * Return 0 upon success and -2 if allocation fails.
+ */
+static int mul_shadow(matrix **shadow, matrix *mat, matrix *result) {
+    *shadow = NULL;
+    if (!mat->transposed)
+    {
+      return share_matrix(shadow, mat);
+    }
+    return matrix_root(mat) == matrix_root(result) ? dense_matrix(shadow, mat) : 0;
+}
+
+/*
+ * Store the result of multiplying mat1 and mat2 to `result`.
+ * Return 0 upon success and a nonzero value upon failure.
+ * Remember that matrix multiplication is not the same as multiplying individual elements.
+ * float32 operands are multiplied with float64 accumulation (see mul_matrix_mixed) if the
+ * result is float64 or either operand has acc_f64 set.
+ */
+int mul_matrix(matrix *result, matrix *mat1, matrix *mat2) {
+    return mul_matrix_acc(result, mat1, mat2, -1);
+}
+
+/*
+ * mul_matrix with the accumulation precision of float32 operands given by `acc`, DTYPE_FLOAT64
+ * or DTYPE_FLOAT32, instead of by their acc_f64. A float64 result always accumulates in
+ * float64. An `acc` of -1 leaves the choice to the operands, as in mul_matrix.
+ */
+int mul_matrix_acc(matrix *result, matrix *mat1, matrix *mat2, int acc) {
+    int acc_f64 = acc == -1 ? mat1->acc_f64 || mat2->acc_f64 : acc == DTYPE_FLOAT64;
+    if (mat1->dtype == DTYPE_FLOAT32 && mat2->dtype == DTYPE_FLOAT32 &&
+        (result->dtype == DTYPE_FLOAT64 || acc_f64))
+    {
+      return mul_matrix_mixed(result, mat1, mat2);
+    }
+
+    if (mat1->cols != mat2->rows || mat1->rows != result->rows || mat2->cols != result->cols ||
+        mat1->dtype != mat2->dtype || result->dtype != mat1->dtype || result->transposed)
+    {
+      return -1;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+
+    const tiny_kernels *tiny = find_tiny(mat1);
+    if (tiny && mat2->rows == mat2->cols && !mat1->transposed && !mat2->transposed)
+    {
+      TRACE_BEGIN(t_compute);
+      if (mat1->dtype == DTYPE_FLOAT32)
+      {
+        tiny->mul_f32(result->fdata, mat1->fdata, mat2->fdata);
+      }
+      else
+      {
+        tiny->mul(result->data, mat1->data, mat2->data);
+      }
+      TRACE_END(t_compute, "mul_matrix", "compute", result->rows, result->cols);
+      return 0;
+    }
+
+    /* Matrix-vector and vector-matrix products skip the blocking and the copies below */
+    if (mat2->cols == 1 && !mat1->transposed)
+    {
+      return mul_gemv(result, mat1, mat2);
+    }
+    if (mat1->rows == 1 && !mat2->transposed)
+    {
+      return mul_gevm(result, mat1, mat2);
+    }
+
+    // Need to consider if mat1 or mat2 are the same point as result. The shadows share the
+    // operands' entries where they can, and result is unshared after, so only an operand
+    // that is also the result (or a slice) is actually copied.
+    matrix* mat1_shadow;
+    matrix* mat2_shadow;
+
+    TRACE_BEGIN(t_pack);
+    if (mul_shadow(&mat1_shadow, mat1, result) != 0)
+    {
+      return -2;
+    }
+    if (mul_shadow(&mat2_shadow, mat2, result) != 0)
+    {
+      deallocate_matrix(mat1_shadow);
+      return -2;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      deallocate_matrix(mat1_shadow);
+      deallocate_matrix(mat2_shadow);
+      return -2;
+    }
+    TRACE_END(t_pack, "mul_matrix.pack", "pack", mat1->rows + mat2->rows, mat1->cols + mat2->cols);
+
+    int ret = mul_tiles(result, mat1_shadow ? mat1_shadow : mat1, mat2_shadow ? mat2_shadow : mat2,
+                        &matrix_tune);
+
+    deallocate_matrix(mat1_shadow);
+    deallocate_matrix(mat2_shadow);
+
+    return ret;
+}
+
+/*
+ * Store the product of the float32 matrices mat1 and mat2 to `result`, which may be float32 or
+ * float64, accumulating every dot product in float64. The operands are read as they are, so
+ * only a float32 result pays for a float64 scratch matrix (which also makes aliasing safe).
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int mul_matrix_mixed(matrix *result, matrix *mat1, matrix *mat2) {
+    if (mat1->cols != mat2->rows || mat1->rows != result->rows || mat2->cols != result->cols ||
+        mat1->dtype != DTYPE_FLOAT32 || mat2->dtype != DTYPE_FLOAT32 || result->transposed)
+    {
+      return -1;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+
+    if (result->dtype == DTYPE_FLOAT64)
+    {
+      return mul_tiles(result, mat1, mat2, &matrix_tune);
+    }
+
+    matrix *acc;
+    if (allocate_matrix(&acc, result->rows, result->cols) != 0)
+    {
+      return -2;
+    }
+    int ret = mul_tiles(acc, mat1, mat2, &matrix_tune);
+    if (ret == 0)
+    {
+      copy_matrix(result, acc);
+    }
+    deallocate_matrix(acc);
+    return ret;
+}
+
+/*
+ * Blocked result = mat1 * mat2 with the parameters in `tune` instead of matrix_tune, so
+ * candidates can be timed without publishing them to other threads. The operands must be
+ * dense float64 matrices that do not alias `result`.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int mul_matrix_tuned(matrix *result, matrix *mat1, matrix *mat2, const tune_params *tune) {
+    if (mat1->cols != mat2->rows || mat1->rows != result->rows || mat2->cols != result->cols ||
+        mat1->dtype != DTYPE_FLOAT64 || mat2->dtype != DTYPE_FLOAT64 ||
+        result->dtype != DTYPE_FLOAT64 || result->transposed || result == mat1 || result == mat2)
+    {
+      return -1;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+    return mul_tiles(result, mat1, mat2, tune);
+}
+
+/*
+ * Store the result of raising mat to the (pow)th power to `result`.
+ * Return 0 upon success and a nonzero value upon failure.
+ * Remember that pow is defined with matrix multiplication, not element-wise multiplication.
+ */
+int pow_matrix(matrix *result, matrix *mat, int pow) {
+    /* TODO: YOUR CODE HERE */
+
+
+    if (mat->cols != mat->rows || pow < 0 || result->rows != mat->rows ||
+        result->cols != mat->cols || result->dtype != mat->dtype || result->transposed)
+    {
+      return -1;
+    }
+    if (mat->transposed)
+    {
+      matrix *dense;
+      int ret = dense_matrix(&dense, mat);
+      if (ret == 0)
+      {
+        ret = pow_matrix(result, dense, pow);
+        deallocate_matrix(dense);
+      }
+      return ret;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+
+    const tiny_kernels *tiny = find_tiny(mat);
+    if (tiny)
+    {
+      TRACE_BEGIN(t_compute);
+      if (mat->dtype == DTYPE_FLOAT32)
+      {
+        tiny->pow_f32(result->fdata, mat->fdata, pow);
+      }
+      else
+      {
+        tiny->pow(result->data, mat->data, pow);
+      }
+      TRACE_END(t_compute, "pow_matrix", "compute", mat->rows, mat->cols);
+      return 0;
+    }
+
+    //Identity matrix
+    for (int r= 0; r<mat->rows; r++)
+    {
+      for (int c= 0; c<mat->cols; c++)
+      {
+        set(result, r, c, r==c ? 1: 0);
+      }
+    }
+
+
+    if (pow > 0)
+    {
+       for(int i=0; i<pow; i++)
+       {
+           if (mul_matrix(result, result, mat) != 0)
+           {
+             return -2;
+           }
+       }
+    }
+
+    return 0;
+}
+
+/*
+ * Store mat^pow * vec to `result` without forming mat^pow: pow matrix-vector products that
+ * ping-pong between two column vectors. `vec` and `result` are vectors (either orientation)
+ * with as many entries as mat has rows. If tol > 0 the iteration stops early once no entry
+ * changes by more than tol in a step, as when looking for a stationary distribution. The
+ * number of products done is stored to *steps if it is not NULL.
+ * Return 0 upon success, -1 for invalid dimensions and -2 if allocation fails, in which
+ * case `result` is left as it was.
+ */
+int pow_apply_matrix(matrix *result, matrix *mat, int pow, matrix *vec, double tol, int *steps) {
+    int n = mat->rows;
+    if (mat->cols != n || pow < 0 || !vec->is_1d || vec->rows * vec->cols != n ||
+        !result->is_1d || result->rows * result->cols != n ||
+        vec->dtype != mat->dtype || result->dtype != mat->dtype || result->transposed)
+    {
+      return -1;
+    }
+    if (mat->transposed)
+    {
+      // Read across once here rather than in each of the products
+      matrix *dense;
+      int ret = dense_matrix(&dense, mat);
+      if (ret == 0)
+      {
+        ret = pow_apply_matrix(result, dense, pow, vec, tol, steps);
+        deallocate_matrix(dense);
+      }
+      return ret;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+
+    matrix *x, *y;
+    if (allocate_matrix_dtype(&x, n, 1, mat->dtype) != 0)
+    {
+      return -2;
+    }
+    if (allocate_matrix_dtype(&y, n, 1, mat->dtype) != 0)
+    {
+      deallocate_matrix(x);
+      return -2;
+    }
+    for (int i = 0; i < n; i++)
+    {
+      set(x, i, 0, vec->cols == 1 ? get(vec, i, 0) : get(vec, 0, i));
+    }
+
+    TRACE_BEGIN(t_compute);
+    int done = 0;
+    while (done < pow)
+    {
+      int ret = mul_matrix(y, mat, x);
+      if (ret != 0)
+      {
+        deallocate_matrix(x);
+        deallocate_matrix(y);
+        return ret;
+      }
+      matrix *tmp = x;
+      x = y;
+      y = tmp;
+      done++;
+      if (tol > 0)
+      {
+        double change = 0;
+        for (int i = 0; i < n; i++)
+        {
+          double d = fabs(get(x, i, 0) - get(y, i, 0));
+          change = d > change ? d : change;
+        }
+        if (change <= tol)
+        {
+          break;
+        }
+      }
+    }
+    TRACE_END(t_compute, "pow_apply_matrix", "compute", n, done);
+
+    for (int i = 0; i < n; i++)
+    {
+      if (result->cols == 1)
+      {
+        set(result, i, 0, get(x, i, 0));
+      }
+      else
+      {
+        set(result, 0, i, get(x, i, 0));
+      }
+    }
+    deallocate_matrix(x);
+    deallocate_matrix(y);
+    if (steps)
+    {
+      *steps = done;
+    }
+    return 0;
+}
+
+/*
+ * Store the result of element-wise negating mat's entries to `result`.
  * Return 0 upon success and a nonzero value upon failure.
  */
 int neg_matrix(matrix *result, matrix *mat) {
     /* TODO: YOUR CODE HERE */
-      for (int r = 0; r< mat->rows; r++)
+      if (result->rows != mat->rows || result->cols != mat->cols || result->dtype != mat->dtype ||
+          result->transposed)
       {
-          for (int c = 0; c < mat->cols; c++)
-          {
-              result -> data[r][c] =  -mat->data[r][c];
-          }
+        return -1;
+      }
+      if (mat->transposed)
+      {
+        matrix *dense;
+        int ret = dense_matrix(&dense, mat);
+        if (ret == 0)
+        {
+          ret = neg_matrix(result, dense);
+          deallocate_matrix(dense);
+        }
+        return ret;
       }
+      if (unshare_matrix(result) != 0)
+      {
+        return -2;
+      }
+
+      TRACE_BEGIN(t_compute);
+      #pragma omp parallel if ((long long)mat->rows * mat->cols >= matrix_tune.par_elem)
+      {
+        TRACE_BEGIN(t_tile);
+        int tile_rows = 0;
+        #pragma omp for nowait
+        for (int r = 0; r< mat->rows; r++)
+        {
+            if (mat->dtype == DTYPE_FLOAT32)
+            {
+              kernels->neg_f32(result->fdata[r], mat->fdata[r], mat->cols);
+            }
+            else
+            {
+              kernels->neg(result->data[r], mat->data[r], mat->cols);
+            }
+            tile_rows++;
+        }
+        TRACE_END(t_tile, "neg_matrix.tile", "thread", tile_rows, mat->cols);
+      }
+      TRACE_END(t_compute, "neg_matrix", "compute", mat->rows, mat->cols);
       return 0;
 }
 
@@ -380,13 +2211,318 @@ int neg_matrix(matrix *result, matrix *mat) {
  */
 int abs_matrix(matrix *result, matrix *mat) {
     /* TODO: YOUR CODE HERE */
-      for (int r = 0; r< mat->rows; r++)
+      if (result->rows != mat->rows || result->cols != mat->cols || result->dtype != mat->dtype ||
+          result->transposed)
+      {
+        return -1;
+      }
+      if (mat->transposed)
+      {
+        matrix *dense;
+        int ret = dense_matrix(&dense, mat);
+        if (ret == 0)
+        {
+          ret = abs_matrix(result, dense);
+          deallocate_matrix(dense);
+        }
+        return ret;
+      }
+      if (unshare_matrix(result) != 0)
+      {
+        return -2;
+      }
+
+      const tiny_kernels *tiny = find_tiny(mat);
+      if (tiny)
+      {
+        TRACE_BEGIN(t_compute);
+        if (mat->dtype == DTYPE_FLOAT32)
+        {
+          tiny->abs_f32(result->fdata, mat->fdata);
+        }
+        else
+        {
+          tiny->abs(result->data, mat->data);
+        }
+        TRACE_END(t_compute, "abs_matrix", "compute", mat->rows, mat->cols);
+        return 0;
+      }
+
+      TRACE_BEGIN(t_compute);
+      #pragma omp parallel if ((long long)mat->rows * mat->cols >= matrix_tune.par_elem)
+      {
+        TRACE_BEGIN(t_tile);
+        int tile_rows = 0;
+        #pragma omp for nowait
+        for (int r = 0; r< mat->rows; r++)
+        {
+            if (mat->dtype == DTYPE_FLOAT32)
+            {
+              kernels->abs_f32(result->fdata[r], mat->fdata[r], mat->cols);
+            }
+            else
+            {
+              kernels->abs(result->data[r], mat->data[r], mat->cols);
+            }
+            tile_rows++;
+        }
+        TRACE_END(t_tile, "abs_matrix.tile", "thread", tile_rows, mat->cols);
+      }
+      TRACE_END(t_compute, "abs_matrix", "compute", mat->rows, mat->cols);
+      return 0;
+}
+
+/* Indices handled per step of take_matrix and put_matrix */
+#define INDEX_CHUNK 256
+
+/*
+ * Turn the positions rows[i], cols[i] of mat into element offsets from the start of its first
+ * row. Slices and transposed views share the block of their parent, so this also holds for
+ * them.
+ * Return 0 upon success and -1 if any position is out of range.
+ */
+static int index_offsets(long long *off, matrix *mat, const long long *rows,
+                         const long long *cols, int n) {
+    int bad = 0;
+    for (int i = 0; i < n; i++)
+    {
+      long long r = rows[i], c = cols[i];
+      bad |= r < 0 || r >= mat->rows || c < 0 || c >= mat->cols;
+      if (mat->transposed)
+      {
+        r = cols[i];
+        c = rows[i];
+      }
+      if (!bad)
+      {
+        off[i] = (mat->dtype == DTYPE_FLOAT32 ? mat->fdata[r] - mat->fdata[0]
+                                              : mat->data[r] - mat->data[0]) + c;
+      }
+    }
+    return bad ? -1 : 0;
+}
+
+/*
+ * Store the `n` entries of `mat` at rows[i], cols[i] to dst[i]. Indices are turned into
+ * offsets a chunk at a time and read with the gather kernel; large index sets are split over
+ * the threads.
+ * Return 0 upon success and -1 if any index is out of range.
+ */
+int take_matrix(double *dst, matrix *mat, const long long *rows, const long long *cols, long long n) {
+    int bad = 0;
+    TRACE_BEGIN(t_compute);
+    #pragma omp parallel if (n >= matrix_tune.par_elem) reduction(|:bad)
+    {
+      long long off[INDEX_CHUNK];
+      #pragma omp for schedule(static) nowait
+      for (long long i = 0; i < n; i += INDEX_CHUNK)
       {
-          for (int c = 0; c < mat->cols; c++)
+          int len = n - i < INDEX_CHUNK ? (int)(n - i) : INDEX_CHUNK;
+          if (index_offsets(off, mat, rows + i, cols + i, len) != 0)
+          {
+            bad = 1;
+            continue;
+          }
+          if (mat->dtype == DTYPE_FLOAT32)
+          {
+            for (int j = 0; j < len; j++)
+            {
+              dst[i + j] = mat->fdata[0][off[j]];
+            }
+          }
+          else
           {
-              result -> data[r][c] =  mat->data[r][c] > 0 ? mat->data[r][c]  : -mat->data[r][c];
+            kernels->gather(dst + i, mat->data[0], off, len);
           }
       }
-      return 0;
+    }
+    TRACE_END(t_compute, "take_matrix", "compute", 1, n);
+    return bad ? -1 : 0;
+}
+
+/*
+ * Store vals[i] to the entry of `mat` at rows[i], cols[i] for every i < n. All indices are
+ * checked before anything is written. If a position appears more than once, which of its
+ * values ends up stored is unspecified when the indices are split over several threads.
+ * Return 0 upon success and -1 if any index is out of range.
+ */
+int put_matrix(matrix *mat, const long long *rows, const long long *cols, const double *vals, long long n) {
+    int bad = 0;
+    for (long long i = 0; i < n && !bad; i++)
+    {
+      bad = rows[i] < 0 || rows[i] >= mat->rows || cols[i] < 0 || cols[i] >= mat->cols;
+    }
+    if (bad)
+    {
+      return -1;
+    }
+    if (unshare_matrix(mat) != 0)
+    {
+      return -2;
+    }
+
+    TRACE_BEGIN(t_compute);
+    #pragma omp parallel if (n >= matrix_tune.par_elem)
+    {
+      long long off[INDEX_CHUNK];
+      #pragma omp for schedule(static) nowait
+      for (long long i = 0; i < n; i += INDEX_CHUNK)
+      {
+          int len = n - i < INDEX_CHUNK ? (int)(n - i) : INDEX_CHUNK;
+          index_offsets(off, mat, rows + i, cols + i, len);
+          if (mat->dtype == DTYPE_FLOAT32)
+          {
+            for (int j = 0; j < len; j++)
+            {
+              mat->fdata[0][off[j]] = (float)vals[i + j];
+            }
+          }
+          else
+          {
+            kernels->scatter(mat->data[0], off, vals + i, len);
+          }
+      }
+    }
+    TRACE_END(t_compute, "put_matrix", "compute", 1, n);
+    return 0;
+}
+
+/*
+ * Apply the elementwise function `op` to n doubles. `dst` may be `a`.
+ */
+static void ufunc_row(double *dst, const double *a, int n, int op, double p0, double p1) {
+    switch (op)
+    {
+      case UFUNC_EXP: kernels->exp(dst, a, n); break;
+      case UFUNC_LOG: kernels->log(dst, a, n); break;
+      case UFUNC_SQRT: kernels->sqrt(dst, a, n); break;
+      case UFUNC_POW: kernels->pow_scalar(dst, a, n, p0); break;
+      case UFUNC_TANH: kernels->tanh(dst, a, n); break;
+      case UFUNC_SIGMOID: kernels->sigmoid(dst, a, n); break;
+      case UFUNC_RELU: kernels->relu(dst, a, n); break;
+      default: kernels->clip(dst, a, n, p0, p1); break;
+    }
+}
+
+/*
+ * Store the elementwise function `op` (one of UFUNC_*) of `mat` to `result`, which may be
+ * `mat` itself. UFUNC_POW raises to the power p0 and UFUNC_CLIP clamps to [p0, p1]. float32
+ * rows are computed in float64 a chunk at a time.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int ufunc_matrix(matrix *result, matrix *mat, int op, double p0, double p1) {
+    if (result->rows != mat->rows || result->cols != mat->cols || result->dtype != mat->dtype ||
+        result->transposed || op < UFUNC_EXP || op > UFUNC_CLIP)
+    {
+      return -1;
+    }
+    if (mat->transposed)
+    {
+      matrix *dense;
+      int ret = dense_matrix(&dense, mat);
+      if (ret == 0)
+      {
+        ret = ufunc_matrix(result, dense, op, p0, p1);
+        deallocate_matrix(dense);
+      }
+      return ret;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+
+    /* The transcendental functions are worth threads at fewer entries */
+    long long cutoff = op == UFUNC_RELU || op == UFUNC_CLIP || op == UFUNC_SQRT ?
+                       matrix_tune.par_elem : matrix_tune.par_elem / 8;
+    TRACE_BEGIN(t_compute);
+    #pragma omp parallel if ((long long)mat->rows * mat->cols >= cutoff)
+    {
+      TRACE_BEGIN(t_tile);
+      int tile_rows = 0;
+      double tmp[ROW_CHUNK];
+      #pragma omp for nowait
+      for (int r = 0; r < mat->rows; r++)
+      {
+          if (mat->dtype == DTYPE_FLOAT32)
+          {
+            for (int c = 0; c < mat->cols; c += ROW_CHUNK)
+            {
+              int len = mat->cols - c < ROW_CHUNK ? mat->cols - c : ROW_CHUNK;
+              kernels->f32_to_f64(tmp, mat->fdata[r] + c, len);
+              ufunc_row(tmp, tmp, len, op, p0, p1);
+              kernels->f64_to_f32(result->fdata[r] + c, tmp, len);
+            }
+          }
+          else
+          {
+            ufunc_row(result->data[r], mat->data[r], mat->cols, op, p0, p1);
+          }
+          tile_rows++;
+      }
+      TRACE_END(t_tile, "ufunc_matrix.tile", "thread", tile_rows, mat->cols);
+    }
+    TRACE_END(t_compute, "ufunc_matrix", "compute", mat->rows, mat->cols);
+    return 0;
 }
 
+/*
+ * Store the elementwise product, quotient, minimum or maximum of mat1 and mat2 to `result`,
+ * according to `op` (one of ELEM_*). `result` may be either operand.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int elementwise_matrix(matrix *result, matrix *mat1, matrix *mat2, int op) {
+    if (mat1->cols != mat2->cols || mat1->rows != mat2->rows ||
+        result->rows != mat1->rows || result->cols != mat1->cols ||
+        mat1->dtype != mat2->dtype || result->dtype != mat1->dtype || result->transposed ||
+        op < ELEM_MUL || op > ELEM_MAX)
+    {
+      return -1;
+    }
+    if (mat1->transposed || mat2->transposed)
+    {
+      matrix *tmp1, *tmp2;
+      int ret = dense_operands(&mat1, &mat2, &tmp1, &tmp2);
+      if (ret == 0)
+      {
+        ret = elementwise_matrix(result, mat1, mat2, op);
+      }
+      deallocate_matrix(tmp1);
+      deallocate_matrix(tmp2);
+      return ret;
+    }
+    if (unshare_matrix(result) != 0)
+    {
+      return -2;
+    }
+
+    void (*row)(double *, const double *, const double *, int) =
+        op == ELEM_MUL ? kernels->mul : op == ELEM_DIV ? kernels->div :
+        op == ELEM_MIN ? kernels->min : kernels->max;
+    void (*row_f32)(float *, const float *, const float *, int) =
+        op == ELEM_MUL ? kernels->mul_f32 : op == ELEM_DIV ? kernels->div_f32 :
+        op == ELEM_MIN ? kernels->min_f32 : kernels->max_f32;
+
+    TRACE_BEGIN(t_compute);
+    #pragma omp parallel if ((long long)mat1->rows * mat1->cols >= matrix_tune.par_elem)
+    {
+      TRACE_BEGIN(t_tile);
+      int tile_rows = 0;
+      #pragma omp for nowait
+      for (int r = 0; r < mat1->rows; r++)
+      {
+          if (mat1->dtype == DTYPE_FLOAT32)
+          {
+            row_f32(result->fdata[r], mat1->fdata[r], mat2->fdata[r], mat1->cols);
+          }
+          else
+          {
+            row(result->data[r], mat1->data[r], mat2->data[r], mat1->cols);
+          }
+          tile_rows++;
+      }
+      TRACE_END(t_tile, "elementwise_matrix.tile", "thread", tile_rows, mat1->cols);
+    }
+    TRACE_END(t_compute, "elementwise_matrix", "compute", mat1->rows, mat1->cols);
+    return 0;
+}
@@ -1,27 +1,100 @@
+#ifndef NUMC_MATRIX_H
+#define NUMC_MATRIX_H
+
 #include <Python.h>
 
+/* Matrices with at most this many bytes of data are allocated in a single block */
+#define SMALL_MATRIX_BYTES 512
+
+/* Element types a matrix can hold */
+#define DTYPE_FLOAT64 0
+#define DTYPE_FLOAT32 1
+
+/* Elementwise functions of ufunc_matrix */
+#define UFUNC_EXP 0
+#define UFUNC_LOG 1
+#define UFUNC_SQRT 2
+#define UFUNC_POW 3      // x ** p0
+#define UFUNC_TANH 4
+#define UFUNC_SIGMOID 5
+#define UFUNC_RELU 6
+#define UFUNC_CLIP 7     // clamp to [p0, p1]
+
+/* Elementwise binary operations of elementwise_matrix */
+#define ELEM_MUL 0
+#define ELEM_DIV 1
+#define ELEM_MIN 2
+#define ELEM_MAX 3
+
+/*
+ * Entries that several matrices share copy-on-write (see share_matrix). Only
+ * whole matrices with data of their own take part: not slices, matrices with
+ * slices, small inline matrices or mapped and borrowed data.
+ */
+typedef struct matrix_buffer {
+    int ref_cnt;    // matrices reading the entries, updated atomically
+    void *data;     // the contiguous entries, freed with the last of them
+} matrix_buffer;
+
 typedef struct matrix {
     int rows;      	// number of rows
     int cols;      	// number of columns
     double **data; 	// each element is a pointer to a row of data
+    float **fdata; 	// same for float32 matrices; only the array matching dtype is set
+    int dtype;     	// DTYPE_FLOAT64 or DTYPE_FLOAT32
+    int acc_f64;   	// float32 only: accumulate products in float64 (see mul_matrix_mixed)
+    int is_inline; 	// struct, row pointers and data share one allocation
     int is_1d;     	// Whether this matrix is a 1d matrix
     // For 1D matrix, shape is (rows * cols)
     int ref_cnt;
     struct matrix *parent;
+    void *map;         	// mapping that holds the data, unmapped with the matrix; NULL if malloced
+    size_t map_size;   	// length of `map` in bytes
+    void (*release)(void *);  // called with `owner` when the data goes, after any unmapping
+    void *owner;       	// argument of release
+    matrix_buffer *buf;	// entries shared copy-on-write; NULL while the matrix is their only user
+    int transposed;    	// a view of `parent` read across: entry (i, j) is data[j][i], and the
+                       	// `cols` row pointers each hold `rows` entries (see transpose_matrix)
 } matrix;
 
 
 void rand_matrix(matrix *result, unsigned int seed, double low, double high);
+int uniform_matrix(matrix *result, unsigned long long seed, double low, double high);
+int normal_matrix(matrix *result, unsigned long long seed, double mean, double std);
 int allocate_matrix(matrix **mat, int rows, int cols);
+int allocate_matrix_dtype(matrix **mat, int rows, int cols, int dtype);
 int allocate_matrix_ref(matrix **mat, matrix *from, int row_offset,
                         int col_offset, int rows, int cols);
+int allocate_matrix_mapped(matrix **mat, void *data, int rows, int cols, long long row_stride,
+                           int dtype, void *map, size_t map_size);
+int allocate_matrix_borrowed(matrix **mat, void *data, int rows, int cols, int dtype,
+                             void (*release)(void *), void *owner);
+int allocate_matrix_transposed(matrix **mat, matrix *from);
+int allocate_matrix_reshaped(matrix **mat, matrix *from, int rows, int cols);
+int matrix_contiguous(matrix *mat);
+int share_matrix(matrix **mat, matrix *from);
+int unshare_matrix(matrix *mat);
+matrix_buffer *pin_matrix(matrix *mat);
+void unpin_matrix(matrix *mat, matrix_buffer *pin);
 void deallocate_matrix(matrix *mat);
 double get(matrix *mat, int row, int col);
 void set(matrix *mat, int row, int col, double val);
 void fill_matrix(matrix *mat, double val);
+int copy_matrix(matrix *result, matrix *mat);
+int transpose_matrix(matrix *result, matrix *mat);
+int dense_matrix(matrix **dense, matrix *mat);
 int add_matrix(matrix *result, matrix *mat1, matrix *mat2);
 int sub_matrix(matrix *result, matrix *mat1, matrix *mat2);
 int mul_matrix(matrix *result, matrix *mat1, matrix *mat2);
+int mul_matrix_acc(matrix *result, matrix *mat1, matrix *mat2, int acc);
+int mul_matrix_mixed(matrix *result, matrix *mat1, matrix *mat2);
 int pow_matrix(matrix *result, matrix *mat, int pow);
+int pow_apply_matrix(matrix *result, matrix *mat, int pow, matrix *vec, double tol, int *steps);
 int neg_matrix(matrix *result, matrix *mat);
 int abs_matrix(matrix *result, matrix *mat);
+int take_matrix(double *dst, matrix *mat, const long long *rows, const long long *cols, long long n);
+int ufunc_matrix(matrix *result, matrix *mat, int op, double p0, double p1);
+int elementwise_matrix(matrix *result, matrix *mat1, matrix *mat2, int op);
+int put_matrix(matrix *mat, const long long *rows, const long long *cols, const double *vals, long long n);
+
+#endif
@@ -1,27 +1,79 @@
 #include "numc.h"
+#include "trace.h"
+#include "tune.h"
+#include "kernels.h"
 #include <structmember.h>
+#include <omp.h>
 
 PyTypeObject Matrix61cType;
+PyTypeObject Mask61cType;
+PyTypeObject Shard61cType;
 
 /* Helper functions for initalization of matrices and vectors */
 
+/* Shape tuples of matrices with dimensions below this are built once and shared */
+#define SHAPE_CACHE 64
+
+static PyObject *shapes_2d[SHAPE_CACHE][SHAPE_CACHE];
+static PyObject *shapes_1d[SHAPE_CACHE * SHAPE_CACHE];
+
 /*
  * Return a tuple given rows and cols
  */
 PyObject *get_shape(int rows, int cols) {
+  PyObject **cached = NULL;
+  if (rows == 1 || cols == 1) {
+    if (rows * cols < SHAPE_CACHE * SHAPE_CACHE) {
+      cached = &shapes_1d[rows * cols];
+    }
+  } else if (rows < SHAPE_CACHE && cols < SHAPE_CACHE) {
+    cached = &shapes_2d[rows][cols];
+  }
+  if (cached && *cached) {
+    Py_INCREF(*cached);
+    return *cached;
+  }
+
+  PyObject *shape;
   if (rows == 1 || cols == 1) {
-    return PyTuple_Pack(1, PyLong_FromLong(rows * cols));
+    shape = Py_BuildValue("(i)", rows * cols);
   } else {
-    return PyTuple_Pack(2, PyLong_FromLong(rows), PyLong_FromLong(cols));
+    shape = Py_BuildValue("(ii)", rows, cols);
+  }
+  if (cached && shape) {
+    Py_INCREF(shape);
+    *cached = shape;
   }
+  return shape;
+}
+/*
+ * Names of the dtypes, indexed by DTYPE_*
+ */
+const char *dtype_names[] = {"float64", "float32"};
+
+/*
+ * Parse a dtype name ("float64" or "float32") into *dtype. Sets a python error upon failure.
+ */
+int parse_dtype(PyObject *obj, int *dtype) {
+    if (PyUnicode_Check(obj)) {
+        for (int i = 0; i < 2; i++) {
+            if (PyUnicode_CompareWithASCIIString(obj, dtype_names[i]) == 0) {
+                *dtype = i;
+                return 0;
+            }
+        }
+    }
+    PyErr_SetString(PyExc_TypeError, "dtype must be \"float64\" or \"float32\"");
+    return -1;
 }
+
 /*
  * Matrix(rows, cols, low, high). Fill a matrix random double values
  */
 int init_rand(PyObject *self, int rows, int cols, unsigned int seed, double low,
-              double high) {
+              double high, int dtype) {
     matrix *new_mat;
-    int alloc_failed = allocate_matrix(&new_mat, rows, cols);
+    int alloc_failed = allocate_matrix_dtype(&new_mat, rows, cols, dtype);
     if (alloc_failed) return alloc_failed;
     rand_matrix(new_mat, seed, low, high);
     ((Matrix61c *)self)->mat = new_mat;
@@ -32,9 +84,9 @@ int init_rand(PyObject *self, int rows, int cols, unsigned int seed, double low,
 /*
  * Matrix(rows, cols, val). Fill a matrix of dimension rows * cols with val
  */
-int init_fill(PyObject *self, int rows, int cols, double val) {
+int init_fill(PyObject *self, int rows, int cols, double val, int dtype) {
     matrix *new_mat;
-    int alloc_failed = allocate_matrix(&new_mat, rows, cols);
+    int alloc_failed = allocate_matrix_dtype(&new_mat, rows, cols, dtype);
     if (alloc_failed)
         return alloc_failed;
     else {
@@ -48,14 +100,15 @@ int init_fill(PyObject *self, int rows, int cols, double val) {
 /*
  * Matrix(rows, cols, 1d_list). Fill a matrix with dimension rows * cols with 1d_list values
  */
-int init_1d(PyObject *self, int rows, int cols, PyObject *lst) {
+int init_1d(PyObject *self, int rows, int cols, PyObject *lst, int dtype) {
     if (rows * cols != PyList_Size(lst)) {
         PyErr_SetString(PyExc_ValueError, "Incorrect number of elements in list");
         return -1;
     }
     matrix *new_mat;
-    int alloc_failed = allocate_matrix(&new_mat, rows, cols);
+    int alloc_failed = allocate_matrix_dtype(&new_mat, rows, cols, dtype);
     if (alloc_failed) return alloc_failed;
+    TRACE_BEGIN(t_convert);
     int count = 0;
     for (int i = 0; i < rows; i++) {
         for (int j = 0; j < cols; j++) {
@@ -63,6 +116,7 @@ int init_1d(PyObject *self, int rows, int cols, PyObject *lst) {
             count++;
         }
     }
+    TRACE_END(t_convert, "init_1d", "convert", rows, cols);
     ((Matrix61c *)self)->mat = new_mat;
     ((Matrix61c *)self)->shape = get_shape(new_mat->rows, new_mat->cols);
     return 0;
@@ -71,7 +125,7 @@ int init_1d(PyObject *self, int rows, int cols, PyObject *lst) {
 /*
  * Matrix(2d_list). Fill a matrix with dimension len(2d_list) * len(2d_list[0])
  */
-int init_2d(PyObject *self, PyObject *lst) {
+int init_2d(PyObject *self, PyObject *lst, int dtype) {
     int rows = PyList_Size(lst);
     if (rows == 0) {
         PyErr_SetString(PyExc_ValueError,
@@ -93,30 +147,53 @@ int init_2d(PyObject *self, PyObject *lst) {
         }
     }
     matrix *new_mat;
-    int alloc_failed = allocate_matrix(&new_mat, rows, cols);
+    int alloc_failed = allocate_matrix_dtype(&new_mat, rows, cols, dtype);
     if (alloc_failed) return alloc_failed;
+    TRACE_BEGIN(t_convert);
     for (int i = 0; i < rows; i++) {
         for (int j = 0; j < cols; j++) {
             set(new_mat, i, j,
                 PyFloat_AsDouble(PyList_GetItem(PyList_GetItem(lst, i), j)));
         }
     }
+    TRACE_END(t_convert, "init_2d", "convert", rows, cols);
     ((Matrix61c *)self)->mat = new_mat;
     ((Matrix61c *)self)->shape = get_shape(new_mat->rows, new_mat->cols);
     return 0;
 }
 
+/*
+ * Freed numc.Matrix objects (not those of subclasses) are kept here for reuse, like the free
+ * lists of the builtin float and tuple types. Only touched with the GIL held.
+ */
+#define MATRIX_FREE_LIST 80
+
+static Matrix61c *free_matrices[MATRIX_FREE_LIST];
+static int num_free_matrices = 0;
+
 /*
  * This deallocation function is called when reference count is 0
  */
 void Matrix61c_dealloc(Matrix61c *self) {
     deallocate_matrix(self->mat);
+    Py_XDECREF(self->shape);
+    if (Py_TYPE(self) == &Matrix61cType && num_free_matrices < MATRIX_FREE_LIST) {
+        free_matrices[num_free_matrices++] = self;
+        return;
+    }
     Py_TYPE(self)->tp_free(self);
 }
 
 /* For immutable types all initializations should take place in tp_new */
 PyObject *Matrix61c_new(PyTypeObject *type, PyObject *args,
                         PyObject *kwds) {
+    if (type == &Matrix61cType && num_free_matrices > 0) {
+        Matrix61c *self = free_matrices[--num_free_matrices];
+        PyObject_Init((PyObject *)self, type);
+        self->mat = NULL;
+        self->shape = NULL;
+        return (PyObject *)self;
+    }
     /* size of allocated memory is tp_basicsize + nitems*tp_itemsize*/
     Matrix61c *self = (Matrix61c *)type->tp_alloc(type, 0);
     return (PyObject *)self;
@@ -126,6 +203,20 @@ PyObject *Matrix61c_new(PyTypeObject *type, PyObject *args,
  * This matrix61c type is mutable, so needs init function. Return 0 on success otherwise -1
  */
 int Matrix61c_init(PyObject *self, PyObject *args, PyObject *kwds) {
+    /* Element type, Matrix(..., dtype="float32") */
+    int dtype = DTYPE_FLOAT64;
+    if (kwds != NULL) {
+        PyObject *dtype_obj = PyDict_GetItemString(kwds, "dtype");
+        if (dtype_obj) {
+            if (parse_dtype(dtype_obj, &dtype) != 0) {
+                return -1;
+            }
+            if (PyDict_Size(kwds) == 1) {
+                kwds = NULL;
+            }
+        }
+    }
+
     /* Generate random matrices */
     if (kwds != NULL) {
         PyObject *rand = PyDict_GetItemString(kwds, "rand");
@@ -182,7 +273,7 @@ int Matrix61c_init(PyObject *self, PyObject *args, PyObject *kwds) {
         if (PyArg_UnpackTuple(args, "args", 2, 2, &rows, &cols)) {
             if (rows && cols && PyLong_Check(rows) && PyLong_Check(cols)) {
                 return init_rand(self, PyLong_AsLong(rows), PyLong_AsLong(cols), unsigned_seed, double_low,
-                                 double_high);
+                                 double_high, dtype);
             }
         } else {
             PyErr_SetString(PyExc_TypeError, "Invalid arguments");
@@ -197,18 +288,18 @@ int Matrix61c_init(PyObject *self, PyObject *args, PyObject *kwds) {
         if (arg1 && arg2 && arg3 && PyLong_Check(arg1) && PyLong_Check(arg2) && (PyLong_Check(arg3)
                 || PyFloat_Check(arg3))) {
             if (PyLong_Check(arg3)) {
-                return init_fill(self, PyLong_AsLong(arg1), PyLong_AsLong(arg2), PyLong_AsLong(arg3));
+                return init_fill(self, PyLong_AsLong(arg1), PyLong_AsLong(arg2), PyLong_AsLong(arg3), dtype);
             } else
-                return init_fill(self, PyLong_AsLong(arg1), PyLong_AsLong(arg2), PyFloat_AsDouble(arg3));
+                return init_fill(self, PyLong_AsLong(arg1), PyLong_AsLong(arg2), PyFloat_AsDouble(arg3), dtype);
         } else if (arg1 && arg2 && arg3 && PyLong_Check(arg1) && PyLong_Check(arg2) && PyList_Check(arg3)) {
             /* Matrix(rows, cols, 1D list) */
-            return init_1d(self, PyLong_AsLong(arg1), PyLong_AsLong(arg2), arg3);
+            return init_1d(self, PyLong_AsLong(arg1), PyLong_AsLong(arg2), arg3, dtype);
         } else if (arg1 && PyList_Check(arg1) && arg2 == NULL && arg3 == NULL) {
             /* Matrix(rows, cols, 1D list) */
-            return init_2d(self, arg1);
+            return init_2d(self, arg1, dtype);
         } else if (arg1 && arg2 && PyLong_Check(arg1) && PyLong_Check(arg2) && arg3 == NULL) {
             /* Matrix(rows, cols, 1D list) */
-            return init_fill(self, PyLong_AsLong(arg1), PyLong_AsLong(arg2), 0);
+            return init_fill(self, PyLong_AsLong(arg1), PyLong_AsLong(arg2), 0, dtype);
         } else {
             PyErr_SetString(PyExc_TypeError, "Invalid arguments");
             return -1;
@@ -226,6 +317,7 @@ PyObject *Matrix61c_to_list(Matrix61c *self) {
     int rows = self->mat->rows;
     int cols = self->mat->cols;
     PyObject *py_lst = NULL;
+    TRACE_BEGIN(t_convert);
     if (self->mat->is_1d) {  // If 1D matrix, print as a single list
         py_lst = PyList_New(rows * cols);
         int count = 0;
@@ -245,6 +337,7 @@ PyObject *Matrix61c_to_list(Matrix61c *self) {
             }
         }
     }
+    TRACE_END(t_convert, "to_list", "convert", rows, cols);
     return py_lst;
 }
 
@@ -264,481 +357,3351 @@ PyObject *Matrix61c_class_to_list(Matrix61c *self, PyObject *args) {
 }
 
 /*
- * Add class methods
+ * numc.trace_start(path). Start writing a Chrome trace-event file to `path`.
  */
-PyMethodDef Matrix61c_class_methods[] = {
-    {"to_list", (PyCFunction)Matrix61c_class_to_list, METH_VARARGS, "Returns a list representation of numc.Matrix"},
-    {NULL, NULL, 0, NULL}
-};
+PyObject *Matrix61c_trace_start(PyObject *self, PyObject *args) {
+    const char *path = NULL;
+    if (!PyArg_ParseTuple(args, "s", &path)) {
+        return NULL;
+    }
+    if (trace_start(path) != 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
 
 /*
- * Matrix61c string representation. For printing purposes.
+ * numc.trace_stop(). Finish the current trace. Returns whether a trace was running.
  */
-PyObject *Matrix61c_repr(PyObject *self) {
-    PyObject *py_lst = Matrix61c_to_list((Matrix61c *)self);
-    return PyObject_Repr(py_lst);
+PyObject *Matrix61c_trace_stop(PyObject *self, PyObject *args) {
+    return PyBool_FromLong(trace_stop() == 0);
 }
 
-/* NUMBER METHODS */
-
 /*
- * Add the second numc.Matrix (Matrix61c) object to the first one. The first operand is
- * self, and the second operand can be obtained by casting `args`.
+ * Return the kernel tuning parameters currently in use as a dict.
  */
-PyObject *Matrix61c_add(Matrix61c* self, PyObject* args) {
-    /* TODO: YOUR CODE HERE */
-
-    if (PyObject_TypeCheck(args, &Matrix61cType))
-    {
-      matrix* operand1 = ((Matrix61c*)args)->mat; 
-      matrix* res;
-      if (allocate_matrix(&res, operand1->rows, operand1->cols) !=0)
-      {
-        return NULL ;
-      }
-
-      if (add_matrix(res, self->mat, operand1)!=0)
-      {
-        return NULL;
-      }
-
-      Matrix61c* res_mat = (Matrix61c*)Matrix61c_new(&Matrix61cType, NULL, NULL);
-      res_mat->mat = res; 
-      
-      return res_mat;
-    }
-    else
-    {
-      return NULL;
-    }
+PyObject *tune_params_dict(void) {
+    return Py_BuildValue("{s:i,s:i,s:i,s:i,s:i,s:L,s:L}",
+                         "tile_m", matrix_tune.tile_m,
+                         "tile_n", matrix_tune.tile_n,
+                         "tile_k", matrix_tune.tile_k,
+                         "micro_m", matrix_tune.micro_m,
+                         "micro_n", matrix_tune.micro_n,
+                         "par_mul", matrix_tune.par_mul,
+                         "par_elem", matrix_tune.par_elem);
 }
 
 /*
- * Substract the second numc.Matrix (Matrix61c) object from the first one. The first operand is
- * self, and the second operand can be obtained by casting `args`.
+ * numc.autotune(path=None, size=384). Benchmark the kernels on this machine, save the
+ * fastest parameters to `path` (NUMC_PROFILE or ~/.numc_profile by default) and return them.
  */
-PyObject *Matrix61c_sub(Matrix61c* self, PyObject* args) {
-    /* TODO: YOUR CODE HERE */
-    if (PyObject_TypeCheck(args, &Matrix61cType))
-    {
-      matrix* operand1 = ((Matrix61c*)args)->mat; 
-      matrix* res;
-      if (allocate_matrix(&res, operand1->rows, operand1->cols) !=0)
-      {
-        return NULL ;
-      }
-
-      if (sub_matrix(res, self->mat, operand1)!=0)
-      {
+PyObject *Matrix61c_autotune(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"path", "size", NULL};
+    const char *path = NULL;
+    int size = 384;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|zi", kwlist, &path, &size)) {
         return NULL;
-      }
-
-      Matrix61c* res_mat = (Matrix61c*)Matrix61c_new(&Matrix61cType, NULL, NULL);
-      res_mat->mat = res; 
-      
-      return res_mat;
     }
-    else
-    {
-      return NULL;
+    if (size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "size must be positive");
+        return NULL;
+    }
+    if (!path) {
+        path = tune_default_path();
     }
-}
-
-/*
- * NOT element-wise multiplication. The first operand is self, and the second operand
- * can be obtained by casting `args`.
- */
-PyObject *Matrix61c_multiply(Matrix61c* self, PyObject *args) {
-    /* TODO: YOUR CODE HERE */
-    if (PyObject_TypeCheck(args, &Matrix61cType))
-    {
-      matrix* operand1 = ((Matrix61c*)args)->mat; 
-      matrix* res;
-      if (allocate_matrix(&res, self->mat->rows, operand1->cols) !=0)
-      {
-        return NULL ;
-      }
 
-      if (mul_matrix(res, self->mat, operand1)!=0)
-      {
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = tune_autotune(size);
+    Py_END_ALLOW_THREADS
+    if (ret != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrices for autotuning");
         return NULL;
-      }
-
-      Matrix61c* res_mat = (Matrix61c*)Matrix61c_new(&Matrix61cType, NULL, NULL);
-      res_mat->mat = res; 
-      
-      return res_mat;
     }
-    else
-    {
-      return NULL;
+    if (tune_save(path) != 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return NULL;
     }
+    return tune_params_dict();
 }
 
 /*
- * Negates the given numc.Matrix.
+ * numc.tune_params(). Return the kernel tuning parameters currently in use.
  */
-PyObject *Matrix61c_neg(Matrix61c* self) {
-    /* TODO: YOUR CODE HERE */
-      matrix* res;
-      if (allocate_matrix(&res, self->mat->rows, self->mat->cols) !=0)
-      {
-        return NULL ;
-      }
-
-
-      if (neg_matrix(res, self->mat) != 0)
-      {
-        return NULL; 
-      }
+PyObject *Matrix61c_tune_params(PyObject *self, PyObject *args) {
+    return tune_params_dict();
+}
 
-      Matrix61c* res_mat = (Matrix61c*)Matrix61c_new(&Matrix61cType, NULL, NULL);
-      res_mat->mat = res; 
+/*
+ * numc.isa(). Return the name of the kernel variant in use ("scalar", "avx2" or "avx512").
+ */
+PyObject *Matrix61c_isa(PyObject *self, PyObject *args) {
+    return PyUnicode_FromString(kernels->name);
 }
 
 /*
- * Take the element-wise absolute value of this numc.Matrix.
+ * numc.matmul(a, b, accumulate=None, dtype=None). Matrix product of a and b. `accumulate`
+ * ("float64" or "float32") overrides the accumulation precision the operands ask for, so
+ * float32 matrices can be multiplied with float64 sums on a per call basis. The result has
+ * the operands' dtype unless `dtype` says otherwise.
  */
-PyObject *Matrix61c_abs(Matrix61c *self) {
-    /* TODO: YOUR CODE HERE */
-      matrix* res;
-      if (allocate_matrix(&res, self->mat->rows, self->mat->cols) !=0)
-      {
-        return NULL ;
-      }
+PyObject *Matrix61c_matmul(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"a", "b", "accumulate", "dtype", NULL};
+    PyObject *a = NULL, *b = NULL, *acc_obj = Py_None, *dtype_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O!|OO", kwlist, &Matrix61cType, &a,
+                                     &Matrix61cType, &b, &acc_obj, &dtype_obj)) {
+        return NULL;
+    }
+    int acc = -1;
+    if (acc_obj != Py_None && parse_dtype(acc_obj, &acc) != 0) {
+        return NULL;
+    }
 
+    TRACE_BEGIN(t_op);
+    matrix *operand0 = ((Matrix61c *)a)->mat;
+    matrix *operand1 = ((Matrix61c *)b)->mat;
+    matrix *promoted;
+    if (promote_operands(&operand0, &operand1, &promoted) != 0) {
+        return NULL;
+    }
+    int dtype = operand0->dtype;
+    if (dtype_obj != Py_None && parse_dtype(dtype_obj, &dtype) != 0) {
+        deallocate_matrix(promoted);
+        return NULL;
+    }
 
-      if (abs_matrix(res, self->mat) != 0)
-      {
-        return NULL; 
-      }
+    /* The accumulation precision of this call, overriding the operands' */
+    if (acc == -1) {
+        acc = operand0->acc_f64 || operand1->acc_f64 ? DTYPE_FLOAT64 : operand0->dtype;
+    }
+    int mixed = operand0->dtype == DTYPE_FLOAT32 && acc == DTYPE_FLOAT64;
+
+    matrix *res = allocate_result(operand0->rows, operand1->cols, dtype);
+    if (!res) {
+        deallocate_matrix(promoted);
+        return NULL;
+    }
+    int failed;
+    if (mixed || dtype == operand0->dtype) {
+        failed = mul_matrix_acc(res, operand0, operand1, acc);
+    } else {
+        /* Plain product in the operands' dtype, converted afterwards */
+        matrix *tmp = allocate_result(operand0->rows, operand1->cols, operand0->dtype);
+        if (!tmp) {
+            deallocate_matrix(promoted);
+            deallocate_matrix(res);
+            return NULL;
+        }
+        failed = mul_matrix_acc(tmp, operand0, operand1, acc);
+        copy_matrix(res, tmp);
+        deallocate_matrix(tmp);
+    }
+    deallocate_matrix(promoted);
+    if (failed) {
+        deallocate_matrix(res);
+        PyErr_SetString(PyExc_ValueError, "Matrix dimensions do not match");
+        return NULL;
+    }
 
-      Matrix61c* res_mat = (Matrix61c*)Matrix61c_new(&Matrix61cType, NULL, NULL);
-      res_mat->mat = res; 
-    
+    TRACE_END(t_op, "numc.matmul", "op", res->rows, res->cols);
+    PyObject *res_mat = wrap_matrix(res);
+    return res_mat;
 }
 
 /*
- * Raise numc.Matrix (Matrix61c) to the `pow`th power. You can ignore the argument `optional`.
+ * numc.matrix_power_apply(A, k, v, tol=0). Return A^k * v, computed with k matrix-vector
+ * products instead of forming A^k. With tol > 0 the products stop as soon as no entry changes
+ * by more than tol, which turns k into an iteration limit for power iteration.
  */
-PyObject *Matrix61c_pow(Matrix61c *self, PyObject *pow, PyObject *optional) {
-    /* TODO: YOUR CODE HERE */
-  if(PyLong_Check(pow))
-  {
-      matrix* res;
-      if (allocate_matrix(&res, self->mat->rows, self->mat->cols) !=0)
-      {
-        return NULL ;
-      }
+PyObject *Matrix61c_power_apply(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"A", "k", "v", "tol", NULL};
+    PyObject *a = NULL, *v = NULL;
+    int pow;
+    double tol = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!iO!|d", kwlist, &Matrix61cType, &a, &pow,
+                                     &Matrix61cType, &v, &tol)) {
+        return NULL;
+    }
 
-      if (pow_matrix(res, self->mat, PyLong_AsLong(pow))!=0)
-      {
+    TRACE_BEGIN(t_op);
+    matrix *mat = ((Matrix61c *)a)->mat;
+    matrix *vec = ((Matrix61c *)v)->mat;
+    matrix *promoted;
+    if (promote_operands(&mat, &vec, &promoted) != 0) {
         return NULL;
-      }
+    }
+    matrix *res = allocate_result(vec->rows, vec->cols, vec->dtype);
+    if (!res) {
+        deallocate_matrix(promoted);
+        return NULL;
+    }
+    int ret;
+    matrix_buffer *pin0 = pin_matrix(mat), *pin1 = pin_matrix(vec);
+    Py_BEGIN_ALLOW_THREADS
+    ret = pow_apply_matrix(res, mat, pow, vec, tol, NULL);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(mat, pin0);
+    unpin_matrix(vec, pin1);
+    deallocate_matrix(promoted);
+    if (ret == -1) {
+        deallocate_matrix(res);
+        PyErr_SetString(PyExc_ValueError,
+                        "A must be square, v a vector of matching length and k non-negative");
+        return NULL;
+    } else if (ret != 0) {
+        deallocate_matrix(res);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+        return NULL;
+    }
 
-      Matrix61c* res_mat = (Matrix61c*)Matrix61c_new(&Matrix61cType, NULL, NULL);
-      res_mat->mat = res; 
-      
-      return res_mat;
-  }
-  else
-  {
-    return NULL;
-  }
+    TRACE_END(t_op, "numc.matrix_power_apply", "op", res->rows, res->cols);
+    PyObject *res_mat = wrap_matrix(res);
+    return res_mat;
 }
 
 /*
- * Create a PyNumberMethods struct for overloading operators with all the number methods you have
- * define. You might find this link helpful: https://docs.python.org/3.6/c-api/typeobj.html
+ * Allocate a `rows` x `cols` matrix and fill it with uniform_matrix, or normal_matrix if
+ * `normal` is set, without holding the GIL. `a` and `b` are low and high, or mean and std.
  */
-PyNumberMethods Matrix61c_as_number = {
-    /* TODO: YOUR CODE HERE */
-    (binaryfunc) Matrix61c_add,
-    (binaryfunc) Matrix61c_sub,
-    (binaryfunc) Matrix61c_multiply,
-    NULL, //remainder
-    NULL, //divmod
-    (ternaryfunc) Matrix61c_pow,
-    (unaryfunc) Matrix61c_neg,
-    NULL, //positive
-    (unaryfunc)Matrix61c_abs
-
-};
-
-
-/* INSTANCE METHODS */
+static PyObject *random_matrix(int rows, int cols, double a, double b, unsigned long long seed,
+                               PyObject *dtype_obj, int normal) {
+    int dtype = DTYPE_FLOAT64;
+    if (dtype_obj && parse_dtype(dtype_obj, &dtype) != 0) {
+        return NULL;
+    }
+    TRACE_BEGIN(t_op);
+    matrix *res = allocate_result(rows, cols, dtype);
+    if (!res) {
+        return NULL;
+    }
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    if (normal) {
+        ret = normal_matrix(res, seed, a, b);
+    } else {
+        ret = uniform_matrix(res, seed, a, b);
+    }
+    Py_END_ALLOW_THREADS
+    if (ret != 0) {
+        deallocate_matrix(res);
+        return PyErr_NoMemory();
+    }
+    PyObject *res_mat = wrap_matrix(res);
+    TRACE_END(t_op, normal ? "numc.normal" : "numc.uniform", "op", rows, cols);
+    return res_mat;
+}
 
 /*
- * Given a numc.Matrix self, parse `args` to (int) row, (int) col, and (double/int) val.
- * Return None in Python (this is different from returning null).
+ * numc.uniform(rows, cols, low=0, high=1, seed=0, dtype="float64"). A matrix of numbers drawn
+ * uniformly from [low, high), the same for a given seed whatever the number of threads.
  */
-PyObject *Matrix61c_set_value(Matrix61c *self, PyObject* args) {
-    /* TODO: YOUR CODE HERE */
-    PyObject *col = NULL;
-    PyObject *row = NULL;
-    PyObject *val = NULL;
-    if (PyArg_UnpackTuple(args, "args", 3, 3, &row, &col, &val))
-    {
-        set(self->mat, PyLong_AsLong(row), PyLong_AsLong(col), PyFloat_AsDouble(val));
-        //return Py_None;
-        Py_RETURN_NONE;
-       
+PyObject *Matrix61c_uniform(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"rows", "cols", "low", "high", "seed", "dtype", NULL};
+    int rows, cols;
+    double low = 0, high = 1;
+    unsigned long long seed = 0;
+    PyObject *dtype_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii|ddKO", kwlist, &rows, &cols, &low, &high,
+                                     &seed, &dtype_obj)) {
+        return NULL;
     }
-    else
-    {
-      PyErr_SetString(PyExc_TypeError, "Failed to unpack args when calling  set function!");
-      return NULL;
+    if (!(low < high)) {
+        PyErr_SetString(PyExc_ValueError, "low must be less than high");
+        return NULL;
     }
+    return random_matrix(rows, cols, low, high, seed, dtype_obj, 0);
 }
 
 /*
- * Given a numc.Matrix `self`, parse `args` to (int) row and (int) col.
- * Return the value at the `row`th row and `col`th column, which is a Python
- * float/int.
+ * numc.normal(rows, cols, mean=0, std=1, seed=0, dtype="float64"). Like numc.uniform, but
+ * normally distributed.
  */
-PyObject *Matrix61c_get_value(Matrix61c *self, PyObject* args) {
-    /* TODO: YOUR CODE HERE */
-    PyObject *col = NULL;
-    PyObject *row = NULL;
-    if (PyArg_UnpackTuple(args, "args", 2, 2, &row, &col))
-    {
-      return PyFloat_FromDouble(get(self->mat, PyLong_AsLong(row), PyLong_AsLong(col))); 
+PyObject *Matrix61c_normal(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"rows", "cols", "mean", "std", "seed", "dtype", NULL};
+    int rows, cols;
+    double mean = 0, std = 1;
+    unsigned long long seed = 0;
+    PyObject *dtype_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii|ddKO", kwlist, &rows, &cols, &mean, &std,
+                                     &seed, &dtype_obj)) {
+        return NULL;
     }
-    else
-    {
-      return NULL;
+    if (std < 0) {
+        PyErr_SetString(PyExc_ValueError, "std must not be negative");
+        return NULL;
     }
+    return random_matrix(rows, cols, mean, std, seed, dtype_obj, 1);
 }
 
 /*
- * Create an array of PyMethodDef structs to hold the instance methods.
- * Name the python function corresponding to Matrix61c_get_value as "get" and Matrix61c_set_value
- * as "set"
- * You might find this link helpful: https://docs.python.org/3.6/c-api/structures.html
+ * Store the elementwise function `op` of the numc.Matrix `m` to `out`, or to a new matrix if
+ * `out` is NULL or None. `out` must have the shape and dtype of `m` and may be `m` itself.
  */
-PyMethodDef Matrix61c_methods[] = {
-    /* TODO: YOUR CODE HERE */
-    {"get", (PyCFunction)Matrix61c_get_value, METH_VARARGS, "Get an element's value from a give position."},
-    {"set", Matrix61c_set_value, METH_VARARGS, "Set an element's value from a give position."},
-    {NULL, NULL, 0, NULL}
-};
+static PyObject *apply_ufunc(PyObject *m, PyObject *out, int op, double p0, double p1,
+                             const char *name) {
+    matrix *mat = ((Matrix61c *)m)->mat;
+    matrix *res;
+    if (out && out != Py_None) {
+        if (!PyObject_TypeCheck(out, &Matrix61cType)) {
+            PyErr_SetString(PyExc_TypeError, "out must be a numc.Matrix");
+            return NULL;
+        }
+        res = ((Matrix61c *)out)->mat;
+        if (res->rows != mat->rows || res->cols != mat->cols || res->dtype != mat->dtype) {
+            PyErr_SetString(PyExc_ValueError, "out must have the shape and dtype of the input");
+            return NULL;
+        }
+        if (res->transposed) {
+            PyErr_SetString(PyExc_ValueError, "out must not be a transposed view");
+            return NULL;
+        }
+        if (make_writable(res) != 0) {
+            return NULL;
+        }
+    } else {
+        out = NULL;
+        if (!(res = allocate_result(mat->rows, mat->cols, mat->dtype))) {
+            return NULL;
+        }
+    }
 
-/* INDEXING */
+    int ret;
+    TRACE_BEGIN(t_op);
+    matrix_buffer *pin0 = pin_matrix(mat), *pin1 = pin_matrix(out ? res : NULL);
+    Py_BEGIN_ALLOW_THREADS
+    ret = ufunc_matrix(res, mat, op, p0, p1);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(mat, pin0);
+    unpin_matrix(out ? res : NULL, pin1);
+    TRACE_END(t_op, name, "op", mat->rows, mat->cols);
+    if (ret != 0) {
+        if (!out) {
+            deallocate_matrix(res);
+        }
+        if (ret == -1) {
+            PyErr_SetString(PyExc_ValueError, "Invalid matrix for this function");
+        } else {
+            PyErr_NoMemory();
+        }
+        return NULL;
+    }
+    if (out) {
+        Py_INCREF(out);
+        return out;
+    }
+    return wrap_matrix(res);
+}
 
 /*
- * Given a numc.Matrix `self`, index into it with `key`. Return the indexed result.
+ * numc.<name>(m, out=None) for the functions without parameters.
  */
-PyObject *Matrix61c_subscript(Matrix61c* self, PyObject* key) {
-    /* TODO: YOUR CODE HERE */
-
+#define DEFINE_UFUNC(fn, op, pyname)                                                           \
+    PyObject *Matrix61c_##fn(PyObject *self, PyObject *args, PyObject *kwds) {                 \
+        static char *kwlist[] = {"m", "out", NULL};                                            \
+        PyObject *m, *out = NULL;                                                              \
+        if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|O:" pyname, kwlist, &Matrix61cType,  \
+                                         &m, &out)) {                                          \
+            return NULL;                                                                       \
+        }                                                                                      \
+        return apply_ufunc(m, out, op, 0, 0, "numc." pyname);                                  \
+    }
 
-    //printf("HELLO tuple %d List %d long %d  slice %d\n", PyTuple_Check(key), PyList_Check(key), PyLong_Check(key), PySlice_Check(key));
+DEFINE_UFUNC(exp, UFUNC_EXP, "exp")
+DEFINE_UFUNC(log, UFUNC_LOG, "log")
+DEFINE_UFUNC(sqrt, UFUNC_SQRT, "sqrt")
+DEFINE_UFUNC(tanh, UFUNC_TANH, "tanh")
+DEFINE_UFUNC(sigmoid, UFUNC_SIGMOID, "sigmoid")
+DEFINE_UFUNC(relu, UFUNC_RELU, "relu")
 
-    if (key == NULL)
-    {
-      return NULL;
+/*
+ * numc.power(m, p, out=None). Raise every entry to the scalar power p. (m ** k is the matrix
+ * power.)
+ */
+PyObject *Matrix61c_power(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"m", "p", "out", NULL};
+    PyObject *m, *out = NULL;
+    double p;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!d|O:power", kwlist, &Matrix61cType, &m, &p,
+                                     &out)) {
+        return NULL;
     }
-    else if (PyLong_Check(key))
+    return apply_ufunc(m, out, UFUNC_POW, p, 0, "numc.power");
+}
+
+/*
+ * numc.clip(m, lo, hi, out=None). Clamp every entry to [lo, hi].
+ */
+PyObject *Matrix61c_clip(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"m", "lo", "hi", "out", NULL};
+    PyObject *m, *out = NULL;
+    double lo, hi;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!dd|O:clip", kwlist, &Matrix61cType, &m, &lo,
+                                     &hi, &out)) {
+        return NULL;
+    }
+    if (lo > hi) {
+        PyErr_SetString(PyExc_ValueError, "lo must not be greater than hi");
+        return NULL;
+    }
+    return apply_ufunc(m, out, UFUNC_CLIP, lo, hi, "numc.clip");
+}
+
+/*
+ * Store the elementwise operation `op` (one of ELEM_*) of the numc.Matrix objects a and b to
+ * `out`, or to a new matrix if `out` is NULL or None. Operands of different dtypes are
+ * promoted as for +.
+ */
+static PyObject *apply_elementwise(PyObject *a, PyObject *b, PyObject *out, int op,
+                                   const char *name) {
+    if (!PyObject_TypeCheck(a, &Matrix61cType) || !PyObject_TypeCheck(b, &Matrix61cType)) {
+        PyErr_SetString(PyExc_TypeError, "Arguments must be of type numc.Matrix");
+        return NULL;
+    }
+    matrix *mat1 = ((Matrix61c *)a)->mat, *mat2 = ((Matrix61c *)b)->mat;
+    if (mat1->rows != mat2->rows || mat1->cols != mat2->cols) {
+        PyErr_SetString(PyExc_ValueError, "Matrix dimensions do not match");
+        return NULL;
+    }
+    matrix *promoted;
+    if (promote_operands(&mat1, &mat2, &promoted) != 0) {
+        return NULL;
+    }
+    matrix *res;
+    if (out && out != Py_None) {
+        if (!PyObject_TypeCheck(out, &Matrix61cType)) {
+            deallocate_matrix(promoted);
+            PyErr_SetString(PyExc_TypeError, "out must be a numc.Matrix");
+            return NULL;
+        }
+        res = ((Matrix61c *)out)->mat;
+        if (res->rows != mat1->rows || res->cols != mat1->cols || res->dtype != mat1->dtype) {
+            deallocate_matrix(promoted);
+            PyErr_SetString(PyExc_ValueError, "out must have the shape and dtype of the result");
+            return NULL;
+        }
+        if (res->transposed) {
+            deallocate_matrix(promoted);
+            PyErr_SetString(PyExc_ValueError, "out must not be a transposed view");
+            return NULL;
+        }
+        if (make_writable(res) != 0) {
+            deallocate_matrix(promoted);
+            return NULL;
+        }
+    } else {
+        out = NULL;
+        if (!(res = allocate_result(mat1->rows, mat1->cols, mat1->dtype))) {
+            deallocate_matrix(promoted);
+            return NULL;
+        }
+    }
+
+    TRACE_BEGIN(t_op);
+    matrix_buffer *pin0 = pin_matrix(mat1), *pin1 = pin_matrix(mat2);
+    matrix_buffer *pin2 = pin_matrix(out ? res : NULL);
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = elementwise_matrix(res, mat1, mat2, op);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(mat1, pin0);
+    unpin_matrix(mat2, pin1);
+    unpin_matrix(out ? res : NULL, pin2);
+    TRACE_END(t_op, name, "op", res->rows, res->cols);
+    deallocate_matrix(promoted);
+    if (ret != 0) {
+        if (!out) {
+            deallocate_matrix(res);
+        }
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if (out) {
+        Py_INCREF(out);
+        return out;
+    }
+    return wrap_matrix(res);
+}
+
+/*
+ * numc.<name>(a, b, out=None) for the elementwise binary operations.
+ */
+#define DEFINE_ELEMENTWISE(fn, op, pyname)                                                     \
+    PyObject *Matrix61c_##fn(PyObject *self, PyObject *args, PyObject *kwds) {                 \
+        static char *kwlist[] = {"a", "b", "out", NULL};                                       \
+        PyObject *a, *b, *out = NULL;                                                          \
+        if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|O:" pyname, kwlist, &a, &b, &out)) {  \
+            return NULL;                                                                       \
+        }                                                                                      \
+        return apply_elementwise(a, b, out, op, "numc." pyname);                               \
+    }
+
+DEFINE_ELEMENTWISE(elementwise_multiply, ELEM_MUL, "multiply")
+DEFINE_ELEMENTWISE(divide, ELEM_DIV, "divide")
+DEFINE_ELEMENTWISE(minimum, ELEM_MIN, "minimum")
+DEFINE_ELEMENTWISE(maximum, ELEM_MAX, "maximum")
+
+/*
+ * m.multiply(other), the elementwise product. (m * other is the matrix product.)
+ */
+PyObject *Matrix61c_multiply_method(Matrix61c *self, PyObject *other) {
+    return apply_elementwise((PyObject *)self, other, NULL, ELEM_MUL, "numc.multiply");
+}
+
+/*
+ * a / b divides entry by entry.
+ */
+PyObject *Matrix61c_true_divide(PyObject *self, PyObject *other) {
+    if (!PyObject_TypeCheck(self, &Matrix61cType) || !PyObject_TypeCheck(other, &Matrix61cType)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    return apply_elementwise(self, other, NULL, ELEM_DIV, "numc.divide");
+}
+
+/*
+ * numc.where(mask, a, b). Entries of a where the numc.Mask is set and of b elsewhere; either
+ * may be a number instead of a matrix. Matrices of different dtypes are promoted as for +, and
+ * two numbers give a float64 matrix.
+ */
+PyObject *Matrix61c_where(PyObject *self, PyObject *args) {
+    PyObject *m_obj, *a_obj, *b_obj;
+    if (!PyArg_ParseTuple(args, "O!OO:where", &Mask61cType, &m_obj, &a_obj, &b_obj)) {
+        return NULL;
+    }
+    mask *m = ((Mask61c *)m_obj)->m;
+    matrix *a = NULL, *b = NULL;
+    double sa = 0, sb = 0;
+    if (PyObject_TypeCheck(a_obj, &Matrix61cType)) {
+        a = ((Matrix61c *)a_obj)->mat;
+    } else if ((sa = PyFloat_AsDouble(a_obj)) == -1 && PyErr_Occurred()) {
+        PyErr_SetString(PyExc_TypeError, "a must be a numc.Matrix or a number");
+        return NULL;
+    }
+    if (PyObject_TypeCheck(b_obj, &Matrix61cType)) {
+        b = ((Matrix61c *)b_obj)->mat;
+    } else if ((sb = PyFloat_AsDouble(b_obj)) == -1 && PyErr_Occurred()) {
+        PyErr_SetString(PyExc_TypeError, "b must be a numc.Matrix or a number");
+        return NULL;
+    }
+    if ((a && (a->rows != m->rows || a->cols != m->cols)) ||
+        (b && (b->rows != m->rows || b->cols != m->cols))) {
+        PyErr_SetString(PyExc_ValueError, "Matrix dimensions do not match the mask");
+        return NULL;
+    }
+    matrix *promoted = NULL;
+    if (a && b && promote_operands(&a, &b, &promoted) != 0) {
+        return NULL;
+    }
+    int dtype = a ? a->dtype : b ? b->dtype : DTYPE_FLOAT64;
+    matrix *res = allocate_result(m->rows, m->cols, dtype);
+    if (!res) {
+        deallocate_matrix(promoted);
+        return NULL;
+    }
+
+    TRACE_BEGIN(t_op);
+    matrix_buffer *pin0 = pin_matrix(a), *pin1 = pin_matrix(b);
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = where_matrix(res, m, a, b, sa, sb);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(a, pin0);
+    unpin_matrix(b, pin1);
+    TRACE_END(t_op, "numc.where", "op", res->rows, res->cols);
+    deallocate_matrix(promoted);
+    if (ret != 0) {
+        deallocate_matrix(res);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    return wrap_matrix(res);
+}
+
+/*
+ * Set the python error for the return value `ret` of a matfile.c function on `path`.
+ */
+static void matfile_error(int ret, const char *path) {
+    if (ret == -1) {
+        PyErr_Format(PyExc_ValueError, "%s is not a valid numc matrix file", path);
+    } else if (ret == -2) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+    } else {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    }
+}
+
+/*
+ * numc.save(path, m). Write m to `path` in the binary matrix file format of matfile.h.
+ */
+PyObject *Matrix61c_save(PyObject *self, PyObject *args) {
+    const char *path;
+    PyObject *m;
+    if (!PyArg_ParseTuple(args, "sO!:save", &path, &Matrix61cType, &m)) {
+        return NULL;
+    }
+    int ret;
+    matrix *mat = ((Matrix61c *)m)->mat;
+    matrix_buffer *pin = pin_matrix(mat);
+    Py_BEGIN_ALLOW_THREADS
+    ret = save_matrix(path, mat);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(mat, pin);
+    if (ret != 0) {
+        matfile_error(ret, path);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/*
+ * numc.load(path). Read a matrix written by numc.save into memory.
+ */
+PyObject *Matrix61c_load(PyObject *self, PyObject *args) {
+    const char *path;
+    if (!PyArg_ParseTuple(args, "s:load", &path)) {
+        return NULL;
+    }
+    matrix *mat;
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = load_matrix(&mat, path);
+    Py_END_ALLOW_THREADS
+    if (ret != 0) {
+        matfile_error(ret, path);
+        return NULL;
+    }
+    return wrap_matrix(mat);
+}
+
+/*
+ * numc.open_mmap(path, mode="r", shape=None, dtype=None). A numc.Matrix backed by the mapped
+ * matrix file at `path`, without reading it. Mode "r" keeps changes to the matrix in memory,
+ * "r+" writes them to the file, and "w+" first creates a file of zeros of the given shape
+ * ((rows, cols), or a length for a row vector) and dtype.
+ */
+PyObject *Matrix61c_open_mmap(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"path", "mode", "shape", "dtype", NULL};
+    const char *path, *mode = "r";
+    PyObject *shape = NULL, *dtype_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|sOO:open_mmap", kwlist, &path, &mode,
+                                     &shape, &dtype_obj)) {
+        return NULL;
+    }
+    int create = strcmp(mode, "w+") == 0;
+    if (!create && strcmp(mode, "r") != 0 && strcmp(mode, "r+") != 0) {
+        PyErr_SetString(PyExc_ValueError, "mode must be \"r\", \"r+\" or \"w+\"");
+        return NULL;
+    }
+    if (!create && ((shape && shape != Py_None) || (dtype_obj && dtype_obj != Py_None))) {
+        PyErr_SetString(PyExc_ValueError, "shape and dtype are only given with mode \"w+\"");
+        return NULL;
+    }
+
+    int ret;
+    if (create) {
+        int rows = 1, cols, dtype = DTYPE_FLOAT64;
+        if (!shape || shape == Py_None) {
+            PyErr_SetString(PyExc_ValueError, "mode \"w+\" needs a shape");
+            return NULL;
+        }
+        if (PyLong_Check(shape)) {
+            cols = (int)PyLong_AsLong(shape);
+        } else if (PyTuple_Check(shape) || PyList_Check(shape)) {
+            PyObject *dims = PySequence_Tuple(shape);
+            int parsed = dims && PyArg_ParseTuple(dims, "ii:open_mmap shape", &rows, &cols);
+            Py_XDECREF(dims);
+            if (!parsed) {
+                return NULL;
+            }
+        } else {
+            PyErr_SetString(PyExc_TypeError, "shape must be an int or a (rows, cols) pair");
+            return NULL;
+        }
+        if (PyErr_Occurred() ||
+            (dtype_obj && dtype_obj != Py_None && parse_dtype(dtype_obj, &dtype) != 0)) {
+            return NULL;
+        }
+        if ((ret = create_matrix_file(path, rows, cols, dtype)) == -1) {
+            PyErr_SetString(PyExc_ValueError, "Invalid matrix dimensions");
+            return NULL;
+        } else if (ret != 0) {
+            matfile_error(ret, path);
+            return NULL;
+        }
+    }
+
+    matrix *mat;
+    if ((ret = map_matrix(&mat, path, strcmp(mode, "r") == 0 ? MATFILE_PRIVATE : MATFILE_SHARED))) {
+        matfile_error(ret, path);
+        return NULL;
+    }
+    return wrap_matrix(mat);
+}
+
+/*
+ * numc.Matrix.shared(name, rows, cols, dtype=None). Create the POSIX shared memory object
+ * `name` holding a `rows` x `cols` matrix of zeros and return a matrix of it. Other processes
+ * reach the same pages with numc.Matrix.attach(name). The name is removed when this matrix
+ * (and every slice of it) is freed; attached matrices stay valid until they are freed too.
+ */
+PyObject *Matrix61c_shared(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"name", "rows", "cols", "dtype", NULL};
+    const char *name;
+    int rows, cols, dtype = DTYPE_FLOAT64;
+    PyObject *dtype_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "sii|O:shared", kwlist, &name, &rows, &cols,
+                                     &dtype_obj)) {
+        return NULL;
+    }
+    if (dtype_obj && dtype_obj != Py_None && parse_dtype(dtype_obj, &dtype) != 0) {
+        return NULL;
+    }
+    matrix *mat;
+    int ret = create_shared_matrix(&mat, name, rows, cols, dtype);
+    if (ret == -1) {
+        PyErr_SetString(PyExc_ValueError, "Invalid shared memory name or matrix dimensions");
+        return NULL;
+    } else if (ret != 0) {
+        matfile_error(ret, name);
+        return NULL;
+    }
+    return wrap_matrix(mat);
+}
+
+/*
+ * numc.Matrix.attach(name). Return a matrix of the shared memory object `name` made by
+ * numc.Matrix.shared in any process. Sets are seen by every process attached to it.
+ */
+PyObject *Matrix61c_attach(PyObject *self, PyObject *args) {
+    const char *name;
+    if (!PyArg_ParseTuple(args, "s:attach", &name)) {
+        return NULL;
+    }
+    matrix *mat;
+    int ret = attach_shared_matrix(&mat, name);
+    if (ret != 0) {
+        matfile_error(ret, name);
+        return NULL;
+    }
+    return wrap_matrix(mat);
+}
+
+/*
+ * Parse a delimiter argument: None (blanks) or a single ASCII character. Sets a python error
+ * and returns -1 upon failure.
+ */
+static int parse_delimiter(PyObject *obj, char *delim) {
+    if (obj == Py_None) {
+        *delim = 0;
+        return 0;
+    }
+    if (!PyUnicode_Check(obj) || PyUnicode_GetLength(obj) != 1 ||
+        PyUnicode_READ_CHAR(obj, 0) >= 128 || PyUnicode_READ_CHAR(obj, 0) == '\n' ||
+        PyUnicode_READ_CHAR(obj, 0) == '#') {
+        PyErr_SetString(PyExc_ValueError, "delimiter must be a single character");
+        return -1;
+    }
+    *delim = (char)PyUnicode_READ_CHAR(obj, 0);
+    return 0;
+}
+
+/*
+ * numc.loadtxt(path, delimiter=None, dtype=None). Read a text matrix with one row per line and
+ * the entries separated by `delimiter`, or by blanks if it is None. Blank lines and lines
+ * starting with '#' are skipped. The file is parsed in parallel, straight into the matrix.
+ */
+PyObject *Matrix61c_loadtxt(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"path", "delimiter", "dtype", NULL};
+    const char *path;
+    PyObject *delim_obj = Py_None, *dtype_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|OO:loadtxt", kwlist, &path, &delim_obj,
+                                     &dtype_obj)) {
+        return NULL;
+    }
+    char delim;
+    int dtype = DTYPE_FLOAT64;
+    if (parse_delimiter(delim_obj, &delim) != 0 ||
+        (dtype_obj != Py_None && parse_dtype(dtype_obj, &dtype) != 0)) {
+        return NULL;
+    }
+    matrix *mat;
+    long long bad_row;
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = load_text_matrix(&mat, path, delim, dtype, &bad_row);
+    Py_END_ALLOW_THREADS
+    if (ret == -1 && bad_row >= 0) {
+        PyErr_Format(PyExc_ValueError, "%s: row %lld is malformed or has the wrong length",
+                     path, bad_row);
+        return NULL;
+    } else if (ret == -1) {
+        PyErr_Format(PyExc_ValueError, "%s does not contain a matrix", path);
+        return NULL;
+    } else if (ret != 0) {
+        matfile_error(ret, path);
+        return NULL;
+    }
+    return wrap_matrix(mat);
+}
+
+/*
+ * numc.savetxt(path, m, delimiter=" "). Write m as text that numc.loadtxt reads back exactly.
+ * Rows are formatted in parallel.
+ */
+PyObject *Matrix61c_savetxt(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"path", "m", "delimiter", NULL};
+    const char *path;
+    PyObject *m, *delim_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "sO!|O:savetxt", kwlist, &path, &Matrix61cType,
+                                     &m, &delim_obj)) {
+        return NULL;
+    }
+    char delim = ' ';
+    if (delim_obj && delim_obj != Py_None && parse_delimiter(delim_obj, &delim) != 0) {
+        return NULL;
+    }
+    int ret;
+    matrix *mat = ((Matrix61c *)m)->mat;
+    matrix_buffer *pin = pin_matrix(mat);
+    Py_BEGIN_ALLOW_THREADS
+    ret = save_text_matrix(path, mat, delim);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(mat, pin);
+    if (ret != 0) {
+        matfile_error(ret, path);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/*
+ * Progress callback of mul_matrix_ooc that calls the python callable `arg` with (done, total),
+ * taking the GIL for it. An exception in the callable stops the product.
+ */
+static int call_progress(long long done, long long total, void *arg) {
+    PyGILState_STATE gil = PyGILState_Ensure();
+    PyObject *ret = PyObject_CallFunction((PyObject *)arg, "LL", done, total);
+    Py_XDECREF(ret);
+    PyGILState_Release(gil);
+    return ret == NULL;
+}
+
+/*
+ * numc.matmul_ooc(a, b, out=None, memory_limit=256 MiB, progress=None). Matrix product of
+ * operands too large for memory, usually from numc.open_mmap, in square tiles that fit
+ * `memory_limit` bytes. Pass a mapped `out` (numc.open_mmap(path, "w+", ...)) when the result
+ * does not fit either. `progress(done, total)` is called after every result tile; raising
+ * from it stops the product.
+ */
+PyObject *Matrix61c_matmul_ooc(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"a", "b", "out", "memory_limit", "progress", NULL};
+    PyObject *a, *b, *out = Py_None, *progress = Py_None;
+    long long limit = 256LL << 20;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O!|OLO:matmul_ooc", kwlist, &Matrix61cType,
+                                     &a, &Matrix61cType, &b, &out, &limit, &progress)) {
+        return NULL;
+    }
+    matrix *mat1 = ((Matrix61c *)a)->mat, *mat2 = ((Matrix61c *)b)->mat;
+    if (mat1->dtype != mat2->dtype) {
+        PyErr_SetString(PyExc_TypeError, "Operands must have the same dtype");
+        return NULL;
+    }
+    if (mat1->cols != mat2->rows) {
+        PyErr_SetString(PyExc_ValueError, "Matrix dimensions do not match");
+        return NULL;
+    }
+    if (limit <= 0 || ooc_tile_size((size_t)limit, mat1->dtype) == 0) {
+        PyErr_Format(PyExc_ValueError, "memory_limit must allow tiles of at least %d x %d",
+                     OOC_TILE_GRAIN, OOC_TILE_GRAIN);
+        return NULL;
+    }
+    if (progress != Py_None && !PyCallable_Check(progress)) {
+        PyErr_SetString(PyExc_TypeError, "progress must be callable");
+        return NULL;
+    }
+    matrix *res;
+    if (out != Py_None) {
+        if (!PyObject_TypeCheck(out, &Matrix61cType)) {
+            PyErr_SetString(PyExc_TypeError, "out must be a numc.Matrix");
+            return NULL;
+        }
+        res = ((Matrix61c *)out)->mat;
+        if (res->rows != mat1->rows || res->cols != mat2->cols || res->dtype != mat1->dtype) {
+            PyErr_SetString(PyExc_ValueError, "out must have the shape and dtype of the result");
+            return NULL;
+        }
+        if (res->transposed) {
+            PyErr_SetString(PyExc_ValueError, "out must not be a transposed view");
+            return NULL;
+        }
+        if (make_writable(res) != 0) {
+            return NULL;
+        }
+    } else if (!(res = allocate_result(mat1->rows, mat2->cols, mat1->dtype))) {
+        return NULL;
+    }
+
+    int ret;
+    TRACE_BEGIN(t_op);
+    matrix_buffer *pin0 = pin_matrix(mat1), *pin1 = pin_matrix(mat2);
+    matrix_buffer *pin2 = pin_matrix(out != Py_None ? res : NULL);
+    Py_BEGIN_ALLOW_THREADS
+    ret = mul_matrix_ooc(res, mat1, mat2, (size_t)limit,
+                         progress != Py_None ? call_progress : NULL, progress);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(mat1, pin0);
+    unpin_matrix(mat2, pin1);
+    unpin_matrix(out != Py_None ? res : NULL, pin2);
+    TRACE_END(t_op, "numc.matmul_ooc", "op", res->rows, res->cols);
+    if (ret != 0) {
+        if (out == Py_None) {
+            deallocate_matrix(res);
+        }
+        if (ret == -1) {
+            PyErr_SetString(PyExc_ValueError, "out must not share data with the operands");
+        } else if (ret == -2) {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+        }
+        return NULL;
+    }
+    if (out != Py_None) {
+        Py_INCREF(out);
+        return out;
+    }
+    return wrap_matrix(res);
+}
+
+/*
+ * Add class methods
+ */
+PyMethodDef Matrix61c_class_methods[] = {
+    {"to_list", (PyCFunction)Matrix61c_class_to_list, METH_VARARGS, "Returns a list representation of numc.Matrix"},
+    {"trace_start", (PyCFunction)Matrix61c_trace_start, METH_VARARGS, "Start writing a Chrome trace-event file"},
+    {"trace_stop", (PyCFunction)Matrix61c_trace_stop, METH_NOARGS, "Finish the current trace file"},
+    {"autotune", (PyCFunction)Matrix61c_autotune, METH_VARARGS | METH_KEYWORDS, "Tune kernel parameters for this machine and save them"},
+    {"tune_params", (PyCFunction)Matrix61c_tune_params, METH_NOARGS, "Returns the kernel tuning parameters in use"},
+    {"isa", (PyCFunction)Matrix61c_isa, METH_NOARGS, "Returns the instruction set of the kernels in use"},
+    {"matmul", (PyCFunction)Matrix61c_matmul, METH_VARARGS | METH_KEYWORDS, "Matrix product with a choice of accumulation precision"},
+    {"matrix_power_apply", (PyCFunction)Matrix61c_power_apply, METH_VARARGS | METH_KEYWORDS, "Returns A^k * v without forming A^k"},
+    {"batch_matmul", (PyCFunction)Matrix61c_batch_matmul, METH_VARARGS, "Multiplies two batches of matrices entry by entry"},
+    {"uniform", (PyCFunction)Matrix61c_uniform, METH_VARARGS | METH_KEYWORDS, "Returns a matrix of uniformly distributed random numbers"},
+    {"normal", (PyCFunction)Matrix61c_normal, METH_VARARGS | METH_KEYWORDS, "Returns a matrix of normally distributed random numbers"},
+    {"exp", (PyCFunction)Matrix61c_exp, METH_VARARGS | METH_KEYWORDS, "Elementwise exponential"},
+    {"log", (PyCFunction)Matrix61c_log, METH_VARARGS | METH_KEYWORDS, "Elementwise natural logarithm"},
+    {"sqrt", (PyCFunction)Matrix61c_sqrt, METH_VARARGS | METH_KEYWORDS, "Elementwise square root"},
+    {"power", (PyCFunction)Matrix61c_power, METH_VARARGS | METH_KEYWORDS, "Elementwise power with a scalar exponent"},
+    {"tanh", (PyCFunction)Matrix61c_tanh, METH_VARARGS | METH_KEYWORDS, "Elementwise hyperbolic tangent"},
+    {"sigmoid", (PyCFunction)Matrix61c_sigmoid, METH_VARARGS | METH_KEYWORDS, "Elementwise logistic function"},
+    {"relu", (PyCFunction)Matrix61c_relu, METH_VARARGS | METH_KEYWORDS, "Elementwise max(x, 0)"},
+    {"clip", (PyCFunction)Matrix61c_clip, METH_VARARGS | METH_KEYWORDS, "Clamps every entry to [lo, hi]"},
+    {"multiply", (PyCFunction)Matrix61c_elementwise_multiply, METH_VARARGS | METH_KEYWORDS, "Elementwise product"},
+    {"divide", (PyCFunction)Matrix61c_divide, METH_VARARGS | METH_KEYWORDS, "Elementwise quotient"},
+    {"minimum", (PyCFunction)Matrix61c_minimum, METH_VARARGS | METH_KEYWORDS, "Elementwise minimum"},
+    {"maximum", (PyCFunction)Matrix61c_maximum, METH_VARARGS | METH_KEYWORDS, "Elementwise maximum"},
+    {"where", (PyCFunction)Matrix61c_where, METH_VARARGS, "Picks entries of a where the mask is set and of b elsewhere"},
+    {"save", (PyCFunction)Matrix61c_save, METH_VARARGS, "Writes a matrix to a binary file"},
+    {"load", (PyCFunction)Matrix61c_load, METH_VARARGS, "Reads a matrix from a binary file"},
+    {"open_mmap", (PyCFunction)Matrix61c_open_mmap, METH_VARARGS | METH_KEYWORDS, "Returns a matrix backed by a memory-mapped binary file"},
+    {"_from_buffer", (PyCFunction)Matrix61c_from_buffer, METH_VARARGS, "Rebuilds a pickled matrix, adopting the buffer where possible"},
+    {"matmul_ooc", (PyCFunction)Matrix61c_matmul_ooc, METH_VARARGS | METH_KEYWORDS, "Matrix product in tiles within a memory limit"},
+    {"loadtxt", (PyCFunction)Matrix61c_loadtxt, METH_VARARGS | METH_KEYWORDS, "Reads a matrix from a text file"},
+    {"savetxt", (PyCFunction)Matrix61c_savetxt, METH_VARARGS | METH_KEYWORDS, "Writes a matrix to a text file"},
+    {NULL, NULL, 0, NULL}
+};
+
+/*
+ * Matrix61c string representation. For printing purposes.
+ */
+PyObject *Matrix61c_repr(PyObject *self) {
+    PyObject *py_lst = Matrix61c_to_list((Matrix61c *)self);
+    if (!py_lst) return NULL;
+    PyObject *repr = PyObject_Repr(py_lst);
+    Py_DECREF(py_lst);
+    return repr;
+}
+
+/* NUMBER METHODS */
+
+/*
+ * Wrap `mat` in a new numc.Matrix object. On failure `mat` is deallocated and NULL is returned.
+ */
+PyObject *wrap_matrix(matrix *mat) {
+    Matrix61c* res_mat = (Matrix61c*)Matrix61c_new(&Matrix61cType, NULL, NULL);
+    if (!res_mat)
     {
-      PyObject* py_lst;
-      py_lst = PyList_New(self->mat->cols);
-      for(int i = 0; i< self->mat->cols; i++)
-      {
-        PyList_SetItem(py_lst, i, PyFloat_FromDouble(get(self->mat, PyLong_AsLong(key), i)));
-      }
-      return py_lst;
+      deallocate_matrix(mat);
+      return NULL;
+    }
+    res_mat->mat = mat;
+    res_mat->shape = get_shape(mat->rows, mat->cols);
+    return (PyObject *)res_mat;
+}
+
+/*
+ * Bring the operands of a binary operation to a common dtype: a float32 operand meeting a float64
+ * one is converted to float64. The converted copy, if any, is returned in *tmp and must be
+ * deallocated by the caller. Return 0 upon success, setting a python error upon failure.
+ */
+int promote_operands(matrix **mat1, matrix **mat2, matrix **tmp) {
+    *tmp = NULL;
+    if ((*mat1)->dtype == (*mat2)->dtype) {
+        return 0;
+    }
+    matrix **narrow = (*mat1)->dtype == DTYPE_FLOAT32 ? mat1 : mat2;
+    if (allocate_matrix_dtype(tmp, (*narrow)->rows, (*narrow)->cols, DTYPE_FLOAT64) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+        return -1;
+    }
+    copy_matrix(*tmp, *narrow);
+    *narrow = *tmp;
+    return 0;
+}
+
+/*
+ * Allocate the result of an operation, setting a python error upon failure.
+ */
+matrix *allocate_result(int rows, int cols, int dtype) {
+    matrix* res;
+    int ret = allocate_matrix_dtype(&res, rows, cols, dtype);
+    if (ret == -1)
+    {
+      PyErr_SetString(PyExc_ValueError, "Invalid matrix dimensions");
+      return NULL;
+    }
+    else if (ret != 0)
+    {
+      PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+      return NULL;
+    }
+    return res;
+}
+
+/*
+ * Give `mat` entries of its own before it is written in place, if it shares them with copies
+ * (see share_matrix). Sets a python error and returns -1 upon failure.
+ */
+int make_writable(matrix *mat) {
+    if (unshare_matrix(mat) != 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Return a new numc.Matrix with the entries of `self`, shared with it until either is written.
+ * While python code holds a buffer of `self`, which could write to the entries behind both
+ * their backs, the entries are copied instead.
+ */
+PyObject *share_result(Matrix61c *self) {
+    matrix *res;
+    if (self->exports > 0) {
+        if (!(res = allocate_result(self->mat->rows, self->mat->cols, self->mat->dtype))) {
+            return NULL;
+        }
+        copy_matrix(res, self->mat);
+        res->acc_f64 = self->mat->acc_f64;
+        res->is_1d = self->mat->is_1d;
+    } else if (share_matrix(&res, self->mat) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+        return NULL;
+    }
+    return wrap_matrix(res);
+}
+
+/*
+ * Add the second numc.Matrix (Matrix61c) object to the first one. The first operand is
+ * self, and the second operand can be obtained by casting `args`.
+ */
+PyObject *Matrix61c_add(Matrix61c* self, PyObject* args) {
+    /* TODO: YOUR CODE HERE */
+
+    if (PyObject_TypeCheck(args, &Matrix61cType))
+    {
+      TRACE_BEGIN(t_op);
+      matrix* operand0 = self->mat;
+      matrix* operand1 = ((Matrix61c*)args)->mat;
+      matrix* promoted;
+      if (promote_operands(&operand0, &operand1, &promoted) != 0)
+      {
+        return NULL;
+      }
+      matrix* res = allocate_result(operand1->rows, operand1->cols, operand0->dtype);
+      if (!res)
+      {
+        deallocate_matrix(promoted);
+        return NULL ;
+      }
+
+      int failed = add_matrix(res, operand0, operand1);
+      deallocate_matrix(promoted);
+      if (failed)
+      {
+        deallocate_matrix(res);
+        PyErr_SetString(PyExc_ValueError, "Matrix dimensions do not match");
+        return NULL;
+      }
+
+      TRACE_END(t_op, "numc.add", "op", res->rows, res->cols);
+      PyObject *res_mat = wrap_matrix(res);
+      return res_mat;
+    }
+    else
+    {
+      PyErr_SetString(PyExc_TypeError, "Argument must of type numc.Matrix!");
+      return NULL;
+    }
+}
+
+/*
+ * Substract the second numc.Matrix (Matrix61c) object from the first one. The first operand is
+ * self, and the second operand can be obtained by casting `args`.
+ */
+PyObject *Matrix61c_sub(Matrix61c* self, PyObject* args) {
+    /* TODO: YOUR CODE HERE */
+    if (PyObject_TypeCheck(args, &Matrix61cType))
+    {
+      TRACE_BEGIN(t_op);
+      matrix* operand0 = self->mat;
+      matrix* operand1 = ((Matrix61c*)args)->mat;
+      matrix* promoted;
+      if (promote_operands(&operand0, &operand1, &promoted) != 0)
+      {
+        return NULL;
+      }
+      matrix* res = allocate_result(operand1->rows, operand1->cols, operand0->dtype);
+      if (!res)
+      {
+        deallocate_matrix(promoted);
+        return NULL ;
+      }
+
+      int failed = sub_matrix(res, operand0, operand1);
+      deallocate_matrix(promoted);
+      if (failed)
+      {
+        deallocate_matrix(res);
+        PyErr_SetString(PyExc_ValueError, "Matrix dimensions do not match");
+        return NULL;
+      }
+
+      TRACE_END(t_op, "numc.sub", "op", res->rows, res->cols);
+      PyObject *res_mat = wrap_matrix(res);
+      return res_mat;
+    }
+    else
+    {
+      PyErr_SetString(PyExc_TypeError, "Argument must of type numc.Matrix!");
+      return NULL;
+    }
+}
+
+/*
+ * NOT element-wise multiplication. The first operand is self, and the second operand
+ * can be obtained by casting `args`.
+ */
+PyObject *Matrix61c_multiply(Matrix61c* self, PyObject *args) {
+    /* TODO: YOUR CODE HERE */
+    if (PyObject_TypeCheck(args, &Matrix61cType))
+    {
+      TRACE_BEGIN(t_op);
+      matrix* operand0 = self->mat;
+      matrix* operand1 = ((Matrix61c*)args)->mat;
+      matrix* promoted;
+      if (promote_operands(&operand0, &operand1, &promoted) != 0)
+      {
+        return NULL;
+      }
+      matrix* res = allocate_result(operand0->rows, operand1->cols, operand0->dtype);
+      if (!res)
+      {
+        deallocate_matrix(promoted);
+        return NULL ;
+      }
+
+      int failed = mul_matrix(res, operand0, operand1);
+      deallocate_matrix(promoted);
+      if (failed)
+      {
+        deallocate_matrix(res);
+        PyErr_SetString(PyExc_ValueError, "Matrix dimensions do not match");
+        return NULL;
+      }
+
+      TRACE_END(t_op, "numc.mul", "op", res->rows, res->cols);
+      PyObject *res_mat = wrap_matrix(res);
+      return res_mat;
+    }
+    else
+    {
+      PyErr_SetString(PyExc_TypeError, "Argument must of type numc.Matrix!");
+      return NULL;
+    }
+}
+
+/*
+ * Negates the given numc.Matrix.
+ */
+PyObject *Matrix61c_neg(Matrix61c* self) {
+    /* TODO: YOUR CODE HERE */
+      TRACE_BEGIN(t_op);
+      matrix* res = allocate_result(self->mat->rows, self->mat->cols, self->mat->dtype);
+      if (!res)
+      {
+        return NULL ;
+      }
+
+
+      if (neg_matrix(res, self->mat) != 0)
+      {
+        deallocate_matrix(res);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to negate matrix");
+        return NULL;
+      }
+
+      TRACE_END(t_op, "numc.neg", "op", res->rows, res->cols);
+      PyObject *res_mat = wrap_matrix(res);
+      return res_mat;
+}
+
+/*
+ * Take the element-wise absolute value of this numc.Matrix.
+ */
+PyObject *Matrix61c_abs(Matrix61c *self) {
+    /* TODO: YOUR CODE HERE */
+      TRACE_BEGIN(t_op);
+      matrix* res = allocate_result(self->mat->rows, self->mat->cols, self->mat->dtype);
+      if (!res)
+      {
+        return NULL ;
+      }
+
+
+      if (abs_matrix(res, self->mat) != 0)
+      {
+        deallocate_matrix(res);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to take absolute value of matrix");
+        return NULL;
+      }
+
+      TRACE_END(t_op, "numc.abs", "op", res->rows, res->cols);
+      PyObject *res_mat = wrap_matrix(res);
+      return res_mat;
+}
+
+/*
+ * +m, a copy of this numc.Matrix sharing its entries until either is written.
+ */
+PyObject *Matrix61c_pos(Matrix61c *self) {
+    return share_result(self);
+}
+
+/*
+ * m.copy(), copy.copy(m) and copy.deepcopy(m, memo). The copy shares the entries of m until
+ * either of them is written.
+ */
+PyObject *Matrix61c_copy(Matrix61c *self, PyObject *args) {
+    return share_result(self);
+}
+
+/*
+ * Raise numc.Matrix (Matrix61c) to the `pow`th power. You can ignore the argument `optional`.
+ */
+PyObject *Matrix61c_pow(Matrix61c *self, PyObject *pow, PyObject *optional) {
+    /* TODO: YOUR CODE HERE */
+  if(PyLong_Check(pow))
+  {
+      if (PyLong_AsLong(pow) == 1 && self->mat->rows == self->mat->cols)
+      {
+        return share_result(self);
+      }
+      TRACE_BEGIN(t_op);
+      matrix* res = allocate_result(self->mat->rows, self->mat->cols, self->mat->dtype);
+      if (!res)
+      {
+        return NULL ;
+      }
+
+      if (pow_matrix(res, self->mat, PyLong_AsLong(pow))!=0)
+      {
+        deallocate_matrix(res);
+        PyErr_SetString(PyExc_ValueError, "Matrix must be square and power must be non-negative");
+        return NULL;
+      }
+
+      TRACE_END(t_op, "numc.pow", "op", res->rows, res->cols);
+      PyObject *res_mat = wrap_matrix(res);
+      return res_mat;
+  }
+  else
+  {
+    PyErr_SetString(PyExc_TypeError, "Power must be an integer");
+    return NULL;
+  }
+}
+
+/*
+ * Create a PyNumberMethods struct for overloading operators with all the number methods you have
+ * define. You might find this link helpful: https://docs.python.org/3.6/c-api/typeobj.html
+ */
+PyNumberMethods Matrix61c_as_number = {
+    /* TODO: YOUR CODE HERE */
+    (binaryfunc) Matrix61c_add,
+    (binaryfunc) Matrix61c_sub,
+    (binaryfunc) Matrix61c_multiply,
+    NULL, //remainder
+    NULL, //divmod
+    (ternaryfunc) Matrix61c_pow,
+    (unaryfunc) Matrix61c_neg,
+    (unaryfunc)Matrix61c_pos,
+    (unaryfunc)Matrix61c_abs,
+    .nb_true_divide = (binaryfunc)Matrix61c_true_divide,
+};
+
+
+/*
+ * a < b, a <= b, a == b, ... compare entry by entry with another matrix of the same shape or
+ * with a number, giving a numc.Mask.
+ */
+PyObject *Matrix61c_richcompare(PyObject *self, PyObject *other, int op) {
+    static const int cmp_ops[] = {
+        [Py_LT] = CMP_LT, [Py_LE] = CMP_LE, [Py_EQ] = CMP_EQ,
+        [Py_NE] = CMP_NE, [Py_GT] = CMP_GT, [Py_GE] = CMP_GE,
+    };
+    matrix *mat1 = ((Matrix61c *)self)->mat, *mat2 = NULL;
+    double s = 0;
+    if (PyObject_TypeCheck(other, &Matrix61cType)) {
+        mat2 = ((Matrix61c *)other)->mat;
+        if (mat2->rows != mat1->rows || mat2->cols != mat1->cols) {
+            PyErr_SetString(PyExc_ValueError, "Matrix dimensions do not match");
+            return NULL;
+        }
+    } else if (PyFloat_Check(other) || PyLong_Check(other)) {
+        if ((s = PyFloat_AsDouble(other)) == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    } else {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    matrix *promoted = NULL;
+    if (mat2 && promote_operands(&mat1, &mat2, &promoted) != 0) {
+        return NULL;
+    }
+    mask *res;
+    if (allocate_mask(&res, mat1->rows, mat1->cols) != 0) {
+        deallocate_matrix(promoted);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate mask");
+        return NULL;
+    }
+
+    TRACE_BEGIN(t_op);
+    matrix_buffer *pin0 = pin_matrix(mat1), *pin1 = pin_matrix(mat2);
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = compare_matrix(res, mat1, mat2, s, cmp_ops[op]);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(mat1, pin0);
+    unpin_matrix(mat2, pin1);
+    TRACE_END(t_op, "numc.compare", "op", res->rows, res->cols);
+    deallocate_matrix(promoted);
+    if (ret != 0) {
+        deallocate_mask(res);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    return wrap_mask(res);
+}
+
+
+/* INSTANCE METHODS */
+
+/*
+ * Parse the python int `obj` as an index below `size` into *idx. Sets a python error and
+ * returns -1 if it is not an int or out of range.
+ */
+static int parse_index(PyObject *obj, int size, int *idx) {
+    long i = PyLong_AsLong(obj);
+    if (i == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (i < 0 || i >= size) {
+        PyErr_SetString(PyExc_IndexError, "Index out of range");
+        return -1;
+    }
+    *idx = (int)i;
+    return 0;
+}
+
+/*
+ * Given a numc.Matrix self, parse `args` to (int) row, (int) col, and (double/int) val.
+ * Return None in Python (this is different from returning null).
+ * Called with METH_FASTCALL, so the arguments arrive as a plain array and no tuple is built.
+ */
+PyObject *Matrix61c_set_value(Matrix61c *self, PyObject *const *args, Py_ssize_t nargs) {
+    /* TODO: YOUR CODE HERE */
+    int row, col;
+    if (nargs != 3) {
+        PyErr_SetString(PyExc_TypeError, "set() takes exactly 3 arguments (row, col, val)");
+        return NULL;
+    }
+    if (parse_index(args[0], self->mat->rows, &row) != 0 ||
+        parse_index(args[1], self->mat->cols, &col) != 0) {
+        return NULL;
+    }
+    double val = PyFloat_AsDouble(args[2]);
+    if ((val == -1 && PyErr_Occurred()) || make_writable(self->mat) != 0) {
+        return NULL;
+    }
+    set(self->mat, row, col, val);
+    Py_RETURN_NONE;
+}
+
+/*
+ * Given a numc.Matrix `self`, parse `args` to (int) row and (int) col.
+ * Return the value at the `row`th row and `col`th column, which is a Python
+ * float/int. Called with METH_FASTCALL like set.
+ */
+PyObject *Matrix61c_get_value(Matrix61c *self, PyObject *const *args, Py_ssize_t nargs) {
+    /* TODO: YOUR CODE HERE */
+    int row, col;
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "get() takes exactly 2 arguments (row, col)");
+        return NULL;
+    }
+    if (parse_index(args[0], self->mat->rows, &row) != 0 ||
+        parse_index(args[1], self->mat->cols, &col) != 0) {
+        return NULL;
+    }
+    return PyFloat_FromDouble(get(self->mat, row, col));
+}
+
+/*
+ * Return a copy of this numc.Matrix converted to `dtype` ("float64" or "float32").
+ */
+PyObject *Matrix61c_astype(Matrix61c *self, PyObject *dtype_obj) {
+    int dtype;
+    if (parse_dtype(dtype_obj, &dtype) != 0) {
+        return NULL;
+    }
+    if (dtype == self->mat->dtype) {
+        return share_result(self);
+    }
+    TRACE_BEGIN(t_op);
+    matrix *res = allocate_result(self->mat->rows, self->mat->cols, dtype);
+    if (!res) {
+        return NULL;
+    }
+    copy_matrix(res, self->mat);
+    PyObject *res_mat = wrap_matrix(res);
+    TRACE_END(t_op, "numc.astype", "convert", self->mat->rows, self->mat->cols);
+    return res_mat;
+}
+
+/*
+ * m.transpose(out=None). Return the transpose of `m` as a matrix of its own, or store it to
+ * `out`, which must have the transposed shape and the dtype of `m` and must not share data
+ * with it. Unlike m.T, which reads the entries of `m` in place, this copies them once in
+ * cache sized blocks.
+ */
+PyObject *Matrix61c_transpose(Matrix61c *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"out", NULL};
+    PyObject *out = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:transpose", kwlist, &out)) {
+        return NULL;
+    }
+    matrix *mat = self->mat;
+    matrix *res;
+    if (out != Py_None) {
+        if (!PyObject_TypeCheck(out, &Matrix61cType)) {
+            PyErr_SetString(PyExc_TypeError, "out must be a numc.Matrix");
+            return NULL;
+        }
+        res = ((Matrix61c *)out)->mat;
+        if (res->rows != mat->cols || res->cols != mat->rows || res->dtype != mat->dtype) {
+            PyErr_SetString(PyExc_ValueError, "out must have the shape and dtype of the result");
+            return NULL;
+        }
+        if (make_writable(res) != 0) {
+            return NULL;
+        }
+    } else if (!(res = allocate_result(mat->cols, mat->rows, mat->dtype))) {
+        return NULL;
+    }
+
+    int ret;
+    TRACE_BEGIN(t_op);
+    matrix_buffer *pin0 = pin_matrix(mat), *pin1 = pin_matrix(out != Py_None ? res : NULL);
+    Py_BEGIN_ALLOW_THREADS
+    ret = transpose_matrix(res, mat);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(mat, pin0);
+    unpin_matrix(out != Py_None ? res : NULL, pin1);
+    TRACE_END(t_op, "numc.transpose", "op", mat->rows, mat->cols);
+    if (ret != 0) {
+        if (out == Py_None) {
+            deallocate_matrix(res);
+        }
+        if (ret == -1) {
+            PyErr_SetString(PyExc_ValueError, "out must not share data with the input");
+        } else {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+        }
+        return NULL;
+    }
+    if (out != Py_None) {
+        Py_INCREF(out);
+        return out;
+    }
+    res->acc_f64 = mat->acc_f64;
+    return wrap_matrix(res);
+}
+
+/*
+ * Wrap `from` read as `rows` x `cols` entries (see allocate_matrix_reshaped), setting a
+ * python error upon failure.
+ */
+static PyObject *reshape_result(matrix *from, int rows, int cols) {
+    matrix *res;
+    int ret = allocate_matrix_reshaped(&res, from, rows, cols);
+    if (ret == -1) {
+        PyErr_Format(PyExc_ValueError, "Cannot reshape %d entries into (%d, %d)",
+                     from->rows * from->cols, rows, cols);
+        return NULL;
+    } else if (ret != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+        return NULL;
+    }
+    return wrap_matrix(res);
+}
+
+/*
+ * m.reshape(rows, cols). Return the entries of `m` read row by row into rows x cols, as a
+ * view that writes through to `m` if its entries are contiguous and as a copy otherwise.
+ * One of the dimensions may be -1, which stands for whatever the other leaves.
+ */
+PyObject *Matrix61c_reshape(Matrix61c *self, PyObject *args) {
+    int rows, cols;
+    if (!PyArg_ParseTuple(args, "ii:reshape", &rows, &cols)) {
+        return NULL;
+    }
+    int size = self->mat->rows * self->mat->cols;
+    if (rows == -1 && cols > 0 && size % cols == 0) {
+        rows = size / cols;
+    } else if (cols == -1 && rows > 0 && size % rows == 0) {
+        cols = size / rows;
+    }
+    return reshape_result(self->mat, rows, cols);
+}
+
+/*
+ * m.flatten(). Return the entries of `m` as a 1D matrix, a view if they are contiguous.
+ */
+PyObject *Matrix61c_flatten(Matrix61c *self, PyObject *args) {
+    return reshape_result(self->mat, 1, self->mat->rows * self->mat->cols);
+}
+
+/*
+ * Copy the integers of `obj` into a new array of *n long longs. `obj` is either a one
+ * dimensional buffer of any integer format (a NumPy array, array.array, ...) or a sequence of
+ * python ints. Sets a python error and returns NULL upon failure.
+ */
+static long long *index_array(PyObject *obj, const char *name, Py_ssize_t *n) {
+    long long *idx;
+    if (PyObject_CheckBuffer(obj)) {
+        Py_buffer view;
+        if (PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+            return NULL;
+        }
+        const char *fmt = view.format ? view.format : "B";
+        if (*fmt == '@' || *fmt == '=' || *fmt == '<') {
+            fmt++;
+        }
+        int is_signed = strchr("bhilq", *fmt) != NULL;
+        if (view.ndim > 1 || fmt[0] == '\0' || fmt[1] != '\0' ||
+            (!is_signed && !strchr("BHILQ", *fmt))) {
+            PyErr_Format(PyExc_TypeError, "%s must be a one dimensional integer buffer", name);
+            PyBuffer_Release(&view);
+            return NULL;
+        }
+        *n = view.len / view.itemsize;
+        idx = (long long *)malloc(sizeof(long long) * (*n > 0 ? *n : 1));
+        if (!idx) {
+            PyBuffer_Release(&view);
+            PyErr_NoMemory();
+            return NULL;
+        }
+        for (Py_ssize_t i = 0; i < *n; i++) {
+            const char *p = (const char *)view.buf + i * view.itemsize;
+            switch (view.itemsize) {
+            case 1: idx[i] = is_signed ? (long long)*(const int8_t *)p : (long long)*(const uint8_t *)p; break;
+            case 2: idx[i] = is_signed ? (long long)*(const int16_t *)p : (long long)*(const uint16_t *)p; break;
+            case 4: idx[i] = is_signed ? (long long)*(const int32_t *)p : (long long)*(const uint32_t *)p; break;
+            default: idx[i] = *(const int64_t *)p; break;
+            }
+        }
+        PyBuffer_Release(&view);
+        return idx;
+    }
+
+    PyObject *fast = PySequence_Fast(obj, name);
+    if (!fast) {
+        return NULL;
+    }
+    *n = PySequence_Fast_GET_SIZE(fast);
+    idx = (long long *)malloc(sizeof(long long) * (*n > 0 ? *n : 1));
+    if (!idx) {
+        Py_DECREF(fast);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    PyObject **items = PySequence_Fast_ITEMS(fast);
+    for (Py_ssize_t i = 0; i < *n; i++) {
+        idx[i] = PyLong_AsLongLong(items[i]);
+    }
+    Py_DECREF(fast);
+    if (PyErr_Occurred()) {
+        free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+/*
+ * Copy `n` values from `obj` into a new array of doubles. `obj` is a number, which is
+ * repeated, a numc.Matrix or float buffer with `n` entries, or a sequence of `n` numbers.
+ * Sets a python error and returns NULL upon failure.
+ */
+static double *value_array(PyObject *obj, Py_ssize_t n) {
+    double *vals = (double *)malloc(sizeof(double) * (n > 0 ? n : 1));
+    if (!vals) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if (PyFloat_Check(obj) || PyLong_Check(obj)) {
+        double val = PyFloat_AsDouble(obj);
+        for (Py_ssize_t i = 0; i < n; i++) {
+            vals[i] = val;
+        }
+        if (!PyErr_Occurred()) {
+            return vals;
+        }
+    } else if (PyObject_TypeCheck(obj, &Matrix61cType)) {
+        matrix *mat = ((Matrix61c *)obj)->mat;
+        if ((Py_ssize_t)mat->rows * mat->cols == n) {
+            for (Py_ssize_t i = 0; i < n; i++) {
+                vals[i] = get(mat, i / mat->cols, i % mat->cols);
+            }
+            return vals;
+        }
+        PyErr_SetString(PyExc_ValueError, "values must have one entry per index");
+    } else if (PyObject_CheckBuffer(obj)) {
+        Py_buffer view;
+        if (PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == 0) {
+            const char *fmt = view.format ? view.format : "B";
+            if (*fmt == '@' || *fmt == '=' || *fmt == '<') {
+                fmt++;
+            }
+            if (view.ndim > 1 || (strcmp(fmt, "d") && strcmp(fmt, "f"))) {
+                PyErr_SetString(PyExc_TypeError, "values must be a one dimensional float buffer");
+            } else if (view.len / view.itemsize != n) {
+                PyErr_SetString(PyExc_ValueError, "values must have one entry per index");
+            } else if (*fmt == 'd') {
+                memcpy(vals, view.buf, sizeof(double) * n);
+            } else {
+                kernels->f32_to_f64(vals, (const float *)view.buf, n);
+            }
+            PyBuffer_Release(&view);
+            if (!PyErr_Occurred()) {
+                return vals;
+            }
+        }
+    } else {
+        PyObject *fast = PySequence_Fast(obj, "values must be a number, buffer or sequence");
+        if (fast) {
+            if (PySequence_Fast_GET_SIZE(fast) != n) {
+                PyErr_SetString(PyExc_ValueError, "values must have one entry per index");
+            } else {
+                PyObject **items = PySequence_Fast_ITEMS(fast);
+                for (Py_ssize_t i = 0; i < n; i++) {
+                    vals[i] = PyFloat_AsDouble(items[i]);
+                }
+            }
+            Py_DECREF(fast);
+            if (!PyErr_Occurred()) {
+                return vals;
+            }
+        }
+    }
+    free(vals);
+    return NULL;
+}
+
+/*
+ * Read the index arrays `rows_obj` and `cols_obj`, which must have the same nonzero length,
+ * into *rows and *cols. Sets a python error and returns -1 upon failure.
+ */
+static int index_arrays(PyObject *rows_obj, PyObject *cols_obj, long long **rows, long long **cols,
+                        Py_ssize_t *n) {
+    Py_ssize_t n_cols;
+    *rows = index_array(rows_obj, "rows", n);
+    if (!*rows) {
+        return -1;
+    }
+    *cols = index_array(cols_obj, "cols", &n_cols);
+    if (!*cols) {
+        free(*rows);
+        return -1;
+    }
+    if (*n != n_cols || *n == 0) {
+        PyErr_SetString(PyExc_ValueError, "rows and cols must have the same nonzero length");
+        free(*rows);
+        free(*cols);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * m.take(rows, cols) returns the entries at (rows[i], cols[i]) as a float64 1D numc.Matrix,
+ * reading them all in one call.
+ */
+PyObject *Matrix61c_take(Matrix61c *self, PyObject *const *args, Py_ssize_t nargs) {
+    long long *rows, *cols;
+    Py_ssize_t n;
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "take() takes exactly 2 arguments (rows, cols)");
+        return NULL;
+    }
+    if (index_arrays(args[0], args[1], &rows, &cols, &n) != 0) {
+        return NULL;
+    }
+    TRACE_BEGIN(t_op);
+    matrix *res = n > INT_MAX ? NULL : allocate_result(1, (int)n, DTYPE_FLOAT64);
+    if (!res) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError, "Too many indices");
+        }
+        free(rows);
+        free(cols);
+        return NULL;
+    }
+    int ret;
+    matrix_buffer *pin = pin_matrix(self->mat);
+    Py_BEGIN_ALLOW_THREADS
+    ret = take_matrix(res->data[0], self->mat, rows, cols, n);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(self->mat, pin);
+    free(rows);
+    free(cols);
+    if (ret != 0) {
+        deallocate_matrix(res);
+        PyErr_SetString(PyExc_IndexError, "Index out of range");
+        return NULL;
+    }
+    PyObject *res_mat = wrap_matrix(res);
+    TRACE_END(t_op, "numc.take", "op", 1, (int)n);
+    return res_mat;
+}
+
+/*
+ * m.put(rows, cols, values) stores values[i] at (rows[i], cols[i]). `values` may also be a
+ * single number stored at every position. Nothing is written if any index is out of range.
+ */
+PyObject *Matrix61c_put(Matrix61c *self, PyObject *const *args, Py_ssize_t nargs) {
+    long long *rows, *cols;
+    Py_ssize_t n;
+    if (nargs != 3) {
+        PyErr_SetString(PyExc_TypeError, "put() takes exactly 3 arguments (rows, cols, values)");
+        return NULL;
+    }
+    if (index_arrays(args[0], args[1], &rows, &cols, &n) != 0) {
+        return NULL;
+    }
+    double *vals = value_array(args[2], n);
+    if (!vals || make_writable(self->mat) != 0) {
+        free(rows);
+        free(cols);
+        free(vals);
+        return NULL;
+    }
+    TRACE_BEGIN(t_op);
+    int ret;
+    matrix_buffer *pin = pin_matrix(self->mat);
+    Py_BEGIN_ALLOW_THREADS
+    ret = put_matrix(self->mat, rows, cols, vals, n);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(self->mat, pin);
+    free(rows);
+    free(cols);
+    free(vals);
+    if (ret != 0) {
+        PyErr_SetString(PyExc_IndexError, "Index out of range");
+        return NULL;
+    }
+    TRACE_END(t_op, "numc.put", "op", 1, (int)n);
+    Py_RETURN_NONE;
+}
+
+/* BUFFERS AND PICKLING */
+
+/*
+ * Export the entries of a contiguous matrix as a writable buffer of doubles ('d') or floats
+ * ('f'), with the shape of m.shape, so memoryview, pickle and numpy can use them in place.
+ * Entries shared with copies are copied first, since writes through the buffer bypass set.
+ */
+int Matrix61c_getbuffer(Matrix61c *self, Py_buffer *view, int flags) {
+    matrix *mat = self->mat;
+    if (!matrix_contiguous(mat)) {
+        PyErr_SetString(PyExc_BufferError, "Matrix slice is not contiguous");
+        view->obj = NULL;
+        return -1;
+    }
+    if (make_writable(mat) != 0) {
+        view->obj = NULL;
+        return -1;
+    }
+    Py_ssize_t elem = mat->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    if (mat->is_1d) {
+        self->buf_shape[0] = (Py_ssize_t)mat->rows * mat->cols;
+        self->buf_strides[0] = elem;
+    } else {
+        self->buf_shape[0] = mat->rows;
+        self->buf_shape[1] = mat->cols;
+        self->buf_strides[0] = elem * mat->cols;
+        self->buf_strides[1] = elem;
+    }
+    view->buf = mat->dtype == DTYPE_FLOAT32 ? (void *)mat->fdata[0] : (void *)mat->data[0];
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->len = (Py_ssize_t)mat->rows * mat->cols * elem;
+    view->readonly = 0;
+    view->itemsize = elem;
+    view->format = flags & PyBUF_FORMAT ? (mat->dtype == DTYPE_FLOAT32 ? "f" : "d") : NULL;
+    view->ndim = mat->is_1d ? 1 : 2;
+    view->shape = flags & PyBUF_ND ? self->buf_shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->buf_strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    self->exports++;
+    return 0;
+}
+
+void Matrix61c_releasebuffer(Matrix61c *self, Py_buffer *view) {
+    self->exports--;
+}
+
+PyBufferProcs Matrix61c_as_buffer = {
+    .bf_getbuffer = (getbufferproc)Matrix61c_getbuffer,
+    .bf_releasebuffer = (releasebufferproc)Matrix61c_releasebuffer,
+};
+
+/*
+ * m.__reduce_ex__(protocol). Pickles as numc._from_buffer(data, rows, cols, dtype,
+ * accumulate). With protocol 5 the data is a PickleBuffer over the matrix itself, which a
+ * buffer_callback can send out of band without copying; older protocols get the entries as
+ * one bytes object. Slices that are not contiguous are copied first.
+ */
+PyObject *Matrix61c_reduce_ex(Matrix61c *self, PyObject *protocol_obj) {
+    long protocol = PyLong_AsLong(protocol_obj);
+    if (protocol == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    matrix *mat = self->mat;
+    PyObject *src;
+    if (matrix_contiguous(mat)) {
+        src = (PyObject *)self;
+        Py_INCREF(src);
+    } else {
+        matrix *copy = allocate_result(mat->rows, mat->cols, mat->dtype);
+        if (!copy) {
+            return NULL;
+        }
+        copy_matrix(copy, mat);
+        copy->acc_f64 = mat->acc_f64;
+        if (!(src = wrap_matrix(copy))) {
+            return NULL;
+        }
+        mat = copy;
+    }
+
+    PyObject *data;
+    if (protocol >= 5) {
+        data = PyPickleBuffer_FromObject(src);
+    } else {
+        Py_ssize_t elem = mat->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+        data = PyBytes_FromStringAndSize(
+            mat->dtype == DTYPE_FLOAT32 ? (char *)mat->fdata[0] : (char *)mat->data[0],
+            (Py_ssize_t)mat->rows * mat->cols * elem);
+    }
+    Py_DECREF(src);
+    PyObject *module = data ? PyImport_ImportModule("numc") : NULL;
+    PyObject *rebuild = module ? PyObject_GetAttrString(module, "_from_buffer") : NULL;
+    Py_XDECREF(module);
+    if (!rebuild) {
+        Py_XDECREF(data);
+        return NULL;
+    }
+    return Py_BuildValue("N(Niisi)", rebuild, data, mat->rows, mat->cols,
+                         dtype_names[mat->dtype], mat->acc_f64);
+}
+
+/*
+ * Release function of matrices that adopted a python buffer, see numc._from_buffer.
+ */
+static void release_buffer(void *owner) {
+    PyGILState_STATE gil = PyGILState_Ensure();
+    PyBuffer_Release((Py_buffer *)owner);
+    PyGILState_Release(gil);
+    free(owner);
+}
+
+/*
+ * numc._from_buffer(data, rows, cols, dtype, accumulate=False), the unpickling side of
+ * __reduce_ex__. A writable, suitably aligned buffer (such as the bytearray or out-of-band
+ * buffer that protocol 5 produces) is adopted as the matrix data without copying, and kept
+ * alive until the matrix is freed; anything else is copied once.
+ */
+PyObject *Matrix61c_from_buffer(PyObject *self, PyObject *args) {
+    PyObject *data;
+    int rows, cols, acc = 0;
+    const char *dtype_name;
+    if (!PyArg_ParseTuple(args, "Oiis|p:_from_buffer", &data, &rows, &cols, &dtype_name, &acc)) {
+        return NULL;
+    }
+    int dtype = strcmp(dtype_name, dtype_names[DTYPE_FLOAT32]) == 0 ? DTYPE_FLOAT32 : DTYPE_FLOAT64;
+    size_t elem = dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    if (rows <= 0 || cols <= 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid matrix dimensions");
+        return NULL;
+    }
+
+    Py_buffer *view = (Py_buffer *)malloc(sizeof(Py_buffer));
+    if (!view) {
+        return PyErr_NoMemory();
+    }
+    int writable = PyObject_GetBuffer(data, view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) == 0;
+    if (!writable) {
+        PyErr_Clear();
+        if (PyObject_GetBuffer(data, view, PyBUF_C_CONTIGUOUS) != 0) {
+            free(view);
+            return NULL;
+        }
+    }
+    if ((size_t)view->len != (size_t)rows * cols * elem) {
+        PyBuffer_Release(view);
+        free(view);
+        PyErr_SetString(PyExc_ValueError, "Buffer size does not match the matrix dimensions");
+        return NULL;
+    }
+
+    matrix *mat;
+    if (writable && (size_t)view->buf % elem == 0) {
+        int ret = allocate_matrix_borrowed(&mat, view->buf, rows, cols, dtype, release_buffer, view);
+        if (ret != 0) {
+            PyBuffer_Release(view);
+            free(view);
+            PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+            return NULL;
+        }
+    } else {
+        mat = allocate_result(rows, cols, dtype);
+        if (mat) {
+            memcpy(dtype == DTYPE_FLOAT32 ? (void *)mat->fdata[0] : (void *)mat->data[0],
+                   view->buf, view->len);
+        }
+        PyBuffer_Release(view);
+        free(view);
+        if (!mat) {
+            return NULL;
+        }
+    }
+    mat->acc_f64 = dtype == DTYPE_FLOAT32 && acc;
+    return wrap_matrix(mat);
+}
+
+/*
+ * Create an array of PyMethodDef structs to hold the instance methods.
+ * Name the python function corresponding to Matrix61c_get_value as "get" and Matrix61c_set_value
+ * as "set"
+ * You might find this link helpful: https://docs.python.org/3.6/c-api/structures.html
+ */
+PyMethodDef Matrix61c_methods[] = {
+    /* TODO: YOUR CODE HERE */
+    {"get", (PyCFunction)(void (*)(void))Matrix61c_get_value, METH_FASTCALL, "Get an element's value from a give position."},
+    {"set", (PyCFunction)(void (*)(void))Matrix61c_set_value, METH_FASTCALL, "Set an element's value from a give position."},
+    {"astype", (PyCFunction)Matrix61c_astype, METH_O, "Returns a copy converted to the given dtype."},
+    {"reshape", (PyCFunction)Matrix61c_reshape, METH_VARARGS, "Returns the entries as rows x cols, a view unless they must be copied."},
+    {"flatten", (PyCFunction)Matrix61c_flatten, METH_NOARGS, "Returns the entries as a 1D matrix, a view unless they must be copied."},
+    {"transpose", (PyCFunction)(void (*)(void))Matrix61c_transpose, METH_VARARGS | METH_KEYWORDS, "Returns the transpose as a matrix of its own, or stores it to out."},
+    {"copy", (PyCFunction)Matrix61c_copy, METH_NOARGS, "Returns a copy, sharing the entries until either is written."},
+    {"__copy__", (PyCFunction)Matrix61c_copy, METH_NOARGS, "copy.copy support."},
+    {"__deepcopy__", (PyCFunction)Matrix61c_copy, METH_O, "copy.deepcopy support."},
+    {"take", (PyCFunction)(void (*)(void))Matrix61c_take, METH_FASTCALL, "Returns the entries at many (row, col) positions."},
+    {"put", (PyCFunction)(void (*)(void))Matrix61c_put, METH_FASTCALL, "Sets the entries at many (row, col) positions."},
+    {"multiply", (PyCFunction)Matrix61c_multiply_method, METH_O, "Returns the elementwise product."},
+    {"__reduce_ex__", (PyCFunction)Matrix61c_reduce_ex, METH_O, "Pickle support; protocol 5 passes the data out of band."},
+    {"shared", (PyCFunction)Matrix61c_shared, METH_VARARGS | METH_KEYWORDS | METH_STATIC, "Creates a matrix in POSIX shared memory"},
+    {"attach", (PyCFunction)Matrix61c_attach, METH_VARARGS | METH_STATIC, "Returns a matrix of existing POSIX shared memory"},
+    {NULL, NULL, 0, NULL}
+};
+
+/* INDEXING */
+
+/*
+ * Fast path for the keys that pick a single element: m[i, j] with two ints, and m[i] on a 1D
+ * matrix. Exact types are checked first so element access skips the general parsing below.
+ * Return 0 and store the position if `key` is such a key; return -1 otherwise, with a python
+ * error set only if the key had the right form but was out of range.
+ */
+static int scalar_index(matrix *mat, PyObject *key, int *row, int *col) {
+    if (PyTuple_CheckExact(key) && PyTuple_GET_SIZE(key) == 2 &&
+        PyLong_CheckExact(PyTuple_GET_ITEM(key, 0)) && PyLong_CheckExact(PyTuple_GET_ITEM(key, 1))) {
+        if (parse_index(PyTuple_GET_ITEM(key, 0), mat->rows, row) != 0 ||
+            parse_index(PyTuple_GET_ITEM(key, 1), mat->cols, col) != 0) {
+            return -1;
+        }
+        return 0;
+    }
+    if (mat->is_1d && PyLong_CheckExact(key)) {
+        int i;
+        if (parse_index(key, mat->rows * mat->cols, &i) != 0) {
+            return -1;
+        }
+        *row = mat->cols == 1 ? i : 0;
+        *col = mat->cols == 1 ? 0 : i;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Given a numc.Matrix `self`, index into it with `key`. Return the indexed result.
+ */
+PyObject *Matrix61c_subscript(Matrix61c* self, PyObject* key) {
+    /* TODO: YOUR CODE HERE */
+    int row, col;
+    if (scalar_index(self->mat, key, &row, &col) == 0) {
+        return PyFloat_FromDouble(get(self->mat, row, col));
+    } else if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+
+    //printf("HELLO tuple %d List %d long %d  slice %d\n", PyTuple_Check(key), PyList_Check(key), PyLong_Check(key), PySlice_Check(key));
+
+    if (key == NULL)
+    {
+      return NULL;
+    }
+    else if (PyLong_Check(key))
+    {
+      PyObject* py_lst;
+      py_lst = PyList_New(self->mat->cols);
+      for(int i = 0; i< self->mat->cols; i++)
+      {
+        PyList_SetItem(py_lst, i, PyFloat_FromDouble(get(self->mat, PyLong_AsLong(key), i)));
+      }
+      return py_lst;
+    }
+    else if (PySlice_Check(key))
+    {
+      Py_ssize_t start;
+      Py_ssize_t step ;
+      Py_ssize_t end ;
+      Py_ssize_t slice_length ;
+      if (PySlice_GetIndicesEx(key, self->mat->rows, &start, &end, &step, &slice_length) == 0)
+      {
+        PyObject * py_lst;
+
+        py_lst = PyList_New(slice_length);
+
+        int row = 0;
+        for (int i = start ; i< end; i+=step)
+        {
+
+          PyList_SetItem(py_lst, row, PyList_New(self->mat->cols));
+          PyObject *curr_row = PyList_GetItem(py_lst, row);
+          row ++;
+          for(int j = 0; j< self->mat->cols; j++)
+          {
+            PyList_SetItem(curr_row, j, PyFloat_FromDouble(get(self->mat, i, j)));
+          }
+        }
+        return py_lst;
+      }
+      else
+      {
+        PyErr_SetString(PyExc_TypeError, "Invalid slice format!");
+        return NULL;
+      }
+    }
+    else if (PyTuple_Check(key))
+    {
+      PyObject *arg1 = NULL;
+      PyObject *arg2 = NULL;
+      if (PyArg_UnpackTuple(key, "args", 2, 2, &arg1, &arg2))
+      {
+        PyObject * py_lst;
+        Py_ssize_t start1;
+        Py_ssize_t step1 ;
+        Py_ssize_t end1 ;
+        Py_ssize_t slice_length1 ;
+        Py_ssize_t start2;
+        Py_ssize_t step2 ;
+        Py_ssize_t end2 ;
+        Py_ssize_t slice_length2 ;
+
+        if (PySlice_Check(arg1))
+        {
+            if (!PySlice_GetIndicesEx(arg1, self->mat->rows, &start1, &end1, &step1, &slice_length1) == 0)
+            {
+              PyErr_SetString(PyExc_TypeError, "Invalid slice format for arg1!");
+              return NULL;
+            }
+        }
+        else if (PyLong_Check(arg1))
+        {
+          slice_length1 = -1;
+          start1 = PyLong_AsLong(arg1);
+        }
+        else
+        {
+          PyErr_SetString(PyExc_TypeError, "Invalid first args in tuple!");
+          return NULL;
+        }
+
+        if (PySlice_Check(arg2))
+        {
+            if (!PySlice_GetIndicesEx(arg2, self->mat->rows, &start2, &end2, &step2, &slice_length2) == 0)
+            {
+              PyErr_SetString(PyExc_TypeError, "Invalid slice format for arg2!");
+              return NULL;
+            }
+        }
+        else if (PyLong_Check(arg2))
+        {
+          slice_length2 = -1;
+          start2 = PyLong_AsLong(arg2);
+        }
+        else
+        {
+          PyErr_SetString(PyExc_TypeError, "Invalid second args in tuple!");
+          return NULL;
+        }
+
+        if (slice_length1 == -1 && slice_length2 == -1)
+        {
+          return PyFloat_FromDouble(get(self->mat, start1, start2));
+        }
+        else if (slice_length1 == -1 && slice_length2 != -1)
+        {
+          py_lst = PyList_New(slice_length2);
+          int col = 0;
+          for (int i =start2; i< end2; i+=step2)
+          {
+            PyList_SetItem(py_lst, col, PyFloat_FromDouble(get(self->mat, start1, i)));
+            col ++;
+          }
+          return py_lst;
+        }
+        else if (slice_length1 != -1 && slice_length2 == -1)
+        {
+          py_lst = PyList_New(slice_length1);
+          int row = 0;
+          for (int i =start1; i< end1; i+=step1)
+          {
+            PyList_SetItem(py_lst, row, PyFloat_FromDouble(get(self->mat, i, start2)));
+            row ++;
+          }
+          return py_lst;
+        }
+        else if (slice_length1 != -1 && slice_length2 != -1)
+        {
+
+
+          py_lst = PyList_New(slice_length1);
+
+          int row = 0;
+          for (int r = start1; r<end1; r+=step1)
+          {
+              PyList_SetItem(py_lst, row, PyList_New(slice_length2));
+              PyObject *curr_row = PyList_GetItem(py_lst, row);
+              int col = 0;
+              for (int c = start2 ; c< end2; c+=step2)
+              {
+                PyList_SetItem(curr_row, col, PyFloat_FromDouble(get(self->mat, r, c)));
+                col ++;
+              }
+              row ++;
+          }
+
+          return py_lst;
+
+
+        }
+        else
+        {
+          PyErr_SetString(PyExc_TypeError, "Something is wrong!");
+          return NULL;
+        }
+      }
+      else
+      {
+          PyErr_SetString(PyExc_TypeError, "Invalid tuple format!");
+          return NULL;
+      }
+    }
+    PyErr_SetString(PyExc_TypeError, "Invalid index type!");
+    return NULL;
+}
+
+/*
+ * Given a numc.Matrix `self`, index into it with `key`, and set the indexed result to `v`.
+ */
+int Matrix61c_set_subscript(Matrix61c* self, PyObject *key, PyObject *v) {
+    /* TODO: YOUR CODE HERE */
+    int row, col;
+    if (!v) {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete matrix entries");
+        return -1;
+    }
+    if (scalar_index(self->mat, key, &row, &col) != 0) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "Only single entries can be assigned");
+        }
+        return -1;
+    }
+    double val = PyFloat_AsDouble(v);
+    if ((val == -1 && PyErr_Occurred()) || make_writable(self->mat) != 0) {
+        return -1;
+    }
+    set(self->mat, row, col, val);
+    return 0;
+}
+
+PyMappingMethods Matrix61c_mapping = {
+    NULL,
+    (binaryfunc) Matrix61c_subscript,
+    (objobjargproc) Matrix61c_set_subscript,
+};
+
+/* INSTANCE ATTRIBUTES*/
+PyMemberDef Matrix61c_members[] = {
+    {
+        "shape", T_OBJECT_EX, offsetof(Matrix61c, shape), READONLY,
+        "(rows, cols)"
+    },
+    {NULL}  /* Sentinel */
+};
+
+/*
+ * Name of the element type, "float64" or "float32"
+ */
+PyObject *Matrix61c_get_dtype(Matrix61c *self, void *closure) {
+    return PyUnicode_FromString(dtype_names[self->mat->dtype]);
+}
+
+/*
+ * Precision that matrix products with this matrix accumulate in, "float64" or "float32"
+ */
+PyObject *Matrix61c_get_accumulate(Matrix61c *self, void *closure) {
+    matrix *mat = self->mat;
+    int acc = mat->dtype == DTYPE_FLOAT64 || mat->acc_f64 ? DTYPE_FLOAT64 : DTYPE_FLOAT32;
+    return PyUnicode_FromString(dtype_names[acc]);
+}
+
+/*
+ * Setting "float64" on a float32 matrix makes its products accumulate in float64 while the
+ * result is still stored as float32. float64 matrices always accumulate in float64.
+ */
+int Matrix61c_set_accumulate(Matrix61c *self, PyObject *value, void *closure) {
+    int acc;
+    if (!value) {
+        PyErr_SetString(PyExc_TypeError, "Cannot delete the accumulate attribute");
+        return -1;
+    }
+    if (parse_dtype(value, &acc) != 0) {
+        return -1;
+    }
+    if (self->mat->dtype == DTYPE_FLOAT64 && acc == DTYPE_FLOAT32) {
+        PyErr_SetString(PyExc_ValueError, "float64 matrices accumulate in float64");
+        return -1;
+    }
+    self->mat->acc_f64 = self->mat->dtype == DTYPE_FLOAT32 && acc == DTYPE_FLOAT64;
+    return 0;
+}
+
+/*
+ * The transpose of the matrix as a view: no entries are copied, writes go through to the
+ * matrix, and products read the view across in their packing step (see mul_matrix). m.T.T
+ * is again a view of `m` as it is.
+ */
+PyObject *Matrix61c_get_T(Matrix61c *self, void *closure) {
+    matrix *res;
+    if (allocate_matrix_transposed(&res, self->mat) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+        return NULL;
+    }
+    return wrap_matrix(res);
+}
+
+PyGetSetDef Matrix61c_getset[] = {
+    {"dtype", (getter)Matrix61c_get_dtype, NULL, "element type", NULL},
+    {"T", (getter)Matrix61c_get_T, NULL, "transposed view, sharing the entries", NULL},
+    {"accumulate", (getter)Matrix61c_get_accumulate, (setter)Matrix61c_set_accumulate,
+     "precision of the sums in matrix products", NULL},
+    {NULL}  /* Sentinel */
+};
+
+/* ITERATION */
+
+/*
+ * Iterator over a numc.Matrix: the rows of a 2D matrix as views that write through to it,
+ * and the entries of a 1D matrix as floats.
+ */
+typedef struct {
+    PyObject_HEAD
+    Matrix61c *m;
+    int next;  // index of the row or entry to return next
+} Matrix61cIter;
+
+void Matrix61cIter_dealloc(Matrix61cIter *self) {
+    Py_XDECREF(self->m);
+    Py_TYPE(self)->tp_free(self);
+}
+
+PyObject *Matrix61cIter_next(Matrix61cIter *self) {
+    matrix *mat = self->m->mat;
+    if (mat->is_1d) {
+        if (self->next >= mat->rows * mat->cols) {
+            return NULL;
+        }
+        int i = self->next++;
+        return PyFloat_FromDouble(mat->cols == 1 ? get(mat, i, 0) : get(mat, 0, i));
+    }
+    if (self->next >= mat->rows) {
+        return NULL;
+    }
+    matrix *row;
+    if (allocate_matrix_ref(&row, mat, self->next, 0, 1, mat->cols) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+        return NULL;
+    }
+    self->next++;
+    return wrap_matrix(row);
+}
+
+PyTypeObject Matrix61cIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "numc.MatrixIterator",
+    .tp_basicsize = sizeof(Matrix61cIter),
+    .tp_dealloc = (destructor)Matrix61cIter_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Iterator over the rows of a numc.Matrix",
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc)Matrix61cIter_next,
+};
+
+/*
+ * iter(m). Rows are views, so `for row in m` reads each row in place instead of building a
+ * list of it like m[i] does.
+ */
+PyObject *Matrix61c_iter(Matrix61c *self) {
+    Matrix61cIter *it = PyObject_New(Matrix61cIter, &Matrix61cIterType);
+    if (!it) {
+        return NULL;
+    }
+    Py_INCREF(self);
+    it->m = self;
+    it->next = 0;
+    return (PyObject *)it;
+}
+
+PyTypeObject Matrix61cType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "numc.Matrix",
+    .tp_basicsize = sizeof(Matrix61c),
+    .tp_dealloc = (destructor)Matrix61c_dealloc,
+    .tp_repr = (reprfunc)Matrix61c_repr,
+    .tp_as_number = &Matrix61c_as_number,
+    .tp_richcompare = (richcmpfunc)Matrix61c_richcompare,
+    .tp_iter = (getiterfunc)Matrix61c_iter,
+    .tp_flags = Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_BASETYPE,
+    .tp_doc = "numc.Matrix objects",
+    .tp_methods = Matrix61c_methods,
+    .tp_members = Matrix61c_members,
+    .tp_getset = Matrix61c_getset,
+    .tp_as_mapping = &Matrix61c_mapping,
+    .tp_as_buffer = &Matrix61c_as_buffer,
+    .tp_init = (initproc)Matrix61c_init,
+    .tp_new = Matrix61c_new
+};
+
+
+/* SPARSE MATRICES */
+
+PyTypeObject Sparse61cType;
+
+void Sparse61c_dealloc(Sparse61c *self) {
+    deallocate_sparse(self->sp);
+    Py_XDECREF(self->shape);
+    Py_TYPE(self)->tp_free(self);
+}
+
+/*
+ * A new numc.SparseMatrix is an empty 1 x 1 matrix until __init__ replaces it, so one made
+ * with SparseMatrix.__new__ alone is still a valid one.
+ */
+PyObject *Sparse61c_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    Sparse61c *self = (Sparse61c *)type->tp_alloc(type, 0);
+    if (!self) {
+        return NULL;
+    }
+    if (allocate_sparse(&self->sp, 1, 1, 0) != 0) {
+        Py_DECREF(self);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate sparse matrix");
+        return NULL;
+    }
+    if (!(self->shape = Py_BuildValue("(ii)", 1, 1))) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
+
+/*
+ * Wrap `sp` in a new numc.SparseMatrix object. On failure `sp` is deallocated and NULL is
+ * returned.
+ */
+PyObject *wrap_sparse(sparse *sp) {
+    Sparse61c *res = (Sparse61c *)Sparse61cType.tp_alloc(&Sparse61cType, 0);
+    if (!res) {
+        deallocate_sparse(sp);
+        return NULL;
+    }
+    res->sp = sp;
+    res->shape = Py_BuildValue("(ii)", sp->rows, sp->cols);
+    return (PyObject *)res;
+}
+
+/*
+ * Copy the python sequence `seq` of `n` numbers into `ints` (as ints), `longs` (as long longs)
+ * or `doubles`, whichever is not NULL. Return 0 upon success, setting a python error upon
+ * failure.
+ */
+static int parse_csr_array(PyObject *seq, const char *name, long long n, int *ints,
+                           long long *longs, double *doubles) {
+    PyObject *fast = PySequence_Fast(seq, name);
+    if (!fast) {
+        return -1;
+    }
+    if (PySequence_Fast_GET_SIZE(fast) != n) {
+        PyErr_Format(PyExc_ValueError, "%s has %zd entries, expected %lld", name,
+                     PySequence_Fast_GET_SIZE(fast), n);
+        Py_DECREF(fast);
+        return -1;
+    }
+    PyObject **items = PySequence_Fast_ITEMS(fast);
+    for (long long i = 0; i < n; i++) {
+        if (doubles) {
+            doubles[i] = PyFloat_AsDouble(items[i]);
+        } else if (longs) {
+            longs[i] = PyLong_AsLongLong(items[i]);
+        } else {
+            ints[i] = (int)PyLong_AsLong(items[i]);
+        }
+    }
+    Py_DECREF(fast);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+/*
+ * SparseMatrix(matrix) keeps the nonzero entries of a numc.Matrix.
+ * SparseMatrix(rows, cols, row_ptr, col_idx, values) takes CSR arrays as they are; the
+ * columns of each row must be increasing.
+ */
+int Sparse61c_init(PyObject *self, PyObject *args, PyObject *kwds) {
+    Sparse61c *sp_self = (Sparse61c *)self;
+    PyObject *dense = NULL;
+    int rows, cols;
+    PyObject *row_ptr, *col_idx, *values;
+    sparse *sp;
+
+    if (kwds && PyDict_Size(kwds) > 0) {
+        PyErr_SetString(PyExc_TypeError, "Invalid arguments");
+        return -1;
+    }
+    if (PyArg_ParseTuple(args, "O!", &Matrix61cType, &dense)) {
+        int ret = dense_to_sparse(&sp, ((Matrix61c *)dense)->mat);
+        if (ret != 0) {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to allocate sparse matrix");
+            return -1;
+        }
+    } else {
+        PyErr_Clear();
+        if (!PyArg_ParseTuple(args, "iiOOO", &rows, &cols, &row_ptr, &col_idx, &values)) {
+            PyErr_SetString(PyExc_TypeError, "Invalid arguments");
+            return -1;
+        }
+        Py_ssize_t nnz = PyObject_Length(values);
+        if (nnz < 0) {
+            return -1;
+        }
+        int ret = allocate_sparse(&sp, rows, cols, nnz);
+        if (ret == -1) {
+            PyErr_SetString(PyExc_ValueError, "Invalid matrix dimensions");
+            return -1;
+        } else if (ret != 0) {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to allocate sparse matrix");
+            return -1;
+        }
+        if (parse_csr_array(row_ptr, "row_ptr", (long long)rows + 1, NULL, sp->row_ptr, NULL) ||
+            parse_csr_array(col_idx, "col_idx", nnz, sp->col_idx, NULL, NULL) ||
+            parse_csr_array(values, "values", nnz, NULL, NULL, sp->vals)) {
+            deallocate_sparse(sp);
+            return -1;
+        }
+        if (check_sparse(sp) != 0) {
+            deallocate_sparse(sp);
+            PyErr_SetString(PyExc_ValueError, "Invalid CSR arrays");
+            return -1;
+        }
+    }
+
+    deallocate_sparse(sp_self->sp);
+    Py_XDECREF(sp_self->shape);
+    sp_self->sp = sp;
+    sp_self->shape = Py_BuildValue("(ii)", sp->rows, sp->cols);
+    return 0;
+}
+
+PyObject *Sparse61c_repr(PyObject *self) {
+    sparse *sp = ((Sparse61c *)self)->sp;
+    return PyUnicode_FromFormat("SparseMatrix(shape=(%d, %d), nnz=%lld)", sp->rows, sp->cols,
+                                sp->nnz);
+}
+
+/*
+ * Return this sparse matrix as a float64 numc.Matrix.
+ */
+PyObject *Sparse61c_to_dense(Sparse61c *self, PyObject *args) {
+    TRACE_BEGIN(t_op);
+    matrix *res = allocate_result(self->sp->rows, self->sp->cols, DTYPE_FLOAT64);
+    if (!res) {
+        return NULL;
+    }
+    sparse_to_dense(res, self->sp);
+    TRACE_END(t_op, "numc.sparse.to_dense", "op", res->rows, res->cols);
+    PyObject *res_mat = wrap_matrix(res);
+    return res_mat;
+}
+
+/*
+ * Sum of two numc.SparseMatrix objects, itself sparse.
+ */
+PyObject *Sparse61c_add(PyObject *self, PyObject *args) {
+    if (!PyObject_TypeCheck(self, &Sparse61cType) || !PyObject_TypeCheck(args, &Sparse61cType)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    TRACE_BEGIN(t_op);
+    sparse *res;
+    int ret = add_sparse(&res, ((Sparse61c *)self)->sp, ((Sparse61c *)args)->sp);
+    if (ret == -1) {
+        PyErr_SetString(PyExc_ValueError, "Matrix dimensions do not match");
+        return NULL;
+    } else if (ret != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate sparse matrix");
+        return NULL;
+    }
+    TRACE_END(t_op, "numc.sparse.add", "op", res->rows, res->cols);
+    PyObject *res_sp = wrap_sparse(res);
+    return res_sp;
+}
+
+/*
+ * numc.SparseMatrix times a dense numc.Matrix (or vector), giving a float64 numc.Matrix.
+ */
+PyObject *Sparse61c_multiply(PyObject *self, PyObject *args) {
+    if (!PyObject_TypeCheck(self, &Sparse61cType) || !PyObject_TypeCheck(args, &Matrix61cType)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    TRACE_BEGIN(t_op);
+    sparse *sp = ((Sparse61c *)self)->sp;
+    matrix *operand = ((Matrix61c *)args)->mat;
+    matrix *converted = NULL;
+    if (operand->dtype != DTYPE_FLOAT64) {
+        if (allocate_matrix(&converted, operand->rows, operand->cols) != 0) {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+            return NULL;
+        }
+        copy_matrix(converted, operand);
+        operand = converted;
+    }
+    if (sp->cols != operand->rows) {
+        deallocate_matrix(converted);
+        PyErr_SetString(PyExc_ValueError, "Matrix dimensions do not match");
+        return NULL;
+    }
+    matrix *res = allocate_result(sp->rows, operand->cols, DTYPE_FLOAT64);
+    if (!res) {
+        deallocate_matrix(converted);
+        return NULL;
+    }
+    int failed = mul_sparse_dense(res, sp, operand);
+    deallocate_matrix(converted);
+    if (failed) {
+        deallocate_matrix(res);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+        return NULL;
+    }
+    TRACE_END(t_op, "numc.sparse.mul", "op", res->rows, res->cols);
+    PyObject *res_mat = wrap_matrix(res);
+    return res_mat;
+}
+
+PyNumberMethods Sparse61c_as_number = {
+    .nb_add = (binaryfunc)Sparse61c_add,
+    .nb_multiply = (binaryfunc)Sparse61c_multiply,
+};
+
+PyMethodDef Sparse61c_methods[] = {
+    {"to_dense", (PyCFunction)Sparse61c_to_dense, METH_NOARGS, "Returns the matrix as a dense numc.Matrix."},
+    {NULL, NULL, 0, NULL}
+};
+
+PyMemberDef Sparse61c_members[] = {
+    {"shape", T_OBJECT_EX, offsetof(Sparse61c, shape), READONLY, "(rows, cols)"},
+    {NULL}  /* Sentinel */
+};
+
+/*
+ * Number of stored entries
+ */
+PyObject *Sparse61c_get_nnz(Sparse61c *self, void *closure) {
+    return PyLong_FromLongLong(self->sp->nnz);
+}
+
+PyGetSetDef Sparse61c_getset[] = {
+    {"nnz", (getter)Sparse61c_get_nnz, NULL, "number of stored entries", NULL},
+    {NULL}  /* Sentinel */
+};
+
+PyTypeObject Sparse61cType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "numc.SparseMatrix",
+    .tp_basicsize = sizeof(Sparse61c),
+    .tp_dealloc = (destructor)Sparse61c_dealloc,
+    .tp_repr = (reprfunc)Sparse61c_repr,
+    .tp_as_number = &Sparse61c_as_number,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "numc.SparseMatrix objects, in compressed sparse row form",
+    .tp_methods = Sparse61c_methods,
+    .tp_members = Sparse61c_members,
+    .tp_getset = Sparse61c_getset,
+    .tp_init = (initproc)Sparse61c_init,
+    .tp_new = Sparse61c_new
+};
+
+/* BATCHES */
+
+PyTypeObject Batch61cType;
+
+void Batch61c_dealloc(Batch61c *self) {
+    deallocate_batch(self->b);
+    Py_XDECREF(self->shape);
+    Py_TYPE(self)->tp_free(self);
+}
+
+/*
+ * A new numc.Batch holds one zeroed 1 x 1 matrix until __init__ replaces it, so a Batch made
+ * with Batch.__new__ alone is still a valid one.
+ */
+PyObject *Batch61c_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    Batch61c *self = (Batch61c *)type->tp_alloc(type, 0);
+    if (!self) {
+        return NULL;
+    }
+    if (!(self->b = allocate_batch_result(1, 1, 1, DTYPE_FLOAT64)) ||
+        !(self->shape = Py_BuildValue("(iii)", 1, 1, 1))) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
+
+/*
+ * Allocate a batch, setting a python error upon failure.
+ */
+batch *allocate_batch_result(int count, int rows, int cols, int dtype) {
+    batch *res;
+    int ret = allocate_batch(&res, count, rows, cols, dtype);
+    if (ret == -1) {
+        PyErr_SetString(PyExc_ValueError, "Invalid batch dimensions");
+        return NULL;
+    } else if (ret != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate batch");
+        return NULL;
+    }
+    return res;
+}
+
+/*
+ * Wrap `b` in a new numc.Batch object. On failure `b` is deallocated and NULL is returned.
+ */
+PyObject *wrap_batch(batch *b) {
+    Batch61c *res = (Batch61c *)Batch61cType.tp_alloc(&Batch61cType, 0);
+    if (!res) {
+        deallocate_batch(b);
+        return NULL;
+    }
+    res->b = b;
+    res->shape = Py_BuildValue("(iii)", b->count, b->rows, b->cols);
+    return (PyObject *)res;
+}
+
+/*
+ * Copy a non-empty sequence of equally shaped numc.Matrix objects into a new batch. The batch
+ * is float32 only if every matrix is. Sets a python error and returns NULL upon failure.
+ */
+batch *stack_matrices(PyObject *seq) {
+    PyObject *fast = PySequence_Fast(seq, "Expected a numc.Batch or a sequence of numc.Matrix");
+    if (!fast) {
+        return NULL;
+    }
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(fast);
+    PyObject **items = PySequence_Fast_ITEMS(fast);
+    if (count == 0 || count > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "Expected between 1 and INT_MAX matrices");
+        Py_DECREF(fast);
+        return NULL;
+    }
+    int dtype = DTYPE_FLOAT32;
+    for (Py_ssize_t i = 0; i < count; i++) {
+        if (!PyObject_TypeCheck(items[i], &Matrix61cType)) {
+            PyErr_SetString(PyExc_TypeError, "Expected a numc.Batch or a sequence of numc.Matrix");
+            Py_DECREF(fast);
+            return NULL;
+        }
+        matrix *mat = ((Matrix61c *)items[i])->mat;
+        matrix *first = ((Matrix61c *)items[0])->mat;
+        if (mat->rows != first->rows || mat->cols != first->cols) {
+            PyErr_SetString(PyExc_ValueError, "All matrices of a batch must have the same shape");
+            Py_DECREF(fast);
+            return NULL;
+        }
+        if (mat->dtype == DTYPE_FLOAT64) {
+            dtype = DTYPE_FLOAT64;
+        }
+    }
+    matrix *first = ((Matrix61c *)items[0])->mat;
+    batch *res = allocate_batch_result((int)count, first->rows, first->cols, dtype);
+    if (res) {
+        for (Py_ssize_t i = 0; i < count; i++) {
+            batch_set_matrix(res, (int)i, ((Matrix61c *)items[i])->mat);
+        }
+    }
+    Py_DECREF(fast);
+    return res;
+}
+
+/*
+ * Return the batch behind `obj`, a numc.Batch or a sequence of numc.Matrix. A new batch is
+ * stacked for a sequence and stored to *tmp, which the caller deallocates.
+ */
+batch *as_batch(PyObject *obj, batch **tmp) {
+    *tmp = NULL;
+    if (PyObject_TypeCheck(obj, &Batch61cType)) {
+        return ((Batch61c *)obj)->b;
+    }
+    *tmp = stack_matrices(obj);
+    return *tmp;
+}
+
+/*
+ * Batch(count, rows, cols, dtype="float64") is a zeroed batch; Batch(matrices) stacks a
+ * sequence of equally shaped numc.Matrix objects.
+ */
+int Batch61c_init(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"count", "rows", "cols", "dtype", NULL};
+    Batch61c *b_self = (Batch61c *)self;
+    PyObject *seq = NULL;
+    batch *res;
+    if (PyTuple_Size(args) == 1 && (!kwds || PyDict_Size(kwds) == 0)) {
+        seq = PyTuple_GetItem(args, 0);
+        res = stack_matrices(seq);
+    } else {
+        int count, rows, cols;
+        int dtype = DTYPE_FLOAT64;
+        PyObject *dtype_obj = NULL;
+        if (!PyArg_ParseTupleAndKeywords(args, kwds, "iii|O", kwlist, &count, &rows, &cols,
+                                         &dtype_obj)) {
+            return -1;
+        }
+        if (dtype_obj && parse_dtype(dtype_obj, &dtype) != 0) {
+            return -1;
+        }
+        res = allocate_batch_result(count, rows, cols, dtype);
+    }
+    if (!res) {
+        return -1;
+    }
+    deallocate_batch(b_self->b);
+    Py_XDECREF(b_self->shape);
+    b_self->b = res;
+    b_self->shape = Py_BuildValue("(iii)", res->count, res->rows, res->cols);
+    return 0;
+}
+
+PyObject *Batch61c_repr(PyObject *self) {
+    batch *b = ((Batch61c *)self)->b;
+    return PyUnicode_FromFormat("Batch(shape=(%d, %d, %d), dtype=%s)", b->count, b->rows, b->cols,
+                                dtype_names[b->dtype]);
+}
+
+Py_ssize_t Batch61c_length(Batch61c *self) {
+    return self->b->count;
+}
+
+/*
+ * Parse an entry index of `b`, counting from the end if it is negative. Sets a python error
+ * and returns -1 if it is out of range.
+ */
+static int batch_index(batch *b, PyObject *key) {
+    if (!PyLong_Check(key)) {
+        PyErr_SetString(PyExc_TypeError, "Batch indices must be integers");
+        return -1;
+    }
+    long i = PyLong_AsLong(key);
+    if (i < 0) {
+        i += b->count;
+    }
+    if (i < 0 || i >= b->count) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_IndexError, "Batch index out of range");
+        }
+        return -1;
+    }
+    return (int)i;
+}
+
+/*
+ * Entry i as a new numc.Matrix; also what iterating over a batch yields.
+ */
+PyObject *Batch61c_item(Batch61c *self, Py_ssize_t i) {
+    if (i < 0 || i >= self->b->count) {
+        PyErr_SetString(PyExc_IndexError, "Batch index out of range");
+        return NULL;
+    }
+    matrix *res = allocate_result(self->b->rows, self->b->cols, self->b->dtype);
+    if (!res) {
+        return NULL;
+    }
+    batch_get_matrix(res, self->b, (int)i);
+    return wrap_matrix(res);
+}
+
+/*
+ * batch[i] is a copy of entry i as a numc.Matrix.
+ */
+PyObject *Batch61c_subscript(Batch61c *self, PyObject *key) {
+    int i = batch_index(self->b, key);
+    if (i < 0) {
+        return NULL;
+    }
+    return Batch61c_item(self, i);
+}
+
+/*
+ * batch[i] = matrix copies a numc.Matrix of the right shape into entry i.
+ */
+int Batch61c_set_subscript(Batch61c *self, PyObject *key, PyObject *v) {
+    int i = batch_index(self->b, key);
+    if (i < 0) {
+        return -1;
+    }
+    if (!v || !PyObject_TypeCheck(v, &Matrix61cType)) {
+        PyErr_SetString(PyExc_TypeError, "Batch entries must be numc.Matrix objects");
+        return -1;
+    }
+    if (batch_set_matrix(self->b, i, ((Matrix61c *)v)->mat) != 0) {
+        PyErr_SetString(PyExc_ValueError, "Matrix shape does not match the batch");
+        return -1;
+    }
+    return 0;
+}
+
+PyObject *Batch61c_get_dtype(Batch61c *self, void *closure) {
+    return PyUnicode_FromString(dtype_names[self->b->dtype]);
+}
+
+PyMappingMethods Batch61c_mapping = {
+    (lenfunc)Batch61c_length,
+    (binaryfunc)Batch61c_subscript,
+    (objobjargproc)Batch61c_set_subscript,
+};
+
+PySequenceMethods Batch61c_sequence = {
+    .sq_length = (lenfunc)Batch61c_length,
+    .sq_item = (ssizeargfunc)Batch61c_item,
+};
+
+PyMemberDef Batch61c_members[] = {
+    {"shape", T_OBJECT_EX, offsetof(Batch61c, shape), READONLY, "(count, rows, cols)"},
+    {NULL}  /* Sentinel */
+};
+
+PyGetSetDef Batch61c_getset[] = {
+    {"dtype", (getter)Batch61c_get_dtype, NULL, "element type", NULL},
+    {NULL}  /* Sentinel */
+};
+
+PyTypeObject Batch61cType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "numc.Batch",
+    .tp_basicsize = sizeof(Batch61c),
+    .tp_dealloc = (destructor)Batch61c_dealloc,
+    .tp_repr = (reprfunc)Batch61c_repr,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "numc.Batch objects, stacks of equally shaped matrices",
+    .tp_members = Batch61c_members,
+    .tp_getset = Batch61c_getset,
+    .tp_as_mapping = &Batch61c_mapping,
+    .tp_as_sequence = &Batch61c_sequence,
+    .tp_init = (initproc)Batch61c_init,
+    .tp_new = Batch61c_new
+};
+
+/*
+ * numc.batch_matmul(As, Bs). Multiply every matrix of As with the matrix of Bs at the same
+ * position in one native call. Each side is a numc.Batch or a sequence of numc.Matrix, and a
+ * side with a single matrix is used for every product. Returns a numc.Batch if both sides
+ * are batches and a list of numc.Matrix otherwise.
+ */
+PyObject *Matrix61c_batch_matmul(PyObject *self, PyObject *args) {
+    PyObject *a_obj, *b_obj;
+    if (!PyArg_ParseTuple(args, "OO", &a_obj, &b_obj)) {
+        return NULL;
+    }
+    TRACE_BEGIN(t_op);
+    batch *tmp1, *tmp2;
+    batch *b1 = as_batch(a_obj, &tmp1);
+    if (!b1) {
+        return NULL;
+    }
+    batch *b2 = as_batch(b_obj, &tmp2);
+    if (!b2) {
+        deallocate_batch(tmp1);
+        return NULL;
+    }
+
+    PyObject *ret = NULL;
+    batch *res = NULL;
+    int count = b1->count > b2->count ? b1->count : b2->count;
+    int rows = b1->rows;
+    if (b1->dtype != b2->dtype) {
+        PyErr_SetString(PyExc_TypeError, "Batches must have the same dtype");
+    } else if ((b1->count != count && b1->count != 1) || (b2->count != count && b2->count != 1) ||
+               b1->cols != b2->rows) {
+        PyErr_SetString(PyExc_ValueError, "Batch dimensions do not match");
+    } else if ((res = allocate_batch_result(count, b1->rows, b2->cols, b1->dtype))) {
+        // Another thread may re-init a numc.Batch operand, dropping its batch, meanwhile
+        retain_batch(b1);
+        retain_batch(b2);
+        Py_BEGIN_ALLOW_THREADS
+        batch_mul(res, b1, b2);
+        Py_END_ALLOW_THREADS
+        deallocate_batch(b1);
+        deallocate_batch(b2);
+        if (!tmp1 && !tmp2) {
+            ret = wrap_batch(res);
+            res = NULL;
+        } else {
+            ret = PyList_New(count);
+            for (int i = 0; ret && i < count; i++) {
+                matrix *mat = allocate_result(res->rows, res->cols, res->dtype);
+                PyObject *item = mat ? wrap_matrix(mat) : NULL;
+                if (!item) {
+                    Py_CLEAR(ret);
+                    break;
+                }
+                batch_get_matrix(mat, res, i);
+                PyList_SET_ITEM(ret, i, item);
+            }
+        }
+    }
+    deallocate_batch(res);
+    deallocate_batch(tmp1);
+    deallocate_batch(tmp2);
+    TRACE_END(t_op, "numc.batch_matmul", "op", count, rows);
+    return ret;
+}
+
+/* MASKS */
+
+void Mask61c_dealloc(Mask61c *self) {
+    deallocate_mask(self->m);
+    Py_XDECREF(self->shape);
+    Py_TYPE(self)->tp_free(self);
+}
+
+/*
+ * Wrap `m` in a new numc.Mask object. On failure `m` is deallocated and NULL is returned.
+ */
+PyObject *wrap_mask(mask *m) {
+    Mask61c *res = (Mask61c *)Mask61cType.tp_alloc(&Mask61cType, 0);
+    if (!res) {
+        deallocate_mask(m);
+        return NULL;
+    }
+    res->m = m;
+    res->shape = get_shape(m->rows, m->cols);
+    return (PyObject *)res;
+}
+
+PyObject *Mask61c_repr(PyObject *self) {
+    mask *m = ((Mask61c *)self)->m;
+    return PyUnicode_FromFormat("Mask(shape=(%d, %d), count=%lld)", m->rows, m->cols,
+                                mask_count(m));
+}
+
+/*
+ * The mask as a list of rows of bools.
+ */
+PyObject *Mask61c_to_list(Mask61c *self, PyObject *args) {
+    mask *m = self->m;
+    PyObject *rows = PyList_New(m->rows);
+    if (!rows) {
+        return NULL;
+    }
+    for (int r = 0; r < m->rows; r++) {
+        PyObject *row = PyList_New(m->cols);
+        if (!row) {
+            Py_DECREF(rows);
+            return NULL;
+        }
+        for (int c = 0; c < m->cols; c++) {
+            PyObject *v = m->data[(size_t)r * m->cols + c] ? Py_True : Py_False;
+            Py_INCREF(v);
+            PyList_SET_ITEM(row, c, v);
+        }
+        PyList_SET_ITEM(rows, r, row);
+    }
+    return rows;
+}
+
+/*
+ * Number of set entries
+ */
+PyObject *Mask61c_count(Mask61c *self, PyObject *args) {
+    return PyLong_FromLongLong(mask_count(self->m));
+}
+
+PyObject *Mask61c_any(Mask61c *self, PyObject *args) {
+    return PyBool_FromLong(mask_count(self->m) > 0);
+}
+
+PyObject *Mask61c_all(Mask61c *self, PyObject *args) {
+    return PyBool_FromLong(mask_count(self->m) == (long long)self->m->rows * self->m->cols);
+}
+
+/*
+ * mask[i, j] is a bool.
+ */
+PyObject *Mask61c_subscript(Mask61c *self, PyObject *key) {
+    mask *m = self->m;
+    int r, c;
+    if (!PyTuple_Check(key) || PyTuple_GET_SIZE(key) != 2) {
+        PyErr_SetString(PyExc_TypeError, "Mask indices must be (row, col) pairs");
+        return NULL;
+    }
+    if (parse_index(PyTuple_GET_ITEM(key, 0), m->rows, &r) != 0 ||
+        parse_index(PyTuple_GET_ITEM(key, 1), m->cols, &c) != 0) {
+        return NULL;
     }
-    else if (PySlice_Check(key))
-    {
-      Py_ssize_t start;
-      Py_ssize_t step ;
-      Py_ssize_t end ;
-      Py_ssize_t slice_length ;
-      if (PySlice_GetIndicesEx(key, self->mat->rows, &start, &end, &step, &slice_length) == 0)
-      {
-        PyObject * py_lst;
+    return PyBool_FromLong(m->data[(size_t)r * m->cols + c]);
+}
 
-        py_lst = PyList_New(slice_length);
+/*
+ * Elementwise &, | and ~ of masks.
+ */
+static PyObject *mask_binary(PyObject *a, PyObject *b, int op) {
+    if (!PyObject_TypeCheck(a, &Mask61cType) || !PyObject_TypeCheck(b, &Mask61cType)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    mask *m1 = ((Mask61c *)a)->m, *m2 = ((Mask61c *)b)->m;
+    if (m1->rows != m2->rows || m1->cols != m2->cols) {
+        PyErr_SetString(PyExc_ValueError, "Mask dimensions do not match");
+        return NULL;
+    }
+    mask *res;
+    if (allocate_mask(&res, m1->rows, m1->cols) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate mask");
+        return NULL;
+    }
+    mask_logic(res, m1, m2, op);
+    return wrap_mask(res);
+}
 
-        int row = 0;
-        for (int i = start ; i< end; i+=step)
-        {
+PyObject *Mask61c_and(PyObject *a, PyObject *b) {
+    return mask_binary(a, b, MASK_AND);
+}
 
-          PyList_SetItem(py_lst, row, PyList_New(self->mat->cols));
-          PyObject *curr_row = PyList_GetItem(py_lst, row);
-          row ++;
-          for(int j = 0; j< self->mat->cols; j++)
-          {
-            PyList_SetItem(curr_row, j, PyFloat_FromDouble(get(self->mat, i, j)));
-          }
-        }
-        return py_lst;
-      }
-      else
-      {
-        PyErr_SetString(PyExc_TypeError, "Invalid slice format!");
+PyObject *Mask61c_or(PyObject *a, PyObject *b) {
+    return mask_binary(a, b, MASK_OR);
+}
+
+PyObject *Mask61c_invert(Mask61c *self) {
+    mask *res;
+    if (allocate_mask(&res, self->m->rows, self->m->cols) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate mask");
         return NULL;
-      }
     }
-    else if (PyTuple_Check(key))
-    {
-      PyObject *arg1 = NULL;
-      PyObject *arg2 = NULL;
-      if (PyArg_UnpackTuple(key, "args", 2, 2, &arg1, &arg2))
-      {
-        PyObject * py_lst;
-        Py_ssize_t start1;
-        Py_ssize_t step1 ;
-        Py_ssize_t end1 ;
-        Py_ssize_t slice_length1 ;
-        Py_ssize_t start2;
-        Py_ssize_t step2 ;
-        Py_ssize_t end2 ;
-        Py_ssize_t slice_length2 ;
+    mask_logic(res, self->m, NULL, MASK_NOT);
+    return wrap_mask(res);
+}
 
-        if (PySlice_Check(arg1))
-        {
-            if (!PySlice_GetIndicesEx(arg1, self->mat->rows, &start1, &end1, &step1, &slice_length1) == 0)
-            {
-              PyErr_SetString(PyExc_TypeError, "Invalid slice format for arg1!");
-              return NULL;
-            }
-        }
-        else if (PyLong_Check(arg1))
-        {
-          slice_length1 = -1;
-          start1 = PyLong_AsLong(arg1);
-        }
-        else
-        {
-          PyErr_SetString(PyExc_TypeError, "Invalid first args in tuple!");
-          return NULL;
-        }
+/*
+ * `if a == b:` would silently test one entry or all of them, so it is an error; use any() or
+ * all().
+ */
+int Mask61c_bool(Mask61c *self) {
+    PyErr_SetString(PyExc_ValueError,
+                    "The truth value of a numc.Mask is ambiguous, use any() or all()");
+    return -1;
+}
 
-        if (PySlice_Check(arg2))
-        {
-            if (!PySlice_GetIndicesEx(arg2, self->mat->rows, &start2, &end2, &step2, &slice_length2) == 0)
-            {
-              PyErr_SetString(PyExc_TypeError, "Invalid slice format for arg2!");
-              return NULL;
-            }
-        }
-        else if (PyLong_Check(arg2))
-        {
-          slice_length2 = -1;
-          start2 = PyLong_AsLong(arg2);
-        }
-        else
-        {
-          PyErr_SetString(PyExc_TypeError, "Invalid second args in tuple!");
-          return NULL;
-        }
+PyNumberMethods Mask61c_as_number = {
+    .nb_bool = (inquiry)Mask61c_bool,
+    .nb_invert = (unaryfunc)Mask61c_invert,
+    .nb_and = (binaryfunc)Mask61c_and,
+    .nb_or = (binaryfunc)Mask61c_or,
+};
 
-        if (slice_length1 == -1 && slice_length2 == -1)
-        {
-          return PyFloat_FromDouble(get(self->mat, start1, start2));
-        }
-        else if (slice_length1 == -1 && slice_length2 != -1)
-        {
-          py_lst = PyList_New(slice_length2);
-          int col = 0;
-          for (int i =start2; i< end2; i+=step2)
-          {
-            PyList_SetItem(py_lst, col, PyFloat_FromDouble(get(self->mat, start1, i)));
-            col ++;
-          }
-          return py_lst;
-        }
-        else if (slice_length1 != -1 && slice_length2 == -1)
-        {
-          py_lst = PyList_New(slice_length1);
-          int row = 0;
-          for (int i =start1; i< end1; i+=step1)
-          {
-            PyList_SetItem(py_lst, row, PyFloat_FromDouble(get(self->mat, i, start2)));
-            row ++;
-          }
-          return py_lst;
-        }
-        else if (slice_length1 != -1 && slice_length2 != -1)
-        {
+PyMappingMethods Mask61c_mapping = {
+    .mp_subscript = (binaryfunc)Mask61c_subscript,
+};
 
+PyMethodDef Mask61c_methods[] = {
+    {"to_list", (PyCFunction)Mask61c_to_list, METH_NOARGS, "Returns the mask as a list of rows of bools."},
+    {"count", (PyCFunction)Mask61c_count, METH_NOARGS, "Returns the number of set entries."},
+    {"any", (PyCFunction)Mask61c_any, METH_NOARGS, "Returns whether any entry is set."},
+    {"all", (PyCFunction)Mask61c_all, METH_NOARGS, "Returns whether every entry is set."},
+    {NULL, NULL, 0, NULL}
+};
 
-          py_lst = PyList_New(slice_length1);
+PyMemberDef Mask61c_members[] = {
+    {"shape", T_OBJECT_EX, offsetof(Mask61c, shape), READONLY, "(rows, cols)"},
+    {NULL}  /* Sentinel */
+};
 
-          int row = 0;
-          for (int r = start1; r<end1; r+=step1)
-          {
-              PyList_SetItem(py_lst, row, PyList_New(slice_length2));
-              PyObject *curr_row = PyList_GetItem(py_lst, row);
-              int col = 0;
-              for (int c = start2 ; c< end2; c+=step2)
-              {
-                PyList_SetItem(curr_row, col, PyFloat_FromDouble(get(self->mat, r, c)));
-                col ++;
-              }
-              row ++;
-          }
+PyTypeObject Mask61cType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "numc.Mask",
+    .tp_basicsize = sizeof(Mask61c),
+    .tp_dealloc = (destructor)Mask61c_dealloc,
+    .tp_repr = (reprfunc)Mask61c_repr,
+    .tp_as_number = &Mask61c_as_number,
+    .tp_as_mapping = &Mask61c_mapping,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "numc.Mask objects, the results of comparing numc.Matrix objects",
+    .tp_methods = Mask61c_methods,
+    .tp_members = Mask61c_members,
+};
 
-          return py_lst;
+/* SHARDED PRODUCTS */
 
+void Shard61c_dealloc(Shard61c *self) {
+    shard_pool_stop(self->pool);
+    Py_TYPE(self)->tp_free(self);
+}
 
-        }
-        else
-        {
-          PyErr_SetString(PyExc_TypeError, "Something is wrong!");
-          return NULL;
-        }
-      }
-      else
-      {
-          PyErr_SetString(PyExc_TypeError, "Invalid tuple format!");
-          return NULL;
-      }
+/*
+ * numc.ShardPool(workers=None). Start `workers` worker processes, by default one per
+ * processor, that compute the products of matmul and pow in blocks of rows.
+ */
+int Shard61c_init(PyObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"workers", NULL};
+    Shard61c *s = (Shard61c *)self;
+    int workers = omp_get_num_procs();
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:ShardPool", kwlist, &workers)) {
+        return -1;
+    }
+    if (s->pool) {
+        PyErr_SetString(PyExc_RuntimeError, "ShardPool is already started");
+        return -1;
+    }
+    int ret = shard_pool_start(&s->pool, workers);
+    if (ret == -1) {
+        PyErr_SetString(PyExc_ValueError, "workers must be positive");
+        return -1;
+    } else if (ret == -2) {
+        PyErr_NoMemory();
+        return -1;
+    } else if (ret != 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
     }
+    return 0;
+}
 
+/*
+ * Make sure the pool of `self` can take a call, setting a python error otherwise.
+ */
+static int shard_ready(Shard61c *self) {
+    if (!self->pool) {
+        PyErr_SetString(PyExc_ValueError, "ShardPool is closed");
+        return -1;
+    }
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "ShardPool is in use by another thread");
+        return -1;
+    }
+    return 0;
 }
 
 /*
- * Given a numc.Matrix `self`, index into it with `key`, and set the indexed result to `v`.
+ * Raise the python error for a failed shard_mul or shard_pow.
  */
-int Matrix61c_set_subscript(Matrix61c* self, PyObject *key, PyObject *v) {
-    /* TODO: YOUR CODE HERE */
+static void shard_error(int ret, const char *message) {
+    if (ret == -1) {
+        PyErr_SetString(PyExc_ValueError, message);
+    } else if (ret == -2) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to allocate matrix");
+    } else {
+        PyErr_SetFromErrno(PyExc_OSError);
+    }
 }
 
-PyMappingMethods Matrix61c_mapping = {
-    NULL,
-    (binaryfunc) Matrix61c_subscript,
-    (objobjargproc) Matrix61c_set_subscript,
+/*
+ * pool.matmul(a, b). Return a * b, computed by the workers in blocks of rows. Operands made
+ * with numc.Matrix.shared or attach are read in place; others are copied to shared memory
+ * first.
+ */
+PyObject *Shard61c_matmul(Shard61c *self, PyObject *args) {
+    PyObject *a, *b;
+    if (!PyArg_ParseTuple(args, "O!O!:matmul", &Matrix61cType, &a, &Matrix61cType, &b) ||
+        shard_ready(self) != 0) {
+        return NULL;
+    }
+    matrix *operand0 = ((Matrix61c *)a)->mat;
+    matrix *operand1 = ((Matrix61c *)b)->mat;
+    matrix *promoted;
+    if (promote_operands(&operand0, &operand1, &promoted) != 0) {
+        return NULL;
+    }
+    matrix *res = allocate_result(operand0->rows, operand1->cols, operand0->dtype);
+    if (!res) {
+        deallocate_matrix(promoted);
+        return NULL;
+    }
+    int ret;
+    self->busy = 1;
+    matrix_buffer *pin0 = pin_matrix(operand0), *pin1 = pin_matrix(operand1);
+    Py_BEGIN_ALLOW_THREADS
+    ret = shard_mul(self->pool, res, operand0, operand1);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(operand0, pin0);
+    unpin_matrix(operand1, pin1);
+    self->busy = 0;
+    deallocate_matrix(promoted);
+    if (ret != 0) {
+        deallocate_matrix(res);
+        shard_error(ret, "Matrix dimensions do not match");
+        return NULL;
+    }
+    return wrap_matrix(res);
+}
+
+/*
+ * pool.pow(a, n). Return a ** n, with each product of the squarings computed by the workers.
+ */
+PyObject *Shard61c_pow(Shard61c *self, PyObject *args) {
+    PyObject *a;
+    int pow;
+    if (!PyArg_ParseTuple(args, "O!i:pow", &Matrix61cType, &a, &pow) || shard_ready(self) != 0) {
+        return NULL;
+    }
+    matrix *mat = ((Matrix61c *)a)->mat;
+    matrix *res = allocate_result(mat->rows, mat->cols, mat->dtype);
+    if (!res) {
+        return NULL;
+    }
+    int ret;
+    self->busy = 1;
+    matrix_buffer *pin = pin_matrix(mat);
+    Py_BEGIN_ALLOW_THREADS
+    ret = shard_pow(self->pool, res, mat, pow);
+    Py_END_ALLOW_THREADS
+    unpin_matrix(mat, pin);
+    self->busy = 0;
+    if (ret != 0) {
+        deallocate_matrix(res);
+        shard_error(ret, "Matrix must be square and power must be non-negative");
+        return NULL;
+    }
+    return wrap_matrix(res);
+}
+
+/*
+ * pool.close(). Stop the workers. Also called on leaving a with block.
+ */
+PyObject *Shard61c_close(Shard61c *self, PyObject *args) {
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "ShardPool is in use by another thread");
+        return NULL;
+    }
+    shard_pool_stop(self->pool);
+    self->pool = NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *Shard61c_enter(PyObject *self, PyObject *args) {
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject *Shard61c_get_pids(Shard61c *self, void *closure) {
+    int count = self->pool ? self->pool->count : 0;
+    PyObject *pids = PyTuple_New(count);
+    for (int i = 0; pids && i < count; i++) {
+        PyTuple_SET_ITEM(pids, i, PyLong_FromLong(self->pool->workers[i].pid));
+    }
+    return pids;
+}
+
+static PyObject *Shard61c_get_restarts(Shard61c *self, void *closure) {
+    return PyLong_FromLong(self->pool ? self->pool->restarts : 0);
+}
+
+PyMethodDef Shard61c_methods[] = {
+    {"matmul", (PyCFunction)Shard61c_matmul, METH_VARARGS, "Returns the matrix product, computed by the workers."},
+    {"pow", (PyCFunction)Shard61c_pow, METH_VARARGS, "Returns the matrix power, computed by the workers."},
+    {"close", (PyCFunction)Shard61c_close, METH_NOARGS, "Stops the workers."},
+    {"__enter__", (PyCFunction)Shard61c_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)Shard61c_close, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
 };
 
-/* INSTANCE ATTRIBUTES*/
-PyMemberDef Matrix61c_members[] = {
-    {
-        "shape", T_OBJECT_EX, offsetof(Matrix61c, shape), 0,
-        "(rows, cols)"
-    },
+PyGetSetDef Shard61c_getset[] = {
+    {"pids", (getter)Shard61c_get_pids, NULL, "Process ids of the workers", NULL},
+    {"restarts", (getter)Shard61c_get_restarts, NULL, "Workers started again after dying", NULL},
     {NULL}  /* Sentinel */
 };
 
-PyTypeObject Matrix61cType = {
+PyTypeObject Shard61cType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "numc.Matrix",
-    .tp_basicsize = sizeof(Matrix61c),
-    .tp_dealloc = (destructor)Matrix61c_dealloc,
-    .tp_repr = (reprfunc)Matrix61c_repr,
-    .tp_as_number = &Matrix61c_as_number,
-    .tp_flags = Py_TPFLAGS_DEFAULT |
-    Py_TPFLAGS_BASETYPE,
-    .tp_doc = "numc.Matrix objects",
-    .tp_methods = Matrix61c_methods,
-    .tp_members = Matrix61c_members,
-    .tp_as_mapping = &Matrix61c_mapping,
-    .tp_init = (initproc)Matrix61c_init,
-    .tp_new = Matrix61c_new
+    .tp_name = "numc.ShardPool",
+    .tp_basicsize = sizeof(Shard61c),
+    .tp_dealloc = (destructor)Shard61c_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "numc.ShardPool objects, worker processes that share out matrix products",
+    .tp_methods = Shard61c_methods,
+    .tp_getset = Shard61c_getset,
+    .tp_init = (initproc)Shard61c_init,
+    .tp_new = PyType_GenericNew
 };
 
-
 struct PyModuleDef numcmodule = {
     PyModuleDef_HEAD_INIT,
     "numc",
@@ -747,12 +3710,29 @@ struct PyModuleDef numcmodule = {
     Matrix61c_class_methods
 };
 
+/* Finish a trace left running when the interpreter exits */
+static void trace_exit(void) {
+    trace_stop();
+}
+
 /* Initialize the numc module */
 PyMODINIT_FUNC PyInit_numc(void) {
     PyObject* m;
 
+    /* Comparisons are elementwise, but matrices still hash by identity as they did before */
+    Matrix61cType.tp_hash = PyBaseObject_Type.tp_hash;
     if (PyType_Ready(&Matrix61cType) < 0)
         return NULL;
+    if (PyType_Ready(&Matrix61cIterType) < 0)
+        return NULL;
+    if (PyType_Ready(&Sparse61cType) < 0)
+        return NULL;
+    if (PyType_Ready(&Batch61cType) < 0)
+        return NULL;
+    if (PyType_Ready(&Mask61cType) < 0)
+        return NULL;
+    if (PyType_Ready(&Shard61cType) < 0)
+        return NULL;
 
     m = PyModule_Create(&numcmodule);
     if (m == NULL)
@@ -760,6 +3740,38 @@ PyMODINIT_FUNC PyInit_numc(void) {
 
     Py_INCREF(&Matrix61cType);
     PyModule_AddObject(m, "Matrix", (PyObject *)&Matrix61cType);
+    Py_INCREF(&Sparse61cType);
+    PyModule_AddObject(m, "SparseMatrix", (PyObject *)&Sparse61cType);
+    Py_INCREF(&Batch61cType);
+    PyModule_AddObject(m, "Batch", (PyObject *)&Batch61cType);
+    Py_INCREF(&Mask61cType);
+    PyModule_AddObject(m, "Mask", (PyObject *)&Mask61cType);
+    Py_INCREF(&Shard61cType);
+    PyModule_AddObject(m, "ShardPool", (PyObject *)&Shard61cType);
+    PyModule_AddStringConstant(m, "float64", dtype_names[DTYPE_FLOAT64]);
+    PyModule_AddStringConstant(m, "float32", dtype_names[DTYPE_FLOAT32]);
+
+    /* Pick the kernels for this CPU. NUMC_ISA=scalar|avx2|avx512 forces a variant */
+    const char *isa = getenv("NUMC_ISA");
+    if (kernels_select(isa) != 0) {
+        if (PyErr_WarnFormat(PyExc_RuntimeWarning, 1,
+                             "NUMC_ISA=%s is not available on this machine, using the best supported kernels",
+                             isa) < 0) {
+            Py_DECREF(m);
+            return NULL;
+        }
+        kernels_select(NULL);
+    }
+
+    /* A missing or invalid profile just leaves the built-in defaults */
+    tune_load(tune_default_path());
+
+    /* NUMC_TRACE=path traces the whole process; the file is finished at exit */
+    const char *trace_path = getenv("NUMC_TRACE");
+    if (trace_path && trace_path[0]) {
+        trace_start(trace_path);
+    }
+    Py_AtExit(trace_exit);
     printf("CS61C Fall 2020 Project 4: numc imported!\n");
     fflush(stdout);
     return m;
@@ -1,4 +1,10 @@
 #include "matrix.h"
+#include "sparse.h"
+#include "batch.h"
+#include "mask.h"
+#include "matfile.h"
+#include "ooc.h"
+#include "shard.h"
 
 /*
  * Defines the struct that represents the object
@@ -10,24 +16,148 @@ typedef struct {
     PyObject_HEAD
     matrix* mat;
     PyObject *shape;
+    Py_ssize_t buf_shape[2];    // shape and strides handed out with the buffer of mat
+    Py_ssize_t buf_strides[2];
+    int exports;                // buffers of mat still held by python code
 } Matrix61c;
 
+/*
+ * numc.SparseMatrix, wrapping a CSR matrix
+ */
+typedef struct {
+    PyObject_HEAD
+    sparse *sp;
+    PyObject *shape;
+} Sparse61c;
+
+/*
+ * numc.Batch, wrapping a stack of equally shaped matrices
+ */
+typedef struct {
+    PyObject_HEAD
+    batch *b;
+    PyObject *shape;
+} Batch61c;
+
+/*
+ * numc.Mask, wrapping the result of a comparison
+ */
+typedef struct {
+    PyObject_HEAD
+    mask *m;
+    PyObject *shape;
+} Mask61c;
+
+/*
+ * numc.ShardPool, wrapping a pool of worker processes
+ */
+typedef struct {
+    PyObject_HEAD
+    shard_pool *pool;
+    int busy;  // a call is running with the GIL released
+} Shard61c;
+
 /* Function definitions */
-int init_rand(PyObject *self, int rows, int cols, unsigned int seed, double low, double high);
-int init_fill(PyObject *self, int rows, int cols, double val);
-int init_1d(PyObject *self, int rows, int cols, PyObject *lst);
-int init_2d(PyObject *self, PyObject *lst);
+int parse_dtype(PyObject *obj, int *dtype);
+PyObject *wrap_matrix(matrix *mat);
+int promote_operands(matrix **mat1, matrix **mat2, matrix **tmp);
+matrix *allocate_result(int rows, int cols, int dtype);
+int make_writable(matrix *mat);
+PyObject *share_result(Matrix61c *self);
+int init_rand(PyObject *self, int rows, int cols, unsigned int seed, double low, double high, int dtype);
+int init_fill(PyObject *self, int rows, int cols, double val, int dtype);
+int init_1d(PyObject *self, int rows, int cols, PyObject *lst, int dtype);
+int init_2d(PyObject *self, PyObject *lst, int dtype);
 void Matrix61c_dealloc(Matrix61c *self);
 PyObject *Matrix61c_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
 int Matrix61c_init(PyObject *self, PyObject *args, PyObject *kwds);
 PyObject *Matrix61c_to_list(Matrix61c *self);
 PyObject *Matrix61c_repr(PyObject *self);
-PyObject *Matrix61c_set_value(Matrix61c *self, PyObject* args);
-PyObject *Matrix61c_get_value(Matrix61c *self, PyObject* args);
+PyObject *Matrix61c_set_value(Matrix61c *self, PyObject *const *args, Py_ssize_t nargs);
+PyObject *Matrix61c_get_value(Matrix61c *self, PyObject *const *args, Py_ssize_t nargs);
+PyObject *Matrix61c_take(Matrix61c *self, PyObject *const *args, Py_ssize_t nargs);
+PyObject *Matrix61c_put(Matrix61c *self, PyObject *const *args, Py_ssize_t nargs);
 PyObject *Matrix61c_add(Matrix61c* self, PyObject* args);
 PyObject *Matrix61c_sub(Matrix61c* self, PyObject* args);
 PyObject *Matrix61c_multiply(Matrix61c* self, PyObject *args);
 PyObject *Matrix61c_neg(Matrix61c* self);
 PyObject *Matrix61c_abs(Matrix61c *self);
+PyObject *Matrix61c_pos(Matrix61c *self);
+PyObject *Matrix61c_copy(Matrix61c *self, PyObject *args);
 PyObject *Matrix61c_pow(Matrix61c *self, PyObject *pow, PyObject *optional);
+PyObject *Matrix61c_astype(Matrix61c *self, PyObject *dtype);
+PyObject *Matrix61c_transpose(Matrix61c *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_reshape(Matrix61c *self, PyObject *args);
+PyObject *Matrix61c_flatten(Matrix61c *self, PyObject *args);
+PyObject *Matrix61c_iter(Matrix61c *self);
+int Matrix61c_getbuffer(Matrix61c *self, Py_buffer *view, int flags);
+void Matrix61c_releasebuffer(Matrix61c *self, Py_buffer *view);
+PyObject *Matrix61c_reduce_ex(Matrix61c *self, PyObject *protocol);
+PyObject *Matrix61c_from_buffer(PyObject *self, PyObject *args);
+PyObject *Matrix61c_shared(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_attach(PyObject *self, PyObject *args);
+PyObject *Matrix61c_matmul(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_power_apply(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_uniform(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_normal(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_exp(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_log(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_sqrt(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_power(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_tanh(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_sigmoid(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_relu(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_clip(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_elementwise_multiply(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_divide(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_minimum(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_maximum(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_multiply_method(Matrix61c *self, PyObject *other);
+PyObject *Matrix61c_true_divide(PyObject *self, PyObject *other);
+PyObject *Matrix61c_richcompare(PyObject *self, PyObject *other, int op);
+PyObject *Matrix61c_where(PyObject *self, PyObject *args);
+PyObject *Matrix61c_save(PyObject *self, PyObject *args);
+PyObject *Matrix61c_load(PyObject *self, PyObject *args);
+PyObject *Matrix61c_open_mmap(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_matmul_ooc(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_loadtxt(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Matrix61c_savetxt(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *wrap_sparse(sparse *sp);
+void Sparse61c_dealloc(Sparse61c *self);
+PyObject *Sparse61c_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
+int Sparse61c_init(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Sparse61c_repr(PyObject *self);
+PyObject *Sparse61c_to_dense(Sparse61c *self, PyObject *args);
+PyObject *Sparse61c_add(PyObject *self, PyObject *args);
+PyObject *Sparse61c_multiply(PyObject *self, PyObject *args);
+batch *allocate_batch_result(int count, int rows, int cols, int dtype);
+PyObject *wrap_batch(batch *b);
+batch *stack_matrices(PyObject *seq);
+batch *as_batch(PyObject *obj, batch **tmp);
+void Batch61c_dealloc(Batch61c *self);
+PyObject *Batch61c_new(PyTypeObject *type, PyObject *args, PyObject *kwds);
+int Batch61c_init(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Batch61c_repr(PyObject *self);
+Py_ssize_t Batch61c_length(Batch61c *self);
+PyObject *Batch61c_item(Batch61c *self, Py_ssize_t i);
+PyObject *Batch61c_subscript(Batch61c *self, PyObject *key);
+int Batch61c_set_subscript(Batch61c *self, PyObject *key, PyObject *v);
+PyObject *Matrix61c_batch_matmul(PyObject *self, PyObject *args);
+PyObject *wrap_mask(mask *m);
+void Mask61c_dealloc(Mask61c *self);
+PyObject *Mask61c_repr(PyObject *self);
+PyObject *Mask61c_to_list(Mask61c *self, PyObject *args);
+PyObject *Mask61c_count(Mask61c *self, PyObject *args);
+PyObject *Mask61c_any(Mask61c *self, PyObject *args);
+PyObject *Mask61c_all(Mask61c *self, PyObject *args);
+PyObject *Mask61c_subscript(Mask61c *self, PyObject *key);
+PyObject *Mask61c_and(PyObject *a, PyObject *b);
+PyObject *Mask61c_or(PyObject *a, PyObject *b);
+PyObject *Mask61c_invert(Mask61c *self);
+int Mask61c_bool(Mask61c *self);
 
+void Shard61c_dealloc(Shard61c *self);
+int Shard61c_init(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *Shard61c_matmul(Shard61c *self, PyObject *args);
+PyObject *Shard61c_pow(Shard61c *self, PyObject *args);
+PyObject *Shard61c_close(Shard61c *self, PyObject *args);
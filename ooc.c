@@ -0,0 +1,218 @@
+#include "ooc.h"
+#include "trace.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Side of the square tiles that fit `mem_limit` bytes of working memory, or 0 if not even
+ * the smallest tiles do. A step holds four tiles: the packed copies of the two operand tiles
+ * that mul_matrix makes, the partial product and the result tile it is added to.
+ */
+int ooc_tile_size(size_t mem_limit, int dtype) {
+    size_t elem = dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    double side = sqrt((double)mem_limit / (4 * elem));
+    if (side > 1 << 20)
+    {
+      side = 1 << 20;
+    }
+    return (int)side / OOC_TILE_GRAIN * OOC_TILE_GRAIN;
+}
+
+/*
+ * The matrix that owns the data of `m`, which is `m` itself unless it is a slice.
+ */
+static matrix *data_owner(matrix *m) {
+    while (m->parent)
+    {
+      m = m->parent;
+    }
+    return m;
+}
+
+/*
+ * Apply `advice` (an madvise advice, or -1 for an asynchronous msync) to the pages holding
+ * rows r0..r1-1, columns c0..c1-1 of `m`. Does nothing unless `m` is backed by a mapping.
+ */
+static void advise_tile(matrix *m, int r0, int r1, int c0, int c1, int advice) {
+    if (!data_owner(m)->map)
+    {
+      return;
+    }
+    if (m->transposed)
+    {
+      // The row pointers of a transposed view run along its columns
+      int t0 = r0, t1 = r1;
+      r0 = c0;
+      r1 = c1;
+      c0 = t0;
+      c1 = t1;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t elem = m->dtype == DTYPE_FLOAT32 ? sizeof(float) : sizeof(double);
+    for (int r = r0; r < r1; r++)
+    {
+      char *row = m->dtype == DTYPE_FLOAT32 ? (char *)m->fdata[r] : (char *)m->data[r];
+      size_t start = (size_t)(row + c0 * elem) / page * page;
+      size_t end = (size_t)(row + c1 * elem);
+      if (advice < 0)
+      {
+        msync((void *)start, end - start, MS_ASYNC);
+      }
+      else
+      {
+        madvise((void *)start, end - start, advice);
+      }
+    }
+}
+
+/*
+ * Point `view` at the `rows` x `cols` entries of `from` from row r0 and column c0 on, like
+ * allocate_matrix_ref, but with the row pointers in the array `view` already holds and
+ * without unsharing `from` or counting the view in its ref_cnt. mul_matrix_ooc runs without
+ * the GIL, so it must not touch the counts of matrices python code can reach; its views are
+ * on the stack and never deallocated.
+ */
+static void tile_view(matrix *view, matrix *from, int r0, int c0, int rows, int cols) {
+    int ptrs = from->transposed ? cols : rows;
+    int first = from->transposed ? c0 : r0;
+    int skip = from->transposed ? r0 : c0;
+    for (int i = 0; i < ptrs; i++)
+    {
+      if (from->dtype == DTYPE_FLOAT32)
+      {
+        view->fdata[i] = &from->fdata[first + i][skip];
+      }
+      else
+      {
+        view->data[i] = &from->data[first + i][skip];
+      }
+    }
+    view->rows = rows;
+    view->cols = cols;
+    view->dtype = from->dtype;
+    view->acc_f64 = from->acc_f64;
+    view->is_1d = rows == 1 || cols == 1;
+    view->ref_cnt = 1;
+    view->parent = from;
+    view->transposed = from->transposed;
+}
+
+/*
+ * Store mat1 * mat2 to `result` using at most about `mem_limit` bytes of working memory, for
+ * operands and results too large to hold in memory, typically ones from map_matrix. The
+ * result is computed one square tile at a time: each tile is the sum over the inner
+ * dimension of products of operand tiles by mul_matrix, and goes to `result` (and, for a
+ * mapped result, is queued for writeback) as soon as it is done. While one product runs the
+ * operand tiles of the next one are being read in by the kernel (MADV_WILLNEED). All three
+ * matrices must have the same dtype and `result` must not share data with the operands.
+ * `progress`, if not NULL, is called with `arg` after every result tile.
+ * Return 0 upon success, 1 if `progress` stopped the product, -1 for invalid arguments
+ * (including a limit below four OOC_TILE_GRAIN square tiles) and -2 if allocation fails.
+ */
+int mul_matrix_ooc(matrix *result, matrix *mat1, matrix *mat2, size_t mem_limit,
+                   ooc_progress progress, void *arg) {
+    int tile = ooc_tile_size(mem_limit, result->dtype);
+    if (mat1->cols != mat2->rows || mat1->rows != result->rows || mat2->cols != result->cols ||
+        mat1->dtype != mat2->dtype || result->dtype != mat1->dtype || tile == 0 ||
+        data_owner(result) == data_owner(mat1) || data_owner(result) == data_owner(mat2))
+    {
+      return -1;
+    }
+
+    int m = mat1->rows, n = mat2->cols, k = mat1->cols;
+    int tiles_m = (m + tile - 1) / tile, tiles_n = (n + tile - 1) / tile;
+    int tiles_k = (k + tile - 1) / tile;
+    long long total = (long long)tiles_m * tiles_n;
+    long long steps = total * tiles_k;
+    matrix *acc = NULL, *part = NULL;
+    if (unshare_matrix(result) != 0 ||
+        allocate_matrix_dtype(&acc, tile < m ? tile : m, tile < n ? tile : n, result->dtype) != 0 ||
+        allocate_matrix_dtype(&part, acc->rows, acc->cols, result->dtype) != 0)
+    {
+      deallocate_matrix(acc);
+      return -2;
+    }
+
+    // Headers of the tiles of mat1, mat2, acc and part (or result), `tile` row pointers each
+    matrix views[4];
+    int is_f32 = result->dtype == DTYPE_FLOAT32;
+    void *ptrs = malloc(4 * (size_t)tile * (is_f32 ? sizeof(float *) : sizeof(double *)));
+    if (!ptrs)
+    {
+      deallocate_matrix(acc);
+      deallocate_matrix(part);
+      return -2;
+    }
+    memset(views, 0, sizeof(views));
+    for (int v = 0; v < 4; v++)
+    {
+      if (is_f32)
+      {
+        views[v].fdata = (float **)ptrs + (size_t)v * tile;
+      }
+      else
+      {
+        views[v].data = (double **)ptrs + (size_t)v * tile;
+      }
+    }
+    matrix *a = &views[0], *b = &views[1], *c = &views[2], *d = &views[3];
+
+    TRACE_BEGIN(t_compute);
+    int ret = 0;
+    advise_tile(mat1, 0, m < tile ? m : tile, 0, k < tile ? k : tile, MADV_WILLNEED);
+    advise_tile(mat2, 0, k < tile ? k : tile, 0, n < tile ? n : tile, MADV_WILLNEED);
+    for (long long s = 0; s < steps && ret == 0; s++)
+    {
+      int i = (int)(s / ((long long)tiles_n * tiles_k)) * tile;
+      int j = (int)(s / tiles_k % tiles_n) * tile;
+      int p = (int)(s % tiles_k) * tile;
+      int rows = m - i < tile ? m - i : tile, cols = n - j < tile ? n - j : tile;
+      int inner = k - p < tile ? k - p : tile;
+
+      if (s + 1 < steps)
+      {
+        int ni = (int)((s + 1) / ((long long)tiles_n * tiles_k)) * tile;
+        int nj = (int)((s + 1) / tiles_k % tiles_n) * tile;
+        int np = (int)((s + 1) % tiles_k) * tile;
+        advise_tile(mat1, ni, m - ni < tile ? m : ni + tile, np, k - np < tile ? k : np + tile,
+                    MADV_WILLNEED);
+        advise_tile(mat2, np, k - np < tile ? k : np + tile, nj, n - nj < tile ? n : nj + tile,
+                    MADV_WILLNEED);
+      }
+
+      TRACE_BEGIN(t_tile);
+      tile_view(a, mat1, i, p, rows, inner);
+      tile_view(b, mat2, p, j, inner, cols);
+      tile_view(c, acc, 0, 0, rows, cols);
+      tile_view(d, part, 0, 0, rows, cols);
+      if (p == 0)
+      {
+        ret = mul_matrix(c, a, b);
+      }
+      else if ((ret = mul_matrix(d, a, b)) == 0)
+      {
+        add_matrix(c, c, d);
+      }
+
+      if (ret == 0 && p + inner == k)
+      {
+        tile_view(d, result, i, j, rows, cols);
+        copy_matrix(d, c);
+        advise_tile(result, i, i + rows, j, j + cols, -1);
+        if (progress && progress((s + 1) / tiles_k, total, arg) != 0)
+        {
+          ret = 1;
+        }
+      }
+      TRACE_END(t_tile, "mul_matrix_ooc.tile", "compute", rows, cols);
+    }
+    TRACE_END(t_compute, "mul_matrix_ooc", "compute", m, n);
+
+    free(ptrs);
+    deallocate_matrix(acc);
+    deallocate_matrix(part);
+    return ret;
+}
@@ -0,0 +1,19 @@
+#ifndef NUMC_OOC_H
+#define NUMC_OOC_H
+
+#include "matrix.h"
+
+/* Tiles are a multiple of this many rows and columns, and no smaller */
+#define OOC_TILE_GRAIN 64
+
+/*
+ * Called by mul_matrix_ooc after each finished result tile with the number of
+ * tiles done so far and in total. A nonzero return stops the product.
+ */
+typedef int (*ooc_progress)(long long done, long long total, void *arg);
+
+int ooc_tile_size(size_t mem_limit, int dtype);
+int mul_matrix_ooc(matrix *result, matrix *mat1, matrix *mat2, size_t mem_limit,
+                   ooc_progress progress, void *arg);
+
+#endif
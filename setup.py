@@ -2,14 +2,14 @@ from distutils.core import setup, Extension
 import sysconfig
 
 def main():
-    CFLAGS = ['-g', '-Wall', '-std=c99', '-fopenmp', '-mavx', '-mfma', '-pthread', '-O3']
-    LDFLAGS = ['-fopenmp']
+    CFLAGS = ['-g', '-Wall', '-std=c99', '-fopenmp', '-pthread', '-O3']
+    LDFLAGS = ['-fopenmp', '-lrt']
     # Use the setup function we imported and set up the modules.
     # You may find this reference helpful: https://docs.python.org/3.6/extending/building.html
     # TODO: YOUR CODE HERE
 
     module = Extension(name='numc',
-                       sources = ['matrix.c', 'numc.c'],
+                       sources = ['matrix.c', 'numc.c', 'trace.c', 'tune.c', 'kernels.c', 'sparse.c', 'batch.c', 'mask.c', 'matfile.c', 'ooc.c', 'shard.c'],
                        include_dirs = ['/data/verif/courses/CS61c/fa20-proj4-starter'],
                        extra_compile_args = CFLAGS,
                        extra_link_args=LDFLAGS)
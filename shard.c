@@ -0,0 +1,553 @@
+#include "shard.h"
+#include "trace.h"
+#include "tune.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/*
+ * The functions below return 0 upon success, -1 for invalid arguments, -2 if allocation fails
+ * and -3 if a system call fails, with errno describing it.
+ */
+
+/* States of the shards of a product */
+#define SHARD_PENDING 0
+#define SHARD_RUNNING 1
+#define SHARD_DONE 2
+
+/*
+ * Read `len` bytes from `fd`. Return 1 once they are all read, 0 at the end of the stream
+ * before the first byte and -1 upon failure or a message cut short.
+ */
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while (len > 0)
+    {
+      ssize_t n = read(fd, p, len);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (n <= 0)
+      {
+        return n == 0 && p == (char *)buf ? 0 : -1;
+      }
+      p += n;
+      len -= n;
+    }
+    return 1;
+}
+
+/*
+ * Write `len` bytes to the socket `fd`. Return 1 upon success and -1 upon failure, without
+ * raising SIGPIPE if the other end is gone.
+ */
+static int write_full(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+      ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if (n <= 0)
+      {
+        return -1;
+      }
+      p += n;
+      len -= n;
+    }
+    return 1;
+}
+
+/*
+ * Fork worker i of `pool`, connected to the coordinator by a new socket pair.
+ */
+static int start_worker(shard_pool *pool, int i) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+    {
+      return -3;
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+      int saved_errno = errno;
+      close(sv[0]);
+      close(sv[1]);
+      errno = saved_errno;
+      return -3;
+    }
+    if (pid == 0)
+    {
+      close(sv[0]);
+      for (int j = 0; j < pool->count; j++)
+      {
+        if (j != i && pool->workers[j].fd >= 0)
+        {
+          close(pool->workers[j].fd);
+        }
+      }
+      trace_forget();
+      /* A worker runs one shard at a time, and OpenMP's threads do not survive fork */
+      matrix_tune.par_mul = LLONG_MAX;
+      matrix_tune.par_elem = LLONG_MAX;
+      _exit(shard_serve(sv[1]) == 0 ? 0 : 1);
+    }
+    close(sv[1]);
+    pool->workers[i].pid = pid;
+    pool->workers[i].fd = sv[0];
+    pool->workers[i].shard = -1;
+    return 0;
+}
+
+/*
+ * Start `workers` worker processes in a new pool *pool.
+ */
+int shard_pool_start(shard_pool **pool, int workers) {
+    if (workers <= 0)
+    {
+      return -1;
+    }
+    shard_pool *res = (shard_pool *)malloc(sizeof(shard_pool));
+    if (!res)
+    {
+      return -2;
+    }
+    res->workers = (shard_worker *)malloc(sizeof(shard_worker) * workers);
+    if (!res->workers)
+    {
+      free(res);
+      return -2;
+    }
+    res->count = workers;
+    res->restarts = 0;
+    for (int i = 0; i < workers; i++)
+    {
+      res->workers[i].pid = -1;
+      res->workers[i].fd = -1;
+      res->workers[i].shard = -1;
+    }
+    for (int i = 0; i < workers; i++)
+    {
+      int ret = start_worker(res, i);
+      if (ret != 0)
+      {
+        int saved_errno = errno;
+        shard_pool_stop(res);
+        errno = saved_errno;
+        return ret;
+      }
+    }
+    *pool = res;
+    return 0;
+}
+
+/*
+ * Stop the workers of `pool`, which see their sockets close and exit, and free it. Does
+ * nothing if `pool` is NULL.
+ */
+void shard_pool_stop(shard_pool *pool) {
+    if (!pool)
+    {
+      return;
+    }
+    for (int i = 0; i < pool->count; i++)
+    {
+      if (pool->workers[i].fd >= 0)
+      {
+        close(pool->workers[i].fd);
+      }
+    }
+    for (int i = 0; i < pool->count; i++)
+    {
+      if (pool->workers[i].pid > 0)
+      {
+        waitpid(pool->workers[i].pid, NULL, 0);
+      }
+    }
+    free(pool->workers);
+    free(pool);
+}
+
+/*
+ * Worker i of `pool` broke its connection: make sure it is gone and start another in its
+ * place. If that fails the slot stays empty and the other workers take its share.
+ */
+static void replace_worker(shard_pool *pool, int i) {
+    shard_worker *w = &pool->workers[i];
+    kill(w->pid, SIGKILL);
+    close(w->fd);
+    waitpid(w->pid, NULL, 0);
+    w->pid = -1;
+    w->fd = -1;
+    w->shard = -1;
+    pool->restarts++;
+    start_worker(pool, i);
+}
+
+/*
+ * The loop of a worker process: answer requests read from `fd` until the coordinator closes
+ * it.
+ */
+int shard_serve(int fd) {
+    shard_request req;
+    int got;
+    while ((got = read_full(fd, &req, sizeof(req))) == 1)
+    {
+      shard_reply reply;
+      reply.status = shard_run(&req);
+      if (write_full(fd, &reply, sizeof(reply)) != 1)
+      {
+        close(fd);
+        return -3;
+      }
+    }
+    close(fd);
+    return got == 0 ? 0 : -3;
+}
+
+/*
+ * Carry out `req` in this process, attaching the matrices it names.
+ */
+int shard_run(const shard_request *req) {
+    if (req->op != SHARD_MUL || !memchr(req->a, 0, sizeof(req->a)) ||
+        !memchr(req->b, 0, sizeof(req->b)) || !memchr(req->result, 0, sizeof(req->result)))
+    {
+      return -1;
+    }
+    matrix *a = NULL, *b = NULL, *result = NULL, *a_rows = NULL, *result_rows = NULL;
+    int rows = req->row_end - req->row_begin;
+    int ret;
+    if ((ret = attach_shared_matrix(&a, req->a)) == 0 &&
+        (ret = attach_shared_matrix(&b, req->b)) == 0 &&
+        (ret = attach_shared_matrix(&result, req->result)) == 0)
+    {
+      if (req->row_begin < 0 || rows <= 0 || req->row_end > a->rows || result->rows != a->rows)
+      {
+        ret = -1;
+      }
+      else if ((ret = allocate_matrix_ref(&a_rows, a, req->row_begin, 0, rows, a->cols)) == 0 &&
+               (ret = allocate_matrix_ref(&result_rows, result, req->row_begin, 0, rows,
+                                          result->cols)) == 0)
+      {
+        a_rows->acc_f64 = req->acc_f64;
+        ret = mul_matrix(result_rows, a_rows, b);
+      }
+    }
+    deallocate_matrix(result_rows);
+    deallocate_matrix(a_rows);
+    deallocate_matrix(result);
+    deallocate_matrix(b);
+    deallocate_matrix(a);
+    return ret;
+}
+
+/*
+ * Point `req` at shard s of `rows` rows in shards of `per`.
+ */
+static void shard_bounds(shard_request *req, int s, int per, int rows) {
+    req->row_begin = s * per;
+    req->row_end = req->row_begin + per < rows ? req->row_begin + per : rows;
+}
+
+/*
+ * Split the `rows` result rows of `req` into shards and have the workers of `pool` compute
+ * them, handing each idle worker the next pending shard. The shard of a worker that dies is
+ * handed out again, and computed here once it has lost SHARD_RETRIES workers or if no worker
+ * can be started. Returns the first failure a shard reports, or 0.
+ */
+static int run_shards(shard_pool *pool, shard_request *req, int rows) {
+    int slots = pool->count * SHARD_PER_WORKER;
+    int per = (rows + slots - 1) / slots;
+    if (per < SHARD_MIN_ROWS)
+    {
+      per = SHARD_MIN_ROWS;
+    }
+    int shards = (rows + per - 1) / per;
+    int *state = (int *)calloc(shards, sizeof(int));
+    int *lost = (int *)calloc(shards, sizeof(int));
+    struct pollfd *fds = (struct pollfd *)malloc(sizeof(struct pollfd) * pool->count);
+    int *polled = (int *)malloc(sizeof(int) * pool->count);
+    if (!state || !lost || !fds || !polled)
+    {
+      free(state);
+      free(lost);
+      free(fds);
+      free(polled);
+      return -2;
+    }
+
+    int status = 0, done = 0;
+    while (done < shards)
+    {
+      /* Hand out pending shards; s is the first one */
+      int s = 0, busy = 0;
+      for (int i = 0; i < pool->count; i++)
+      {
+        shard_worker *w = &pool->workers[i];
+        while (s < shards && state[s] != SHARD_PENDING)
+        {
+          s++;
+        }
+        if (w->fd >= 0 && w->shard < 0 && s < shards && lost[s] <= SHARD_RETRIES)
+        {
+          shard_bounds(req, s, per, rows);
+          if (write_full(w->fd, req, sizeof(*req)) == 1)
+          {
+            w->shard = s;
+            state[s] = SHARD_RUNNING;
+          }
+          else
+          {
+            replace_worker(pool, i);
+            lost[s]++;
+          }
+        }
+        if (w->fd >= 0 && w->shard >= 0)
+        {
+          fds[busy].fd = w->fd;
+          fds[busy].events = POLLIN;
+          polled[busy++] = i;
+        }
+      }
+
+      /* Compute a shard here if it lost too many workers or there are none to take it */
+      while (s < shards && state[s] != SHARD_PENDING)
+      {
+        s++;
+      }
+      if (s < shards && (busy == 0 || lost[s] > SHARD_RETRIES))
+      {
+        shard_bounds(req, s, per, rows);
+        int ret = shard_run(req);
+        status = status ? status : ret;
+        state[s] = SHARD_DONE;
+        done++;
+      }
+      if (busy == 0)
+      {
+        continue;
+      }
+
+      if (poll(fds, busy, -1) < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        status = -3;
+        break;
+      }
+      for (int j = 0; j < busy; j++)
+      {
+        if (!fds[j].revents)
+        {
+          continue;
+        }
+        shard_worker *w = &pool->workers[polled[j]];
+        int ws = w->shard;
+        shard_reply reply;
+        if (read_full(w->fd, &reply, sizeof(reply)) == 1)
+        {
+          status = status ? status : reply.status;
+          state[ws] = SHARD_DONE;
+          done++;
+          w->shard = -1;
+        }
+        else
+        {
+          replace_worker(pool, polled[j]);
+          state[ws] = SHARD_PENDING;
+          lost[ws]++;
+        }
+      }
+    }
+
+    /* After a failed poll the workers still hold shards whose replies would be stale */
+    for (int i = 0; i < pool->count; i++)
+    {
+      if (pool->workers[i].shard >= 0)
+      {
+        replace_worker(pool, i);
+      }
+    }
+    free(state);
+    free(lost);
+    free(fds);
+    free(polled);
+    return status;
+}
+
+/*
+ * Store a name for a new temporary shared matrix of this process to `name`.
+ */
+static void temp_name(char *name) {
+    static unsigned int counter;
+    unsigned int n;
+    #pragma omp atomic capture
+    n = counter++;
+    snprintf(name, SHM_NAME_MAX + 2, "numc_shard_%d_%u", (int)getpid(), n);
+}
+
+/*
+ * Store the shared memory name workers can attach to read `mat` to `name`: its own name if it
+ * is a whole shared matrix, or else that of a new shared copy stored to *tmp, which the caller
+ * deallocates.
+ */
+static int stage(matrix *mat, char *name, matrix **tmp) {
+    const char *shared = shared_matrix_name(mat);
+    *tmp = NULL;
+    if (shared)
+    {
+      strcpy(name, shared);
+      return 0;
+    }
+    temp_name(name);
+    int ret = create_shared_matrix(tmp, name, mat->rows, mat->cols, mat->dtype);
+    if (ret == 0)
+    {
+      copy_matrix(*tmp, mat);
+    }
+    return ret;
+}
+
+/*
+ * Store mat1 * mat2 to `result`, with the workers of `pool` each computing blocks of rows.
+ * Operands that are whole shared matrices (see create_shared_matrix) are read in place and a
+ * shared result is written in place unless it is also an operand; anything else is copied
+ * through temporary shared memory. Accepts the same operands as mul_matrix.
+ */
+int shard_mul(shard_pool *pool, matrix *result, matrix *mat1, matrix *mat2) {
+    if (mat1->cols != mat2->rows || mat1->rows != result->rows || mat2->cols != result->cols ||
+        mat1->dtype != mat2->dtype ||
+        (result->dtype != mat1->dtype && mat1->dtype != DTYPE_FLOAT32))
+    {
+      return -1;
+    }
+
+    TRACE_BEGIN(t_compute);
+    shard_request req;
+    memset(&req, 0, sizeof(req));
+    req.op = SHARD_MUL;
+    req.acc_f64 = mat1->acc_f64 || mat2->acc_f64;
+    matrix *tmp1 = NULL, *tmp2 = NULL, *tmp_result = NULL;
+    int ret;
+    if ((ret = stage(mat1, req.a, &tmp1)) == 0 && (ret = stage(mat2, req.b, &tmp2)) == 0)
+    {
+      const char *shared = shared_matrix_name(result);
+      if (shared && strcmp(shared, req.a) != 0 && strcmp(shared, req.b) != 0)
+      {
+        strcpy(req.result, shared);
+      }
+      else
+      {
+        temp_name(req.result);
+        ret = create_shared_matrix(&tmp_result, req.result, result->rows, result->cols,
+                                   result->dtype);
+      }
+    }
+    if (ret == 0)
+    {
+      ret = run_shards(pool, &req, result->rows);
+    }
+    if (ret == 0 && tmp_result)
+    {
+      copy_matrix(result, tmp_result);
+    }
+    deallocate_matrix(tmp1);
+    deallocate_matrix(tmp2);
+    deallocate_matrix(tmp_result);
+    TRACE_END(t_compute, "shard_mul", "compute", result->rows, result->cols);
+    return ret;
+}
+
+/*
+ * Store mat^pow to `result` by squaring and multiplying, each product split over the workers
+ * of `pool` as in shard_mul. The powers live in three temporary shared matrices that the
+ * products take turns writing. Powers 0 and 1 are computed here.
+ */
+int shard_pow(shard_pool *pool, matrix *result, matrix *mat, int pow) {
+    int n = mat->rows;
+    if (mat->cols != n || pow < 0 || result->rows != n || result->cols != n ||
+        result->dtype != mat->dtype)
+    {
+      return -1;
+    }
+    if (pow <= 1)
+    {
+      return pow_matrix(result, mat, pow);
+    }
+
+    TRACE_BEGIN(t_compute);
+    shard_request req;
+    memset(&req, 0, sizeof(req));
+    req.op = SHARD_MUL;
+    req.acc_f64 = mat->acc_f64;
+    matrix *bufs[3] = {NULL, NULL, NULL};
+    char names[3][SHM_NAME_MAX + 2];
+    int ret = 0;
+    for (int i = 0; i < 3 && ret == 0; i++)
+    {
+      temp_name(names[i]);
+      ret = create_shared_matrix(&bufs[i], names[i], n, n, mat->dtype);
+    }
+
+    /* x holds mat^(2^i); acc the product of the powers of two taken so far */
+    int x = 0, acc = 1, spare = 2, have_acc = 0;
+    if (ret == 0)
+    {
+      copy_matrix(bufs[x], mat);
+    }
+    while (ret == 0)
+    {
+      if (pow & 1)
+      {
+        if (!have_acc)
+        {
+          copy_matrix(bufs[acc], bufs[x]);
+          have_acc = 1;
+        }
+        else
+        {
+          strcpy(req.a, names[acc]);
+          strcpy(req.b, names[x]);
+          strcpy(req.result, names[spare]);
+          ret = run_shards(pool, &req, n);
+          int t = acc;
+          acc = spare;
+          spare = t;
+        }
+      }
+      pow >>= 1;
+      if (!pow || ret != 0)
+      {
+        break;
+      }
+      strcpy(req.a, names[x]);
+      strcpy(req.b, names[x]);
+      strcpy(req.result, names[spare]);
+      ret = run_shards(pool, &req, n);
+      int t = x;
+      x = spare;
+      spare = t;
+    }
+    if (ret == 0)
+    {
+      copy_matrix(result, bufs[acc]);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+      deallocate_matrix(bufs[i]);
+    }
+    TRACE_END(t_compute, "shard_pow", "compute", n, n);
+    return ret;
+}
@@ -0,0 +1,60 @@
+#ifndef NUMC_SHARD_H
+#define NUMC_SHARD_H
+
+#include "matrix.h"
+#include "matfile.h"
+
+/*
+ * A pool of local worker processes that multiply blocks of rows of shared
+ * memory matrices (see create_shared_matrix). The coordinator and each worker
+ * talk over a Unix domain socket in the fixed size messages below, naming the
+ * operands rather than sending them, so any process that can attach the names
+ * can serve the same protocol.
+ */
+
+/* Operations of a shard_request */
+#define SHARD_MUL 1  // result[row_begin:row_end] = a[row_begin:row_end] * b
+
+/* A product is split into this many shards per worker, so faster workers take more */
+#define SHARD_PER_WORKER 4
+
+/* Fewest result rows of a shard */
+#define SHARD_MIN_ROWS 8
+
+/* Workers a shard may lose before the coordinator computes it itself */
+#define SHARD_RETRIES 2
+
+typedef struct shard_request {
+    int op;                      // SHARD_MUL
+    int row_begin;               // first result row of the shard
+    int row_end;                 // one past its last row
+    int acc_f64;                 // acc_f64 of the operands, see mul_matrix_mixed
+    char a[SHM_NAME_MAX + 2];    // shared memory names of the operands and the result
+    char b[SHM_NAME_MAX + 2];
+    char result[SHM_NAME_MAX + 2];
+} shard_request;
+
+typedef struct shard_reply {
+    int status;  // what the operation returned
+} shard_reply;
+
+typedef struct shard_worker {
+    int pid;    // worker process
+    int fd;     // coordinator end of its socket, -1 if it could not be started
+    int shard;  // shard it is working on, -1 if idle
+} shard_worker;
+
+typedef struct shard_pool {
+    int count;               // number of workers
+    shard_worker *workers;
+    int restarts;            // workers started again after dying
+} shard_pool;
+
+int shard_pool_start(shard_pool **pool, int workers);
+void shard_pool_stop(shard_pool *pool);
+int shard_serve(int fd);
+int shard_run(const shard_request *req);
+int shard_mul(shard_pool *pool, matrix *result, matrix *mat1, matrix *mat2);
+int shard_pow(shard_pool *pool, matrix *result, matrix *mat, int pow);
+
+#endif
@@ -0,0 +1,333 @@
+#include "sparse.h"
+#include "trace.h"
+#include "tune.h"
+#include "kernels.h"
+#include <stdlib.h>
+#include <omp.h>
+
+/*
+ * Allocate a `rows` x `cols` sparse matrix with room for `nnz` entries. row_ptr is zeroed;
+ * the caller fills in the rest.
+ * Return 0 upon success, -1 for invalid dimensions and -2 if allocation fails.
+ */
+int allocate_sparse(sparse **sp, int rows, int cols, long long nnz) {
+    if (rows <= 0 || cols <= 0 || nnz < 0 || nnz > (long long)rows * cols)
+    {
+      return -1;
+    }
+
+    sparse *s = (sparse *)malloc(sizeof(sparse));
+    if (!s)
+    {
+      return -2;
+    }
+    /* malloc(0) may return NULL, so an empty matrix still gets one slot */
+    size_t slots = nnz > 0 ? (size_t)nnz : 1;
+    s->row_ptr = (long long *)calloc((size_t)rows + 1, sizeof(long long));
+    s->col_idx = (int *)malloc(slots * sizeof(int));
+    s->vals = (double *)malloc(slots * sizeof(double));
+    if (!s->row_ptr || !s->col_idx || !s->vals)
+    {
+      deallocate_sparse(s);
+      return -2;
+    }
+    s->rows = rows;
+    s->cols = cols;
+    s->nnz = nnz;
+    *sp = s;
+    return 0;
+}
+
+/*
+ * Free `sp`. Does nothing if `sp` is NULL.
+ */
+void deallocate_sparse(sparse *sp) {
+    if (!sp)
+    {
+      return;
+    }
+    free(sp->row_ptr);
+    free(sp->col_idx);
+    free(sp->vals);
+    free(sp);
+}
+
+/*
+ * Return 0 if `sp` is well formed: row_ptr runs from 0 to nnz without decreasing and the
+ * columns of every row are in range and strictly increasing. Return -1 otherwise.
+ */
+int check_sparse(sparse *sp) {
+    if (sp->row_ptr[0] != 0 || sp->row_ptr[sp->rows] != sp->nnz)
+    {
+      return -1;
+    }
+    for (int r = 0; r < sp->rows; r++)
+    {
+      if (sp->row_ptr[r + 1] < sp->row_ptr[r])
+      {
+        return -1;
+      }
+      int prev = -1;
+      for (long long i = sp->row_ptr[r]; i < sp->row_ptr[r + 1]; i++)
+      {
+        if (sp->col_idx[i] <= prev || sp->col_idx[i] >= sp->cols)
+        {
+          return -1;
+        }
+        prev = sp->col_idx[i];
+      }
+    }
+    return 0;
+}
+
+/*
+ * Turn the per row counts in row_ptr[1..rows] into offsets. Returns the total.
+ */
+static long long prefix_sum(long long *row_ptr, int rows) {
+    row_ptr[0] = 0;
+    for (int r = 0; r < rows; r++)
+    {
+      row_ptr[r + 1] += row_ptr[r];
+    }
+    return row_ptr[rows];
+}
+
+/*
+ * Store the nonzero entries of `mat` (of either dtype) in a new sparse matrix *sp. Rows are
+ * counted and then filled in parallel.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int dense_to_sparse(sparse **sp, matrix *mat) {
+    long long *counts = (long long *)calloc((size_t)mat->rows + 1, sizeof(long long));
+    if (!counts)
+    {
+      return -2;
+    }
+
+    TRACE_BEGIN(t_convert);
+    #pragma omp parallel for if ((long long)mat->rows * mat->cols >= matrix_tune.par_elem)
+    for (int r = 0; r < mat->rows; r++)
+    {
+      long long n = 0;
+      for (int c = 0; c < mat->cols; c++)
+      {
+        n += get(mat, r, c) != 0;
+      }
+      counts[r + 1] = n;
+    }
+    long long nnz = prefix_sum(counts, mat->rows);
+
+    sparse *s;
+    int ret = allocate_sparse(&s, mat->rows, mat->cols, nnz);
+    if (ret != 0)
+    {
+      free(counts);
+      return ret;
+    }
+    free(s->row_ptr);
+    s->row_ptr = counts;
+
+    #pragma omp parallel for if ((long long)mat->rows * mat->cols >= matrix_tune.par_elem)
+    for (int r = 0; r < mat->rows; r++)
+    {
+      long long i = s->row_ptr[r];
+      for (int c = 0; c < mat->cols; c++)
+      {
+        double val = get(mat, r, c);
+        if (val != 0)
+        {
+          s->col_idx[i] = c;
+          s->vals[i] = val;
+          i++;
+        }
+      }
+    }
+    TRACE_END(t_convert, "dense_to_sparse", "convert", mat->rows, mat->cols);
+
+    *sp = s;
+    return 0;
+}
+
+/*
+ * Store `sp` in the dense matrix `result`, which must have the same shape.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int sparse_to_dense(matrix *result, sparse *sp) {
+    if (result->rows != sp->rows || result->cols != sp->cols)
+    {
+      return -1;
+    }
+
+    TRACE_BEGIN(t_convert);
+    fill_matrix(result, 0);
+    #pragma omp parallel for if ((long long)sp->rows * sp->cols >= matrix_tune.par_elem)
+    for (int r = 0; r < sp->rows; r++)
+    {
+      for (long long i = sp->row_ptr[r]; i < sp->row_ptr[r + 1]; i++)
+      {
+        set(result, r, sp->col_idx[i], sp->vals[i]);
+      }
+    }
+    TRACE_END(t_convert, "sparse_to_dense", "convert", sp->rows, sp->cols);
+    return 0;
+}
+
+/*
+ * Store the product of the sparse matrix `sp` and the float64 matrix `mat` to `result`, which
+ * must not be `mat`. Each thread takes whole rows of the result. A single column `mat` is
+ * copied into a contiguous vector first so that each row is one gathered dot product;
+ * otherwise each stored entry adds a scaled row of `mat` to the result row.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int mul_sparse_dense(matrix *result, sparse *sp, matrix *mat) {
+    if (sp->cols != mat->rows || result->rows != sp->rows || result->cols != mat->cols ||
+        mat->dtype != DTYPE_FLOAT64 || result->dtype != DTYPE_FLOAT64 || result == mat ||
+        result->transposed)
+    {
+      return -1;
+    }
+    if (mat->transposed)
+    {
+      matrix *dense;
+      int ret = dense_matrix(&dense, mat);
+      if (ret == 0)
+      {
+        ret = mul_sparse_dense(result, sp, dense);
+        deallocate_matrix(dense);
+      }
+      return ret;
+    }
+
+    TRACE_BEGIN(t_compute);
+    if (mat->cols == 1)
+    {
+      double *x = (double *)malloc(sizeof(double) * mat->rows);
+      if (!x)
+      {
+        return -2;
+      }
+      for (int k = 0; k < mat->rows; k++)
+      {
+        x[k] = mat->data[k][0];
+      }
+
+      #pragma omp parallel if (sp->nnz >= matrix_tune.par_elem)
+      {
+        TRACE_BEGIN(t_tile);
+        int tile_rows = 0;
+        #pragma omp for schedule(dynamic, 256) nowait
+        for (int r = 0; r < sp->rows; r++)
+        {
+          long long start = sp->row_ptr[r];
+          result->data[r][0] = kernels->gather_dot(sp->vals + start, sp->col_idx + start, x,
+                                                   sp->row_ptr[r + 1] - start);
+          tile_rows++;
+        }
+        TRACE_END(t_tile, "mul_sparse_dense.tile", "thread", tile_rows, 1);
+      }
+      free(x);
+    }
+    else
+    {
+      #pragma omp parallel if (sp->nnz * mat->cols >= matrix_tune.par_elem)
+      {
+        TRACE_BEGIN(t_tile);
+        int tile_rows = 0;
+        #pragma omp for schedule(dynamic, 16) nowait
+        for (int r = 0; r < sp->rows; r++)
+        {
+          kernels->fill(result->data[r], 0, result->cols);
+          for (long long i = sp->row_ptr[r]; i < sp->row_ptr[r + 1]; i++)
+          {
+            kernels->axpy(result->data[r], sp->vals[i], mat->data[sp->col_idx[i]], mat->cols);
+          }
+          tile_rows++;
+        }
+        TRACE_END(t_tile, "mul_sparse_dense.tile", "thread", tile_rows, mat->cols);
+      }
+    }
+    TRACE_END(t_compute, "mul_sparse_dense", "compute", sp->rows, mat->cols);
+    return 0;
+}
+
+/*
+ * Merge row r of sp1 and sp2. Entries that cancel out are dropped. With col_idx and vals
+ * NULL only counts them. Returns the number of entries of the row.
+ */
+static long long add_row(sparse *sp1, sparse *sp2, int r, int *col_idx, double *vals) {
+    long long i = sp1->row_ptr[r], i_end = sp1->row_ptr[r + 1];
+    long long j = sp2->row_ptr[r], j_end = sp2->row_ptr[r + 1];
+    long long n = 0;
+    while (i < i_end || j < j_end)
+    {
+      int c1 = i < i_end ? sp1->col_idx[i] : sp1->cols;
+      int c2 = j < j_end ? sp2->col_idx[j] : sp2->cols;
+      int c = c1 < c2 ? c1 : c2;
+      double val = 0;
+      if (c1 == c)
+      {
+        val += sp1->vals[i++];
+      }
+      if (c2 == c)
+      {
+        val += sp2->vals[j++];
+      }
+      if (val != 0)
+      {
+        if (col_idx)
+        {
+          col_idx[n] = c;
+          vals[n] = val;
+        }
+        n++;
+      }
+    }
+    return n;
+}
+
+/*
+ * Store sp1 + sp2 in a new sparse matrix *result. Every row is merged twice, once to count
+ * its entries and once to fill them in, both in parallel.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int add_sparse(sparse **result, sparse *sp1, sparse *sp2) {
+    if (sp1->rows != sp2->rows || sp1->cols != sp2->cols)
+    {
+      return -1;
+    }
+    int rows = sp1->rows;
+    long long *counts = (long long *)calloc((size_t)rows + 1, sizeof(long long));
+    if (!counts)
+    {
+      return -2;
+    }
+
+    TRACE_BEGIN(t_compute);
+    int parallel = sp1->nnz + sp2->nnz >= matrix_tune.par_elem;
+    #pragma omp parallel for schedule(dynamic, 256) if (parallel)
+    for (int r = 0; r < rows; r++)
+    {
+      counts[r + 1] = add_row(sp1, sp2, r, NULL, NULL);
+    }
+    long long nnz = prefix_sum(counts, rows);
+
+    sparse *s;
+    int ret = allocate_sparse(&s, rows, sp1->cols, nnz);
+    if (ret != 0)
+    {
+      free(counts);
+      return ret;
+    }
+    free(s->row_ptr);
+    s->row_ptr = counts;
+
+    #pragma omp parallel for schedule(dynamic, 256) if (parallel)
+    for (int r = 0; r < rows; r++)
+    {
+      add_row(sp1, sp2, r, s->col_idx + s->row_ptr[r], s->vals + s->row_ptr[r]);
+    }
+    TRACE_END(t_compute, "add_sparse", "compute", rows, sp1->cols);
+
+    *result = s;
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef NUMC_SPARSE_H
+#define NUMC_SPARSE_H
+
+#include "matrix.h"
+
+/*
+ * A float64 matrix in compressed sparse row (CSR) form. The nonzeros of row r
+ * are vals[row_ptr[r]] .. vals[row_ptr[r + 1] - 1], in increasing column
+ * order, with their columns in the same positions of col_idx.
+ */
+typedef struct sparse {
+    int rows;            // number of rows
+    int cols;            // number of columns
+    long long nnz;       // number of stored entries
+    long long *row_ptr;  // rows + 1 offsets into col_idx and vals
+    int *col_idx;        // column of each stored entry
+    double *vals;        // value of each stored entry
+} sparse;
+
+int allocate_sparse(sparse **sp, int rows, int cols, long long nnz);
+void deallocate_sparse(sparse *sp);
+int check_sparse(sparse *sp);
+int dense_to_sparse(sparse **sp, matrix *mat);
+int sparse_to_dense(matrix *result, sparse *sp);
+int mul_sparse_dense(matrix *result, sparse *sp, matrix *mat);
+int add_sparse(sparse **result, sparse *sp1, sparse *sp2);
+
+#endif
@@ -0,0 +1,99 @@
+#define _POSIX_C_SOURCE 200809L
+#include "trace.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <omp.h>
+
+volatile int trace_on = 0;
+
+static FILE *trace_file = NULL;
+static double trace_origin = 0;
+static int trace_events = 0;
+
+/*
+ * Microseconds since the trace was started.
+ */
+double trace_now(void) {
+    return (omp_get_wtime() - trace_origin) * 1e6;
+}
+
+/*
+ * Open `path` and start recording spans. A trace that is already running is
+ * finished first. Return 0 upon success and -1 if the file cannot be opened.
+ */
+int trace_start(const char *path) {
+    trace_stop();
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+      return -1;
+    }
+
+    #pragma omp critical(numc_trace)
+    {
+      trace_file = f;
+      trace_origin = omp_get_wtime();
+      trace_events = 0;
+      fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+      trace_on = 1;
+    }
+    return 0;
+}
+
+/*
+ * Finish the current trace and close its file. Return 0 if a trace was
+ * running and -1 otherwise.
+ */
+int trace_stop(void) {
+    int ret = -1;
+    #pragma omp critical(numc_trace)
+    {
+      if (trace_file)
+      {
+        trace_on = 0;
+        fprintf(trace_file, "\n]}\n");
+        fclose(trace_file);
+        trace_file = NULL;
+        ret = 0;
+      }
+    }
+    return ret;
+}
+
+/*
+ * Drop the trace in a process forked while it was running, without writing to it. The
+ * parent's unflushed events are still in the copied buffer and the file offset is shared,
+ * so anything the child wrote or flushed would interleave with the parent's trace.
+ */
+void trace_forget(void) {
+    trace_on = 0;
+    trace_file = NULL;
+}
+
+/*
+ * Write one complete event from `start` until now. Spans of parallel regions
+ * are attributed to the OpenMP thread that ran them so that load imbalance is
+ * visible as uneven tracks.
+ */
+void trace_span(const char *name, const char *cat, double start, int rows, int cols) {
+    if (start < 0)
+    {
+      // The span began before the trace was started.
+      return;
+    }
+    double end = trace_now();
+    int tid = omp_get_thread_num();
+
+    #pragma omp critical(numc_trace)
+    {
+      if (trace_file)
+      {
+        fprintf(trace_file,
+                "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"rows\":%d,\"cols\":%d,\"size\":%lld}}",
+                trace_events ? ",\n" : "", name, cat, start, end - start, (int)getpid(), tid,
+                rows, cols, (long long)rows * cols);
+        trace_events++;
+      }
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef NUMC_TRACE_H
+#define NUMC_TRACE_H
+
+/*
+ * Opt-in Chrome trace-event tracing. While a trace is running every span is
+ * written as a complete ("X") event to a JSON file that can be opened in
+ * chrome://tracing or ui.perfetto.dev. Start it with numc.trace_start(path)
+ * or by setting NUMC_TRACE=path before importing numc.
+ */
+
+extern volatile int trace_on;
+
+int trace_start(const char *path);
+int trace_stop(void);
+void trace_forget(void);
+double trace_now(void);
+void trace_span(const char *name, const char *cat, double start, int rows, int cols);
+
+/*
+ * Record the time at which a span starts. This is a no-op (apart from the
+ * flag check) while tracing is off.
+ */
+#define TRACE_BEGIN(t) double t = trace_on ? trace_now() : -1
+
+/*
+ * Close the span started with TRACE_BEGIN(t). `rows` and `cols` describe the
+ * shape of the work done inside the span.
+ */
+#define TRACE_END(t, name, cat, rows, cols)                 \
+    do {                                                    \
+        if (trace_on) trace_span(name, cat, t, rows, cols); \
+    } while (0)
+
+#endif
@@ -0,0 +1,289 @@
+#include "matrix.h"
+#include "tune.h"
+#include "kernels.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+/*
+ * Defaults that are used until a profile is loaded.
+ */
+tune_params matrix_tune = {
+    .tile_m = 64,
+    .tile_n = 256,
+    .tile_k = 128,
+    .micro_m = 4,
+    .micro_n = 8,
+    .par_mul = 1LL << 18,
+    .par_elem = 1LL << 14,
+};
+
+/*
+ * Return NUMC_PROFILE if it is set, otherwise ~/.numc_profile.
+ */
+const char *tune_default_path(void) {
+    static char path[4096];
+    const char *env = getenv("NUMC_PROFILE");
+    if (env && env[0])
+    {
+      return env;
+    }
+    const char *home = getenv("HOME");
+    snprintf(path, sizeof(path), "%s/.numc_profile", home ? home : ".");
+    return path;
+}
+
+/*
+ * Return whether every field of `p` is something the kernels can run with.
+ */
+static int tune_valid(const tune_params *p) {
+    return p->tile_m > 0 && p->tile_m <= 4096 &&
+           p->tile_n > 0 && p->tile_n <= 4096 &&
+           p->tile_k > 0 && p->tile_k <= 4096 &&
+           mul_micro_supported(p->micro_m, p->micro_n) &&
+           p->par_mul >= 0 && p->par_elem >= 0;
+}
+
+/*
+ * Load a profile written by tune_save into matrix_tune. Unknown keys are
+ * ignored so that older builds can read newer profiles.
+ * Return 0 upon success, -1 if the file cannot be read and -2 if it holds
+ * invalid values, in which case matrix_tune is left unchanged.
+ */
+int tune_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+      return -1;
+    }
+
+    tune_params p = matrix_tune;
+    char key[64];
+    long long val;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+      if (line[0] == '#' || sscanf(line, "%63s %lld", key, &val) != 2)
+      {
+        continue;
+      }
+      if (!strcmp(key, "tile_m")) p.tile_m = (int)val;
+      else if (!strcmp(key, "tile_n")) p.tile_n = (int)val;
+      else if (!strcmp(key, "tile_k")) p.tile_k = (int)val;
+      else if (!strcmp(key, "micro_m")) p.micro_m = (int)val;
+      else if (!strcmp(key, "micro_n")) p.micro_n = (int)val;
+      else if (!strcmp(key, "par_mul")) p.par_mul = val;
+      else if (!strcmp(key, "par_elem")) p.par_elem = val;
+    }
+    fclose(f);
+
+    if (!tune_valid(&p))
+    {
+      return -2;
+    }
+    matrix_tune = p;
+    return 0;
+}
+
+/*
+ * Write matrix_tune to `path`. Return 0 upon success and -1 upon failure.
+ */
+int tune_save(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+      return -1;
+    }
+    fprintf(f, "# numc autotune profile\n");
+    fprintf(f, "tile_m %d\n", matrix_tune.tile_m);
+    fprintf(f, "tile_n %d\n", matrix_tune.tile_n);
+    fprintf(f, "tile_k %d\n", matrix_tune.tile_k);
+    fprintf(f, "micro_m %d\n", matrix_tune.micro_m);
+    fprintf(f, "micro_n %d\n", matrix_tune.micro_n);
+    fprintf(f, "par_mul %lld\n", matrix_tune.par_mul);
+    fprintf(f, "par_elem %lld\n", matrix_tune.par_elem);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/*
+ * Best of `reps` timings of result = mat1 * mat2 with the parameters in `tune`, in seconds.
+ */
+static double time_mul(matrix *result, matrix *mat1, matrix *mat2, int reps,
+                       const tune_params *tune) {
+    double best = 1e30;
+    for (int i = 0; i < reps; i++)
+    {
+      double start = omp_get_wtime();
+      mul_matrix_tuned(result, mat1, mat2, tune);
+      double t = omp_get_wtime() - start;
+      best = t < best ? t : best;
+    }
+    return best;
+}
+
+/*
+ * Best of `reps` timings of the row loop of add_matrix, run in parallel or serially as
+ * `parallel` says, in seconds.
+ */
+static double time_add(matrix *result, matrix *mat1, matrix *mat2, int reps, int parallel) {
+    double best = 1e30;
+    for (int i = 0; i < reps; i++)
+    {
+      double start = omp_get_wtime();
+      #pragma omp parallel for if (parallel)
+      for (int r = 0; r < mat1->rows; r++)
+      {
+        kernels->add(result->data[r], mat1->data[r], mat2->data[r], mat1->cols);
+      }
+      double t = omp_get_wtime() - start;
+      best = t < best ? t : best;
+    }
+    return best;
+}
+
+/*
+ * Try every value in `cands` for the int field `*field` of `tune`, keeping the fastest.
+ */
+static void tune_field(tune_params *tune, int *field, const int *cands, int n_cands,
+                       matrix *result, matrix *mat1, matrix *mat2) {
+    int best_val = *field;
+    double best = time_mul(result, mat1, mat2, 3, tune);
+    for (int i = 0; i < n_cands; i++)
+    {
+      *field = cands[i];
+      double t = time_mul(result, mat1, mat2, 3, tune);
+      if (t < best)
+      {
+        best = t;
+        best_val = cands[i];
+      }
+    }
+    *field = best_val;
+}
+
+/*
+ * Smallest size in `sizes` (as rows * cols * inner for mul_matrix, or entries
+ * for add_matrix) at which the parallel kernel beats the serial one. If it
+ * never does, the cutoff is put far beyond the largest size tried. The other parameters
+ * come from `tune`.
+ */
+static long long tune_threshold(int is_mul, const int *sizes, int n_sizes,
+                                const tune_params *tune) {
+    tune_params serial_tune = *tune;
+    tune_params parallel_tune = *tune;
+    serial_tune.par_mul = LLONG_MAX;
+    parallel_tune.par_mul = 0;
+    long long last = 0;
+    for (int i = 0; i < n_sizes; i++)
+    {
+      int rows = sizes[i];
+      int cols = is_mul ? sizes[i] : 1024;
+      long long work = is_mul ? (long long)rows * rows * rows : (long long)rows * cols;
+      matrix *result, *mat1, *mat2;
+      if (allocate_matrix(&result, rows, cols) != 0)
+      {
+        break;
+      }
+      if (allocate_matrix(&mat1, rows, cols) != 0)
+      {
+        deallocate_matrix(result);
+        break;
+      }
+      if (allocate_matrix(&mat2, rows, cols) != 0)
+      {
+        deallocate_matrix(result);
+        deallocate_matrix(mat1);
+        break;
+      }
+      rand_matrix(mat1, 1, -1, 1);
+      rand_matrix(mat2, 2, -1, 1);
+
+      double serial = is_mul ? time_mul(result, mat1, mat2, 5, &serial_tune)
+                             : time_add(result, mat1, mat2, 5, 0);
+      double parallel = is_mul ? time_mul(result, mat1, mat2, 5, &parallel_tune)
+                               : time_add(result, mat1, mat2, 5, 1);
+
+      deallocate_matrix(result);
+      deallocate_matrix(mat1);
+      deallocate_matrix(mat2);
+
+      last = work;
+      if (parallel < serial * 0.9)
+      {
+        return work;
+      }
+    }
+    return last > LLONG_MAX / 8 ? LLONG_MAX : last * 8;
+}
+
+/*
+ * Benchmark candidate blocking factors, micro kernel shapes and parallel
+ * cutoffs on this machine and leave the fastest in matrix_tune. The GEMM
+ * parameters are tuned one at a time on n x n operands. Candidates are only
+ * ever timed from a local copy, and matrix_tune is assigned once at the end,
+ * so kernels running on other threads never see a half-tuned set.
+ * Return 0 upon success and a nonzero value upon failure.
+ */
+int tune_autotune(int n) {
+    if (n <= 0)
+    {
+      return -1;
+    }
+
+    matrix *result, *mat1, *mat2;
+    if (allocate_matrix(&result, n, n) != 0)
+    {
+      return -2;
+    }
+    if (allocate_matrix(&mat1, n, n) != 0)
+    {
+      deallocate_matrix(result);
+      return -2;
+    }
+    if (allocate_matrix(&mat2, n, n) != 0)
+    {
+      deallocate_matrix(result);
+      deallocate_matrix(mat1);
+      return -2;
+    }
+    rand_matrix(mat1, 1, -1, 1);
+    rand_matrix(mat2, 2, -1, 1);
+
+    tune_params tune = matrix_tune;
+    static const int micro_shapes[][2] = {{2, 8}, {4, 4}, {4, 8}, {8, 4}};
+    double best = 1e30;
+    int best_shape = 0;
+    for (int i = 0; i < (int)(sizeof(micro_shapes) / sizeof(micro_shapes[0])); i++)
+    {
+      tune.micro_m = micro_shapes[i][0];
+      tune.micro_n = micro_shapes[i][1];
+      double t = time_mul(result, mat1, mat2, 3, &tune);
+      if (t < best)
+      {
+        best = t;
+        best_shape = i;
+      }
+    }
+    tune.micro_m = micro_shapes[best_shape][0];
+    tune.micro_n = micro_shapes[best_shape][1];
+
+    static const int tiles_k[] = {64, 128, 256, 512};
+    static const int tiles_n[] = {64, 128, 256, 512};
+    static const int tiles_m[] = {16, 32, 64, 128};
+    tune_field(&tune, &tune.tile_k, tiles_k, 4, result, mat1, mat2);
+    tune_field(&tune, &tune.tile_n, tiles_n, 4, result, mat1, mat2);
+    tune_field(&tune, &tune.tile_m, tiles_m, 4, result, mat1, mat2);
+
+    deallocate_matrix(result);
+    deallocate_matrix(mat1);
+    deallocate_matrix(mat2);
+
+    static const int mul_sizes[] = {16, 24, 32, 48, 64, 96, 128};
+    static const int elem_rows[] = {1, 4, 16, 64, 256, 1024};
+    tune.par_mul = tune_threshold(1, mul_sizes, 7, &tune);
+    tune.par_elem = tune_threshold(0, elem_rows, 6, &tune);
+    matrix_tune = tune;
+    return 0;
+}
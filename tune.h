@@ -0,0 +1,32 @@
+#ifndef NUMC_TUNE_H
+#define NUMC_TUNE_H
+
+/*
+ * Blocking factors and parallel cutoffs used by the kernels in matrix.c.
+ * The defaults are reasonable everywhere; numc.autotune() measures better
+ * ones for the current machine and saves them to a profile that is loaded
+ * again when numc is imported.
+ */
+typedef struct tune_params {
+    int tile_m;         // result rows per cache block in mul_matrix
+    int tile_n;         // result cols per cache block in mul_matrix
+    int tile_k;         // inner dimension per cache block in mul_matrix
+    int micro_m;        // rows of the register-resident micro kernel
+    int micro_n;        // cols of the register-resident micro kernel
+    long long par_mul;  // rows * cols * inner at which mul_matrix goes parallel
+    long long par_elem; // entries at which elementwise kernels go parallel
+} tune_params;
+
+extern tune_params matrix_tune;
+
+struct matrix;
+
+int mul_micro_supported(int micro_m, int micro_n);
+int mul_matrix_tuned(struct matrix *result, struct matrix *mat1, struct matrix *mat2,
+                     const tune_params *tune);
+const char *tune_default_path(void);
+int tune_load(const char *path);
+int tune_save(const char *path);
+int tune_autotune(int n);
+
+#endif
@@ -1,3 +1,12 @@
+import math
+import array
+import copy
+import multiprocessing
+import os
+import pickle
+import signal
+import struct
+import tempfile
 from utils import *
 from unittest import TestCase
 
@@ -122,7 +131,505 @@ class TestSet(TestCase):
         self.assertEquals(round(dp_mat[rand_row][rand_col], decimal_places),
             round(nc_mat[rand_row][rand_col], decimal_places))
 
+    def test_set_index(self):
+        nc_mat = nc.Matrix(3, 4, 1.5)
+        nc_mat[1, 2] = 7
+        nc_mat.set(0, 3, 2)
+        self.assertEqual(nc_mat[1, 2], 7.0)
+        self.assertEqual(nc_mat.get(0, 3), 2.0)
+        nc_vec = nc.Matrix(1, 5, 0.0)
+        nc_vec[4] = 3
+        self.assertEqual(nc_vec[4], 3.0)
+        with self.assertRaises(IndexError):
+            nc_mat[3, 0] = 1
+        with self.assertRaises(IndexError):
+            nc_mat.get(0, 4)
+        with self.assertRaises(TypeError):
+            nc_mat.set(0, 0)
+
 class TestShape(TestCase):
     def test_shape(self):
         dp_mat, nc_mat = rand_dp_nc_matrix(2, 2, seed=0)
         self.assertTrue(dp_mat.shape == nc_mat.shape)
+
+    def test_shape_shared(self):
+        self.assertIs(nc.Matrix(3, 4).shape, nc.Matrix(3, 4).shape)
+        self.assertEqual(nc.Matrix(1, 5000).shape, (5000,))
+        self.assertEqual((nc.Matrix(70, 2) + nc.Matrix(70, 2)).shape, (70, 2))
+
+class TestDtype(TestCase):
+    def test_float32_mul(self):
+        nc_mat1 = nc.Matrix(40, 30, rand=True, seed=0, dtype=nc.float32)
+        nc_mat2 = nc.Matrix(30, 20, rand=True, seed=1, dtype=nc.float32)
+        result = nc_mat1 * nc_mat2
+        expected = nc_mat1.astype(nc.float64) * nc_mat2.astype(nc.float64)
+        self.assertEqual(result.dtype, nc.float32)
+        self.assertEqual(result.shape, expected.shape)
+        for i in range(40):
+            for j in range(20):
+                self.assertAlmostEqual(result[i, j], expected[i, j], places=4)
+
+    def test_promotion(self):
+        nc_mat1 = nc.Matrix(3, 3, 1.5, dtype=nc.float32)
+        nc_mat2 = nc.Matrix(3, 3, 2.25)
+        self.assertEqual((nc_mat1 + nc_mat2).dtype, nc.float64)
+        self.assertEqual((nc_mat1 + nc_mat2)[2, 2], 3.75)
+
+    def test_mixed_precision_mul(self):
+        nc_mat1 = nc.Matrix(8, 2000, rand=True, seed=2, dtype=nc.float32)
+        nc_mat2 = nc.Matrix(2000, 5, rand=True, seed=3, dtype=nc.float32)
+        expected = nc_mat1.astype(nc.float64) * nc_mat2.astype(nc.float64)
+        wide = nc.matmul(nc_mat1, nc_mat2, accumulate=nc.float64, dtype=nc.float64)
+        nc_mat1.accumulate = nc.float64
+        narrow = nc_mat1 * nc_mat2
+        self.assertEqual(narrow.dtype, nc.float32)
+        for i in range(8):
+            for j in range(5):
+                self.assertAlmostEqual(wide[i, j], expected[i, j], places=10)
+                self.assertAlmostEqual(narrow[i, j], expected[i, j], places=3)
+
+class TestSparse(TestCase):
+    def test_sparse_mul(self):
+        nc_dense = nc.Matrix(60, 50)
+        for i in range(60):
+            nc_dense.set(i, (i * 7) % 50, i + 1)
+            nc_dense.set(i, (i * 3) % 50, -1)
+        nc_sparse = nc.SparseMatrix(nc_dense)
+        self.assertEqual(nc_sparse.shape, (60, 50))
+        nc_mat = nc.Matrix(50, 4, rand=True, seed=4)
+        nc_vec = nc.Matrix(50, 1, rand=True, seed=5)
+        self.assertEqual(nc.to_list(nc_sparse * nc_mat), nc.to_list(nc_dense * nc_mat))
+        self.assertEqual((nc_sparse * nc_vec).shape, (60,))
+        self.assertEqual(nc.to_list(nc_sparse.to_dense()), nc.to_list(nc_dense))
+
+    def test_sparse_add(self):
+        nc_sparse1 = nc.SparseMatrix(2, 3, [0, 1, 2], [0, 2], [1.0, 2.0])
+        nc_sparse2 = nc.SparseMatrix(2, 3, [0, 1, 1], [0], [-1.0])
+        nc_sum = nc_sparse1 + nc_sparse2
+        self.assertEqual(nc_sum.nnz, 1)
+        self.assertEqual(nc.to_list(nc_sum.to_dense()), [[0, 0, 0], [0, 0, 2]])
+
+    def test_sparse_new(self):
+        nc_sparse = nc.SparseMatrix.__new__(nc.SparseMatrix)
+        self.assertEqual(nc_sparse.shape, (1, 1))
+        self.assertEqual(nc_sparse.nnz, 0)
+        self.assertEqual(nc.to_list(nc_sparse.to_dense()), [0])
+
+class TestPowerApply(TestCase):
+    def test_power_apply(self):
+        nc_mat = nc.Matrix(20, 20, rand=True, seed=6, low=-0.5, high=0.5)
+        nc_vec = nc.Matrix(20, 1, rand=True, seed=7)
+        result = nc.matrix_power_apply(nc_mat, 5, nc_vec)
+        expected = (nc_mat ** 5) * nc_vec
+        self.assertEqual(result.shape, (20,))
+        for a, b in zip(nc.to_list(result), nc.to_list(expected)):
+            self.assertAlmostEqual(a, b, places=10)
+
+    def test_power_apply_converges(self):
+        nc_chain = nc.Matrix([[0.5, 0.25], [0.5, 0.75]])
+        nc_dist = nc.Matrix(2, 1, [1, 0])
+        result = nc.matrix_power_apply(nc_chain, 10000, nc_dist, tol=1e-14)
+        self.assertAlmostEqual(nc.to_list(result)[0], 1 / 3, places=10)
+        self.assertAlmostEqual(nc.to_list(result)[1], 2 / 3, places=10)
+
+class TestBatch(TestCase):
+    def test_batch_matmul(self):
+        nc_mats1 = [nc.Matrix(16, 16, rand=True, seed=i) for i in range(10)]
+        nc_mats2 = [nc.Matrix(16, 16, rand=True, seed=20 + i) for i in range(10)]
+        results = nc.batch_matmul(nc_mats1, nc_mats2)
+        self.assertEqual(len(results), 10)
+        for nc_mat1, nc_mat2, result in zip(nc_mats1, nc_mats2, results):
+            expected = nc_mat1 * nc_mat2
+            for i in range(16):
+                for j in range(16):
+                    self.assertAlmostEqual(result[i, j], expected[i, j], places=10)
+
+    def test_batch_container(self):
+        nc_batch = nc.Batch([nc.Matrix(3, 3, 1.0), nc.Matrix(3, 3, 2.0)])
+        self.assertEqual(nc_batch.shape, (2, 3, 3))
+        nc_result = nc.batch_matmul(nc_batch, nc.Batch([nc.Matrix(3, 3, 1.0)]))
+        self.assertEqual(nc_result.shape, (2, 3, 3))
+        self.assertEqual(nc_result[1][0, 0], 6)
+
+    def test_batch_new(self):
+        nc_batch = nc.Batch.__new__(nc.Batch)
+        self.assertEqual(nc_batch.shape, (1, 1, 1))
+        self.assertEqual(len(nc_batch), 1)
+        self.assertEqual(nc_batch[0][0, 0], 0)
+
+class TestTakePut(TestCase):
+    def test_take_put(self):
+        nc_mat = nc.Matrix(40, 30, rand=True, seed=0)
+        rows = array.array('q', [(i * 7) % 40 for i in range(5000)])
+        cols = array.array('i', [(i * 11) % 30 for i in range(5000)])
+        taken = nc_mat.take(rows, cols)
+        for i in range(0, 5000, 101):
+            self.assertEqual(taken[i], nc_mat[rows[i], cols[i]])
+        nc_mat.put(rows[:3], cols[:3], array.array('d', [1, 2, 3]))
+        self.assertEqual(nc_mat[rows[2], cols[2]], 3)
+        nc_mat.put([0, 1], [0, 1], 9.5)
+        self.assertEqual(nc_mat[1, 1], 9.5)
+        with self.assertRaises(IndexError):
+            nc_mat.take([0, 40], [0, 0])
+        with self.assertRaises(ValueError):
+            nc_mat.put([0], [0, 1], 1.0)
+
+class TestRandom(TestCase):
+    def test_uniform(self):
+        nc_mat = nc.uniform(50, 40, low=-1, high=2, seed=3)
+        self.assertEqual(nc_mat.shape, (50, 40))
+        self.assertEqual(nc.to_list(nc_mat), nc.to_list(nc.uniform(50, 40, low=-1, high=2, seed=3)))
+        self.assertNotEqual(nc_mat[0, 0], nc.uniform(50, 40, low=-1, high=2, seed=4)[0, 0])
+        self.assertTrue(all(-1 <= x < 2 for row in nc.to_list(nc_mat) for x in row))
+        self.assertEqual(nc.uniform(2, 3, seed=3, dtype=nc.float32).dtype, "float32")
+
+    def test_normal(self):
+        values = [x for row in nc.to_list(nc.normal(100, 100, mean=5, std=0.5, seed=1)) for x in row]
+        mean = sum(values) / len(values)
+        self.assertAlmostEqual(mean, 5, places=1)
+        self.assertAlmostEqual((sum((x - mean) ** 2 for x in values) / len(values)) ** 0.5, 0.5, places=1)
+
+class TestUfunc(TestCase):
+    def test_ufuncs(self):
+        nc_mat = nc.uniform(30, 20, low=-3, high=3, seed=2)
+        values = nc.to_list(nc_mat)
+        checks = [(nc.exp(nc_mat), math.exp), (nc.tanh(nc_mat), math.tanh),
+                  (nc.sigmoid(nc_mat), lambda x: 1 / (1 + math.exp(-x))),
+                  (nc.relu(nc_mat), lambda x: max(x, 0)),
+                  (nc.clip(nc_mat, -1, 0.5), lambda x: min(max(x, -1), 0.5)),
+                  (nc.power(nc_mat, 3), lambda x: x ** 3),
+                  (nc.sqrt(nc.exp(nc_mat)), lambda x: math.exp(x / 2)),
+                  (nc.log(nc.exp(nc_mat)), lambda x: x)]
+        for nc_res, fn in checks:
+            for row, res_row in zip(values, nc.to_list(nc_res)):
+                for x, y in zip(row, res_row):
+                    self.assertAlmostEqual(y, fn(x), places=12)
+
+    def test_ufunc_out(self):
+        nc_mat = nc.uniform(10, 10, low=-1, high=1, seed=3, dtype=nc.float32)
+        out = nc.Matrix(10, 10, dtype=nc.float32)
+        self.assertIs(nc.relu(nc_mat, out=out), out)
+        self.assertEqual(out[0, 0], max(nc_mat[0, 0], 0))
+        nc.tanh(nc_mat, out=nc_mat)
+        self.assertTrue(-1 < nc_mat[3, 3] < 1)
+        with self.assertRaises(ValueError):
+            nc.exp(nc_mat, out=nc.Matrix(10, 10))
+
+    def test_power_negative_base(self):
+        # Integer exponents beyond the repeated squaring range keep the sign of odd powers, in
+        # the vector lanes and the scalar tail alike
+        nc_mat = nc.Matrix(1, 9, -1.0)
+        self.assertEqual(nc.to_list(nc.power(nc_mat, 1025)), [-1.0] * 9)
+        self.assertEqual(nc.to_list(nc.power(nc_mat, 2 ** 40)), [1.0] * 9)
+        for x, y in zip(nc.to_list(nc.power(nc.Matrix(1, 9, -1.001), 2001)), [(-1.001) ** 2001] * 9):
+            self.assertAlmostEqual(y / x, 1, places=10)
+
+class TestMask(TestCase):
+    def test_elementwise(self):
+        a = nc.uniform(20, 30, low=-2, high=2, seed=4)
+        b = nc.uniform(20, 30, low=1, high=2, seed=5)
+        checks = [(a.multiply(b), lambda x, y: x * y), (a / b, lambda x, y: x / y),
+                  (nc.minimum(a, b), min), (nc.maximum(a, b), max),
+                  (nc.multiply(a, b.astype(nc.float32)), lambda x, y: x * y)]
+        for nc_res, fn in checks:
+            for i in range(20):
+                for j in range(30):
+                    self.assertAlmostEqual(nc_res[i, j], fn(a[i, j], b[i, j]), places=6)
+        with self.assertRaises(ValueError):
+            nc.divide(a, nc.Matrix(30, 20))
+
+    def test_compare_where(self):
+        a = nc.uniform(20, 30, low=-1, high=1, seed=6)
+        positive = a > 0
+        self.assertEqual(positive.shape, (20, 30))
+        self.assertEqual(positive[2, 3], a[2, 3] > 0)
+        self.assertEqual(positive.count() + (a <= 0).count(), 600)
+        self.assertEqual((positive & ~positive).count(), 0)
+        self.assertTrue((positive | ~positive).all())
+        self.assertTrue((a == a).all())
+        self.assertFalse((a != a).any())
+        # Matrices still hash by identity, so they work as dict keys and set members
+        self.assertEqual({a: 1}[a], 1)
+        self.assertEqual(len({a, a.copy()}), 2)
+        relu = nc.where(positive, a, 0)
+        self.assertEqual(nc.to_list(relu), nc.to_list(nc.relu(a)))
+        self.assertEqual(nc.where(a < 0, 1, -1)[0, 0], 1 if a[0, 0] < 0 else -1)
+        with self.assertRaises(ValueError):
+            bool(positive)
+        with self.assertRaises(ValueError):
+            nc.where(positive, nc.Matrix(3, 3), 0)
+
+class TestMatfile(TestCase):
+    def test_save_load_mmap(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "m.bin")
+            nc_mat = nc.uniform(50, 70, seed=7, dtype=nc.float32)
+            nc.save(path, nc_mat)
+            loaded = nc.load(path)
+            self.assertEqual(loaded.dtype, nc.float32)
+            self.assertEqual(nc.to_list(loaded), nc.to_list(nc_mat))
+            mapped = nc.open_mmap(path)
+            self.assertEqual(nc.to_list(mapped), nc.to_list(nc_mat))
+            mapped[0, 0] = 5
+            self.assertEqual(nc.load(path)[0, 0], nc_mat[0, 0])
+            shared = nc.open_mmap(path, "r+")
+            shared[0, 0] = 5
+            del shared
+            self.assertEqual(nc.load(path)[0, 0], 5)
+
+    def test_create(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "z.bin")
+            nc_mat = nc.open_mmap(path, "w+", shape=(4, 6))
+            self.assertEqual(nc_mat.shape, (4, 6))
+            nc_mat[3, 5] = 2
+            del nc_mat
+            self.assertEqual(nc.load(path)[3, 5], 2)
+            self.assertEqual(nc.open_mmap(path, "w+", shape=10).shape, (10,))
+            self.assertEqual(nc.open_mmap(path, "w+", shape=[3, 4]).shape, (3, 4))
+            for bad in ("34", (3,), 2.5):
+                with self.assertRaises(TypeError):
+                    nc.open_mmap(path, "w+", shape=bad)
+            with open(path, "wb") as f:
+                f.write(b"x" * 100)
+            with self.assertRaises(ValueError):
+                nc.load(path)
+            with self.assertRaises(OSError):
+                nc.open_mmap(os.path.join(tmp, "missing.bin"))
+
+class TestOutOfCore(TestCase):
+    def test_matmul_ooc(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            nc_mat1 = nc.uniform(200, 150, seed=8)
+            nc_mat2 = nc.uniform(150, 130, seed=9)
+            nc.save(os.path.join(tmp, "a.bin"), nc_mat1)
+            nc.save(os.path.join(tmp, "b.bin"), nc_mat2)
+            a = nc.open_mmap(os.path.join(tmp, "a.bin"))
+            b = nc.open_mmap(os.path.join(tmp, "b.bin"))
+            out = nc.open_mmap(os.path.join(tmp, "c.bin"), "w+", shape=(200, 130))
+            seen = []
+            res = nc.matmul_ooc(a, b, out=out, memory_limit=200000,
+                                progress=lambda done, total: seen.append((done, total)))
+            self.assertIs(res, out)
+            self.assertEqual(seen[-1], (12, 12))
+            expected = nc_mat1 * nc_mat2
+            for i in range(0, 200, 7):
+                for j in range(130):
+                    self.assertAlmostEqual(out[i, j], expected[i, j], places=10)
+
+    def test_progress_stops(self):
+        def stop(done, total):
+            raise KeyboardInterrupt
+        with self.assertRaises(KeyboardInterrupt):
+            nc.matmul_ooc(nc.Matrix(300, 300), nc.Matrix(300, 300), memory_limit=200000,
+                          progress=stop)
+        with self.assertRaises(ValueError):
+            nc.matmul_ooc(nc.Matrix(3, 3), nc.Matrix(3, 3), memory_limit=1000)
+
+class TestText(TestCase):
+    def test_round_trip(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "m.csv")
+            # Several parser chunks' worth of text
+            nc_mat = nc.normal(20000, 10, std=1000, seed=10)
+            nc.savetxt(path, nc_mat, delimiter=",")
+            self.assertGreater(os.path.getsize(path), 3 << 20)
+            loaded = nc.loadtxt(path, delimiter=",")
+            self.assertEqual(loaded.shape, (20000, 10))
+            self.assertEqual(nc.to_list(loaded), nc.to_list(nc_mat))
+
+    def test_python_written(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "m.txt")
+            rows = [[float(i * 3 + j) / 7 for j in range(3)] for i in range(5)]
+            with open(path, "w") as f:
+                f.write("# header\n")
+                for row in rows:
+                    f.write("  ".join(repr(x) for x in row) + "\n")
+            self.assertEqual(nc.to_list(nc.loadtxt(path)), rows)
+            self.assertEqual(nc.loadtxt(path, dtype=nc.float32).dtype, nc.float32)
+            with open(path, "a") as f:
+                f.write("1 2\n")
+            with self.assertRaisesRegex(ValueError, "row 5"):
+                nc.loadtxt(path)
+            with self.assertRaises(ValueError):
+                nc.loadtxt(path, delimiter=",,")
+
+class TestPickle(TestCase):
+    def test_protocols(self):
+        nc_mat = nc.normal(30, 20, seed=11)
+        for protocol in range(2, pickle.HIGHEST_PROTOCOL + 1):
+            loaded = pickle.loads(pickle.dumps(nc_mat, protocol=protocol))
+            self.assertEqual(loaded.shape, (30, 20))
+            self.assertEqual(nc.to_list(loaded), nc.to_list(nc_mat))
+        f32 = nc_mat.astype(nc.float32)
+        loaded = pickle.loads(pickle.dumps(f32))
+        self.assertEqual(loaded.dtype, nc.float32)
+        self.assertEqual(nc.to_list(loaded), nc.to_list(f32))
+
+    def test_out_of_band(self):
+        nc_mat = nc.normal(200, 100, seed=12)
+        buffers = []
+        data = pickle.dumps(nc_mat, protocol=5, buffer_callback=buffers.append)
+        self.assertEqual(len(buffers), 1)
+        self.assertLess(len(data), 200)
+        self.assertEqual(buffers[0].raw().nbytes, 200 * 100 * 8)
+        # The loaded matrix adopts the writable buffer it is given
+        raw = bytearray(buffers[0].raw())
+        loaded = pickle.loads(data, buffers=[raw])
+        self.assertEqual(nc.to_list(loaded), nc.to_list(nc_mat))
+        raw[0:8] = struct.pack("d", 5.5)
+        self.assertEqual(loaded[0, 0], 5.5)
+        with self.assertRaises(ValueError):
+            nc._from_buffer(b"\0" * 8, 2, 2, "float64")
+
+class TestShared(TestCase):
+    def test_processes(self):
+        name = "numc_test_%d" % os.getpid()
+        nc_mat = nc.Matrix.shared(name, 50, 40)
+        nc_mat[49, 39] = 3.5
+
+        def child():
+            attached = nc.Matrix.attach(name)
+            attached[0, 0] = attached[49, 39] * 2
+
+        process = multiprocessing.get_context("fork").Process(target=child)
+        process.start()
+        process.join()
+        self.assertEqual(process.exitcode, 0)
+        self.assertEqual(nc_mat[0, 0], 7.0)
+
+        attached = nc.Matrix.attach(name)
+        with self.assertRaises(FileExistsError):
+            nc.Matrix.shared(name, 2, 2)
+        # Freeing the creator removes the name but not the data
+        del nc_mat
+        with self.assertRaises(FileNotFoundError):
+            nc.Matrix.attach(name)
+        self.assertEqual(attached[0, 0], 7.0)
+        with self.assertRaises(ValueError):
+            nc.Matrix.shared("a/b", 2, 2)
+
+class TestShardPool(TestCase):
+    def test_matmul_pow(self):
+        a = nc.normal(120, 80, seed=13)
+        b = nc.normal(80, 100, seed=14)
+        sq = nc.normal(60, 60, std=0.1, seed=15)
+        with nc.ShardPool(3) as pool:
+            self.assertEqual(len(pool.pids), 3)
+            for row, ref in zip(nc.to_list(pool.matmul(a, b)), nc.to_list(a * b)):
+                for x, y in zip(row, ref):
+                    self.assertAlmostEqual(x, y, places=10)
+            for row, ref in zip(nc.to_list(pool.pow(sq, 9)), nc.to_list(sq ** 9)):
+                for x, y in zip(row, ref):
+                    self.assertAlmostEqual(x, y, places=12)
+            with self.assertRaises(ValueError):
+                pool.matmul(b, b)
+
+            # The shards of a killed worker are computed again
+            pid = pool.pids[0]
+            os.kill(pid, signal.SIGKILL)
+            os.waitpid(pid, 0)
+            product = pool.matmul(a, b)
+            self.assertEqual(pool.restarts, 1)
+            self.assertNotIn(pid, pool.pids)
+            self.assertAlmostEqual(product[119, 99], (a * b)[119, 99], places=10)
+        with self.assertRaises(ValueError):
+            pool.matmul(a, b)
+
+class TestCopyOnWrite(TestCase):
+    def test_copies(self):
+        nc_mat = nc.normal(40, 40, seed=13)
+        before = nc.to_list(nc_mat)
+        copies = [nc_mat.copy(), +nc_mat, nc_mat.astype(nc.float64), nc_mat ** 1,
+                  copy.copy(nc_mat), copy.deepcopy(nc_mat)]
+        for i, c in enumerate(copies):
+            self.assertEqual(nc.to_list(c), before)
+            c[0, 0] = i + 100
+        self.assertEqual(nc.to_list(nc_mat), before)
+        for i, c in enumerate(copies):
+            self.assertEqual(c[0, 0], i + 100)
+            self.assertEqual(nc.to_list(c)[1:], before[1:])
+
+    def test_writes(self):
+        nc_mat = nc.normal(40, 40, seed=14)
+        c = nc_mat.copy()
+        before = nc.to_list(c)
+        nc_mat[1, 2] = 2
+        nc_mat.put([3, 4], [4, 3], [1.5, 2.5])
+        nc_mat.set(5, 5, 9)
+        nc.relu(nc_mat, out=nc_mat)
+        self.assertEqual(nc.to_list(c), before)
+        # Writes through an exported buffer never reach copies, made before or during the export
+        c2 = nc_mat.copy()
+        view = memoryview(nc_mat)
+        c3 = nc_mat.copy()
+        view[0, 0] = -7.0
+        self.assertEqual(nc_mat[0, 0], -7)
+        self.assertNotEqual(c2[0, 0], -7)
+        self.assertNotEqual(c3[0, 0], -7)
+        view.release()
+
+class TestTranspose(TestCase):
+    def test_view(self):
+        nc_mat = nc.normal(37, 21, seed=15)
+        rows = nc.to_list(nc_mat)
+        t = nc_mat.T
+        self.assertEqual(t.shape, (21, 37))
+        self.assertEqual(nc.to_list(t), [list(r) for r in zip(*rows)])
+        self.assertEqual(nc.to_list(t.T), rows)
+        t[4, 30] = 5
+        self.assertEqual(nc_mat[30, 4], 5)
+        self.assertEqual(nc.to_list(nc_mat.transpose()), nc.to_list(t))
+
+    def test_products(self):
+        a = nc.normal(150, 90, seed=16)
+        b = nc.normal(150, 70, seed=17)
+        at = a.transpose()
+        self.assertEqual(nc.to_list(a.T * b), nc.to_list(at * b))
+        self.assertEqual(nc.to_list(b.T * a), nc.to_list(b.transpose() * a))
+        self.assertEqual(nc.to_list(a.T + at), nc.to_list(at + at))
+
+    def test_out(self):
+        nc_mat = nc.normal(65, 33, seed=18, dtype=nc.float32)
+        out = nc.Matrix(33, 65, dtype=nc.float32)
+        self.assertIs(nc_mat.transpose(out=out), out)
+        self.assertEqual(nc.to_list(out), nc.to_list(nc_mat.T))
+        with self.assertRaises(ValueError):
+            nc_mat.transpose(out=nc_mat)
+        with self.assertRaises(ValueError):
+            nc_mat.T.transpose(out=nc_mat)
+        with self.assertRaises(ValueError):
+            nc.relu(out, out=nc_mat.T)
+
+class TestReshape(TestCase):
+    def test_views(self):
+        nc_mat = nc.normal(6, 10, seed=19)
+        rows = nc.to_list(nc_mat)
+        flat = nc_mat.flatten()
+        self.assertEqual(flat.shape, (60,))
+        self.assertEqual(nc.to_list(flat), [x for r in rows for x in r])
+        m = flat.reshape(15, -1)
+        self.assertEqual(m.shape, (15, 4))
+        m[9, 1] = 5
+        self.assertEqual(nc_mat[3, 7], 5)
+        self.assertEqual(flat[37], 5)
+        with self.assertRaises(ValueError):
+            nc_mat.reshape(7, 9)
+
+    def test_copies(self):
+        nc_mat = nc.normal(6, 10, seed=20)
+        t = nc_mat.T.reshape(5, 12)
+        self.assertEqual(nc.to_list(t.flatten()), nc.to_list(nc_mat.transpose().flatten()))
+        t[0, 0] = 5
+        self.assertNotEqual(nc_mat[0, 0], 5)
+
+    def test_iter(self):
+        nc_mat = nc.normal(5, 3, seed=21)
+        rows = nc.to_list(nc_mat)
+        for i, row in enumerate(nc_mat):
+            self.assertEqual(row.shape, (3,))
+            self.assertEqual(nc.to_list(row), rows[i])
+            row[1] = i
+        self.assertEqual([r[1] for r in nc.to_list(nc_mat)], [0, 1, 2, 3, 4])
+        self.assertEqual(list(nc_mat.flatten()), [x for r in nc.to_list(nc_mat) for x in r])